@@ -0,0 +1,507 @@
+/*
+ * arbiter.c - Witness answering votes without a PostgreSQL server
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * A witness only exists to take part in failover decisions, so instead of
+ * a PostgreSQL instance it can be a repmgrd whose conninfo is
+ * "arbiter://host:port".  It listens on that port and answers one request
+ * per line, each with a one line reply:
+ *
+ *	PING						PONG
+ *	HEARTBEAT <node>			OK
+ *	VISIBLE <node>				YES <ms since its last heartbeat> | NO
+ *	EPOCH						EPOCH <last epoch voted in>
+ *	VOTE <epoch> <node> <lease>	GRANTED <epoch> | REFUSED <epoch>
+ *
+ * Votes follow the same rules as repmgr_request_vote() in repmgr_funcs.
+ * Heartbeats are kept in memory only; the last vote is also written to
+ * arbiter_state_file when one is configured.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "repmgr.h"
+#include "arbiter.h"
+#include "election.h"
+#include "log.h"
+#include "strutil.h"
+
+#define ARBITER_MAX_NODES		64
+#define ARBITER_MAX_CLIENTS		32
+#define ARBITER_LINE_LEN		256
+
+typedef struct
+{
+	int			node_id;
+	struct timeval last_heartbeat;
+}	t_arbiter_node;
+
+typedef struct
+{
+	int			sock;			/* -1 if the slot is free */
+	char		buf[ARBITER_LINE_LEN];
+	int			len;
+}	t_arbiter_client;
+
+/* the in-memory state of the arbiter */
+static t_arbiter_node arbiter_nodes[ARBITER_MAX_NODES];
+static int	arbiter_node_count = 0;
+static t_vote_state vote = {0, -1, 0};
+static const char *state_file = NULL;
+
+static int	open_listener(const char *port);
+static void handle_request(char *line, char *reply, size_t reply_len);
+static bool save_vote(long long epoch, int candidate, long long expiry);
+static void load_vote(void);
+
+
+/*
+ * Splits an arbiter conninfo into host and port (each MAXLEN long)
+ */
+bool
+is_arbiter_conninfo(const char *conninfo, char *host, char *port)
+{
+	const char *address;
+	const char *colon;
+
+	if (strncmp(conninfo, ARBITER_PREFIX, strlen(ARBITER_PREFIX)) != 0)
+		return false;
+
+	address = conninfo + strlen(ARBITER_PREFIX);
+	colon = strrchr(address, ':');
+	if (colon == NULL || colon == address || colon[1] == '\0' ||
+		colon - address >= MAXLEN)
+		return false;
+
+	if (host != NULL)
+	{
+		memcpy(host, address, colon - address);
+		host[colon - address] = '\0';
+	}
+	if (port != NULL)
+		maxlen_snprintf(port, "%s", colon + 1);
+
+	return true;
+}
+
+
+/*
+ * Sends one request to an arbiter and reads its reply, without the line
+ * end.  Gives up after ARBITER_TIMEOUT_SECS.
+ */
+bool
+arbiter_request(const char *conninfo, const char *request,
+				char *reply, size_t reply_len)
+{
+	char		host[MAXLEN];
+	char		port[MAXLEN];
+	char		line[ARBITER_LINE_LEN];
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	struct timeval timeout;
+	fd_set		write_set;
+	socklen_t	len;
+	size_t		received = 0;
+	ssize_t		r;
+	int			sock = -1;
+	int			error;
+
+	if (!is_arbiter_conninfo(conninfo, host, port))
+		return false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0)
+	{
+		log_warning(_("Can't resolve arbiter address \"%s\"\n"), conninfo);
+		return false;
+	}
+
+	/* connect without blocking, to bound the wait on unreachable hosts */
+	for (addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0)
+			continue;
+
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+
+		if (errno == EINPROGRESS)
+		{
+			FD_ZERO(&write_set);
+			FD_SET(sock, &write_set);
+			timeout.tv_sec = ARBITER_TIMEOUT_SECS;
+			timeout.tv_usec = 0;
+			len = sizeof(error);
+			if (select(sock + 1, NULL, &write_set, NULL, &timeout) == 1 &&
+				getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) == 0 &&
+				error == 0)
+				break;
+		}
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+
+	if (sock < 0)
+		return false;
+
+	/* the exchange itself is blocking, with timeouts */
+	fcntl(sock, F_SETFL, 0);
+	timeout.tv_sec = ARBITER_TIMEOUT_SECS;
+	timeout.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	/* the arbiter going away must not raise SIGPIPE in repmgrd */
+	snprintf(line, sizeof(line), "%s\n", request);
+	if (send(sock, line, strlen(line), MSG_NOSIGNAL) != (ssize_t) strlen(line))
+	{
+		close(sock);
+		return false;
+	}
+
+	while (received < reply_len - 1)
+	{
+		r = read(sock, reply + received, reply_len - 1 - received);
+		if (r <= 0)
+			break;
+		received += r;
+		if (memchr(reply, '\n', received) != NULL)
+			break;
+	}
+	close(sock);
+
+	reply[received] = '\0';
+	if (strchr(reply, '\n') == NULL)
+		return false;
+	*strchr(reply, '\n') = '\0';
+
+	return true;
+}
+
+
+/*
+ * Runs the arbiter: serves requests on the port of options->conninfo until
+ * repmgrd is terminated
+ */
+void
+run_arbiter(t_configuration_options *options)
+{
+	t_arbiter_client clients[ARBITER_MAX_CLIENTS];
+	char		port[MAXLEN];
+	char		reply[ARBITER_LINE_LEN];
+	char	   *eol;
+	fd_set		read_set;
+	ssize_t		r;
+	int			listener;
+	int			max_sock;
+	int			sock;
+	int			i;
+
+	if (!is_arbiter_conninfo(options->conninfo, NULL, port))
+	{
+		log_err(_("\"%s\" is not an arbiter address\n"), options->conninfo);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	if (*options->arbiter_state_file)
+	{
+		state_file = options->arbiter_state_file;
+		load_vote();
+	}
+	else
+		log_warning(_("arbiter_state_file is not set, votes will be forgotten if the arbiter restarts\n"));
+
+	listener = open_listener(port);
+	if (listener < 0)
+		exit(ERR_BAD_CONFIG);
+
+	for (i = 0; i < ARBITER_MAX_CLIENTS; i++)
+		clients[i].sock = -1;
+
+	log_notice(_("arbiter of cluster '%s' listening on port %s\n"),
+			   options->cluster_name, port);
+
+	for (;;)
+	{
+		FD_ZERO(&read_set);
+		FD_SET(listener, &read_set);
+		max_sock = listener;
+		for (i = 0; i < ARBITER_MAX_CLIENTS; i++)
+		{
+			if (clients[i].sock < 0)
+				continue;
+			FD_SET(clients[i].sock, &read_set);
+			if (clients[i].sock > max_sock)
+				max_sock = clients[i].sock;
+		}
+
+		if (select(max_sock + 1, &read_set, NULL, NULL, NULL) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			log_err(_("arbiter: select() returned with error: %s\n"),
+					strerror(errno));
+			exit(ERR_SYS_FAILURE);
+		}
+
+		if (FD_ISSET(listener, &read_set))
+		{
+			sock = accept(listener, NULL, NULL);
+			for (i = 0; sock >= 0 && i < ARBITER_MAX_CLIENTS; i++)
+			{
+				if (clients[i].sock < 0)
+				{
+					clients[i].sock = sock;
+					clients[i].len = 0;
+					break;
+				}
+			}
+			/* too many clients: they retry later */
+			if (sock >= 0 && i == ARBITER_MAX_CLIENTS)
+				close(sock);
+		}
+
+		for (i = 0; i < ARBITER_MAX_CLIENTS; i++)
+		{
+			if (clients[i].sock < 0 || !FD_ISSET(clients[i].sock, &read_set))
+				continue;
+
+			r = read(clients[i].sock, clients[i].buf + clients[i].len,
+					 sizeof(clients[i].buf) - 1 - clients[i].len);
+			if (r <= 0)
+			{
+				close(clients[i].sock);
+				clients[i].sock = -1;
+				continue;
+			}
+			clients[i].len += r;
+			clients[i].buf[clients[i].len] = '\0';
+
+			/* answer every complete line */
+			while ((eol = strchr(clients[i].buf, '\n')) != NULL)
+			{
+				*eol = '\0';
+				handle_request(clients[i].buf, reply, sizeof(reply));
+				strcat(reply, "\n");
+
+				/* the client went away: no SIGPIPE, just drop it */
+				if (send(clients[i].sock, reply, strlen(reply), MSG_NOSIGNAL) < 0)
+				{
+					close(clients[i].sock);
+					clients[i].sock = -1;
+					break;
+				}
+
+				clients[i].len -= (eol + 1 - clients[i].buf);
+				memmove(clients[i].buf, eol + 1, clients[i].len + 1);
+			}
+
+			/* a line longer than the buffer is not a request */
+			if (clients[i].sock >= 0 &&
+				clients[i].len == sizeof(clients[i].buf) - 1)
+			{
+				close(clients[i].sock);
+				clients[i].sock = -1;
+			}
+		}
+	}
+}
+
+
+static int
+open_listener(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	int			sock;
+	int			on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	/* listen on IPv6 and IPv4 if possible, else on IPv4 only */
+	if (getaddrinfo(NULL, port, &hints, &addrs) != 0)
+	{
+		hints.ai_family = AF_INET;
+		if (getaddrinfo(NULL, port, &hints, &addrs) != 0)
+		{
+			log_err(_("arbiter: invalid port \"%s\"\n"), port);
+			return -1;
+		}
+	}
+
+	sock = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+	if (sock < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+		bind(sock, addrs->ai_addr, addrs->ai_addrlen) < 0 ||
+		listen(sock, ARBITER_MAX_CLIENTS) < 0)
+	{
+		log_err(_("arbiter: can't listen on port %s: %s\n"), port,
+				strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+
+	return sock;
+}
+
+
+static void
+handle_request(char *line, char *reply, size_t reply_len)
+{
+	struct timeval now;
+	long long	epoch;
+	int			node_id;
+	int			lease;
+	int			i;
+
+	gettimeofday(&now, NULL);
+
+	if (strcmp(line, "PING") == 0)
+		snprintf(reply, reply_len, "PONG");
+	else if (sscanf(line, "HEARTBEAT %d", &node_id) == 1)
+	{
+		for (i = 0; i < arbiter_node_count; i++)
+		{
+			if (arbiter_nodes[i].node_id == node_id)
+				break;
+		}
+		if (i == arbiter_node_count && i < ARBITER_MAX_NODES)
+		{
+			arbiter_nodes[i].node_id = node_id;
+			arbiter_node_count++;
+		}
+		if (i < ARBITER_MAX_NODES)
+			arbiter_nodes[i].last_heartbeat = now;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (sscanf(line, "VISIBLE %d", &node_id) == 1)
+	{
+		snprintf(reply, reply_len, "NO");
+		for (i = 0; i < arbiter_node_count; i++)
+		{
+			if (arbiter_nodes[i].node_id == node_id)
+				snprintf(reply, reply_len, "YES %ld",
+						 (long) ((now.tv_sec - arbiter_nodes[i].last_heartbeat.tv_sec) * 1000 +
+								 (now.tv_usec - arbiter_nodes[i].last_heartbeat.tv_usec) / 1000));
+		}
+	}
+	else if (strcmp(line, "EPOCH") == 0)
+		snprintf(reply, reply_len, "EPOCH %lld", vote.epoch);
+	else if (sscanf(line, "VOTE %lld %d %d", &epoch, &node_id, &lease) == 3)
+	{
+		long long	now_ms = (long long) now.tv_sec * 1000 + now.tv_usec / 1000;
+		bool		granted = false;
+
+		if (epoch == vote.epoch && node_id == vote.voted_for)
+			granted = true;
+		else if (vote_allowed(&vote, epoch, node_id, now_ms))
+		{
+			if (state_file == NULL ||
+				save_vote(epoch, node_id, now_ms + lease * 1000LL))
+			{
+				vote.epoch = epoch;
+				vote.voted_for = node_id;
+				vote.lease_expiry = now_ms + lease * 1000LL;
+				granted = true;
+				log_info(_("arbiter: voted for node %d in epoch %lld\n"),
+						 node_id, epoch);
+			}
+		}
+		snprintf(reply, reply_len, "%s %lld",
+				 granted ? "GRANTED" : "REFUSED", vote.epoch);
+	}
+	else
+		snprintf(reply, reply_len, "ERROR unknown request");
+}
+
+
+/*
+ * Writes a vote durably, before it is granted
+ */
+static bool
+save_vote(long long epoch, int candidate, long long expiry)
+{
+	char		tmp_path[MAXLEN];
+	FILE	   *fp;
+	bool		ok;
+
+	maxlen_snprintf(tmp_path, "%s.tmp", state_file);
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL)
+	{
+		log_err(_("arbiter: can't write \"%s\": %s\n"), tmp_path,
+				strerror(errno));
+		return false;
+	}
+
+	ok = fprintf(fp, "%lld %d %lld\n", epoch, candidate, expiry) > 0 &&
+		fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && rename(tmp_path, state_file) != 0)
+		ok = false;
+
+	if (!ok)
+		log_err(_("arbiter: can't write \"%s\": %s\n"), state_file,
+				strerror(errno));
+	return ok;
+}
+
+
+static void
+load_vote(void)
+{
+	FILE	   *fp;
+	long long	epoch;
+	int			candidate;
+	long long	expiry;
+
+	fp = fopen(state_file, "r");
+	if (fp == NULL)
+		return;
+
+	if (fscanf(fp, "%lld %d %lld", &epoch, &candidate, &expiry) == 3)
+	{
+		vote.epoch = epoch;
+		vote.voted_for = candidate;
+		vote.lease_expiry = expiry;
+		log_info(_("arbiter: last vote for node %d in epoch %lld\n"),
+				 vote.voted_for, vote.epoch);
+	}
+	fclose(fp);
+}
@@ -0,0 +1,36 @@
+/*
+ * arbiter.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_ARBITER_H_
+#define _REPMGR_ARBITER_H_
+
+#include "config.h"
+
+/* conninfo of an arbiter witness: "arbiter://host:port" */
+#define ARBITER_PREFIX			"arbiter://"
+
+/* how long a client waits for an arbiter to connect and answer */
+#define ARBITER_TIMEOUT_SECS	5
+
+bool		is_arbiter_conninfo(const char *conninfo, char *host, char *port);
+bool arbiter_request(const char *conninfo, const char *request,
+				char *reply, size_t reply_len);
+void		run_arbiter(t_configuration_options *options);
+
+#endif
@@ -0,0 +1,373 @@
+#!/bin/sh
+#
+# failover_bench.sh - Times a real repmgrd failover on local PostgreSQL
+# instances
+# Copyright (C) 2ndQuadrant, 2010-2014
+#
+# Creates a master and N-1 standbys cloned from it with repmgr, all on this
+# host, starts repmgrd on every node with automatic failover, kills the
+# master and times each step of the failover, from the master's death:
+#
+#   detect_ms        a repmgrd gave up reconnecting to the master
+#   elect_ms         a standby was elected by a majority of the nodes
+#   promote_ms       a standby left recovery
+#   first_write_ms   the new master accepted a write
+#   all_follow_ms    every other standby streams from the new master
+#
+# One CSV line is printed per run, with the settings it ran with, so runs
+# of different releases or configurations can be compared; -1 marks a step
+# not reached within the timeout, and makes the exit status 1.  Progress
+# goes to stderr.
+#
+# Needs repmgr, repmgrd and repmgr_funcs installed in the PostgreSQL
+# installation whose binaries are used, and GNU date.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+nodes=3
+runs=1
+base_port=55432
+bindir=
+workdir=
+keep=no
+timeout=300
+reconnect_attempts=6
+reconnect_interval=10
+monitor_interval_secs=2
+master_response_timeout=60
+
+usage()
+{
+	cat <<EOF
+$0: times repmgrd failovers on local PostgreSQL instances
+
+Usage:
+ $0 [OPTIONS]
+
+Options:
+  -n, --nodes=N                     nodes, master included (default: 3)
+  -r, --runs=RUNS                   failovers to time (default: 1)
+  -p, --port=PORT                   port of the first node, the others follow
+                                    (default: 55432)
+  -b, --bindir=DIR                  PostgreSQL and repmgr binaries
+                                    (default: pg_config --bindir)
+  -d, --workdir=DIR                 where the nodes are created (default: a
+                                    temporary directory)
+  -k, --keep                        keep the nodes and logs of the last run
+  -t, --timeout=SECS                time allowed for the failover (default: 300)
+  --reconnect-attempts=N            reconnect_attempts (default: 6)
+  --reconnect-interval=SECS         reconnect_interval (default: 10)
+  --monitor-interval=SECS           monitor_interval_secs (default: 2)
+  --master-response-timeout=SECS    master_response_timeout (default: 60)
+EOF
+}
+
+while [ $# -gt 0 ]
+do
+	case "$1" in
+		--*=*)
+			opt="${1%%=*}"
+			val="${1#*=}"
+			;;
+		*)
+			opt="$1"
+			val="$2"
+			;;
+	esac
+	case "$opt" in
+		-n|--nodes) nodes="$val" ;;
+		-r|--runs) runs="$val" ;;
+		-p|--port) base_port="$val" ;;
+		-b|--bindir) bindir="$val" ;;
+		-d|--workdir) workdir="$val" ;;
+		-t|--timeout) timeout="$val" ;;
+		--reconnect-attempts) reconnect_attempts="$val" ;;
+		--reconnect-interval) reconnect_interval="$val" ;;
+		--monitor-interval) monitor_interval_secs="$val" ;;
+		--master-response-timeout) master_response_timeout="$val" ;;
+		-k|--keep)
+			keep=yes
+			shift
+			continue
+			;;
+		-h|--help)
+			usage
+			exit 0
+			;;
+		*)
+			usage >&2
+			exit 1
+			;;
+	esac
+	# options given as "--opt=value" take a single argument
+	case "$1" in
+		--*=*) shift ;;
+		*) shift 2 ;;
+	esac
+done
+
+if [ "$nodes" -lt 2 ] 2>/dev/null
+then
+	echo "$0: at least 2 nodes are needed" >&2
+	exit 1
+fi
+
+[ -n "$bindir" ] || bindir=$(pg_config --bindir) || exit 1
+[ -n "$workdir" ] || workdir=$(mktemp -d "${TMPDIR:-/tmp}/repmgr_bench.XXXXXX") || exit 1
+mkdir -p "$workdir" || exit 1
+
+PATH="$bindir:$PATH"
+export PATH
+PGUSER=$(id -un)
+export PGUSER
+
+log()
+{
+	echo "failover_bench: $*" >&2
+}
+
+now_ms()
+{
+	date +%s%3N
+}
+
+port_of()
+{
+	echo $((base_port + $1 - 1))
+}
+
+# runs a query on node $1, prints the result or fails
+query()
+{
+	psql -X -A -t -q -h 127.0.0.1 -p $(port_of $1) -d postgres \
+		-c "$2" 2>/dev/null
+}
+
+write_config()
+{
+	cat > "$workdir/node$1/repmgr.conf" <<EOF
+cluster=bench
+node=$1
+node_name=node$1
+conninfo='host=127.0.0.1 port=$(port_of $1) dbname=postgres user=$PGUSER'
+pg_bindir=$bindir
+failover=automatic
+priority=$1
+promote_command='repmgr -f $workdir/node$1/repmgr.conf standby promote'
+follow_command='repmgr -f $workdir/node$1/repmgr.conf standby follow -W'
+reconnect_attempts=$reconnect_attempts
+reconnect_interval=$reconnect_interval
+monitor_interval_secs=$monitor_interval_secs
+master_response_timeout=$master_response_timeout
+loglevel=INFO
+EOF
+}
+
+stop_all()
+{
+	for pidfile in "$workdir"/node*/repmgrd.pid
+	do
+		[ -f "$pidfile" ] && kill $(cat "$pidfile") 2>/dev/null
+		rm -f "$pidfile"
+	done
+	for data in "$workdir"/node*/data
+	do
+		[ -d "$data" ] && pg_ctl -D "$data" -m immediate -w stop >/dev/null 2>&1
+	done
+}
+
+# creates the cluster: node1 is the master, the others are cloned from it
+setup_cluster()
+{
+	i=1
+	while [ $i -le $nodes ]
+	do
+		rm -rf "$workdir/node$i"
+		mkdir -p "$workdir/node$i"
+		write_config $i
+		i=$((i + 1))
+	done
+
+	initdb -A trust -D "$workdir/node1/data" >"$workdir/node1/initdb.log" 2>&1 || return 1
+	cat >> "$workdir/node1/data/postgresql.conf" <<EOF
+listen_addresses = '127.0.0.1'
+port = $(port_of 1)
+wal_level = hot_standby
+hot_standby = on
+max_wal_senders = $((nodes + 2))
+wal_keep_segments = 64
+shared_preload_libraries = 'repmgr_funcs'
+EOF
+	echo "host replication all 127.0.0.1/32 trust" >> "$workdir/node1/data/pg_hba.conf"
+
+	pg_ctl -D "$workdir/node1/data" -l "$workdir/node1/postgresql.log" -w start >/dev/null || return 1
+	repmgr -f "$workdir/node1/repmgr.conf" master register >"$workdir/node1/repmgr.log" 2>&1 || return 1
+
+	i=2
+	while [ $i -le $nodes ]
+	do
+		repmgr -f "$workdir/node$i/repmgr.conf" -D "$workdir/node$i/data" \
+			-d postgres -p $(port_of 1) -U "$PGUSER" -R "$PGUSER" \
+			standby clone 127.0.0.1 >"$workdir/node$i/repmgr.log" 2>&1 || return 1
+		echo "port = $(port_of $i)" >> "$workdir/node$i/data/postgresql.conf"
+		pg_ctl -D "$workdir/node$i/data" -l "$workdir/node$i/postgresql.log" -w start >/dev/null || return 1
+		repmgr -f "$workdir/node$i/repmgr.conf" standby register >>"$workdir/node$i/repmgr.log" 2>&1 || return 1
+		i=$((i + 1))
+	done
+
+	i=1
+	while [ $i -le $nodes ]
+	do
+		repmgrd -f "$workdir/node$i/repmgr.conf" >"$workdir/node$i/repmgrd.log" 2>&1 &
+		echo $! > "$workdir/node$i/repmgrd.pid"
+		i=$((i + 1))
+	done
+
+	# let every repmgrd connect to the master before it goes away
+	sleep $((monitor_interval_secs * 2 + 1))
+}
+
+# prints the number of a standby that left recovery, if any
+find_new_master()
+{
+	i=2
+	while [ $i -le $nodes ]
+	do
+		if [ "$(query $i 'SELECT pg_is_in_recovery()')" = "f" ]
+		then
+			echo $i
+			return 0
+		fi
+		i=$((i + 1))
+	done
+	return 1
+}
+
+# waits for every standby to replay the master's WAL up to now
+wait_for_standbys()
+{
+	target=$(query 1 "SELECT pg_current_xlog_location()") || return 1
+	start=$(now_ms)
+	i=2
+	while [ $i -le $nodes ]
+	do
+		if [ "$(query $i "SELECT pg_xlog_location_diff(pg_last_xlog_replay_location(), '$target') >= 0")" = "t" ]
+		then
+			i=$((i + 1))
+		elif [ $(( $(now_ms) - start )) -ge $((timeout * 1000)) ]
+		then
+			log "node $i didn't replay the master's WAL up to $target"
+			return 1
+		else
+			sleep 0.05
+		fi
+	done
+}
+
+# times one failover and prints its CSV line
+run_failover()
+{
+	detect_ms=-1
+	elect_ms=-1
+	promote_ms=-1
+	first_write_ms=-1
+	all_follow_ms=-1
+	new_master=
+
+	query 1 "CREATE TABLE IF NOT EXISTS bench_write (t timestamptz)" >/dev/null
+	wait_for_standbys || return 1
+
+	# the master host dies: its repmgrd with it
+	kill -9 $(cat "$workdir/node1/repmgrd.pid") 2>/dev/null
+	rm -f "$workdir/node1/repmgrd.pid"
+	pg_ctl -D "$workdir/node1/data" -m immediate -w stop >/dev/null 2>&1
+	start=$(now_ms)
+	log "master stopped, waiting for the failover"
+
+	while [ $(( $(now_ms) - start )) -lt $((timeout * 1000)) ]
+	do
+		elapsed=$(( $(now_ms) - start ))
+
+		if [ $detect_ms -lt 0 ] &&
+			grep -q "couldn't reconnect for long enough" "$workdir"/node*/repmgrd.log
+		then
+			detect_ms=$elapsed
+			log "master failure detected after $detect_ms ms"
+		fi
+
+		if [ $elect_ms -lt 0 ] &&
+			grep -q "elected in epoch" "$workdir"/node*/repmgrd.log
+		then
+			elect_ms=$elapsed
+			log "new master elected after $elect_ms ms"
+		fi
+
+		if [ $promote_ms -lt 0 ] && new_master=$(find_new_master)
+		then
+			promote_ms=$elapsed
+			log "node $new_master promoted after $promote_ms ms"
+		fi
+
+		if [ $promote_ms -ge 0 ] && [ $first_write_ms -lt 0 ] &&
+			query $new_master "INSERT INTO bench_write VALUES (now())" >/dev/null
+		then
+			first_write_ms=$(( $(now_ms) - start ))
+			log "first write accepted after $first_write_ms ms"
+		fi
+
+		if [ $first_write_ms -ge 0 ] &&
+			[ "$(query $new_master "SELECT count(*) FROM pg_stat_replication WHERE state = 'streaming'")" = "$((nodes - 2))" ]
+		then
+			all_follow_ms=$(( $(now_ms) - start ))
+			log "all standbys follow node $new_master after $all_follow_ms ms"
+			break
+		fi
+
+		sleep 0.05
+	done
+
+	echo "$nodes,$run,$reconnect_attempts,$reconnect_interval,$monitor_interval_secs,$master_response_timeout,$detect_ms,$elect_ms,$promote_ms,$first_write_ms,$all_follow_ms"
+	[ $all_follow_ms -ge 0 ]
+}
+
+trap 'stop_all; exit 1' INT TERM
+
+echo "nodes,run,reconnect_attempts,reconnect_interval,monitor_interval_secs,master_response_timeout,detect_ms,elect_ms,promote_ms,first_write_ms,all_follow_ms"
+
+run=1
+status=0
+while [ $run -le $runs ]
+do
+	log "run $run: creating $nodes nodes in $workdir"
+	if ! setup_cluster
+	then
+		log "could not create the cluster, see the logs in $workdir"
+		stop_all
+		exit 1
+	fi
+
+	run_failover || status=1
+	stop_all
+	run=$((run + 1))
+done
+
+if [ $keep = no ]
+then
+	rm -rf "$workdir"
+else
+	log "nodes and logs kept in $workdir"
+fi
+
+exit $status
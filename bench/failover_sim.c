@@ -0,0 +1,1144 @@
+/*
+ * failover_sim.c - Deterministic simulation of repmgrd failovers
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * Replays the failover procedure of repmgrd (do_failover() and
+ * win_election()) on simulated nodes, after the master dies: every
+ * standby notices it, checks which nodes it can see, publishes how far it
+ * got, waits for the others, picks a candidate and either gets elected or
+ * follows the winner.  Candidates are chosen and votes granted by the same
+ * code repmgrd runs (election.c); the network and the nodes are simulated,
+ * with latency, jitter, lost requests and standbys crashing along the way.
+ *
+ * Time is simulated too, and every random choice comes from a generator
+ * seeded on the command line, so a run is exactly reproduced by its seed.
+ * For each run a CSV line reports how long it took to promote a new master
+ * and to have every standby follow it, and whether several nodes were
+ * promoted; the exit status is 1 if any run ended in a split brain.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "election.h"
+
+#define MAX_SCENARIOS			16
+
+/* a request to the node itself still goes through a local connection */
+#define LOCAL_LATENCY_MS		1
+
+/* simulated WAL: where the master was when it died, and replay speeds */
+#define MASTER_POSITION			(64LL * 1024 * 1024 * 1024)
+#define MIN_APPLY_RATE			20000	/* bytes per ms */
+#define MAX_APPLY_RATE			200000
+
+/* what a standby is doing */
+typedef enum
+{
+	PHASE_MONITOR,				/* hasn't noticed the master is gone */
+	PHASE_VISIBLE,				/* connecting to every node */
+	PHASE_RECEIVED,				/* asking the others how much WAL they got */
+	PHASE_SAMPLE,				/* measuring its own replay speed */
+	PHASE_READY,				/* waiting for the others to publish theirs */
+	PHASE_ELECT,				/* asking for votes */
+	PHASE_PROMOTE,				/* running promote_command */
+	PHASE_WAIT_MASTER,			/* waiting for the candidate to be promoted */
+	PHASE_FOLLOW,				/* running follow_command */
+	PHASE_DONE,
+	PHASE_ABORTED				/* repmgrd gave up (terminate()) */
+}	t_phase;
+
+typedef enum
+{
+	RPC_EPOCH,
+	RPC_RECEIVED,
+	RPC_PUBLISHED,
+	RPC_VOTE,
+	RPC_PROMOTED
+}	t_rpc;
+
+typedef enum
+{
+	EV_DELIVER,					/* a request reaches its target */
+	EV_REPLY,					/* the answer, or a timeout, reaches the caller */
+	EV_WAKE,					/* end of a sleep or of a command */
+	EV_CRASH
+}	t_event_type;
+
+typedef struct
+{
+	long long	time;
+	long		seq;			/* orders events happening at the same time */
+	t_event_type type;
+	int			node;			/* the caller */
+	int			target;
+	t_rpc		rpc;
+	long long	arg;
+	bool		ok;
+	long long	result;
+	long long	result2;
+}	t_event;
+
+/* what a standby learned about another node during the failover */
+typedef struct
+{
+	bool		visible;
+	bool		ready;
+	long long	received;
+	long		eta;
+}	t_view;
+
+typedef struct
+{
+	bool		is_witness;
+	bool		crashed;
+	bool		promoted;
+	t_phase		phase;
+	long long	received;
+	long		eta;
+	bool		published;
+	t_vote_state vote;
+
+	/* the failover of this node, as do_failover() runs it */
+	t_view	   *view;
+	int			next;			/* node the current loop is at */
+	int			visible_count;
+	long long	max_epoch;
+	int			candidate;
+	long long	epoch;
+	long long	max_seen;
+	int			votes;
+	int			round;
+	long long	round_start;
+	long long	wait_start;
+	long long	promoted_at;
+	long long	followed_at;
+}	t_sim_node;
+
+typedef struct
+{
+	int			nodes;
+	long long	seed;
+	long long	promote_ms;		/* -1 if no node was promoted */
+	long long	converge_ms;	/* -1 if the standbys don't all follow it */
+	int			promotions;
+	int			aborted;
+	int			stuck;
+}	t_run_result;
+
+/* scenario */
+static int	scenarios[MAX_SCENARIOS] = {10, 50, 200};
+static int	scenario_count = 3;
+static long long base_seed = 1;
+static int	runs = 20;
+static int	latency_ms = 1;
+static int	jitter_ms = 2;
+static double loss = 0.0;
+static double crash = 0.0;
+static bool with_witness = false;
+static int	timeout_ms = 2000;
+static int	monitor_interval_secs = 2;
+static int	reconnect_attempts = 6;
+static int	reconnect_interval_secs = 10;
+static long long lag_tolerance = 0;
+static long long max_lag = 16 * 1024 * 1024;
+static long long max_backlog = 256 * 1024 * 1024;
+static int	promote_ms = 1000;
+static int	follow_ms = 1000;
+static int	horizon_secs = 600;
+
+/* state of the run */
+static unsigned long long rng_state;
+static t_event *queue = NULL;
+static int	queue_len = 0;
+static int	queue_size = 0;
+static long event_seq = 0;
+static long long now = 0;
+static t_sim_node *sim_nodes = NULL;
+static int	total_nodes = 0;
+static t_node_info *scratch = NULL;
+
+static void usage(void);
+static void help(const char *progname);
+static bool parse_scenarios(char *list);
+static unsigned long long rng_next(void);
+static long long rng_range(long long n);
+static double rng_unit(void);
+static void push_event(t_event *ev);
+static bool pop_event(t_event *ev);
+static void send_request(int node, int target, t_rpc rpc, long long arg);
+static void sleep_node(int node, long long ms);
+static void deliver(t_event *ev);
+static void step(int node, t_event *ev);
+static void start_ready(int node);
+static void decide(int node);
+static void start_round(int node);
+static void end_round(int node);
+static void run_once(int nodes, long long seed, t_run_result *result);
+static void print_summary(int nodes, t_run_result *results, int count);
+static int	compare_ll(const void *a, const void *b);
+static int	run_checks(void);
+
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] =
+	{
+		{"nodes", required_argument, NULL, 'n'},
+		{"seed", required_argument, NULL, 's'},
+		{"runs", required_argument, NULL, 'r'},
+		{"latency", required_argument, NULL, 1},
+		{"jitter", required_argument, NULL, 2},
+		{"loss", required_argument, NULL, 3},
+		{"crash", required_argument, NULL, 4},
+		{"witness", no_argument, NULL, 5},
+		{"timeout", required_argument, NULL, 6},
+		{"monitor-interval", required_argument, NULL, 7},
+		{"reconnect-attempts", required_argument, NULL, 8},
+		{"reconnect-interval", required_argument, NULL, 9},
+		{"lag-tolerance", required_argument, NULL, 10},
+		{"max-lag", required_argument, NULL, 11},
+		{"max-backlog", required_argument, NULL, 12},
+		{"promote-time", required_argument, NULL, 13},
+		{"follow-time", required_argument, NULL, 14},
+		{"horizon", required_argument, NULL, 15},
+		{"check", no_argument, NULL, 16},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	t_run_result *results;
+	int			optindex;
+	int			c;
+	int			i;
+	int			run;
+	int			split_brains = 0;
+
+	while ((c = getopt_long(argc, argv, "n:s:r:", long_options, &optindex)) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				if (!parse_scenarios(optarg))
+				{
+					fprintf(stderr, "failover_sim: invalid node counts \"%s\"\n",
+							optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				base_seed = atoll(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 1:
+				latency_ms = atoi(optarg);
+				break;
+			case 2:
+				jitter_ms = atoi(optarg);
+				break;
+			case 3:
+				loss = atof(optarg);
+				break;
+			case 4:
+				crash = atof(optarg);
+				break;
+			case 5:
+				with_witness = true;
+				break;
+			case 6:
+				timeout_ms = atoi(optarg);
+				break;
+			case 7:
+				monitor_interval_secs = atoi(optarg);
+				break;
+			case 8:
+				reconnect_attempts = atoi(optarg);
+				break;
+			case 9:
+				reconnect_interval_secs = atoi(optarg);
+				break;
+			case 10:
+				lag_tolerance = atoll(optarg);
+				break;
+			case 11:
+				max_lag = atoll(optarg);
+				break;
+			case 12:
+				max_backlog = atoll(optarg);
+				break;
+			case 13:
+				promote_ms = atoi(optarg);
+				break;
+			case 14:
+				follow_ms = atoi(optarg);
+				break;
+			case 15:
+				horizon_secs = atoi(optarg);
+				break;
+			case 16:
+				return run_checks();
+			case '?':
+				if (optopt == 0)
+				{
+					help(argv[0]);
+					exit(0);
+				}
+				/* FALLTHROUGH */
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (runs < 1 || latency_ms < 0 || jitter_ms < 0 || timeout_ms < 1 ||
+		loss < 0 || loss > 1 || crash < 0 || crash > 1 ||
+		monitor_interval_secs < 1 || reconnect_attempts < 0 ||
+		reconnect_interval_secs < 0 || lag_tolerance < 0 || max_lag < 0 ||
+		max_backlog < 0 || promote_ms < 0 || follow_ms < 0 || horizon_secs < 1)
+	{
+		usage();
+		exit(1);
+	}
+
+	results = malloc(runs * sizeof(t_run_result));
+	if (results == NULL)
+	{
+		fprintf(stderr, "failover_sim: out of memory\n");
+		exit(1);
+	}
+
+	printf("nodes,run,seed,promote_ms,converge_ms,promotions,aborted,stuck,split_brain\n");
+	for (i = 0; i < scenario_count; i++)
+	{
+		for (run = 0; run < runs; run++)
+		{
+			t_run_result *r = &results[run];
+
+			run_once(scenarios[i], base_seed + run, r);
+			printf("%d,%d,%lld,%lld,%lld,%d,%d,%d,%d\n",
+				   r->nodes, run, r->seed, r->promote_ms, r->converge_ms,
+				   r->promotions, r->aborted, r->stuck,
+				   r->promotions > 1 ? 1 : 0);
+			if (r->promotions > 1)
+				split_brains++;
+		}
+		print_summary(scenarios[i], results, runs);
+	}
+
+	free(results);
+	return split_brains > 0 ? 1 : 0;
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Try \"failover_sim --help\" for more information.\n");
+}
+
+
+static void
+help(const char *progname)
+{
+	printf("%s: simulates repmgrd failovers after the master dies\n", progname);
+	printf("\n");
+	printf("Usage:\n");
+	printf(" %s [OPTIONS]\n", progname);
+	printf("\nScenario options:\n");
+	printf("  -n, --nodes=N[,N...]          registered nodes, master included (default: 10,50,200)\n");
+	printf("  -s, --seed=SEED               seed of the first run, incremented for each run\n");
+	printf("  -r, --runs=RUNS               runs per node count (default: 20)\n");
+	printf("  --witness                     the last node is a witness\n");
+	printf("\nNetwork and fault options:\n");
+	printf("  --latency=MS                  one-way latency (default: 1)\n");
+	printf("  --jitter=MS                   random extra latency, up to MS (default: 2)\n");
+	printf("  --loss=P                      probability a request is lost (default: 0)\n");
+	printf("  --timeout=MS                  time before a lost request fails (default: 2000)\n");
+	printf("  --crash=P                     probability a standby crashes during the failover\n");
+	printf("\nrepmgr options:\n");
+	printf("  --monitor-interval=SECS       monitor_interval_secs (default: 2)\n");
+	printf("  --reconnect-attempts=N        reconnect_attempts (default: 6)\n");
+	printf("  --reconnect-interval=SECS     reconnect_interval (default: 10)\n");
+	printf("  --lag-tolerance=BYTES         failover_lag_tolerance (default: 0)\n");
+	printf("  --promote-time=MS             duration of promote_command (default: 1000)\n");
+	printf("  --follow-time=MS              duration of follow_command (default: 1000)\n");
+	printf("\nStandby options:\n");
+	printf("  --max-lag=BYTES               WAL a standby may not have received\n");
+	printf("  --max-backlog=BYTES           WAL a standby may not have replayed\n");
+	printf("  --horizon=SECS                simulated time after which a run stops (default: 600)\n");
+	printf("  --check                       only check the candidate choice on fixed cases\n");
+	printf("\nOne CSV line is printed per run, then a summary per node count.\n");
+	printf("The exit status is 1 if several nodes were promoted in any run.\n");
+}
+
+
+static bool
+parse_scenarios(char *list)
+{
+	char	   *token;
+
+	scenario_count = 0;
+	for (token = strtok(list, ","); token != NULL; token = strtok(NULL, ","))
+	{
+		if (scenario_count == MAX_SCENARIOS || atoi(token) < 2)
+			return false;
+		scenarios[scenario_count++] = atoi(token);
+	}
+	return scenario_count > 0;
+}
+
+
+/* xorshift64* */
+static unsigned long long
+rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+
+/* uniform in [0, n) */
+static long long
+rng_range(long long n)
+{
+	if (n <= 0)
+		return 0;
+	return (long long) (rng_next() % (unsigned long long) n);
+}
+
+
+static double
+rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*
+ * The events are kept in a binary heap ordered by time, then by the order
+ * they were scheduled in
+ */
+static bool
+event_before(t_event *a, t_event *b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+
+static void
+push_event(t_event *ev)
+{
+	int			i;
+
+	if (queue_len == queue_size)
+	{
+		queue_size = queue_size ? queue_size * 2 : 1024;
+		queue = realloc(queue, queue_size * sizeof(t_event));
+		if (queue == NULL)
+		{
+			fprintf(stderr, "failover_sim: out of memory\n");
+			exit(1);
+		}
+	}
+
+	ev->seq = event_seq++;
+	i = queue_len++;
+	while (i > 0 && event_before(ev, &queue[(i - 1) / 2]))
+	{
+		queue[i] = queue[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	queue[i] = *ev;
+}
+
+
+static bool
+pop_event(t_event *ev)
+{
+	t_event		last;
+	int			i = 0;
+	int			child;
+
+	if (queue_len == 0)
+		return false;
+
+	*ev = queue[0];
+	last = queue[--queue_len];
+	while ((child = 2 * i + 1) < queue_len)
+	{
+		if (child + 1 < queue_len && event_before(&queue[child + 1], &queue[child]))
+			child++;
+		if (!event_before(&queue[child], &last))
+			break;
+		queue[i] = queue[child];
+		i = child;
+	}
+	queue[i] = last;
+	return true;
+}
+
+
+static long long
+one_way(int from, int to)
+{
+	if (from == to)
+		return LOCAL_LATENCY_MS;
+	return Max(1, latency_ms + rng_range(jitter_ms + 1));
+}
+
+
+/*
+ * Sends a request from 'node' to 'target'; the answer comes back as an
+ * EV_REPLY event.  A lost request fails after timeout_ms, as a connection
+ * attempt would.
+ */
+static void
+send_request(int node, int target, t_rpc rpc, long long arg)
+{
+	t_event		ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.node = node;
+	ev.target = target;
+	ev.rpc = rpc;
+	ev.arg = arg;
+
+	if (node != target && rng_unit() < loss)
+	{
+		ev.type = EV_REPLY;
+		ev.time = now + timeout_ms;
+		ev.ok = false;
+	}
+	else
+	{
+		ev.type = EV_DELIVER;
+		ev.time = now + one_way(node, target);
+		/* the time the request was sent, for the timeout */
+		ev.result = now;
+	}
+	push_event(&ev);
+}
+
+
+static void
+sleep_node(int node, long long ms)
+{
+	t_event		ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = EV_WAKE;
+	ev.time = now + ms;
+	ev.node = node;
+	push_event(&ev);
+}
+
+
+/*
+ * A request reaches its target: answers it as repmgrd, the repmgr_funcs
+ * functions or the server would
+ */
+static void
+deliver(t_event *ev)
+{
+	t_sim_node *target = &sim_nodes[ev->target];
+	long long	sent = ev->result;
+
+	ev->type = EV_REPLY;
+	if (target->crashed)
+	{
+		ev->ok = false;
+		ev->time = sent + timeout_ms;
+		push_event(ev);
+		return;
+	}
+
+	ev->ok = true;
+	ev->result = 0;
+	ev->result2 = 0;
+	switch (ev->rpc)
+	{
+		case RPC_EPOCH:
+			ev->result = target->vote.epoch;
+			break;
+		case RPC_RECEIVED:
+			ev->result = target->received;
+			break;
+		case RPC_PUBLISHED:
+			if (target->published)
+			{
+				ev->result = target->received;
+				ev->result2 = target->eta;
+			}
+			break;
+		case RPC_VOTE:
+			/* what repmgr_request_vote() does */
+			if (ev->arg == target->vote.epoch && ev->node == target->vote.voted_for)
+				ev->result = 1;
+			else if (vote_allowed(&target->vote, ev->arg, ev->node, now))
+			{
+				target->vote.epoch = ev->arg;
+				target->vote.voted_for = ev->node;
+				target->vote.lease_expiry = now + ELECTION_LEASE_SECS * 1000LL;
+				ev->result = 1;
+			}
+			ev->result2 = target->vote.epoch;
+			break;
+		case RPC_PROMOTED:
+			ev->result = target->promoted;
+			break;
+	}
+	ev->time = now + one_way(ev->target, ev->node);
+	push_event(ev);
+}
+
+
+/*
+ * Moves the failover of a node forward, when what it was waiting for
+ * happened: a reply (ev->type == EV_REPLY) or the end of a sleep
+ */
+static void
+step(int node, t_event *ev)
+{
+	t_sim_node *n = &sim_nodes[node];
+	t_view	   *v;
+
+	switch (n->phase)
+	{
+		case PHASE_MONITOR:
+			/* the master is found dead: start the failover */
+			n->phase = PHASE_VISIBLE;
+			n->next = 0;
+			n->visible_count = 0;
+			n->max_epoch = 0;
+			send_request(node, 0, RPC_EPOCH, 0);
+			break;
+
+		case PHASE_VISIBLE:
+			v = &n->view[n->next];
+			if (ev->ok)
+			{
+				v->visible = true;
+				n->visible_count++;
+				if (ev->result > n->max_epoch)
+					n->max_epoch = ev->result;
+			}
+			if (++n->next < total_nodes)
+			{
+				send_request(node, n->next, RPC_EPOCH, 0);
+				break;
+			}
+
+			/* can't reach most of the nodes */
+			if (n->visible_count < total_nodes / 2.0)
+			{
+				n->phase = PHASE_ABORTED;
+				break;
+			}
+			n->phase = PHASE_RECEIVED;
+			n->next = -1;
+			/* FALLTHROUGH */
+
+		case PHASE_RECEIVED:
+			if (n->next >= 0)
+			{
+				/* "new problems are arising, manual intervention is needed" */
+				if (!ev->ok)
+				{
+					n->phase = PHASE_ABORTED;
+					break;
+				}
+				n->view[n->next].received = ev->result;
+			}
+			for (n->next++; n->next < total_nodes; n->next++)
+			{
+				if (n->view[n->next].visible && !sim_nodes[n->next].is_witness)
+					break;
+			}
+			if (n->next < total_nodes)
+			{
+				send_request(node, n->next, RPC_RECEIVED, 0);
+				break;
+			}
+			n->phase = PHASE_SAMPLE;
+			sleep_node(node, APPLY_SAMPLE_MS);
+			break;
+
+		case PHASE_SAMPLE:
+			n->published = true;
+			n->next = 0;
+			start_ready(node);
+			break;
+
+		case PHASE_READY:
+			v = &n->view[n->next];
+			if (ev->ok && ev->result > 0)
+			{
+				if (ev->result > v->received)
+					v->received = ev->result;
+				v->eta = (long) ev->result2;
+				v->ready = true;
+				n->next++;
+			}
+			else if (!ev->ok)
+			{
+				/* assume the node is restarting and go on without it */
+				n->next++;
+			}
+			/* nothing published yet: ask again */
+			start_ready(node);
+			break;
+
+		case PHASE_ELECT:
+			if (ev->type == EV_WAKE)
+			{
+				/* after the pause between two rounds */
+				start_round(node);
+				break;
+			}
+			if (ev->ok)
+			{
+				if (ev->result)
+					n->votes++;
+				if (ev->result2 > n->max_seen)
+					n->max_seen = ev->result2;
+			}
+			for (n->next++; n->next < total_nodes; n->next++)
+			{
+				if (n->view[n->next].visible)
+					break;
+			}
+			if (n->next < total_nodes)
+				send_request(node, n->next, RPC_VOTE, n->epoch);
+			else
+				end_round(node);
+			break;
+
+		case PHASE_PROMOTE:
+			n->promoted = true;
+			n->promoted_at = now;
+			n->phase = PHASE_DONE;
+			break;
+
+		case PHASE_WAIT_MASTER:
+			if (ev->type == EV_REPLY && (!ev->ok || ev->result))
+			{
+				/* promoted, or unreachable: follow it anyway */
+				n->phase = PHASE_FOLLOW;
+				sleep_node(node, follow_ms);
+			}
+			else if (ev->type == EV_REPLY)
+			{
+				if (now - n->wait_start >= FOLLOW_WAIT_TIMEOUT * 1000LL)
+				{
+					n->phase = PHASE_FOLLOW;
+					sleep_node(node, follow_ms);
+				}
+				else
+					sleep_node(node, FOLLOW_POLL_MS);
+			}
+			else
+				send_request(node, n->candidate, RPC_PROMOTED, 0);
+			break;
+
+		case PHASE_FOLLOW:
+			n->followed_at = now;
+			n->phase = PHASE_DONE;
+			break;
+
+		case PHASE_DONE:
+		case PHASE_ABORTED:
+			break;
+	}
+}
+
+
+/* asks the next visible node that isn't ready for what it published */
+static void
+start_ready(int node)
+{
+	t_sim_node *n = &sim_nodes[node];
+
+	n->phase = PHASE_READY;
+	for (; n->next < total_nodes; n->next++)
+	{
+		/* a witness is ready as soon as it is seen */
+		if (sim_nodes[n->next].is_witness)
+			n->view[n->next].ready = true;
+		if (n->view[n->next].visible && !n->view[n->next].ready)
+			break;
+	}
+
+	if (n->next < total_nodes)
+		send_request(node, n->next, RPC_PUBLISHED, 0);
+	else
+		decide(node);
+}
+
+
+/* every node is ready: pick the candidate as repmgrd does */
+static void
+decide(int node)
+{
+	t_sim_node *n = &sim_nodes[node];
+	int			i;
+
+	for (i = 0; i < total_nodes; i++)
+	{
+		scratch[i].node_id = i;
+		scratch[i].is_witness = sim_nodes[i].is_witness;
+		scratch[i].is_visible = n->view[i].visible;
+		scratch[i].is_ready = n->view[i].ready;
+		scratch[i].received_bytes = n->view[i].received;
+		scratch[i].replay_eta = n->view[i].eta;
+	}
+
+	n->candidate = choose_candidate(scratch, total_nodes, lag_tolerance);
+	if (n->candidate < 0)
+	{
+		n->phase = PHASE_ABORTED;
+		return;
+	}
+
+	if (n->candidate == node)
+	{
+		n->phase = PHASE_ELECT;
+		n->round = 0;
+		n->epoch = n->max_epoch;
+		start_round(node);
+	}
+	else
+	{
+		n->phase = PHASE_WAIT_MASTER;
+		n->wait_start = now;
+		send_request(node, n->candidate, RPC_PROMOTED, 0);
+	}
+}
+
+
+static void
+start_round(int node)
+{
+	t_sim_node *n = &sim_nodes[node];
+
+	n->epoch++;
+	n->max_seen = n->epoch;
+	n->votes = 0;
+	n->round_start = now;
+	for (n->next = 0; n->next < total_nodes; n->next++)
+	{
+		if (n->view[n->next].visible)
+			break;
+	}
+	if (n->next < total_nodes)
+		send_request(node, n->next, RPC_VOTE, n->epoch);
+	else
+		end_round(node);
+}
+
+
+static void
+end_round(int node)
+{
+	t_sim_node *n = &sim_nodes[node];
+
+	if (n->votes > total_nodes / 2 &&
+		now - n->round_start < ELECTION_LEASE_SECS * 1000LL)
+	{
+		n->phase = PHASE_PROMOTE;
+		sleep_node(node, promote_ms);
+		return;
+	}
+
+	n->epoch = n->max_seen;
+	if (++n->round >= ELECTION_ROUNDS)
+	{
+		n->phase = PHASE_ABORTED;
+		return;
+	}
+	sleep_node(node, ELECTION_RETRY_MS + rng_range(ELECTION_RETRY_MS));
+}
+
+
+static void
+run_once(int nodes, long long seed, t_run_result *result)
+{
+	long long	detect_ms = (long long) reconnect_attempts * reconnect_interval_secs * 1000;
+	long long	crash_window = detect_ms + monitor_interval_secs * 1000LL +
+		APPLY_SAMPLE_MS + 5000;
+	long long	horizon = horizon_secs * 1000LL;
+	long long	last_follow = 0;
+	t_event		ev;
+	int			master = -1;
+	bool		converged = true;
+	int			i;
+
+	memset(result, 0, sizeof(t_run_result));
+	result->nodes = nodes;
+	result->seed = seed;
+	result->promote_ms = -1;
+	result->converge_ms = -1;
+
+	rng_state = (unsigned long long) seed * 0x9E3779B97F4A7C15ULL + 1;
+	queue_len = 0;
+	event_seq = 0;
+	now = 0;
+	total_nodes = nodes;
+	sim_nodes = calloc(nodes, sizeof(t_sim_node));
+	scratch = calloc(nodes, sizeof(t_node_info));
+	if (sim_nodes == NULL || scratch == NULL)
+	{
+		fprintf(stderr, "failover_sim: out of memory\n");
+		exit(1);
+	}
+
+	/* node 0 is the master, dead at time 0; the others are standbys */
+	sim_nodes[0].crashed = true;
+	sim_nodes[0].phase = PHASE_DONE;
+	for (i = 1; i < nodes; i++)
+	{
+		t_sim_node *n = &sim_nodes[i];
+		long long	backlog;
+
+		n->vote.voted_for = -1;
+		n->is_witness = with_witness && i == nodes - 1;
+		n->view = calloc(nodes, sizeof(t_view));
+		if (n->view == NULL)
+		{
+			fprintf(stderr, "failover_sim: out of memory\n");
+			exit(1);
+		}
+
+		n->received = MASTER_POSITION - rng_range(max_lag + 1);
+		backlog = rng_range(max_backlog + 1);
+		n->eta = (long) (backlog / (MIN_APPLY_RATE +
+									rng_range(MAX_APPLY_RATE - MIN_APPLY_RATE)));
+
+		if (n->is_witness)
+		{
+			/* witnesses only answer */
+			n->phase = PHASE_DONE;
+			continue;
+		}
+
+		/* noticed when the reconnection attempts run out */
+		n->phase = PHASE_MONITOR;
+		sleep_node(i, rng_range(monitor_interval_secs * 1000LL) + detect_ms);
+
+		if (crash > 0 && rng_unit() < crash)
+		{
+			memset(&ev, 0, sizeof(ev));
+			ev.type = EV_CRASH;
+			ev.node = i;
+			ev.time = rng_range(crash_window);
+			push_event(&ev);
+		}
+	}
+
+	while (pop_event(&ev) && ev.time <= horizon)
+	{
+		now = ev.time;
+		switch (ev.type)
+		{
+			case EV_DELIVER:
+				deliver(&ev);
+				break;
+			case EV_CRASH:
+				sim_nodes[ev.node].crashed = true;
+				break;
+			case EV_REPLY:
+			case EV_WAKE:
+				if (!sim_nodes[ev.node].crashed)
+					step(ev.node, &ev);
+				break;
+		}
+	}
+
+	for (i = 1; i < nodes; i++)
+	{
+		t_sim_node *n = &sim_nodes[i];
+
+		if (n->promoted)
+		{
+			result->promotions++;
+			if (result->promote_ms < 0 || n->promoted_at < result->promote_ms)
+				result->promote_ms = n->promoted_at;
+			master = i;
+		}
+		if (n->phase == PHASE_ABORTED && !n->crashed)
+			result->aborted++;
+		else if (n->phase != PHASE_DONE && !n->crashed)
+			result->stuck++;
+	}
+
+	/* converged once every standby still running follows the one master */
+	if (result->promotions == 1 && !sim_nodes[master].crashed)
+	{
+		last_follow = sim_nodes[master].promoted_at;
+		for (i = 1; i < nodes; i++)
+		{
+			t_sim_node *n = &sim_nodes[i];
+
+			if (i == master || n->crashed || n->is_witness)
+				continue;
+			if (n->followed_at == 0 || n->candidate != master ||
+				n->followed_at < sim_nodes[master].promoted_at)
+			{
+				converged = false;
+				break;
+			}
+			if (n->followed_at > last_follow)
+				last_follow = n->followed_at;
+		}
+		if (converged)
+			result->converge_ms = last_follow;
+	}
+
+	for (i = 1; i < nodes; i++)
+		free(sim_nodes[i].view);
+	free(sim_nodes);
+	free(scratch);
+	sim_nodes = NULL;
+	scratch = NULL;
+}
+
+
+static int
+compare_ll(const void *a, const void *b)
+{
+	long long	x = *(const long long *) a;
+	long long	y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+static void
+print_percentiles(const char *label, long long *values, int count)
+{
+	if (count == 0)
+	{
+		printf("# %s: none\n", label);
+		return;
+	}
+	qsort(values, count, sizeof(long long), compare_ll);
+	printf("# %s: p50=%lld p95=%lld max=%lld ms\n", label,
+		   values[(count - 1) / 2], values[(count * 95 + 99) / 100 - 1],
+		   values[count - 1]);
+}
+
+
+static void
+print_summary(int nodes, t_run_result *results, int count)
+{
+	long long  *promote = malloc(count * sizeof(long long));
+	long long  *converge = malloc(count * sizeof(long long));
+	int			promoted = 0;
+	int			converged = 0;
+	int			split_brains = 0;
+	int			i;
+
+	if (promote == NULL || converge == NULL)
+	{
+		fprintf(stderr, "failover_sim: out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (results[i].promote_ms >= 0)
+			promote[promoted++] = results[i].promote_ms;
+		if (results[i].converge_ms >= 0)
+			converge[converged++] = results[i].converge_ms;
+		if (results[i].promotions > 1)
+			split_brains++;
+	}
+
+	printf("# %d nodes, %d runs: %d promoted, %d converged, %d split brains\n",
+		   nodes, count, promoted, converged, split_brains);
+	print_percentiles("time to promote", promote, promoted);
+	print_percentiles("time to converge", converge, converged);
+
+	free(promote);
+	free(converge);
+}
+
+
+/* one fixed case of the candidate choice: two standbys, the master gone */
+typedef struct
+{
+	const char *name;
+	unsigned int xlogid[2];
+	unsigned int xrecoff[2];
+	long		eta[2];
+	long long	lag_tolerance;
+	int			expected;
+}	t_check;
+
+/*
+ * Checks choose_candidate() on the WAL positions repmgrd computes from the
+ * locations the standbys publish; 1 if any case fails
+ */
+static int
+run_checks(void)
+{
+	static const t_check checks[] =
+	{
+		/* 0/FFFF0000 is before 1/00100000, by 1.06 MB */
+		{"4 GB boundary", {0x0, 0x1}, {0xFFFF0000, 0x00100000},
+		{100, 100}, 0, 1},
+		{"4 GB boundary, most WAL first", {0x1, 0x0}, {0x00100000, 0xFFFF0000},
+		{5000, 100}, 0, 0},
+		{"4 GB boundary, within tolerance", {0x1, 0x0}, {0x00100000, 0xFFFF0000},
+		{5000, 100}, 2 * 1024 * 1024, 1},
+		{"unknown replay time last", {0x2, 0x2}, {0x1000, 0x1000},
+		{REPLAY_ETA_UNKNOWN, 2000}, 0, 1}
+	};
+	t_node_info nodes[2];
+	int			failed = 0;
+	int			chosen;
+	int			i;
+	int			j;
+
+	for (i = 0; i < (int) (sizeof(checks) / sizeof(checks[0])); i++)
+	{
+		memset(nodes, 0, sizeof(nodes));
+		for (j = 0; j < 2; j++)
+		{
+			nodes[j].node_id = j + 2;
+			nodes[j].is_visible = true;
+			nodes[j].is_ready = true;
+			nodes[j].received_bytes =
+				wal_position_bytes(checks[i].xlogid[j], checks[i].xrecoff[j]);
+			nodes[j].replay_eta = checks[i].eta[j];
+		}
+
+		chosen = choose_candidate(nodes, 2, checks[i].lag_tolerance);
+		printf("%s: %s\n", checks[i].name,
+			   chosen == checks[i].expected ? "ok" : "FAILED");
+		if (chosen != checks[i].expected)
+			failed++;
+	}
+
+	return failed > 0 ? 1 : 0;
+}
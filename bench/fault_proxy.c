@@ -0,0 +1,849 @@
+/*
+ * fault_proxy.c - TCP proxy injecting network faults
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * Sits between repmgr or repmgrd and a local PostgreSQL server and forwards
+ * connections to it, adding latency and jitter, limiting the bandwidth, or
+ * cutting the link on command: to see how check_connection(), is_pgup()
+ * and wait_connection_availability() behave on slow or partitioned
+ * networks, and how long failures take to be detected, on a single host.
+ * Point the conninfo of a node to the proxy port instead of the server's.
+ *
+ * The proxy is driven through a control port, one command per line, e.g.
+ * "echo 'LATENCY 200' | nc 127.0.0.1 7432":
+ *
+ *   PASS              forward normally (after a partition: the connections
+ *                     cut by HALFOPEN or BLACKHOLE stay cut)
+ *   LATENCY MS        delay the data by MS milliseconds each way
+ *   JITTER MS         and by up to MS more, at random
+ *   BANDWIDTH KBPS    at most KBPS kilobytes per second each way (0: no limit)
+ *   HALFOPEN          the open connections stop carrying data but are not
+ *                     closed, as when the other end vanished; new ones work
+ *   BLACKHOLE         the open and new connections carry no data
+ *   REFUSE            close every connection and refuse new ones
+ *   RESET             close every connection
+ *   STATUS            print the settings and the number of connections
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CONNECTIONS			256
+#define MAX_CONTROL_CLIENTS		8
+#define CHUNK_SIZE				16384
+#define CONTROL_LINE_LEN		256
+#define MAX_PENDING				(1024 * 1024)	/* per flow, in bytes */
+
+/* data read on one side, to be written to the other side once due */
+typedef struct s_chunk
+{
+	struct s_chunk *next;
+	long long	due;			/* ms */
+	size_t		len;
+	size_t		offset;			/* already written */
+	char		data[1];
+}	t_chunk;
+
+/* one direction of a proxied connection */
+typedef struct
+{
+	int			from;
+	int			to;
+	t_chunk    *head;
+	t_chunk    *tail;
+	size_t		pending;		/* bytes queued, not written yet */
+	bool		eof;			/* 'from' has nothing more to send */
+	double		tokens;			/* bytes the bandwidth limit allows now */
+	long long	refill;			/* ms, when tokens were last added */
+}	t_flow;
+
+typedef struct
+{
+	bool		used;
+	bool		connecting;		/* waiting for the server to accept */
+	bool		silenced;		/* cut by HALFOPEN or BLACKHOLE */
+	t_flow		up;				/* client to server */
+	t_flow		down;			/* server to client */
+}	t_connection;
+
+typedef struct
+{
+	int			sock;			/* -1 if the slot is free */
+	char		buf[CONTROL_LINE_LEN];
+	int			len;
+}	t_control_client;
+
+typedef enum
+{
+	MODE_PASS,
+	MODE_BLACKHOLE,
+	MODE_REFUSE
+}	t_mode;
+
+static t_connection connections[MAX_CONNECTIONS];
+static t_control_client control_clients[MAX_CONTROL_CLIENTS];
+static t_mode mode = MODE_PASS;
+static int	latency_ms = 0;
+static int	jitter_ms = 0;
+static long bandwidth_kbps = 0;
+static unsigned long long rng_state = 1;
+static char *listen_port = NULL;
+static char *target_host = NULL;
+static char *target_port = NULL;
+static int	listener = -1;
+
+static void usage(void);
+static void help(const char *progname);
+static long long now_ms(void);
+static unsigned long long rng_next(void);
+static int	open_listener(const char *port);
+static int	connect_target(void);
+static void accept_connection(void);
+static bool finish_connect(t_connection *conn);
+static void close_connection(t_connection *conn);
+static void close_all(void);
+static bool read_flow(t_flow *flow);
+static bool write_flow(t_flow *flow, long long now);
+static long long next_due(t_flow *flow, long long now);
+static void handle_control(char *line, char *reply, size_t reply_len);
+static void serve_control(int control);
+
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] =
+	{
+		{"listen", required_argument, NULL, 'l'},
+		{"target", required_argument, NULL, 't'},
+		{"control", required_argument, NULL, 'c'},
+		{"latency", required_argument, NULL, 1},
+		{"jitter", required_argument, NULL, 2},
+		{"bandwidth", required_argument, NULL, 3},
+		{"seed", required_argument, NULL, 4},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	char	   *control_port = NULL;
+	char	   *colon;
+	int			control;
+	int			optindex;
+	int			c;
+	int			i;
+
+	while ((c = getopt_long(argc, argv, "l:t:c:", long_options, &optindex)) != -1)
+	{
+		switch (c)
+		{
+			case 'l':
+				listen_port = optarg;
+				break;
+			case 't':
+				colon = strrchr(optarg, ':');
+				if (colon == NULL || colon == optarg || colon[1] == '\0')
+				{
+					fprintf(stderr, "fault_proxy: target must be HOST:PORT\n");
+					exit(1);
+				}
+				*colon = '\0';
+				target_host = optarg;
+				target_port = colon + 1;
+				break;
+			case 'c':
+				control_port = optarg;
+				break;
+			case 1:
+				latency_ms = atoi(optarg);
+				break;
+			case 2:
+				jitter_ms = atoi(optarg);
+				break;
+			case 3:
+				bandwidth_kbps = atol(optarg);
+				break;
+			case 4:
+				rng_state = strtoull(optarg, NULL, 10) | 1;
+				break;
+			case '?':
+				if (optopt == 0)
+				{
+					help(argv[0]);
+					exit(0);
+				}
+				/* FALLTHROUGH */
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (listen_port == NULL || target_host == NULL || control_port == NULL ||
+		latency_ms < 0 || jitter_ms < 0 || bandwidth_kbps < 0)
+	{
+		usage();
+		exit(1);
+	}
+
+	/* a client going away while data is written to it is not an error */
+	signal(SIGPIPE, SIG_IGN);
+
+	listener = open_listener(listen_port);
+	control = open_listener(control_port);
+	if (listener < 0 || control < 0)
+		exit(1);
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+		control_clients[i].sock = -1;
+
+	fprintf(stderr, "fault_proxy: forwarding port %s to %s:%s, control on port %s\n",
+			listen_port, target_host, target_port, control_port);
+
+	for (;;)
+	{
+		fd_set		read_set;
+		fd_set		write_set;
+		struct timeval timeout;
+		struct timeval *timeout_ptr = NULL;
+		long long	now = now_ms();
+		long long	wake = -1;
+		long long	due;
+		int			max_sock = control;
+
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		FD_SET(control, &read_set);
+		if (listener >= 0)
+		{
+			FD_SET(listener, &read_set);
+			if (listener > max_sock)
+				max_sock = listener;
+		}
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+		{
+			if (control_clients[i].sock < 0)
+				continue;
+			FD_SET(control_clients[i].sock, &read_set);
+			if (control_clients[i].sock > max_sock)
+				max_sock = control_clients[i].sock;
+		}
+
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			t_connection *conn = &connections[i];
+			t_flow	   *flows[2];
+			int			f;
+
+			if (!conn->used || conn->silenced)
+				continue;
+
+			/* nothing is forwarded until the server accepted */
+			if (conn->connecting)
+			{
+				FD_SET(conn->up.to, &write_set);
+				if (conn->up.to > max_sock)
+					max_sock = conn->up.to;
+				continue;
+			}
+
+			flows[0] = &conn->up;
+			flows[1] = &conn->down;
+			for (f = 0; f < 2; f++)
+			{
+				/* the other side is too slow: stop reading until it drains */
+				if (!flows[f]->eof && flows[f]->pending < MAX_PENDING)
+				{
+					FD_SET(flows[f]->from, &read_set);
+					if (flows[f]->from > max_sock)
+						max_sock = flows[f]->from;
+				}
+
+				/* wait for the first chunk to be due, then for the socket */
+				due = next_due(flows[f], now);
+				if (due == 0)
+				{
+					FD_SET(flows[f]->to, &write_set);
+					if (flows[f]->to > max_sock)
+						max_sock = flows[f]->to;
+				}
+				else if (due > 0 && (wake < 0 || due < wake))
+					wake = due;
+			}
+		}
+
+		if (wake >= 0)
+		{
+			timeout.tv_sec = wake / 1000;
+			timeout.tv_usec = (wake % 1000) * 1000;
+			timeout_ptr = &timeout;
+		}
+
+		if (select(max_sock + 1, &read_set, &write_set, NULL, timeout_ptr) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "fault_proxy: select() returned with error: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+
+		now = now_ms();
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			t_connection *conn = &connections[i];
+
+			if (!conn->used || conn->silenced)
+				continue;
+
+			if (conn->connecting)
+			{
+				if (FD_ISSET(conn->up.to, &write_set) && !finish_connect(conn))
+					close_connection(conn);
+				continue;
+			}
+
+			if ((!conn->up.eof && FD_ISSET(conn->up.from, &read_set) &&
+				 !read_flow(&conn->up)) ||
+				(!conn->down.eof && FD_ISSET(conn->down.from, &read_set) &&
+				 !read_flow(&conn->down)) ||
+				(FD_ISSET(conn->up.to, &write_set) && !write_flow(&conn->up, now)) ||
+				(FD_ISSET(conn->down.to, &write_set) && !write_flow(&conn->down, now)))
+			{
+				close_connection(conn);
+				continue;
+			}
+
+			/* both sides are done and everything was delivered */
+			if (conn->up.eof && conn->down.eof &&
+				conn->up.head == NULL && conn->down.head == NULL)
+				close_connection(conn);
+		}
+
+		if (listener >= 0 && FD_ISSET(listener, &read_set))
+			accept_connection();
+
+		if (FD_ISSET(control, &read_set))
+		{
+			int			sock = accept(control, NULL, NULL);
+
+			for (i = 0; sock >= 0 && i < MAX_CONTROL_CLIENTS; i++)
+			{
+				if (control_clients[i].sock < 0)
+				{
+					control_clients[i].sock = sock;
+					control_clients[i].len = 0;
+					break;
+				}
+			}
+			if (sock >= 0 && i == MAX_CONTROL_CLIENTS)
+				close(sock);
+		}
+
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i++)
+		{
+			if (control_clients[i].sock >= 0 &&
+				FD_ISSET(control_clients[i].sock, &read_set))
+				serve_control(i);
+		}
+	}
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Try \"fault_proxy --help\" for more information.\n");
+}
+
+
+static void
+help(const char *progname)
+{
+	printf("%s: TCP proxy injecting network faults\n", progname);
+	printf("\n");
+	printf("Usage:\n");
+	printf(" %s -l PORT -t HOST:PORT -c PORT [OPTIONS]\n", progname);
+	printf("\nOptions:\n");
+	printf("  -l, --listen=PORT             port the clients connect to\n");
+	printf("  -t, --target=HOST:PORT        server the connections are forwarded to\n");
+	printf("  -c, --control=PORT            port the commands are read from\n");
+	printf("  --latency=MS                  initial latency, each way\n");
+	printf("  --jitter=MS                   initial random extra latency\n");
+	printf("  --bandwidth=KBPS              initial bandwidth limit, each way\n");
+	printf("  --seed=SEED                   seed of the jitter\n");
+	printf("\nCommands: PASS, LATENCY MS, JITTER MS, BANDWIDTH KBPS, HALFOPEN,\n");
+	printf("BLACKHOLE, REFUSE, RESET, STATUS; one per line on the control port.\n");
+}
+
+
+static long long
+now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/* xorshift64* */
+static unsigned long long
+rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+
+static int
+open_listener(const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	int			sock;
+	int			on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo("127.0.0.1", port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "fault_proxy: invalid port \"%s\"\n", port);
+		return -1;
+	}
+
+	sock = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+	if (sock < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+		bind(sock, addrs->ai_addr, addrs->ai_addrlen) < 0 ||
+		listen(sock, 64) < 0)
+	{
+		fprintf(stderr, "fault_proxy: can't listen on port %s: %s\n", port,
+				strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	return sock;
+}
+
+
+static int
+connect_target(void)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	int			sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(target_host, target_port, &hints, &addrs) != 0)
+		return -1;
+
+	/*
+	 * Only the first address that does not fail at once is tried: the
+	 * connection completes in the event loop, see finish_connect()
+	 */
+	for (addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (fcntl(sock, F_SETFL, O_NONBLOCK) == 0 &&
+			(connect(sock, addr->ai_addr, addr->ai_addrlen) == 0 ||
+			 errno == EINPROGRESS))
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	return sock;
+}
+
+
+static void
+init_flow(t_flow *flow, int from, int to)
+{
+	memset(flow, 0, sizeof(t_flow));
+	flow->from = from;
+	flow->to = to;
+	flow->refill = now_ms();
+}
+
+
+static void
+accept_connection(void)
+{
+	t_connection *conn = NULL;
+	int			client;
+	int			server;
+	int			i;
+
+	client = accept(listener, NULL, NULL);
+	if (client < 0)
+		return;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+	{
+		if (!connections[i].used)
+		{
+			conn = &connections[i];
+			break;
+		}
+	}
+
+	/* the target is down, or too many connections: as the server would */
+	server = conn != NULL ? connect_target() : -1;
+	if (server < 0 || server >= FD_SETSIZE || client >= FD_SETSIZE)
+	{
+		if (server >= 0)
+			close(server);
+		close(client);
+		return;
+	}
+
+	fcntl(client, F_SETFL, O_NONBLOCK);
+
+	conn->used = true;
+	conn->connecting = true;
+	conn->silenced = (mode == MODE_BLACKHOLE);
+	init_flow(&conn->up, client, server);
+	init_flow(&conn->down, server, client);
+}
+
+
+/*
+ * The server socket became writable: the connection to it completed, or
+ * failed.  The client is closed in the latter case, as if the server had
+ * refused it.
+ */
+static bool
+finish_connect(t_connection *conn)
+{
+	int			error = 0;
+	socklen_t	len = sizeof(error);
+
+	if (getsockopt(conn->up.to, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+		error != 0)
+		return false;
+
+	conn->connecting = false;
+	return true;
+}
+
+
+static void
+free_chunks(t_flow *flow)
+{
+	t_chunk    *chunk;
+
+	while ((chunk = flow->head) != NULL)
+	{
+		flow->head = chunk->next;
+		free(chunk);
+	}
+	flow->tail = NULL;
+	flow->pending = 0;
+}
+
+
+static void
+close_connection(t_connection *conn)
+{
+	free_chunks(&conn->up);
+	free_chunks(&conn->down);
+	close(conn->up.from);
+	close(conn->down.from);
+	conn->used = false;
+}
+
+
+static void
+close_all(void)
+{
+	int			i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+	{
+		if (connections[i].used)
+			close_connection(&connections[i]);
+	}
+}
+
+
+/*
+ * Reads what is available on the 'from' side, to be written after the
+ * latency.  Data is never reordered, whatever the jitter.
+ */
+static bool
+read_flow(t_flow *flow)
+{
+	char		buf[CHUNK_SIZE];
+	t_chunk    *chunk;
+	long long	due;
+	ssize_t		r;
+
+	r = read(flow->from, buf, sizeof(buf));
+	if (r < 0)
+		return errno == EAGAIN || errno == EINTR;
+	if (r == 0)
+	{
+		flow->eof = true;
+		/* nothing pending: pass the end of the stream on now */
+		if (flow->head == NULL)
+			shutdown(flow->to, SHUT_WR);
+		return true;
+	}
+
+	chunk = malloc(offsetof(t_chunk, data) + r);
+	if (chunk == NULL)
+		return false;
+
+	due = now_ms() + latency_ms;
+	if (jitter_ms > 0)
+		due += rng_next() % (jitter_ms + 1);
+	if (flow->tail != NULL && flow->tail->due > due)
+		due = flow->tail->due;
+
+	chunk->next = NULL;
+	chunk->due = due;
+	chunk->len = r;
+	chunk->offset = 0;
+	memcpy(chunk->data, buf, r);
+
+	if (flow->tail != NULL)
+		flow->tail->next = chunk;
+	else
+		flow->head = chunk;
+	flow->tail = chunk;
+	flow->pending += r;
+	return true;
+}
+
+
+/* bytes the bandwidth limit lets through now */
+static size_t
+allowance(t_flow *flow, long long now)
+{
+	double		rate;
+	double		burst;
+
+	if (bandwidth_kbps == 0)
+		return CHUNK_SIZE;
+
+	/* bytes per ms, in bursts of at most 100 ms */
+	rate = bandwidth_kbps * 1024 / 1000.0;
+	burst = rate * 100 > 1 ? rate * 100 : 1;
+	flow->tokens += rate * (now - flow->refill);
+	if (flow->tokens > burst)
+		flow->tokens = burst;
+	flow->refill = now;
+
+	return (size_t) flow->tokens;
+}
+
+
+/*
+ * ms until something can be written on the flow, 0 if it can now, -1 if
+ * there is nothing to write
+ */
+static long long
+next_due(t_flow *flow, long long now)
+{
+	long long	wait;
+
+	if (flow->head == NULL)
+		return -1;
+
+	wait = flow->head->due > now ? flow->head->due - now : 0;
+	if (wait == 0 && allowance(flow, now) == 0)
+		wait = 1;
+	return wait;
+}
+
+
+static bool
+write_flow(t_flow *flow, long long now)
+{
+	t_chunk    *chunk = flow->head;
+	size_t		len;
+	ssize_t		w;
+
+	if (chunk == NULL || chunk->due > now)
+		return true;
+
+	len = chunk->len - chunk->offset;
+	if (len > allowance(flow, now))
+		len = allowance(flow, now);
+	if (len == 0)
+		return true;
+
+	w = write(flow->to, chunk->data + chunk->offset, len);
+	if (w < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (bandwidth_kbps > 0)
+		flow->tokens -= w;
+	chunk->offset += w;
+	flow->pending -= w;
+	if (chunk->offset == chunk->len)
+	{
+		flow->head = chunk->next;
+		if (flow->head == NULL)
+		{
+			flow->tail = NULL;
+			if (flow->eof)
+				shutdown(flow->to, SHUT_WR);
+		}
+		free(chunk);
+	}
+	return true;
+}
+
+
+static void
+handle_control(char *line, char *reply, size_t reply_len)
+{
+	int			connection_count = 0;
+	long		value;
+	int			i;
+
+	/* tolerate clients sending CRLF */
+	if (*line && line[strlen(line) - 1] == '\r')
+		line[strlen(line) - 1] = '\0';
+
+	if (strcmp(line, "PASS") == 0 || strcmp(line, "BLACKHOLE") == 0)
+	{
+		if (mode == MODE_REFUSE)
+			listener = open_listener(listen_port);
+		mode = strcmp(line, "PASS") == 0 ? MODE_PASS : MODE_BLACKHOLE;
+		for (i = 0; mode == MODE_BLACKHOLE && i < MAX_CONNECTIONS; i++)
+			connections[i].silenced = true;
+		snprintf(reply, reply_len, listener >= 0 ? "OK" : "ERROR can't listen");
+	}
+	else if (strcmp(line, "HALFOPEN") == 0)
+	{
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+			connections[i].silenced = true;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (strcmp(line, "REFUSE") == 0)
+	{
+		close_all();
+		if (listener >= 0)
+			close(listener);
+		listener = -1;
+		mode = MODE_REFUSE;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (strcmp(line, "RESET") == 0)
+	{
+		close_all();
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (sscanf(line, "LATENCY %ld", &value) == 1 && value >= 0)
+	{
+		latency_ms = (int) value;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (sscanf(line, "JITTER %ld", &value) == 1 && value >= 0)
+	{
+		jitter_ms = (int) value;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (sscanf(line, "BANDWIDTH %ld", &value) == 1 && value >= 0)
+	{
+		bandwidth_kbps = value;
+		snprintf(reply, reply_len, "OK");
+	}
+	else if (strcmp(line, "STATUS") == 0)
+	{
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			if (connections[i].used)
+				connection_count++;
+		}
+		snprintf(reply, reply_len,
+				 "mode=%s latency=%d jitter=%d bandwidth=%ld connections=%d",
+				 mode == MODE_PASS ? "pass" :
+				 mode == MODE_BLACKHOLE ? "blackhole" : "refuse",
+				 latency_ms, jitter_ms, bandwidth_kbps, connection_count);
+	}
+	else
+		snprintf(reply, reply_len, "ERROR unknown command");
+}
+
+
+static void
+serve_control(int i)
+{
+	t_control_client *client = &control_clients[i];
+	char		reply[CONTROL_LINE_LEN];
+	char	   *eol;
+	ssize_t		r;
+
+	r = read(client->sock, client->buf + client->len,
+			 sizeof(client->buf) - 1 - client->len);
+	if (r <= 0)
+	{
+		close(client->sock);
+		client->sock = -1;
+		return;
+	}
+	client->len += r;
+	client->buf[client->len] = '\0';
+
+	/* answer every complete line */
+	while ((eol = strchr(client->buf, '\n')) != NULL)
+	{
+		*eol = '\0';
+		handle_control(client->buf, reply, sizeof(reply) - 1);
+		fprintf(stderr, "fault_proxy: %s: %s\n", client->buf, reply);
+		strcat(reply, "\n");
+		if (write(client->sock, reply, strlen(reply)) < 0)
+			break;
+
+		client->len -= (eol + 1 - client->buf);
+		memmove(client->buf, eol + 1, client->len + 1);
+	}
+
+	/* a line longer than the buffer is not a command */
+	if (client->len == sizeof(client->buf) - 1)
+	{
+		close(client->sock);
+		client->sock = -1;
+	}
+}
@@ -17,6 +17,7 @@
  *
  */
 
+#include "arbiter.h"
 #include "config.h"
 #include "log.h"
 #include "strutil.h"
@@ -41,6 +42,7 @@ parse_config(const char *config_file, t_configuration_options * options)
 	memset(options->node_name, 0, sizeof(options->node_name));
 	memset(options->promote_command, 0, sizeof(options->promote_command));
 	memset(options->follow_command, 0, sizeof(options->follow_command));
+	memset(options->log_format, 0, sizeof(options->log_format));
 	memset(options->rsync_options, 0, sizeof(options->rsync_options));
 	memset(options->ssh_options, 0, sizeof(options->ssh_options));
 	memset(options->pg_bindir, 0, sizeof(options->pg_bindir));
@@ -55,6 +57,13 @@ parse_config(const char *config_file, t_configuration_options * options)
 
 	options->monitor_interval_secs = 2;
 	options->retry_promote_interval_secs = 300;
+	options->failover_lag_tolerance = 0;
+	options->prewarm_interval_secs = 0;
+	options->prewarm_jobs = 4;
+	memset(options->arbiter_state_file, 0, sizeof(options->arbiter_state_file));
+	memset(options->trace_file, 0, sizeof(options->trace_file));
+	memset(options->event_spool_file, 0, sizeof(options->event_spool_file));
+	options->log_rotation_size = 0;
 
 	/*
 	 * Since some commands don't require a config file at all, not having one
@@ -92,6 +101,8 @@ parse_config(const char *config_file, t_configuration_options * options)
 			strncpy(options->loglevel, value, MAXLEN);
 		else if (strcmp(name, "logfacility") == 0)
 			strncpy(options->logfacility, value, MAXLEN);
+		else if (strcmp(name, "log_format") == 0)
+			strncpy(options->log_format, value, MAXLEN);
 		else if (strcmp(name, "failover") == 0)
 		{
 			char		failoverstr[MAXLEN];
@@ -128,10 +139,24 @@ parse_config(const char *config_file, t_configuration_options * options)
 			strncpy(options->pgctl_options, value, MAXLEN);
 		else if (strcmp(name, "logfile") == 0)
 			strncpy(options->logfile, value, MAXLEN);
+		else if (strcmp(name, "log_rotation_size") == 0)
+			options->log_rotation_size = atoi(value);
 		else if (strcmp(name, "monitor_interval_secs") == 0)
 			options->monitor_interval_secs = atoi(value);
 		else if (strcmp(name, "retry_promote_interval_secs") == 0)
 			options->retry_promote_interval_secs = atoi(value);
+		else if (strcmp(name, "failover_lag_tolerance") == 0)
+			options->failover_lag_tolerance = atoi(value);
+		else if (strcmp(name, "prewarm_interval_secs") == 0)
+			options->prewarm_interval_secs = atoi(value);
+		else if (strcmp(name, "prewarm_jobs") == 0)
+			options->prewarm_jobs = atoi(value);
+		else if (strcmp(name, "arbiter_state_file") == 0)
+			strncpy(options->arbiter_state_file, value, MAXLEN);
+		else if (strcmp(name, "trace_file") == 0)
+			strncpy(options->trace_file, value, MAXLEN);
+		else if (strcmp(name, "event_spool_file") == 0)
+			strncpy(options->event_spool_file, value, MAXLEN);
 		else
 			log_warning(_("%s/%s: Unknown name/value pair!\n"), name, value);
 	}
@@ -170,7 +195,21 @@ parse_config(const char *config_file, t_configuration_options * options)
 		exit(ERR_BAD_CONFIG);
 	}
 
-	if (*options->pg_bindir == '\0')
+	if (options->failover_lag_tolerance < 0)
+	{
+		log_err(_("Failover lag tolerance must be zero or greater. Check the configuration file.\n"));
+		exit(ERR_BAD_CONFIG);
+	}
+
+	if (options->prewarm_jobs < 1)
+	{
+		log_err(_("Prewarm jobs must be greater than zero. Check the configuration file.\n"));
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* an arbiter witness doesn't run any PostgreSQL program */
+	if (*options->pg_bindir == '\0' &&
+		!is_arbiter_conninfo(options->conninfo, NULL, NULL))
 	{
 		log_err(_("pg_bindir config value not found. Check the configuration file.\n"));
 		exit(ERR_BAD_CONFIG);
@@ -234,8 +273,48 @@ parse_line(char *buff, char *name, char *value)
 	trim(value);
 }
 
+/* takes a reloaded value, and logs it when it changed */
+static bool
+reload_int(const char *name, int *orig_value, int new_value)
+{
+	if (*orig_value == new_value)
+		return false;
+
+	log_info(_("%s changed from %d to %d\n"), name, *orig_value, new_value);
+	*orig_value = new_value;
+	return true;
+}
+
+
+static bool
+reload_str(const char *name, char *orig_value, const char *new_value)
+{
+	if (strcmp(orig_value, new_value) == 0)
+		return false;
+
+	log_info(_("%s changed from \"%s\" to \"%s\"\n"), name, orig_value,
+			 new_value);
+	strcpy(orig_value, new_value);
+	return true;
+}
+
+
+/* for a value that may hold a password: its change is logged, not its text */
+static bool
+reload_secret_str(const char *name, char *orig_value, const char *new_value)
+{
+	if (strcmp(orig_value, new_value) == 0)
+		return false;
+
+	log_info(_("%s changed\n"), name);
+	strcpy(orig_value, new_value);
+	return true;
+}
+
+
 bool
-reload_config(char *config_file, t_configuration_options * orig_options)
+reload_config(char *config_file, t_configuration_options * orig_options,
+			  int *changes)
 {
 	PGconn	   *conn;
 
@@ -244,7 +323,7 @@ reload_config(char *config_file, t_configuration_options * orig_options)
 	/*
 	 * Re-read the configuration file: repmgr.conf
 	 */
-	log_info(_("Reloading configuration file and updating repmgr tables\n"));
+	log_info(_("Reloading configuration file\n"));
 	parse_config(config_file, &new_options);
 	if (new_options.node == -1)
 	{
@@ -294,39 +373,90 @@ reload_config(char *config_file, t_configuration_options * orig_options)
 		return false;
 	}
 
-	/* Test conninfo string */
-	conn = establish_db_connection(new_options.conninfo, false);
-	if (!conn || (PQstatus(conn) != CONNECTION_OK))
+	if (new_options.failover_lag_tolerance < 0)
+	{
+		log_warning(_("New value for failover_lag_tolerance is not valid. Should be greater or equal than zero.\n"));
+		return false;
+	}
+
+	if (new_options.prewarm_jobs < 1)
 	{
-		log_warning(_("conninfo string is not valid, will keep current configuration.\n"));
+		log_warning(_("New value for prewarm_jobs is not valid. Should be greater than zero.\n"));
 		return false;
 	}
-	PQfinish(conn);
-
-	/* Configuration seems ok, will load new values */
-	strcpy(orig_options->cluster_name, new_options.cluster_name);
-	orig_options->node = new_options.node;
-	strcpy(orig_options->conninfo, new_options.conninfo);
-	orig_options->failover = new_options.failover;
-	orig_options->priority = new_options.priority;
-	strcpy(orig_options->node_name, new_options.node_name);
-	strcpy(orig_options->promote_command, new_options.promote_command);
-	strcpy(orig_options->follow_command, new_options.follow_command);
-	strcpy(orig_options->rsync_options, new_options.rsync_options);
-	strcpy(orig_options->ssh_options, new_options.ssh_options);
-	orig_options->master_response_timeout = new_options.master_response_timeout;
-	orig_options->reconnect_attempts = new_options.reconnect_attempts;
-	orig_options->reconnect_intvl = new_options.reconnect_intvl;
+
+	/* Test conninfo string, when there's a new one */
+	if (strcmp(new_options.conninfo, orig_options->conninfo) != 0)
+	{
+		conn = establish_db_connection(new_options.conninfo, false);
+		if (!conn || (PQstatus(conn) != CONNECTION_OK))
+		{
+			log_warning(_("conninfo string is not valid, will keep current configuration.\n"));
+			return false;
+		}
+		PQfinish(conn);
+	}
+
+	if (strcmp(new_options.logfacility, orig_options->logfacility) != 0)
+	{
+		log_warning(_("logfacility can't change until repmgrd restarts, keeping \"%s\".\n"),
+					orig_options->logfacility);
+	}
+	if (strcmp(new_options.arbiter_state_file, orig_options->arbiter_state_file) != 0 ||
+		strcmp(new_options.event_spool_file, orig_options->event_spool_file) != 0)
+	{
+		log_warning(_("arbiter_state_file and event_spool_file can't change until repmgrd restarts.\n"));
+	}
 
 	/*
-	 * XXX These ones can change with a simple SIGHUP?
-	 *
-	 * strcpy (orig_options->loglevel, new_options.loglevel); strcpy
-	 * (orig_options->logfacility, new_options.logfacility);
-	 *
-	 * logger_shutdown(); XXX do we have progname here ? logger_init(progname,
-	 * orig_options.loglevel, orig_options.logfacility);
+	 * Configuration seems ok, will load new values: only the ones that
+	 * changed are logged, and the caller told what it has to redo
 	 */
+	*changes = 0;
+
+	if (reload_secret_str("conninfo", orig_options->conninfo,
+						  new_options.conninfo))
+		*changes |= CONFIG_CHANGED_CONNINFO;
+	if (reload_int("priority", &orig_options->priority, new_options.priority))
+		*changes |= CONFIG_CHANGED_PRIORITY;
+
+	if (reload_str("loglevel", orig_options->loglevel, new_options.loglevel) |
+		reload_str("log_format", orig_options->log_format, new_options.log_format) |
+		reload_str("logfile", orig_options->logfile, new_options.logfile) |
+		reload_int("log_rotation_size", &orig_options->log_rotation_size,
+				   new_options.log_rotation_size))
+		*changes |= CONFIG_CHANGED_LOGGING;
+
+	reload_int("failover", &orig_options->failover, new_options.failover);
+	reload_str("promote_command", orig_options->promote_command,
+			   new_options.promote_command);
+	reload_str("follow_command", orig_options->follow_command,
+			   new_options.follow_command);
+	reload_str("rsync_options", orig_options->rsync_options,
+			   new_options.rsync_options);
+	reload_str("ssh_options", orig_options->ssh_options,
+			   new_options.ssh_options);
+	reload_str("pg_bindir", orig_options->pg_bindir, new_options.pg_bindir);
+	reload_str("pg_ctl_options", orig_options->pgctl_options,
+			   new_options.pgctl_options);
+	reload_int("master_response_timeout", &orig_options->master_response_timeout,
+			   new_options.master_response_timeout);
+	reload_int("reconnect_attempts", &orig_options->reconnect_attempts,
+			   new_options.reconnect_attempts);
+	reload_int("reconnect_interval", &orig_options->reconnect_intvl,
+			   new_options.reconnect_intvl);
+	reload_int("monitor_interval_secs", &orig_options->monitor_interval_secs,
+			   new_options.monitor_interval_secs);
+	reload_int("retry_promote_interval_secs",
+			   &orig_options->retry_promote_interval_secs,
+			   new_options.retry_promote_interval_secs);
+	reload_int("failover_lag_tolerance", &orig_options->failover_lag_tolerance,
+			   new_options.failover_lag_tolerance);
+	reload_int("prewarm_interval_secs", &orig_options->prewarm_interval_secs,
+			   new_options.prewarm_interval_secs);
+	reload_int("prewarm_jobs", &orig_options->prewarm_jobs,
+			   new_options.prewarm_jobs);
+	reload_str("trace_file", orig_options->trace_file, new_options.trace_file);
 
 	return true;
 }
@@ -35,6 +35,7 @@ typedef struct
 	char		follow_command[MAXLEN];
 	char		loglevel[MAXLEN];
 	char		logfacility[MAXLEN];
+	char		log_format[MAXLEN];
 	char		rsync_options[QUERY_STR_LEN];
 	char		ssh_options[QUERY_STR_LEN];
 	int			master_response_timeout;
@@ -45,13 +46,26 @@ typedef struct
 	char		logfile[MAXLEN];
 	int			monitor_interval_secs;
 	int			retry_promote_interval_secs;
+	int			failover_lag_tolerance;
+	int			prewarm_interval_secs;
+	int			prewarm_jobs;
+	char		arbiter_state_file[MAXLEN];
+	char		trace_file[MAXLEN];
+	char		event_spool_file[MAXLEN];
+	int			log_rotation_size;
 }	t_configuration_options;
 
-#define T_CONFIGURATION_OPTIONS_INITIALIZER { "", -1, "", MANUAL_FAILOVER, -1, "", "", "", "", "", "", "", -1, -1, -1, "", "", "", 0, 0 }
+#define T_CONFIGURATION_OPTIONS_INITIALIZER { "", -1, "", MANUAL_FAILOVER, -1, "", "", "", "", "", "", "", "", -1, -1, -1, "", "", "", 0, 0, 0, 0, 0, "", "", "", 0 }
+
+/* what reload_config() changed that needs more than a new value */
+#define CONFIG_CHANGED_CONNINFO		(1 << 0)
+#define CONFIG_CHANGED_PRIORITY		(1 << 1)
+#define CONFIG_CHANGED_LOGGING		(1 << 2)
 
 void		parse_config(const char *config_file, t_configuration_options * options);
 void		parse_line(char *buff, char *name, char *value);
 char	   *trim(char *s);
-bool		reload_config(char *config_file, t_configuration_options * orig_options);
+bool reload_config(char *config_file, t_configuration_options * orig_options,
+			  int *changes);
 
 #endif
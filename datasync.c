@@ -0,0 +1,610 @@
+/*
+ * datasync.c - Durability and verification of a cloned data directory
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * Once a clone is copied its files only live in the OS cache; they are
+ * flushed to disk here, with several files in flight at once.  The same
+ * pass can verify the page checksums of relation files when the cluster
+ * was initialized with them (9.3 and later).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* NB: postgres_fe must be included BEFORE datasync */
+#include "postgres_fe.h"
+#include "datasync.h"
+
+#include "strutil.h"
+#include "log.h"
+
+/* pages read at once when verifying */
+#define DATA_SYNC_READ_PAGES	32
+
+/* bad pages reported one by one, the others are only counted */
+#define DATA_SYNC_MAX_REPORTED	100
+
+/* times a page with a bad checksum is read again from the source */
+#define DATA_SYNC_REREADS		5
+#define DATA_SYNC_REREAD_DELAY	100000	/* usec */
+
+/* The beginning of a page header, as laid out since 9.3 */
+typedef struct
+{
+	uint32		lsn_xlogid;
+	uint32		lsn_xrecoff;
+	uint16		checksum;
+	uint16		flags;
+	uint16		lower;
+	uint16		upper;
+}	t_page_header;
+
+typedef struct
+{
+	char	   *path;
+	bool		is_dir;
+}	t_sync_entry;
+
+typedef struct
+{
+	const char *data_dir;
+	t_sync_entry *entries;
+	int			nentries;
+	int			maxentries;
+	int			next;
+	bool		verify;
+	uint64		backup_lsn;
+	PGconn	   *source_conn;
+	t_data_sync_stats *stats;
+	pthread_mutex_t lock;
+	pthread_mutex_t source_lock;	/* one query at a time on source_conn */
+}	t_sync_work;
+
+static bool walk_dir(t_sync_work *work, const char *rel);
+static bool add_entry(t_sync_work *work, const char *rel, bool is_dir);
+static void *sync_worker(void *arg);
+static bool sync_file(t_sync_work *work, t_sync_entry *entry, char *buf);
+static int	recheck_page(t_sync_work *work, const char *rel, int fd,
+			 uint32 blkno, uint32 segno);
+static bool read_source_page(t_sync_work *work, const char *rel,
+				 uint32 file_blkno, char *page);
+static bool relation_segment(const char *rel, uint32 *segno);
+static uint16 pg_checksum_page(char *page, uint32 blkno);
+
+
+/*
+ * Converts an "X/Y" WAL location to its 64 bit position
+ */
+uint64
+parse_lsn(const char *lsn)
+{
+	uint32		hi;
+	uint32		lo;
+
+	if (sscanf(lsn, "%X/%X", &hi, &lo) != 2)
+		return 0;
+
+	return ((uint64) hi << 32) | lo;
+}
+
+
+/*
+ * fsyncs every file and directory of data_dir, tablespaces included, using
+ * up to jobs threads.  With verify, the checksum of every page of relation
+ * files is checked on the way, except for pages changed after backup_lsn:
+ * those may have been copied while being written, and WAL replay will
+ * restore them anyway.
+ *
+ * A page may also have been copied while the source was writing it.  When
+ * source_conn is given, a page with a bad checksum is read again from there
+ * a few times before being reported, as pg_basebackup does.
+ */
+bool
+sync_data_directory(const char *data_dir, int jobs, bool verify,
+					uint64 backup_lsn, PGconn *source_conn,
+					t_data_sync_stats *stats)
+{
+	t_sync_work work;
+	pthread_t  *threads;
+	struct timeval start;
+	struct timeval end;
+	int			started = 0;
+	int			i;
+	bool		ok;
+
+	gettimeofday(&start, NULL);
+
+	memset(&work, 0, sizeof(work));
+	work.data_dir = data_dir;
+	work.verify = verify;
+	work.backup_lsn = backup_lsn;
+	work.source_conn = source_conn;
+	work.stats = stats;
+	pthread_mutex_init(&work.lock, NULL);
+	pthread_mutex_init(&work.source_lock, NULL);
+
+	ok = walk_dir(&work, "") && add_entry(&work, "", true);
+
+	if (ok)
+	{
+		if (jobs < 1)
+			jobs = 1;
+		if (jobs > work.nentries)
+			jobs = work.nentries;
+
+		threads = malloc(jobs * sizeof(pthread_t));
+		if (threads == NULL)
+		{
+			log_err(_("data sync: out of memory\n"));
+			ok = false;
+		}
+		else
+		{
+			for (i = 0; i < jobs; i++)
+			{
+				if (pthread_create(&threads[i], NULL, sync_worker, &work) != 0)
+					break;
+				started++;
+			}
+
+			/* if no thread could be started, do the work ourselves */
+			if (started == 0)
+				sync_worker(&work);
+
+			for (i = 0; i < started; i++)
+				pthread_join(threads[i], NULL);
+			free(threads);
+		}
+	}
+
+	for (i = 0; i < work.nentries; i++)
+		free(work.entries[i].path);
+	free(work.entries);
+	pthread_mutex_destroy(&work.lock);
+	pthread_mutex_destroy(&work.source_lock);
+
+	gettimeofday(&end, NULL);
+	stats->seconds = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	return ok && stats->failed == 0 && stats->bad_pages == 0;
+}
+
+
+/*
+ * Lists the files and directories below rel.  Symbolic links are followed,
+ * so tablespaces linked from pg_tblspc are handled too.
+ */
+static bool
+walk_dir(t_sync_work *work, const char *rel)
+{
+	char		path[MAXFILENAME];
+	char		entry_rel[MAXFILENAME];
+	DIR		   *dir;
+	struct dirent *de;
+	struct stat st;
+	bool		ok = true;
+
+	maxlen_snprintf(path, "%s%s%s", work->data_dir, rel[0] ? "/" : "", rel);
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		log_err(_("data sync: can't open directory \"%s\": %s\n"),
+				path, strerror(errno));
+		return false;
+	}
+
+	while (ok && (de = readdir(dir)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		maxlen_snprintf(entry_rel, "%s%s%s", rel, rel[0] ? "/" : "",
+						de->d_name);
+		maxlen_snprintf(path, "%s/%s", work->data_dir, entry_rel);
+
+		if (stat(path, &st) != 0)
+		{
+			log_err(_("data sync: can't stat \"%s\": %s\n"),
+					path, strerror(errno));
+			ok = false;
+		}
+		else if (S_ISDIR(st.st_mode))
+			ok = walk_dir(work, entry_rel) && add_entry(work, entry_rel, true);
+		else if (S_ISREG(st.st_mode))
+			ok = add_entry(work, entry_rel, false);
+	}
+
+	closedir(dir);
+	return ok;
+}
+
+
+static bool
+add_entry(t_sync_work *work, const char *rel, bool is_dir)
+{
+	t_sync_entry *entries;
+
+	if (work->nentries == work->maxentries)
+	{
+		work->maxentries = work->maxentries ? work->maxentries * 2 : 1024;
+		entries = realloc(work->entries,
+						  work->maxentries * sizeof(t_sync_entry));
+		if (entries == NULL)
+		{
+			log_err(_("data sync: out of memory\n"));
+			return false;
+		}
+		work->entries = entries;
+	}
+
+	work->entries[work->nentries].path = strdup(rel);
+	if (work->entries[work->nentries].path == NULL)
+	{
+		log_err(_("data sync: out of memory\n"));
+		return false;
+	}
+	work->entries[work->nentries].is_dir = is_dir;
+	work->nentries++;
+
+	return true;
+}
+
+
+static void *
+sync_worker(void *arg)
+{
+	t_sync_work *work = (t_sync_work *) arg;
+	t_sync_entry *entry;
+	char	   *buf;
+	bool		ok;
+
+	buf = malloc(DATA_SYNC_READ_PAGES * BLCKSZ);
+	if (buf == NULL)
+	{
+		log_err(_("data sync: out of memory\n"));
+		pthread_mutex_lock(&work->lock);
+		work->stats->failed++;
+		pthread_mutex_unlock(&work->lock);
+		return NULL;
+	}
+
+	for (;;)
+	{
+		pthread_mutex_lock(&work->lock);
+		entry = (work->next < work->nentries) ?
+			&work->entries[work->next++] : NULL;
+		pthread_mutex_unlock(&work->lock);
+
+		if (entry == NULL)
+			break;
+
+		ok = sync_file(work, entry, buf);
+		if (!ok)
+		{
+			pthread_mutex_lock(&work->lock);
+			work->stats->failed++;
+			pthread_mutex_unlock(&work->lock);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+static bool
+sync_file(t_sync_work *work, t_sync_entry *entry, char *buf)
+{
+	char		path[MAXFILENAME];
+	t_page_header *page;
+	long long	bytes = 0;
+	long		checked = 0;
+	long		skipped = 0;
+	long		reread = 0;
+	long		bad = 0;
+	uint32		segno;
+	uint32		blkno = 0;
+	uint64		page_lsn;
+	uint16		checksum;
+	ssize_t		nread;
+	int			fd;
+	int			i;
+	bool		verify;
+
+	maxlen_snprintf(path, "%s%s%s", work->data_dir,
+					entry->path[0] ? "/" : "", entry->path);
+
+	fd = open(path, entry->is_dir ? O_RDONLY : O_RDWR);
+	if (fd < 0)
+	{
+		log_err(_("data sync: can't open \"%s\": %s\n"), path, strerror(errno));
+		return false;
+	}
+
+	verify = work->verify && !entry->is_dir &&
+		relation_segment(entry->path, &segno);
+	if (verify)
+		blkno = segno * RELSEG_SIZE;
+
+	while (verify &&
+		   (nread = read(fd, buf, DATA_SYNC_READ_PAGES * BLCKSZ)) > 0)
+	{
+		bytes += nread;
+
+		for (i = 0; i < nread / BLCKSZ; i++, blkno++)
+		{
+			page = (t_page_header *) (buf + i * BLCKSZ);
+			page_lsn = ((uint64) page->lsn_xlogid << 32) | page->lsn_xrecoff;
+
+			/* new pages carry no checksum yet */
+			if (page->upper == 0 || page_lsn >= work->backup_lsn)
+			{
+				skipped++;
+				continue;
+			}
+
+			checked++;
+			checksum = pg_checksum_page((char *) page, blkno);
+			if (checksum == page->checksum)
+				continue;
+
+			switch (recheck_page(work, entry->path, fd, blkno, segno))
+			{
+				case 1:
+					/* written on the source during the copy */
+					checked--;
+					skipped++;
+					reread++;
+					break;
+				case 0:
+					/* torn copy, replaced by a good page from the source */
+					reread++;
+					break;
+				default:
+					bad++;
+					if (work->stats->bad_pages + bad <= DATA_SYNC_MAX_REPORTED)
+						log_err(_("data sync: checksum mismatch in \"%s\" block %u (block %u of the file): expected %X, found %X\n"),
+								path, blkno, blkno - segno * RELSEG_SIZE,
+								checksum, page->checksum);
+					break;
+			}
+		}
+	}
+
+	if (fsync(fd) != 0)
+	{
+		log_err(_("data sync: can't fsync \"%s\": %s\n"), path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (!verify && !entry->is_dir)
+	{
+		struct stat st;
+
+		if (fstat(fd, &st) == 0)
+			bytes = st.st_size;
+	}
+	close(fd);
+
+	pthread_mutex_lock(&work->lock);
+	if (!entry->is_dir)
+		work->stats->files++;
+	work->stats->bytes += bytes;
+	work->stats->pages_checked += checked;
+	work->stats->pages_skipped += skipped;
+	work->stats->pages_reread += reread;
+	work->stats->bad_pages += bad;
+	pthread_mutex_unlock(&work->lock);
+
+	return true;
+}
+
+
+/*
+ * Reads a page with a bad checksum again from the source, until it shows
+ * a consistent state.  Returns 1 if the page changed after backup_lsn (WAL
+ * replay restores it), 0 if the source page is valid and was written over
+ * the copy, and -1 if the page still looks bad or can't be read.
+ */
+static int
+recheck_page(t_sync_work *work, const char *rel, int fd,
+			 uint32 blkno, uint32 segno)
+{
+	char		page[BLCKSZ];
+	t_page_header *hdr = (t_page_header *) page;
+	uint32		file_blkno = blkno - segno * RELSEG_SIZE;
+	uint64		page_lsn;
+	int			i;
+
+	for (i = 0; i < DATA_SYNC_REREADS; i++)
+	{
+		if (i > 0)
+			usleep(DATA_SYNC_REREAD_DELAY);
+
+		if (!read_source_page(work, rel, file_blkno, page))
+			return -1;
+
+		page_lsn = ((uint64) hdr->lsn_xlogid << 32) | hdr->lsn_xrecoff;
+		if (hdr->upper == 0 || page_lsn >= work->backup_lsn)
+			return 1;
+
+		if (pg_checksum_page(page, blkno) == hdr->checksum)
+		{
+			if (pwrite(fd, page, BLCKSZ, (off_t) file_blkno * BLCKSZ) != BLCKSZ)
+			{
+				log_err(_("data sync: can't rewrite block %u of \"%s\": %s\n"),
+						file_blkno, rel, strerror(errno));
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Fetches one page of rel, relative to the data directory, from the source
+ * with pg_read_binary_file().
+ */
+static bool
+read_source_page(t_sync_work *work, const char *rel, uint32 file_blkno,
+				 char *page)
+{
+	PGresult   *res;
+	const char *params[3];
+	char		offset[MAXLEN];
+	char		length[MAXLEN];
+	bool		ok;
+
+	if (work->source_conn == NULL)
+		return false;
+
+	maxlen_snprintf(offset, "%lld", (long long) file_blkno * BLCKSZ);
+	maxlen_snprintf(length, "%d", BLCKSZ);
+	params[0] = rel;
+	params[1] = offset;
+	params[2] = length;
+
+	pthread_mutex_lock(&work->source_lock);
+	res = PQexecParams(work->source_conn,
+					   "SELECT pg_catalog.pg_read_binary_file($1, $2, $3)",
+					   3, NULL, params, NULL, NULL, 1);
+	ok = (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 &&
+		  PQgetlength(res, 0, 0) == BLCKSZ);
+	if (ok)
+		memcpy(page, PQgetvalue(res, 0, 0), BLCKSZ);
+	else if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		log_warning(_("data sync: can't read \"%s\" again from the source: %s\n"),
+					rel, PQerrorMessage(work->source_conn));
+	PQclear(res);
+	pthread_mutex_unlock(&work->source_lock);
+
+	return ok;
+}
+
+
+/*
+ * Relation segments live in global, base/<db> and the tablespaces, and are
+ * named <relfilenode>[_<fork>][.<segment>].  Returns the segment number of
+ * such a file.
+ */
+static bool
+relation_segment(const char *rel, uint32 *segno)
+{
+	const char *name;
+	const char *p;
+
+	if (strncmp(rel, "global/", 7) != 0 &&
+		strncmp(rel, "base/", 5) != 0 &&
+		strncmp(rel, "pg_tblspc/", 10) != 0)
+		return false;
+
+	name = strrchr(rel, '/') + 1;
+	for (p = name; *p >= '0' && *p <= '9'; p++)
+		;
+	if (p == name)
+		return false;
+
+	if (strncmp(p, "_fsm", 4) == 0 || strncmp(p, "_vm", 3) == 0 ||
+		strncmp(p, "_init", 5) == 0)
+		p = strpbrk(p, ".") ? strpbrk(p, ".") : p + strlen(p);
+
+	*segno = 0;
+	if (*p == '.')
+	{
+		if (p[1] == '\0')
+			return false;
+		for (p++; *p >= '0' && *p <= '9'; p++)
+			*segno = *segno * 10 + (*p - '0');
+	}
+
+	return (*p == '\0');
+}
+
+
+/*
+ * Page checksum algorithm, from PostgreSQL's storage/checksum_impl.h (not
+ * available before 9.3).  It runs N_SUMS independent FNV-1a like hashes
+ * over interleaved words, which compilers turn into vector instructions.
+ */
+#define N_SUMS 32
+#define FNV_PRIME 16777619
+
+static const uint32 checksumBaseOffsets[N_SUMS] = {
+	0x5B1F36E9, 0xB8525960, 0x02AB50AA, 0x1DE66D2A,
+	0x79FF467A, 0x9BB9F8A3, 0x217E7CD2, 0x83E13D2C,
+	0xF8D4474F, 0xE39EB970, 0x42C6AE16, 0x993216FA,
+	0x7B093B5D, 0x98DAFF3C, 0xF718902A, 0x0B1C9CDB,
+	0xE58F764B, 0x187636BC, 0x5D7B3BB1, 0xE73DE7DE,
+	0x92BEC979, 0xCCA6C0B2, 0x304A0979, 0x85AA43D4,
+	0x783125BB, 0x6CA8EAA2, 0xE407EAC6, 0x4B5CFC3E,
+	0x9FBF8C76, 0x15CA20BE, 0xF2CA9FD3, 0x959BD756
+};
+
+#define CHECKSUM_COMP(checksum, value) \
+do { \
+	uint32		__tmp = (checksum) ^ (value); \
+	(checksum) = __tmp * FNV_PRIME ^ (__tmp >> 17); \
+} while (0)
+
+static uint16
+pg_checksum_page(char *page, uint32 blkno)
+{
+	t_page_header *phdr = (t_page_header *) page;
+	uint32		sums[N_SUMS];
+	uint32		(*dataArr)[N_SUMS] = (uint32 (*)[N_SUMS]) page;
+	uint16		save_checksum;
+	uint32		result = 0;
+	uint32		i,
+				j;
+
+	/* the checksum is computed with its own field set to zero */
+	save_checksum = phdr->checksum;
+	phdr->checksum = 0;
+
+	memcpy(sums, checksumBaseOffsets, sizeof(checksumBaseOffsets));
+
+	for (i = 0; i < (uint32) (BLCKSZ / sizeof(uint32) / N_SUMS); i++)
+		for (j = 0; j < N_SUMS; j++)
+			CHECKSUM_COMP(sums[j], dataArr[i][j]);
+
+	/* two rounds of zeroes for additional mixing */
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < N_SUMS; j++)
+			CHECKSUM_COMP(sums[j], 0);
+
+	for (i = 0; i < N_SUMS; i++)
+		result ^= sums[i];
+
+	phdr->checksum = save_checksum;
+
+	/* mix in the block number and reduce to 16 bits, never 0 */
+	result ^= blkno;
+	return (uint16) ((result % 65535) + 1);
+}
@@ -0,0 +1,42 @@
+/*
+ * datasync.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_DATASYNC_H_
+#define _REPMGR_DATASYNC_H_
+
+#include "libpq-fe.h"
+
+typedef struct
+{
+	long		files;
+	long long	bytes;
+	long		pages_checked;
+	long		pages_skipped;	/* new, or changed after the backup start */
+	long		pages_reread;	/* bad in the copy, read again from the source */
+	long		bad_pages;
+	long		failed;			/* files that could not be read or synced */
+	double		seconds;
+}	t_data_sync_stats;
+
+bool sync_data_directory(const char *data_dir, int jobs, bool verify,
+					uint64 backup_lsn, PGconn *source_conn,
+					t_data_sync_stats *stats);
+uint64		parse_lsn(const char *lsn);
+
+#endif
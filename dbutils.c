@@ -17,13 +17,94 @@
  *
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/select.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
 
 #include "repmgr.h"
+#include "election.h"
 #include "strutil.h"
 #include "log.h"
+#include "registry.h"
+
+/* how often wait_for_promotion() checks the server */
+#define PROMOTION_POLL_MS	100
+
+/* connections whose prepared statements are tracked at the same time */
+#define STMT_CONN_CACHE		16
+
+/* type OIDs of the parameters, from catalog/pg_type.h */
+#define INT4OID				23
+#define INT8OID				20
+#define TEXTOID				25
+#define TIMESTAMPTZOID		1184
+
+typedef struct
+{
+	const char *name;
+	/* %s stands for the repmgr schema */
+	const char *text;
+	int			nparams;
+	Oid			types[STMT_MAX_PARAMS];
+} t_statement_def;
+
+static const t_statement_def statement_defs[NUM_STATEMENTS] = {
+	[STMT_IS_IN_RECOVERY] = {"repmgr_is_in_recovery",
+		"SELECT pg_is_in_recovery()", 0, {0}},
+	[STMT_REPLAY_PROGRESS] = {"repmgr_replay_progress",
+		"SELECT pg_last_xlog_receive_location(), "
+		"pg_last_xlog_replay_location()", 0, {0}},
+	[STMT_STANDBY_LOCATIONS] = {"repmgr_standby_locations",
+		"SELECT CURRENT_TIMESTAMP, pg_last_xlog_receive_location(), "
+		"pg_last_xlog_replay_location(), pg_last_xact_replay_timestamp()",
+	0, {0}},
+	[STMT_MASTER_LOCATION] = {"repmgr_master_location",
+		"SELECT pg_current_xlog_location()", 0, {0}},
+	[STMT_CURRENT_TIMESTAMP] = {"repmgr_current_timestamp",
+		"SELECT CURRENT_TIMESTAMP", 0, {0}},
+	[STMT_INSERT_MONITOR] = {"repmgr_insert_monitor",
+		"INSERT INTO %s.repl_monitor "
+		"VALUES($1, $2, $3, $4, $5, $6, $7, $8)",
+		8, {INT4OID, INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID, TEXTOID,
+	TEXTOID, INT8OID, INT8OID}},
+	[STMT_INSERT_WITNESS_MONITOR] = {"repmgr_insert_witness_monitor",
+		"INSERT INTO %s.repl_monitor "
+		"VALUES($1, $2, $3, NULL, pg_current_xlog_location(), NULL, 0, 0)",
+	3, {INT4OID, INT4OID, TIMESTAMPTZOID}},
+	[STMT_UPDATE_STANDBY_LOCATION] = {"repmgr_update_standby_location",
+		"SELECT %s.repmgr_update_standby_location($1)", 1, {TEXTOID}},
+	[STMT_NODE_LIST] = {"repmgr_node_list",
+		"SELECT id, name, conninfo, priority, witness FROM %s.repl_nodes "
+		" WHERE cluster = $1 ORDER BY priority, id", 1, {TEXTOID}},
+};
+
+/* the statement texts, with the schema in, built by statements_init() */
+static char statement_texts[NUM_STATEMENTS][MAXLEN];
+
+/*
+ * The statements prepared on each connection.  A connection reset by
+ * PQreset() keeps its PGconn but gets a new backend, which has none, so
+ * entries are matched on the backend PID as well.
+ */
+typedef struct
+{
+	PGconn	   *conn;
+	int			backend_pid;
+	unsigned int prepared;
+} t_stmt_conn;
+
+/* the event writer thread runs statements too, on its own connections */
+static pthread_mutex_t stmt_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_stmt_conn stmt_conns[STMT_CONN_CACHE];
+static int	stmt_conn_next = 0;
+
+static bool prepare_statement(PGconn *conn, t_statement stmt, int timeout);
+static int	wait_connection_ready(PGconn *conn, long long timeout);
 
 PGconn *
 establish_db_connection(const char *conninfo, const bool exit_on_error)
@@ -80,7 +161,7 @@ is_standby(PGconn *conn)
 	PGresult   *res;
 	int			result = 0;
 
-	res = PQexec(conn, "SELECT pg_is_in_recovery()");
+	res = exec_statement(conn, STMT_IS_IN_RECOVERY, NULL);
 
 	if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
@@ -97,6 +178,68 @@ is_standby(PGconn *conn)
 
 
 
+/*
+ * Copies the value of one keyword of a conninfo string into output, which
+ * must hold MAXLEN bytes.  Returns false if the keyword is not set.
+ */
+bool
+get_conninfo_value(const char *conninfo, const char *keyword, char *output)
+{
+	PQconninfoOption *conninfo_options;
+	PQconninfoOption *option;
+	bool		found = false;
+
+	conninfo_options = PQconninfoParse(conninfo, NULL);
+	if (conninfo_options == NULL)
+		return false;
+
+	for (option = conninfo_options; option->keyword != NULL; option++)
+	{
+		if (strcmp(option->keyword, keyword) == 0 && option->val != NULL &&
+			option->val[0] != '\0')
+		{
+			snprintf(output, MAXLEN, "%s", option->val);
+			found = true;
+			break;
+		}
+	}
+
+	PQconninfoFree(conninfo_options);
+	return found;
+}
+
+
+/*
+ * Polls the server every PROMOTION_POLL_MS until it leaves recovery or
+ * timeout seconds have passed.  Returns 1 once promoted, 0 on timeout and
+ * -1 if the connection was lost.
+ */
+int
+wait_for_promotion(PGconn *conn, int timeout)
+{
+	struct timeval start,
+				now;
+	int			retval;
+
+	gettimeofday(&start, NULL);
+	for (;;)
+	{
+		retval = is_standby(conn);
+		if (retval == 0)
+			return 1;
+		if (retval == -1)
+			return -1;
+
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_usec - start.tv_usec) / 1000 >= timeout * 1000L)
+			return 0;
+
+		usleep(PROMOTION_POLL_MS * 1000);
+	}
+}
+
+
 int
 is_witness(PGconn *conn, char *schema, char *cluster, int node_id)
 {
@@ -124,8 +267,6 @@ is_witness(PGconn *conn, char *schema, char *cluster, int node_id)
 bool
 is_pgup(PGconn *conn, int timeout)
 {
-	char		sqlquery[QUERY_STR_LEN];
-
 	/* Check the connection status twice in case it changes after reset */
 	bool		twice = false;
 
@@ -149,8 +290,7 @@ is_pgup(PGconn *conn, int timeout)
 			if (wait_connection_availability(conn, timeout) != 1)
 				goto failed;
 
-			sqlquery_snprintf(sqlquery, "SELECT 1");
-			if (PQsendQuery(conn, sqlquery) == 0)
+			if (PQsendQuery(conn, "SELECT 1") == 0)
 			{
 				log_warning(_("PQsendQuery: Query could not be sent to primary. %s\n"),
 							PQerrorMessage(conn));
@@ -312,24 +452,24 @@ get_cluster_size(PGconn *conn)
 }
 
 /*
- * get a connection to master by reading repl_nodes, creating a connection
- * to each node (one at a time) and finding if it is a master or a standby
+ * get a connection to master by reading the node list, creating a
+ * connection to each node (one at a time) and finding if it is a master or a
+ * standby
  *
  * NB: If master_conninfo_out may be NULL.	If it is non-null, it is assumed to
  * point to allocated memory of MAXCONNINFO in length, and the master server
  * connection string is placed there.
  */
 PGconn *
-get_master_connection(PGconn *standby_conn, char *schema, char *cluster,
-					  int *master_id, char *master_conninfo_out)
+get_master_connection(PGconn *standby_conn, int *master_id,
+					  char *master_conninfo_out)
 {
 	PGconn	   *master_conn = NULL;
-	PGresult   *res1;
-	PGresult   *res2;
-	char		sqlquery[QUERY_STR_LEN];
+	PGresult   *res;
 	char		master_conninfo_stack[MAXCONNINFO];
 	char	   *master_conninfo = &*master_conninfo_stack;
-	char		schema_quoted[MAXLEN];
+	t_registry_node *nodes;
+	int			total_nodes;
 
 	int			i;
 
@@ -340,41 +480,23 @@ get_master_connection(PGconn *standby_conn, char *schema, char *cluster,
 	if (master_conninfo_out != NULL)
 		master_conninfo = master_conninfo_out;
 
-	/*
-	 * XXX: This is copied in at least two other procedures
-	 *
-	 * Assemble the unquoted schema name
-	 */
-	{
-		char	   *identifier = PQescapeIdentifier(standby_conn, schema,
-													strlen(schema));
-
-		maxlen_snprintf(schema_quoted, "%s", identifier);
-		PQfreemem(identifier);
-	}
-
 	/* find all nodes belonging to this cluster */
-	log_info(_("finding node list for cluster '%s'\n"),
-			 cluster);
-
-	sqlquery_snprintf(sqlquery, "SELECT id, conninfo FROM %s.repl_nodes "
-					  " WHERE cluster = '%s' and not witness",
-					  schema_quoted, cluster);
-
-	res1 = PQexec(standby_conn, sqlquery);
-	if (PQresultStatus(res1) != PGRES_TUPLES_OK)
+	total_nodes = registry_nodes(standby_conn, &nodes);
+	if (total_nodes < 0)
 	{
 		log_err(_("Can't get nodes info: %s\n"),
 				PQerrorMessage(standby_conn));
-		PQclear(res1);
 		return NULL;
 	}
 
-	for (i = 0; i < PQntuples(res1); i++)
+	for (i = 0; i < total_nodes; i++)
 	{
+		if (nodes[i].is_witness)
+			continue;
+
 		/* initialize with the values of the current node being processed */
-		*master_id = atoi(PQgetvalue(res1, i, 0));
-		strncpy(master_conninfo, PQgetvalue(res1, i, 1), MAXCONNINFO);
+		*master_id = nodes[i].node_id;
+		snprintf(master_conninfo, MAXCONNINFO, "%s", nodes[i].conninfo);
 		log_info(_("checking role of cluster node '%s'\n"),
 				 master_conninfo);
 		master_conn = establish_db_connection(master_conninfo, false);
@@ -387,28 +509,28 @@ get_master_connection(PGconn *standby_conn, char *schema, char *cluster,
 		 * function closes the connection passed and exits.  This still needs
 		 * to close master_conn first.
 		 */
-		res2 = PQexec(master_conn, "SELECT pg_is_in_recovery()");
+		res = PQexec(master_conn, "SELECT pg_is_in_recovery()");
 
-		if (PQresultStatus(res2) != PGRES_TUPLES_OK)
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
 		{
 			log_err(_("Can't get recovery state from this node: %s\n"),
 					PQerrorMessage(master_conn));
-			PQclear(res2);
+			PQclear(res);
 			PQfinish(master_conn);
 			continue;
 		}
 
 		/* if false, this is the master */
-		if (strcmp(PQgetvalue(res2, 0, 0), "f") == 0)
+		if (strcmp(PQgetvalue(res, 0, 0), "f") == 0)
 		{
-			PQclear(res2);
-			PQclear(res1);
+			PQclear(res);
+			free(nodes);
 			return master_conn;
 		}
 		else
 		{
 			/* if it is a standby clear info */
-			PQclear(res2);
+			PQclear(res);
 			PQfinish(master_conn);
 			*master_id = -1;
 		}
@@ -422,20 +544,18 @@ get_master_connection(PGconn *standby_conn, char *schema, char *cluster,
 	 * Probably we will need to check the error to know if we need to start
 	 * failover procedure or just fix some situation on the standby.
 	 */
-	PQclear(res1);
+	free(nodes);
 	return NULL;
 }
 
 
 /*
- * wait until current query finishes ignoring any results, this could be an
- * async command or a cancelation of a query
+ * wait until current query finishes, leaving its results to be read
  * return 1 if Ok; 0 if any error ocurred; -1 if timeout reached
  */
-int
-wait_connection_availability(PGconn *conn, long long timeout)
+static int
+wait_connection_ready(PGconn *conn, long long timeout)
 {
-	PGresult   *res;
 	fd_set		read_set;
 	int			sock = PQsocket(conn);
 	struct timeval tmout,
@@ -456,16 +576,7 @@ wait_connection_availability(PGconn *conn, long long timeout)
 		}
 
 		if (PQisBusy(conn) == 0)
-		{
-			do
-			{
-				res = PQgetResult(conn);
-				PQclear(res);
-			} while (res != NULL);
-
-			break;
-		}
-
+			return 1;
 
 		tmout.tv_sec = 0;
 		tmout.tv_usec = 250000;
@@ -487,16 +598,37 @@ wait_connection_availability(PGconn *conn, long long timeout)
 			(before.tv_sec * 1000000 + before.tv_usec);
 	}
 
-
 	if (timeout >= 0)
-	{
 		return 1;
-	}
 
 	log_warning(_("wait_connection_availability: timeout reached"));
 	return -1;
 }
 
+/*
+ * wait until current query finishes ignoring any results, this could be an
+ * async command or a cancelation of a query
+ * return 1 if Ok; 0 if any error ocurred; -1 if timeout reached
+ */
+int
+wait_connection_availability(PGconn *conn, long long timeout)
+{
+	PGresult   *res;
+	int			ret;
+
+	ret = wait_connection_ready(conn, timeout);
+	if (ret != 1)
+		return ret;
+
+	do
+	{
+		res = PQgetResult(conn);
+		PQclear(res);
+	} while (res != NULL);
+
+	return 1;
+}
+
 
 bool
 cancel_query(PGconn *conn, int timeout)
@@ -527,3 +659,820 @@ cancel_query(PGconn *conn, int timeout)
 
 	return true;
 }
+
+
+unsigned long long int
+wal_location_to_bytes(char *wal_location)
+{
+	unsigned int xlogid;
+	unsigned int xrecoff;
+
+	if (sscanf(wal_location, "%X/%X", &xlogid, &xrecoff) != 2)
+	{
+		log_err(_("wrong log location format: %s\n"), wal_location);
+		return 0;
+	}
+	return wal_position_bytes(xlogid, xrecoff);
+}
+
+
+/*
+ * The WAL functions were renamed in 10, "xlog" becoming "wal" and
+ * "location" "lsn": returns the name the server of conn knows for the
+ * function called 'name' before 10
+ */
+const char *
+wal_function(PGconn *conn, const char *name)
+{
+	static const char *const renamed[][2] =
+	{
+		{"pg_current_xlog_location", "pg_current_wal_lsn"},
+		{"pg_last_xlog_receive_location", "pg_last_wal_receive_lsn"},
+		{"pg_last_xlog_replay_location", "pg_last_wal_replay_lsn"},
+		{"pg_xlog_location_diff", "pg_wal_lsn_diff"},
+		{"pg_xlogfile_name", "pg_walfile_name"}
+	};
+	int			i;
+
+	if (PQserverVersion(conn) < 100000)
+		return name;
+
+	for (i = 0; i < (int) (sizeof(renamed) / sizeof(renamed[0])); i++)
+	{
+		if (strcmp(name, renamed[i][0]) == 0)
+			return renamed[i][1];
+	}
+	return name;
+}
+
+
+/*
+ * A buffer cache snapshot lists, for the current database, the ranges of
+ * relation blocks found in shared buffers, one "relid fork first last" per
+ * line.  It needs the pg_buffercache and pg_prewarm (9.4) extensions.
+ */
+bool
+has_buffer_extensions(PGconn *conn)
+{
+	PGresult   *res;
+	bool		found;
+
+	res = PQexec(conn, "SELECT count(*) FROM pg_extension "
+				 " WHERE extname IN ('pg_buffercache', 'pg_prewarm')");
+	found = (PQresultStatus(res) == PGRES_TUPLES_OK &&
+			 strcmp(PQgetvalue(res, 0, 0), "2") == 0);
+	PQclear(res);
+
+	return found;
+}
+
+
+/*
+ * Writes a snapshot of the buffer cache to path.  Returns the number of
+ * blocks found, or -1 on error.
+ */
+long
+capture_buffer_cache(PGconn *conn, const char *path)
+{
+	PGresult   *res;
+	FILE	   *fp;
+	char		tmp_path[MAXLEN];
+	long		blocks;
+	long		first = 0;
+	long		last = -2;
+	long		block;
+	char		relid[MAXLEN] = "";
+	char		fork[MAXLEN] = "";
+	int			i;
+
+	res = PQexec(conn,
+				 "SELECT c.oid, "
+				 "       CASE b.relforknumber WHEN 0 THEN 'main' "
+				 "            WHEN 1 THEN 'fsm' WHEN 2 THEN 'vm' "
+				 "            ELSE 'init' END, "
+				 "       b.relblocknumber "
+				 "  FROM pg_buffercache b "
+				 "  JOIN pg_class c "
+				 "    ON b.relfilenode = pg_relation_filenode(c.oid) "
+				 " WHERE b.reldatabase = (SELECT oid FROM pg_database "
+				 "                         WHERE datname = current_database()) "
+				 " ORDER BY 1, 2, 3");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_warning(_("Can't read the buffer cache: %s\n"),
+					PQerrorMessage(conn));
+		PQclear(res);
+		return -1;
+	}
+
+	/* written aside, so a reader never sees a partial snapshot */
+	maxlen_snprintf(tmp_path, "%s.tmp", path);
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL)
+	{
+		log_warning(_("Can't write the buffer cache snapshot \"%s\": %s\n"),
+					tmp_path, strerror(errno));
+		PQclear(res);
+		return -1;
+	}
+
+	blocks = PQntuples(res);
+	for (i = 0; i <= blocks; i++)
+	{
+		block = (i < blocks) ? atol(PQgetvalue(res, i, 2)) : -1;
+
+		/* extend the current range while blocks follow each other */
+		if (i < blocks && block == last + 1 &&
+			strcmp(relid, PQgetvalue(res, i, 0)) == 0 &&
+			strcmp(fork, PQgetvalue(res, i, 1)) == 0)
+		{
+			last = block;
+			continue;
+		}
+
+		if (relid[0])
+			fprintf(fp, "%s %s %ld %ld\n", relid, fork, first, last);
+
+		if (i < blocks)
+		{
+			maxlen_snprintf(relid, "%s", PQgetvalue(res, i, 0));
+			maxlen_snprintf(fork, "%s", PQgetvalue(res, i, 1));
+			first = last = block;
+		}
+	}
+	PQclear(res);
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+	{
+		log_warning(_("Can't write the buffer cache snapshot \"%s\": %s\n"),
+					path, strerror(errno));
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return blocks;
+}
+
+
+/*
+ * Loads the blocks listed in a buffer cache snapshot back into shared
+ * buffers, through up to 'jobs' connections opened with conninfo, each one
+ * prewarming a range of blocks at a time.  Relations dropped since are
+ * skipped.  Returns the number of blocks loaded, or -1 if the snapshot
+ * can't be read or no connection can be made.
+ */
+long
+prewarm_buffer_cache(const char *conninfo, const char *path, int jobs)
+{
+	PGconn	  **conns;
+	bool	   *busy;
+	PGresult   *res;
+	FILE	   *fp;
+	fd_set		read_set;
+	char		line[MAXLEN];
+	char		sqlquery[QUERY_STR_LEN];
+	unsigned int relid;
+	char		fork[MAXLEN];
+	long		first;
+	long		last;
+	long		blocks = 0;
+	bool		eof = false;
+	int			connected = 0;
+	int			running;
+	int			max_sock;
+	int			i;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	if (jobs < 1)
+		jobs = 1;
+	conns = malloc(jobs * sizeof(PGconn *));
+	busy = malloc(jobs * sizeof(bool));
+	if (conns == NULL || busy == NULL)
+	{
+		free(conns);
+		free(busy);
+		fclose(fp);
+		return -1;
+	}
+
+	for (i = 0; i < jobs; i++)
+	{
+		conns[connected] = establish_db_connection(conninfo, false);
+		if (PQstatus(conns[connected]) != CONNECTION_OK)
+		{
+			PQfinish(conns[connected]);
+			continue;
+		}
+		busy[connected++] = false;
+	}
+	if (connected == 0)
+	{
+		blocks = -1;
+		eof = true;
+	}
+
+	for (;;)
+	{
+		/* give a range to each idle connection */
+		for (i = 0; i < connected && !eof; i++)
+		{
+			if (busy[i] || conns[i] == NULL)
+				continue;
+
+			while (!busy[i] && !eof)
+			{
+				if (fgets(line, sizeof(line), fp) == NULL)
+				{
+					eof = true;
+					break;
+				}
+				if (sscanf(line, "%u %5s %ld %ld", &relid, fork, &first, &last) != 4)
+					continue;
+
+				sqlquery_snprintf(sqlquery,
+								  "SELECT pg_prewarm(c.oid, 'buffer', '%s', %ld, "
+								  "       least(%ld, pg_relation_size(c.oid, '%s') / "
+								  "       current_setting('block_size')::int - 1)) "
+								  "  FROM pg_class c WHERE c.oid = %u",
+								  fork, first, last, fork, relid);
+				busy[i] = (PQsendQuery(conns[i], sqlquery) == 1);
+				if (!busy[i])
+				{
+					PQfinish(conns[i]);
+					conns[i] = NULL;
+					break;
+				}
+			}
+		}
+
+		/* then wait for any of them to finish */
+		running = 0;
+		max_sock = -1;
+		FD_ZERO(&read_set);
+		for (i = 0; i < connected; i++)
+		{
+			if (!busy[i])
+				continue;
+			running++;
+			FD_SET(PQsocket(conns[i]), &read_set);
+			if (PQsocket(conns[i]) > max_sock)
+				max_sock = PQsocket(conns[i]);
+		}
+		if (running == 0)
+			break;
+
+		if (select(max_sock + 1, &read_set, NULL, NULL, NULL) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			log_warning(_("prewarm_buffer_cache: select() returned with error: %s\n"),
+						strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < connected; i++)
+		{
+			if (!busy[i] || !FD_ISSET(PQsocket(conns[i]), &read_set))
+				continue;
+
+			if (PQconsumeInput(conns[i]) == 0)
+			{
+				PQfinish(conns[i]);
+				conns[i] = NULL;
+				busy[i] = false;
+				continue;
+			}
+
+			while (busy[i] && PQisBusy(conns[i]) == 0)
+			{
+				res = PQgetResult(conns[i]);
+				if (res == NULL)
+				{
+					busy[i] = false;
+					break;
+				}
+				if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+					blocks += atol(PQgetvalue(res, 0, 0));
+				PQclear(res);
+			}
+		}
+	}
+
+	for (i = 0; i < connected; i++)
+	{
+		if (conns[i] != NULL)
+			PQfinish(conns[i]);
+	}
+	free(conns);
+	free(busy);
+	fclose(fp);
+
+	return blocks;
+}
+
+
+/*
+ * Hash indexes are not WAL-logged before PostgreSQL 10, so they are invalid
+ * on a promoted standby until rebuilt.  reindex_hash_indexes() finds them
+ * in every database and rebuilds them with up to 'jobs' connections, the
+ * most scanned first and, among those, the smallest first so that as many
+ * as possible are usable early.  Returns the number of indexes that could
+ * not be rebuilt, or -1 if they can't be listed.
+ */
+typedef struct
+{
+	char		dbname[MAXLEN];
+	char		name[MAXLEN];	/* schema-qualified and quoted */
+	long long	size;
+	long long	scans;
+}	t_hash_index;
+
+typedef struct
+{
+	PGconn	   *conn;
+	char		dbname[MAXLEN];
+	int			index;			/* being rebuilt, -1 when idle */
+	struct timeval start;
+}	t_reindex_worker;
+
+static PGconn *
+connect_to_database(const char *conninfo, const char *dbname)
+{
+	const char *keywords[3] = {"dbname", "dbname", NULL};
+	const char *values[3];
+
+	values[0] = conninfo;
+	values[1] = dbname;
+	values[2] = NULL;
+
+	return establish_db_connection_by_params(keywords, values, false);
+}
+
+static int
+compare_hash_indexes(const void *a, const void *b)
+{
+	const t_hash_index *ia = a;
+	const t_hash_index *ib = b;
+
+	if (ia->scans != ib->scans)
+		return (ia->scans > ib->scans) ? -1 : 1;
+	if (ia->size != ib->size)
+		return (ia->size < ib->size) ? -1 : 1;
+	return 0;
+}
+
+int
+reindex_hash_indexes(const char *conninfo, int jobs)
+{
+	PGconn	   *conn;
+	PGconn	   *db_conn;
+	PGresult   *res;
+	PGresult   *db_res;
+	t_hash_index *indexes = NULL;
+	t_hash_index *grown;
+	t_reindex_worker *workers;
+	fd_set		read_set;
+	struct timeval now;
+	char		sqlquery[QUERY_STR_LEN];
+	int			total = 0;
+	int			next = 0;
+	int			done = 0;
+	int			failed = 0;
+	int			running;
+	int			max_sock;
+	int			i,
+				j;
+
+	conn = establish_db_connection(conninfo, false);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		PQfinish(conn);
+		return -1;
+	}
+	res = PQexec(conn, "SELECT datname FROM pg_database "
+				 " WHERE datallowconn ORDER BY datname");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get the list of databases: %s\n"),
+				PQerrorMessage(conn));
+		PQclear(res);
+		PQfinish(conn);
+		return -1;
+	}
+	PQfinish(conn);
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		db_conn = connect_to_database(conninfo, PQgetvalue(res, i, 0));
+		if (PQstatus(db_conn) != CONNECTION_OK)
+		{
+			PQfinish(db_conn);
+			failed++;
+			continue;
+		}
+
+		db_res = PQexec(db_conn,
+						"SELECT quote_ident(n.nspname) || '.' || "
+						"       quote_ident(c.relname), "
+						"       pg_relation_size(c.oid), "
+						"       coalesce(s.idx_scan, 0) "
+						"  FROM pg_class c "
+						"  JOIN pg_am a ON a.oid = c.relam "
+						"  JOIN pg_namespace n ON n.oid = c.relnamespace "
+						"  LEFT JOIN pg_stat_all_indexes s "
+						"    ON s.indexrelid = c.oid "
+						" WHERE c.relkind = 'i' AND a.amname = 'hash'");
+		if (PQresultStatus(db_res) == PGRES_TUPLES_OK && PQntuples(db_res) > 0)
+		{
+			grown = realloc(indexes, (total + PQntuples(db_res)) *
+							sizeof(t_hash_index));
+			if (grown != NULL)
+			{
+				indexes = grown;
+				for (j = 0; j < PQntuples(db_res); j++, total++)
+				{
+					maxlen_snprintf(indexes[total].dbname, "%s",
+									PQgetvalue(res, i, 0));
+					maxlen_snprintf(indexes[total].name, "%s",
+									PQgetvalue(db_res, j, 0));
+					indexes[total].size = atoll(PQgetvalue(db_res, j, 1));
+					indexes[total].scans = atoll(PQgetvalue(db_res, j, 2));
+				}
+			}
+		}
+		else if (PQresultStatus(db_res) != PGRES_TUPLES_OK)
+		{
+			log_warning(_("Can't list the hash indexes of database \"%s\": %s\n"),
+						PQgetvalue(res, i, 0), PQerrorMessage(db_conn));
+			failed++;
+		}
+		PQclear(db_res);
+		PQfinish(db_conn);
+	}
+	PQclear(res);
+
+	if (total == 0)
+	{
+		free(indexes);
+		return failed;
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+	jobs = Min(jobs, total);
+
+	qsort(indexes, total, sizeof(t_hash_index), compare_hash_indexes);
+	log_notice(_("rebuilding %d hash indexes with %d jobs\n"), total, jobs);
+
+	workers = malloc(jobs * sizeof(t_reindex_worker));
+	if (workers == NULL)
+	{
+		free(indexes);
+		return total;
+	}
+	for (i = 0; i < jobs; i++)
+	{
+		workers[i].conn = NULL;
+		workers[i].dbname[0] = '\0';
+		workers[i].index = -1;
+	}
+
+	while (done < total)
+	{
+		/* hand the next index to each idle worker */
+		for (i = 0; i < jobs && next < total; i++)
+		{
+			if (workers[i].index != -1)
+				continue;
+
+			/* a worker keeps its connection while it stays in the same database */
+			if (workers[i].conn == NULL ||
+				strcmp(workers[i].dbname, indexes[next].dbname) != 0)
+			{
+				PQfinish(workers[i].conn);
+				workers[i].conn = connect_to_database(conninfo,
+													  indexes[next].dbname);
+				strcpy(workers[i].dbname, indexes[next].dbname);
+				if (PQstatus(workers[i].conn) != CONNECTION_OK)
+				{
+					PQfinish(workers[i].conn);
+					workers[i].conn = NULL;
+					failed++;
+					done++;
+					next++;
+					continue;
+				}
+			}
+
+			sqlquery_snprintf(sqlquery, "REINDEX INDEX %s", indexes[next].name);
+			gettimeofday(&workers[i].start, NULL);
+			if (PQsendQuery(workers[i].conn, sqlquery) == 0)
+			{
+				log_warning(_("Can't rebuild index %s: %s\n"),
+							indexes[next].name,
+							PQerrorMessage(workers[i].conn));
+				PQfinish(workers[i].conn);
+				workers[i].conn = NULL;
+				failed++;
+				done++;
+				next++;
+				continue;
+			}
+			workers[i].index = next++;
+		}
+
+		/* wait for a worker to finish */
+		running = 0;
+		max_sock = -1;
+		FD_ZERO(&read_set);
+		for (i = 0; i < jobs; i++)
+		{
+			if (workers[i].index == -1)
+				continue;
+			running++;
+			FD_SET(PQsocket(workers[i].conn), &read_set);
+			if (PQsocket(workers[i].conn) > max_sock)
+				max_sock = PQsocket(workers[i].conn);
+		}
+		if (running == 0)
+			continue;
+
+		if (select(max_sock + 1, &read_set, NULL, NULL, NULL) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			log_err(_("reindex_hash_indexes: select() returned with error: %s\n"),
+					strerror(errno));
+			failed += total - done;
+			break;
+		}
+
+		for (i = 0; i < jobs; i++)
+		{
+			t_hash_index *index;
+			bool		ok = true;
+
+			if (workers[i].index == -1 ||
+				!FD_ISSET(PQsocket(workers[i].conn), &read_set))
+				continue;
+
+			index = &indexes[workers[i].index];
+			if (PQconsumeInput(workers[i].conn) == 0)
+				ok = false;
+			else if (PQisBusy(workers[i].conn))
+				continue;
+
+			while (ok && (res = PQgetResult(workers[i].conn)) != NULL)
+			{
+				if (PQresultStatus(res) != PGRES_COMMAND_OK)
+					ok = false;
+				PQclear(res);
+			}
+
+			done++;
+			gettimeofday(&now, NULL);
+			if (ok)
+			{
+				log_info(_("[%d/%d] rebuilt hash index %s in database \"%s\" (%ld ms)\n"),
+						 done, total, index->name, index->dbname,
+						 (long) ((now.tv_sec - workers[i].start.tv_sec) * 1000 +
+								 (now.tv_usec - workers[i].start.tv_usec) / 1000));
+			}
+			else
+			{
+				log_warning(_("[%d/%d] can't rebuild hash index %s in database \"%s\": %s\n"),
+							done, total, index->name, index->dbname,
+							PQerrorMessage(workers[i].conn));
+				failed++;
+				PQfinish(workers[i].conn);
+				workers[i].conn = NULL;
+			}
+			workers[i].index = -1;
+		}
+	}
+
+	for (i = 0; i < jobs; i++)
+		PQfinish(workers[i].conn);
+	free(workers);
+	free(indexes);
+
+	return failed;
+}
+
+
+/*
+ * Builds the text of the statements for the repmgr schema.  Must be called
+ * before any of them is run.
+ */
+void
+statements_init(const char *schema)
+{
+	int			i;
+	int			r;
+
+	for (i = 0; i < NUM_STATEMENTS; i++)
+	{
+		r = snprintf(statement_texts[i], MAXLEN, statement_defs[i].text,
+					 schema);
+		if (r < 0 || r >= MAXLEN)
+		{
+			log_err(_("The text of statement %s is too long\n"),
+					statement_defs[i].name);
+			exit(ERR_BAD_CONFIG);
+		}
+	}
+	pthread_mutex_lock(&stmt_conns_lock);
+	memset(stmt_conns, 0, sizeof(stmt_conns));
+	pthread_mutex_unlock(&stmt_conns_lock);
+}
+
+
+void
+stmt_params_init(t_stmt_params *params)
+{
+	params->count = 0;
+}
+
+
+/* a NULL value is sent as SQL NULL */
+void
+stmt_param_text(t_stmt_params *params, const char *value)
+{
+	int			i = params->count++;
+
+	params->values[i] = value;
+	params->lengths[i] = 0;
+	params->formats[i] = 0;
+}
+
+
+void
+stmt_param_int4(t_stmt_params *params, int value)
+{
+	int			i = params->count++;
+	uint32		n = htonl((uint32) value);
+
+	memcpy(params->binary[i], &n, 4);
+	params->values[i] = params->binary[i];
+	params->lengths[i] = 4;
+	params->formats[i] = 1;
+}
+
+
+void
+stmt_param_int8(t_stmt_params *params, long long value)
+{
+	int			i = params->count++;
+	uint32		hi = htonl((uint32) ((unsigned long long) value >> 32));
+	uint32		lo = htonl((uint32) value);
+
+	memcpy(params->binary[i], &hi, 4);
+	memcpy(params->binary[i] + 4, &lo, 4);
+	params->values[i] = params->binary[i];
+	params->lengths[i] = 8;
+	params->formats[i] = 1;
+}
+
+
+/*
+ * Returns the entry of a connection, with nothing prepared if it is new or
+ * was reset.  When all the entries are taken, the oldest one is reused.
+ * Called with stmt_conns_lock held.
+ */
+static t_stmt_conn *
+stmt_conn_entry(PGconn *conn)
+{
+	int			pid = PQbackendPID(conn);
+	t_stmt_conn *entry;
+	int			i;
+
+	for (i = 0; i < STMT_CONN_CACHE; i++)
+	{
+		if (stmt_conns[i].conn == conn)
+		{
+			if (stmt_conns[i].backend_pid != pid)
+			{
+				stmt_conns[i].backend_pid = pid;
+				stmt_conns[i].prepared = 0;
+			}
+			return &stmt_conns[i];
+		}
+	}
+
+	entry = &stmt_conns[stmt_conn_next];
+	stmt_conn_next = (stmt_conn_next + 1) % STMT_CONN_CACHE;
+	entry->conn = conn;
+	entry->backend_pid = pid;
+	entry->prepared = 0;
+	return entry;
+}
+
+
+/*
+ * Prepares a statement on the connection if it isn't yet.  A backend whose
+ * entry was reused still has its statements, so "already exists" is fine.
+ * With a timeout (in seconds, -1 for none) the preparation is sent
+ * asynchronously, and given up on if the server doesn't answer in time.
+ */
+static bool
+prepare_statement(PGconn *conn, t_statement stmt, int timeout)
+{
+	const t_statement_def *def = &statement_defs[stmt];
+	PGresult   *res;
+	const char *sqlstate;
+	bool		prepared;
+	bool		ok;
+
+	pthread_mutex_lock(&stmt_conns_lock);
+	prepared = (stmt_conn_entry(conn)->prepared & (1U << stmt)) != 0;
+	pthread_mutex_unlock(&stmt_conns_lock);
+	if (prepared)
+		return true;
+
+	log_debug(_("preparing %s: %s\n"), def->name, statement_texts[stmt]);
+	if (timeout < 0)
+		res = PQprepare(conn, def->name, statement_texts[stmt],
+						def->nparams, def->types);
+	else
+	{
+		if (PQsendPrepare(conn, def->name, statement_texts[stmt],
+						  def->nparams, def->types) == 0)
+		{
+			log_warning(_("Can't prepare statement %s: %s"), def->name,
+						PQerrorMessage(conn));
+			return false;
+		}
+		if (wait_connection_ready(conn, timeout) != 1)
+		{
+			log_warning(_("Can't prepare statement %s: no answer\n"),
+						def->name);
+			return false;
+		}
+		res = PQgetResult(conn);
+	}
+
+	sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	ok = (PQresultStatus(res) == PGRES_COMMAND_OK) ||
+		(sqlstate != NULL && strcmp(sqlstate, "42P05") == 0);
+	if (!ok)
+	{
+		log_warning(_("Can't prepare statement %s: %s"), def->name,
+					PQerrorMessage(conn));
+	}
+	else
+	{
+		pthread_mutex_lock(&stmt_conns_lock);
+		stmt_conn_entry(conn)->prepared |= (1U << stmt);
+		pthread_mutex_unlock(&stmt_conns_lock);
+	}
+	PQclear(res);
+
+	/* the end of the asynchronous preparation */
+	if (timeout >= 0)
+	{
+		while ((res = PQgetResult(conn)) != NULL)
+			PQclear(res);
+	}
+
+	return ok;
+}
+
+
+/*
+ * Runs a statement, preparing it first on a connection that hasn't got it.
+ * Returns the result like PQexec(), NULL if it couldn't be prepared.
+ */
+PGresult *
+exec_statement(PGconn *conn, t_statement stmt, t_stmt_params *params)
+{
+	if (!prepare_statement(conn, stmt, -1))
+		return NULL;
+
+	return PQexecPrepared(conn, statement_defs[stmt].name,
+						  params ? params->count : 0,
+						  params ? params->values : NULL,
+						  params ? params->lengths : NULL,
+						  params ? params->formats : NULL, 0);
+}
+
+
+/*
+ * Sends a statement without waiting for its result, like PQsendQuery().
+ * The preparation, when needed, waits timeout seconds at most.
+ */
+int
+send_statement(PGconn *conn, t_statement stmt, t_stmt_params *params,
+			   int timeout)
+{
+	if (!prepare_statement(conn, stmt, timeout))
+		return 0;
+
+	return PQsendQueryPrepared(conn, statement_defs[stmt].name,
+							   params ? params->count : 0,
+							   params ? params->values : NULL,
+							   params ? params->lengths : NULL,
+							   params ? params->formats : NULL, 0);
+}
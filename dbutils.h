@@ -22,12 +22,56 @@
 
 #include "strutil.h"
 
+/*
+ * The statements repmgr runs over and over, mostly from the monitor loop.
+ * They are prepared once per connection and executed with their parameters
+ * sent apart from the text, in binary for the numbers.
+ */
+typedef enum
+{
+	STMT_IS_IN_RECOVERY,
+	STMT_REPLAY_PROGRESS,
+	STMT_STANDBY_LOCATIONS,
+	STMT_MASTER_LOCATION,
+	STMT_CURRENT_TIMESTAMP,
+	STMT_INSERT_MONITOR,
+	STMT_INSERT_WITNESS_MONITOR,
+	STMT_UPDATE_STANDBY_LOCATION,
+	STMT_NODE_LIST,
+	NUM_STATEMENTS
+} t_statement;
+
+#define STMT_MAX_PARAMS		8
+
+/* the parameters of one execution, filled with the stmt_param_* functions */
+typedef struct
+{
+	int			count;
+	const char *values[STMT_MAX_PARAMS];
+	int			lengths[STMT_MAX_PARAMS];
+	int			formats[STMT_MAX_PARAMS];
+	char		binary[STMT_MAX_PARAMS][8];
+} t_stmt_params;
+
+void		statements_init(const char *schema);
+void		stmt_params_init(t_stmt_params *params);
+void		stmt_param_text(t_stmt_params *params, const char *value);
+void		stmt_param_int4(t_stmt_params *params, int value);
+void		stmt_param_int8(t_stmt_params *params, long long value);
+PGresult   *exec_statement(PGconn *conn, t_statement stmt,
+						   t_stmt_params *params);
+int send_statement(PGconn *conn, t_statement stmt,
+			   t_stmt_params *params, int timeout);
+
 PGconn *establish_db_connection(const char *conninfo,
 						const bool exit_on_error);
 PGconn *establish_db_connection_by_params(const char *keywords[],
 								  const char *values[],
 								  const bool exit_on_error);
 int			is_standby(PGconn *conn);
+int			wait_for_promotion(PGconn *conn, int timeout);
+bool		get_conninfo_value(const char *conninfo, const char *keyword,
+				   char *output);
 int			is_witness(PGconn *conn, char *schema, char *cluster, int node_id);
 bool		is_pgup(PGconn *conn, int timeout);
 char	   *pg_version(PGconn *conn, char *major_version);
@@ -37,10 +81,19 @@ int guc_set_typed(PGconn *conn, const char *parameter, const char *op,
 			  const char *value, const char *datatype);
 
 const char *get_cluster_size(PGconn *conn);
-PGconn *get_master_connection(PGconn *standby_conn, char *schema, char *cluster,
-					  int *master_id, char *master_conninfo_out);
+PGconn *get_master_connection(PGconn *standby_conn, int *master_id,
+					  char *master_conninfo_out);
 
 int			wait_connection_availability(PGconn *conn, long long timeout);
 bool		cancel_query(PGconn *conn, int timeout);
 
+unsigned long long int wal_location_to_bytes(char *wal_location);
+const char *wal_function(PGconn *conn, const char *name);
+
+bool		has_buffer_extensions(PGconn *conn);
+long		capture_buffer_cache(PGconn *conn, const char *path);
+long prewarm_buffer_cache(const char *conninfo, const char *path,
+					 int jobs);
+int			reindex_hash_indexes(const char *conninfo, int jobs);
+
 #endif
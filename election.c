@@ -0,0 +1,104 @@
+/*
+ * election.c - Failover decisions shared by repmgrd and its simulator
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * These functions only look at the data they are given, so that
+ * bench/failover_sim can run the same decisions as repmgrd on simulated
+ * nodes.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "election.h"
+
+
+/*
+ * Position of a WAL location in bytes, so that locations compare and
+ * subtract across xlogids.  Before 9.3 the last segment of every xlogid was
+ * never used; since, a location is a plain 64-bit position and xrecoff runs
+ * to 0xFFFFFFFF.  Matches XLAssignValue() in repmgrd.c.
+ */
+long long
+wal_position_bytes(unsigned int xlogid, unsigned int xrecoff)
+{
+#if PG_VERSION_NUM >= 90300
+	return ((long long) xlogid << 32) | xrecoff;
+#else
+	return (long long) xlogid * 16 * 1024 * 1024 * 255 + xrecoff;
+#endif
+}
+
+
+/*
+ * Returns the index of the node to promote, or -1 if there is none: of the
+ * nodes that received the most WAL, or at most lag_tolerance bytes less,
+ * the one that will be writable first, i.e. that has the shortest replay
+ * ahead of it.  Nodes are expected ordered by priority, so priority breaks
+ * ties.
+ */
+int
+choose_candidate(t_node_info *nodes, int total_nodes, long long lag_tolerance)
+{
+	long long	max_received = 0;
+	int			best = -1;
+	int			i;
+
+	for (i = 0; i < total_nodes; i++)
+	{
+		if (nodes[i].is_witness || !nodes[i].is_ready || !nodes[i].is_visible)
+			continue;
+
+		if (nodes[i].received_bytes > max_received)
+			max_received = nodes[i].received_bytes;
+	}
+
+	for (i = 0; i < total_nodes; i++)
+	{
+		/* witness is never a good candidate */
+		if (nodes[i].is_witness)
+			continue;
+
+		if (!nodes[i].is_ready || !nodes[i].is_visible)
+			continue;
+
+		if (max_received - nodes[i].received_bytes > lag_tolerance)
+			continue;
+
+		if (best == -1 || nodes[i].replay_eta < nodes[best].replay_eta)
+			best = i;
+	}
+
+	return best;
+}
+
+
+/*
+ * Whether a node whose last vote is 'state' gives its vote to 'candidate'
+ * in 'epoch', at time 'now' (ms): at most once per epoch, only for an epoch
+ * newer than any it voted in, and not for another candidate while the lease
+ * of its last vote lasts.  Asking again for the vote already given is
+ * granted.  The caller records the new vote.
+ */
+bool
+vote_allowed(const t_vote_state *state, long long epoch, int candidate,
+			 long long now)
+{
+	if (epoch == state->epoch && candidate == state->voted_for)
+		return true;
+
+	return epoch > state->epoch &&
+		(candidate == state->voted_for || state->voted_for == -1 ||
+		 now >= state->lease_expiry);
+}
@@ -0,0 +1,85 @@
+/*
+ * election.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_ELECTION_H_
+#define _REPMGR_ELECTION_H_
+
+#include <limits.h>
+
+#include "repmgr.h"
+#include "access/xlogdefs.h"
+
+/*
+ * After a failover, the standbys wait at most FOLLOW_WAIT_TIMEOUT seconds
+ * for the new master to be promoted before following it, and the new master
+ * reports for as long which of them stream from it again
+ */
+#define FOLLOW_WAIT_TIMEOUT		60
+#define FOLLOW_POLL_MS			200
+
+/*
+ * At failover each standby measures for APPLY_SAMPLE_MS how fast it replays
+ * the WAL it has received but not applied, and publishes how long it will
+ * take to become writable
+ */
+#define APPLY_SAMPLE_MS			1000
+#define REPLAY_ETA_UNKNOWN		LONG_MAX
+
+/*
+ * The candidate chosen by do_failover() only promotes itself once a
+ * majority of the registered nodes voted for it in a new epoch (see
+ * repmgr_request_vote() in repmgr_funcs).  A vote holds for
+ * ELECTION_LEASE_SECS: no other node can be elected meanwhile.
+ */
+#define ELECTION_LEASE_SECS		60
+#define ELECTION_ROUNDS			3
+#define ELECTION_RETRY_MS		500
+
+/*
+ * Struct to keep info about the nodes, used in the voting process in
+ * do_failover()
+ */
+typedef struct s_node_info
+{
+	int			node_id;
+	char		conninfo_str[MAXLEN];
+	char		name[MAXLEN];
+	XLogRecPtr	xlog_location;
+	long long	received_bytes;
+	long		replay_eta;		/* ms until all received WAL is replayed */
+	bool		is_ready;
+	bool		is_visible;
+	bool		is_witness;
+}	t_node_info;
+
+/* the last vote of a node */
+typedef struct
+{
+	long long	epoch;
+	int			voted_for;		/* -1 if none */
+	long long	lease_expiry;	/* in ms */
+}	t_vote_state;
+
+long long	wal_position_bytes(unsigned int xlogid, unsigned int xrecoff);
+int choose_candidate(t_node_info *nodes, int total_nodes,
+				 long long lag_tolerance);
+bool vote_allowed(const t_vote_state *state, long long epoch,
+			 int candidate, long long now);
+
+#endif
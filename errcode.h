@@ -36,5 +36,9 @@
 #define ERR_FAILOVER_FAIL 11
 #define ERR_BAD_SSH 12
 #define ERR_SYS_FAILURE 13
+#define ERR_BAD_BASEBACKUP 14
+#define ERR_BAD_CHECKSUM 15
+#define ERR_PROMOTION_FAIL 16
+#define ERR_BAD_REWIND 17
 
 #endif   /* _ERRCODE_H_ */
@@ -0,0 +1,733 @@
+/*
+ * events.c - Cluster event log, written to repl_events on the master
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * record_event() never waits for the network: in repmgrd the event is
+ * queued for a writer thread which inserts it on the master, and repmgr
+ * appends it to a local spool file, then leaves a child process to send
+ * it.  Events that can't be sent, because the master is down or being
+ * replaced, go to the spool too, and are sent in their order by whichever
+ * writer reaches the master next.
+ *
+ * The spool has one event per line.  Appends take an flock() on it; a
+ * writer claims it by renaming it under that lock to a name of its own
+ * ending in its PID, so the events are sent once, and a file left by a
+ * writer that died is claimed again by the next one.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "repmgr.h"
+#include "arbiter.h"
+#include "events.h"
+#include "log.h"
+#include "strutil.h"
+
+/* read-only transaction: the node we write to is no longer the master */
+#define SQLSTATE_READ_ONLY		"25006"
+
+typedef struct
+{
+	int			node_id;
+	char		event[64];
+	bool		successful;
+	char		timestamp[64];
+	long long	duration_ms;	/* -1 if not timed */
+	char		details[MAXLEN];
+}	t_event;
+
+static bool enabled = false;
+static int	event_node;
+static char event_conninfo[MAXCONNINFO];
+static char event_schema[MAXLEN];
+static char spool_path[MAXLEN];
+
+/* the queue, a ring read by the writer thread */
+static t_event queue[EVENT_QUEUE_SIZE];
+static int	queue_head = 0;
+static int	queue_count = 0;
+static bool writer_running = false;
+static bool stopping = false;
+static bool sending = false;	/* the writer took an event off the queue */
+static pthread_t writer;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER;
+
+/* used by the writer only */
+static PGconn *master_conn = NULL;
+
+static void spool_event(const t_event *e);
+static void *event_writer(void *arg);
+
+
+/*
+ * Where the events of this node go.  Nodes without a database (arbiters)
+ * and commands run without a node number record nothing.
+ */
+void
+events_init(t_configuration_options *options)
+{
+	if (options->node == -1 || options->conninfo[0] == '\0' ||
+		is_arbiter_conninfo(options->conninfo, NULL, NULL))
+		return;
+
+	event_node = options->node;
+	snprintf(event_conninfo, sizeof(event_conninfo), "%s", options->conninfo);
+	maxlen_snprintf(event_schema, "%s%s", DEFAULT_REPMGR_SCHEMA_PREFIX,
+					options->cluster_name);
+
+	if (options->event_spool_file[0])
+		snprintf(spool_path, sizeof(spool_path), "%s",
+				 options->event_spool_file);
+	else
+	{
+		/* not in a shared directory, where others could create it first */
+		const char *home = getenv("HOME");
+		struct passwd *pw;
+
+		if (home == NULL || home[0] == '\0')
+		{
+			pw = getpwuid(geteuid());
+			home = (pw != NULL) ? pw->pw_dir : ".";
+		}
+		maxlen_snprintf(spool_path, "%s/.repmgr_%s_%d.events", home,
+						options->cluster_name, options->node);
+	}
+
+	enabled = true;
+}
+
+
+/*
+ * Starts the writer thread; until then, and if it can't start, events
+ * are spooled
+ */
+void
+events_start(void)
+{
+	sigset_t	blocked,
+				saved;
+
+	if (!enabled || writer_running)
+		return;
+
+	/* signals are for the main thread, which owns the shutdown */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	if (pthread_create(&writer, NULL, event_writer, NULL) == 0)
+		writer_running = true;
+	else
+		log_warning(_("Can't start the event writer, events will wait in %s\n"),
+					spool_path);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+
+/*
+ * Records an event of this node.  'duration_ms' is -1 and 'details' NULL
+ * when there are none.
+ */
+void
+record_event(const char *event, bool successful, long long duration_ms,
+			 const char *details)
+{
+	t_event		e;
+	struct timeval tv;
+	struct tm	tm;
+	char		secs[32];
+	char		zone[8];
+
+	if (!enabled)
+		return;
+
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	strftime(secs, sizeof(secs), "%Y-%m-%d %H:%M:%S", &tm);
+	strftime(zone, sizeof(zone), "%z", &tm);
+
+	e.node_id = event_node;
+	snprintf(e.event, sizeof(e.event), "%s", event);
+	e.successful = successful;
+	snprintf(e.timestamp, sizeof(e.timestamp), "%s.%06ld%s", secs,
+			 (long) tv.tv_usec, zone);
+	e.duration_ms = duration_ms;
+	snprintf(e.details, sizeof(e.details), "%s", details ? details : "");
+
+	pthread_mutex_lock(&queue_lock);
+	if (writer_running && !stopping && queue_count < EVENT_QUEUE_SIZE)
+	{
+		queue[(queue_head + queue_count) % EVENT_QUEUE_SIZE] = e;
+		queue_count++;
+		pthread_cond_signal(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	spool_event(&e);
+}
+
+
+/* appends 'src' to 'dst' with tabs, newlines and backslashes escaped */
+static char *
+escape_field(char *dst, const char *src)
+{
+	for (; *src; src++)
+	{
+		if (*src == '\t' || *src == '\n' || *src == '\\')
+		{
+			*dst++ = '\\';
+			*dst++ = (*src == '\t') ? 't' : (*src == '\n') ? 'n' : '\\';
+		}
+		else
+			*dst++ = *src;
+	}
+	*dst = '\0';
+	return dst;
+}
+
+
+static void
+unescape_field(char *s)
+{
+	char	   *dst = s;
+
+	for (; *s; s++)
+	{
+		if (*s == '\\' && s[1])
+		{
+			s++;
+			*dst++ = (*s == 't') ? '\t' : (*s == 'n') ? '\n' : *s;
+		}
+		else
+			*dst++ = *s;
+	}
+	*dst = '\0';
+}
+
+
+/*
+ * Opens a spool file without following a symbolic link, and refuses one
+ * that isn't a regular file of ours: someone else could read the events,
+ * or have them appended to a file of their choice.
+ */
+static int
+open_spool(const char *path, int flags)
+{
+	struct stat st;
+	int			fd;
+
+	fd = open(path, flags | O_NOFOLLOW, 0600);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+		st.st_uid != geteuid())
+	{
+		log_warning(_("The event spool \"%s\" is not a file of this user, ignoring it\n"),
+					path);
+		close(fd);
+		errno = EPERM;
+		return -1;
+	}
+	return fd;
+}
+
+
+/*
+ * Appends the event to the spool.  The lock is taken on the file that is
+ * still at spool_path, not one renamed meanwhile by a writer claiming it.
+ */
+static void
+spool_event(const t_event *e)
+{
+	char		line[4 * MAXLEN];
+	char	   *p;
+	struct stat fd_stat,
+				path_stat;
+	int			fd;
+
+	p = line + sprintf(line, "%d\t", e->node_id);
+	p = escape_field(p, e->event);
+	p += sprintf(p, "\t%c\t%s\t%lld\t", e->successful ? 't' : 'f',
+				 e->timestamp, e->duration_ms);
+	p = escape_field(p, e->details);
+	*p++ = '\n';
+
+	for (;;)
+	{
+		fd = open_spool(spool_path, O_WRONLY | O_APPEND | O_CREAT);
+		if (fd == -1)
+		{
+			log_warning(_("Can't open the event spool \"%s\", event \"%s\" is lost: %s\n"),
+						spool_path, e->event, strerror(errno));
+			return;
+		}
+
+		/* without locks, appends are still whole */
+		if (flock(fd, LOCK_EX) != 0)
+			break;
+
+		if (fstat(fd, &fd_stat) == 0 && stat(spool_path, &path_stat) == 0 &&
+			fd_stat.st_dev == path_stat.st_dev &&
+			fd_stat.st_ino == path_stat.st_ino)
+			break;
+
+		close(fd);
+	}
+
+	if (write(fd, line, p - line) != p - line)
+	{
+		log_warning(_("Can't write to the event spool \"%s\", event \"%s\" is lost: %s\n"),
+					spool_path, e->event, strerror(errno));
+	}
+	close(fd);
+}
+
+
+/* parses a spool line, false if it isn't one */
+static bool
+read_spool_line(char *line, t_event *e)
+{
+	char	   *field[6];
+	int			i;
+
+	line[strcspn(line, "\n")] = '\0';
+	field[0] = line;
+	for (i = 1; i < 6; i++)
+	{
+		field[i] = strchr(field[i - 1], '\t');
+		if (field[i] == NULL)
+			return false;
+		*field[i]++ = '\0';
+	}
+
+	unescape_field(field[1]);
+	unescape_field(field[5]);
+
+	e->node_id = atoi(field[0]);
+	snprintf(e->event, sizeof(e->event), "%s", field[1]);
+	e->successful = (field[2][0] == 't');
+	snprintf(e->timestamp, sizeof(e->timestamp), "%s", field[3]);
+	e->duration_ms = atoll(field[4]);
+	snprintf(e->details, sizeof(e->details), "%s", field[5]);
+	return true;
+}
+
+
+/*
+ * Renames a spool file left by a writer that died to 'claimed'
+ */
+static bool
+claim_orphan(const char *claimed)
+{
+	char		dir[MAXLEN];
+	char		prefix[MAXLEN];
+	char		orphan[MAXLEN];
+	char	   *slash;
+	DIR		   *dp;
+	struct dirent *de;
+	size_t		prefix_len;
+	long		pid;
+	bool		found = false;
+
+	snprintf(dir, sizeof(dir), "%s", spool_path);
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+	maxlen_snprintf(prefix, "%s.", slash ? strrchr(spool_path, '/') + 1 : spool_path);
+	prefix_len = strlen(prefix);
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return false;
+
+	while (!found && (de = readdir(dp)) != NULL)
+	{
+		if (strncmp(de->d_name, prefix, prefix_len) != 0)
+			continue;
+		pid = atol(de->d_name + prefix_len);
+		if (pid <= 0 || pid == getpid() ||
+			kill((pid_t) pid, 0) == 0 || errno != ESRCH)
+			continue;
+
+		maxlen_snprintf(orphan, "%s/%s", dir, de->d_name);
+		found = (rename(orphan, claimed) == 0);
+	}
+	closedir(dp);
+	return found;
+}
+
+
+/*
+ * Takes the spool, or a file left by a dead writer, for this process to
+ * send; false when there's none
+ */
+static bool
+claim_spool(char *claimed)
+{
+	struct stat fd_stat,
+				path_stat;
+	int			fd;
+	bool		done;
+
+	maxlen_snprintf(claimed, "%s.%d", spool_path, (int) getpid());
+
+	if (claim_orphan(claimed))
+		return true;
+
+	for (;;)
+	{
+		fd = open_spool(spool_path, O_RDONLY);
+		if (fd == -1)
+			return false;
+
+		if (flock(fd, LOCK_EX) == 0 &&
+			(fstat(fd, &fd_stat) != 0 || stat(spool_path, &path_stat) != 0 ||
+			 fd_stat.st_dev != path_stat.st_dev ||
+			 fd_stat.st_ino != path_stat.st_ino))
+		{
+			close(fd);
+			continue;
+		}
+
+		done = (rename(spool_path, claimed) == 0);
+		close(fd);
+		return done;
+	}
+}
+
+
+/*
+ * Inserts the event: 0 when done, -1 when the master was lost (the event
+ * should be retried), 1 when it was refused (it never will be accepted)
+ */
+static int
+insert_event(PGconn *conn, const t_event *e)
+{
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		node_id[16];
+	char		duration_ms[32];
+	const char *values[6];
+	const char *sqlstate;
+	int			ret;
+
+	sqlquery_snprintf(sqlquery,
+					  "INSERT INTO %s.repl_events "
+					  "  (node_id, event, successful, event_timestamp, "
+					  "   duration_ms, details) "
+					  "VALUES ($1, $2, $3, $4, $5, $6)",
+					  event_schema);
+
+	snprintf(node_id, sizeof(node_id), "%d", e->node_id);
+	snprintf(duration_ms, sizeof(duration_ms), "%lld", e->duration_ms);
+	values[0] = node_id;
+	values[1] = e->event;
+	values[2] = e->successful ? "t" : "f";
+	values[3] = e->timestamp;
+	values[4] = (e->duration_ms >= 0) ? duration_ms : NULL;
+	values[5] = e->details[0] ? e->details : NULL;
+
+	res = PQexecParams(conn, sqlquery, 6, NULL, values, NULL, NULL, 0);
+	if (PQresultStatus(res) == PGRES_COMMAND_OK)
+		ret = 0;
+	else
+	{
+		sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+		if (PQstatus(conn) != CONNECTION_OK ||
+			(sqlstate && strcmp(sqlstate, SQLSTATE_READ_ONLY) == 0))
+			ret = -1;
+		else
+		{
+			log_warning(_("Can't record the event \"%s\" of node %d in repl_events: %s\n"),
+						e->event, e->node_id, PQerrorMessage(conn));
+			ret = 1;
+		}
+	}
+	PQclear(res);
+	return ret;
+}
+
+
+/* the master, found through this node, or NULL */
+static PGconn *
+connect_master(void)
+{
+	PGconn	   *local_conn;
+	int			master_id;
+
+	if (master_conn != NULL && PQstatus(master_conn) == CONNECTION_OK)
+		return master_conn;
+
+	if (master_conn != NULL)
+		PQfinish(master_conn);
+	master_conn = NULL;
+
+	local_conn = establish_db_connection(event_conninfo, false);
+	if (PQstatus(local_conn) == CONNECTION_OK)
+		master_conn = get_master_connection(local_conn, &master_id, NULL);
+	PQfinish(local_conn);
+	return master_conn;
+}
+
+
+static void
+disconnect_master(void)
+{
+	if (master_conn != NULL)
+		PQfinish(master_conn);
+	master_conn = NULL;
+}
+
+
+/*
+ * Sends the spooled events, oldest first.  False when the master was lost
+ * on the way; the events not sent are spooled again.
+ */
+static bool
+send_spool(PGconn *conn)
+{
+	char		claimed[MAXLEN];
+	char		line[4 * MAXLEN];
+	FILE	   *fp;
+	t_event		e;
+	bool		lost = false;
+	int			fd;
+
+	while (!lost && claim_spool(claimed))
+	{
+		fd = open_spool(claimed, O_RDONLY);
+		fp = (fd == -1) ? NULL : fdopen(fd, "r");
+		if (fp == NULL)
+		{
+			if (fd != -1)
+				close(fd);
+			log_warning(_("Can't read the event spool \"%s\": %s\n"), claimed,
+						strerror(errno));
+			return true;
+		}
+
+		while (fgets(line, sizeof(line), fp) != NULL)
+		{
+			if (!read_spool_line(line, &e))
+				continue;
+			if (!lost && insert_event(conn, &e) < 0)
+				lost = true;
+			if (lost)
+				spool_event(&e);
+		}
+		fclose(fp);
+		unlink(claimed);
+	}
+	return !lost;
+}
+
+
+/*
+ * Spools what is queued.  Called with queue_lock held; the file is local,
+ * so it's kept only for as long as a few appends take.
+ */
+static void
+spool_queue(void)
+{
+	while (queue_count > 0)
+	{
+		spool_event(&queue[queue_head]);
+		queue_head = (queue_head + 1) % EVENT_QUEUE_SIZE;
+		queue_count--;
+	}
+	pthread_cond_broadcast(&drained_cond);
+}
+
+
+/*
+ * The writer thread: sends the spool then the queue whenever there are
+ * events, and every EVENT_RETRY_SECS while the spool isn't empty.  While
+ * the master can't be reached, the queue is spooled, so it never fills.
+ */
+static void *
+event_writer(void *arg)
+{
+	struct timespec deadline;
+	t_event		e;
+	int			r = 0;
+
+	pthread_mutex_lock(&queue_lock);
+	while (!(stopping && queue_count == 0))
+	{
+		if (queue_count == 0)
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += EVENT_RETRY_SECS;
+			pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline);
+			if (queue_count == 0 && access(spool_path, F_OK) != 0)
+				continue;
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		if (connect_master() == NULL || !send_spool(master_conn))
+		{
+			disconnect_master();
+			pthread_mutex_lock(&queue_lock);
+			spool_queue();
+			continue;
+		}
+
+		/*
+		 * An event taken off the queue belongs to the writer: it is either
+		 * inserted or handed back, never spooled by events_shutdown() too
+		 */
+		pthread_mutex_lock(&queue_lock);
+		while (queue_count > 0)
+		{
+			e = queue[queue_head];
+			queue_head = (queue_head + 1) % EVENT_QUEUE_SIZE;
+			queue_count--;
+			sending = true;
+			pthread_mutex_unlock(&queue_lock);
+			r = insert_event(master_conn, &e);
+			pthread_mutex_lock(&queue_lock);
+			sending = false;
+
+			if (r < 0)
+			{
+				/* back in front, unless the queue was spooled or refilled */
+				if (writer_running && queue_count < EVENT_QUEUE_SIZE)
+				{
+					queue_head = (queue_head + EVENT_QUEUE_SIZE - 1) %
+						EVENT_QUEUE_SIZE;
+					queue[queue_head] = e;
+					queue_count++;
+				}
+				else
+					spool_event(&e);
+				disconnect_master();
+				break;
+			}
+		}
+		if (queue_count == 0)
+			pthread_cond_broadcast(&drained_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	disconnect_master();
+	return NULL;
+}
+
+
+/*
+ * Sends the spool from a child process, so repmgr exits at once; the
+ * child is orphaned like the prewarm one of repmgrd, not to be waited for
+ */
+void
+events_flush_detached(void)
+{
+	PGconn	   *conn;
+	struct stat st;
+	pid_t		pid;
+	int			fd;
+
+	if (!enabled || access(spool_path, F_OK) != 0)
+		return;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	pid = fork();
+	if (pid == -1)
+		return;
+	if (pid > 0)
+	{
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	if (fork() != 0)
+		_exit(0);
+
+	/*
+	 * A caller reading the output of repmgr shouldn't wait for this one;
+	 * a log file is kept
+	 */
+	fd = open("/dev/null", O_RDWR);
+	if (fd != -1)
+	{
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		if (fstat(STDERR_FILENO, &st) != 0 || !S_ISREG(st.st_mode))
+			dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	conn = connect_master();
+	if (conn != NULL)
+		send_spool(conn);
+	disconnect_master();
+	_exit(0);
+}
+
+
+/*
+ * Gives the writer up to timeout_secs to send what is queued, then spools
+ * the rest.  Not joined: it may be stuck connecting to a master that is
+ * gone.  An event it is inserting at the timeout is left to it, and lost
+ * if the process exits before the master answers.
+ */
+void
+events_shutdown(int timeout_secs)
+{
+	struct timespec deadline;
+
+	if (!writer_running)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_secs;
+
+	pthread_mutex_lock(&queue_lock);
+
+	stopping = true;
+	pthread_cond_signal(&queue_cond);
+	while (queue_count > 0 || sending)
+	{
+		if (pthread_cond_timedwait(&drained_cond, &queue_lock, &deadline) != 0)
+			break;
+	}
+	spool_queue();
+	writer_running = false;
+	pthread_mutex_unlock(&queue_lock);
+}
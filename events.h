@@ -0,0 +1,39 @@
+/*
+ * events.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_EVENTS_H_
+#define _REPMGR_EVENTS_H_
+
+#include "repmgr.h"
+
+/* events waiting for the writer; more go straight to the spool */
+#define EVENT_QUEUE_SIZE		64
+/* how often the writer retries while the master can't be reached */
+#define EVENT_RETRY_SECS		10
+/* how long repmgrd waits for the queue to drain when it stops */
+#define EVENT_SHUTDOWN_SECS		5
+
+void		events_init(t_configuration_options *options);
+void		events_start(void);
+void		record_event(const char *event, bool successful,
+						 long long duration_ms, const char *details);
+void		events_flush_detached(void);
+void		events_shutdown(int timeout_secs);
+
+#endif
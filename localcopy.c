@@ -0,0 +1,569 @@
+/*
+ * localcopy.c - Copy of a data directory living on the same host
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * When the node to clone runs on the same machine there is no need to go
+ * through ssh and rsync: files are shared with the source through reflinks
+ * when the filesystem supports them (FICLONE), and otherwise copied in the
+ * kernel with copy_file_range(), skipping holes so sparse files stay
+ * sparse.  Files are spread across several threads.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#endif
+
+/* NB: postgres_fe must be included BEFORE localcopy */
+#include "postgres_fe.h"
+#include "localcopy.h"
+
+#include "strutil.h"
+#include "log.h"
+
+#define LOCAL_COPY_BUFSIZE	(128 * 1024)
+
+/* Regular files found while walking the source, copied by the workers */
+typedef struct
+{
+	const char *src;
+	const char *dst;
+	char	  **files;
+	int			nfiles;
+	int			maxfiles;
+	int			next;
+	local_copy_callback callback;
+	t_local_copy_stats *stats;
+	pthread_mutex_t lock;
+}	t_copy_work;
+
+static bool walk_dir(t_copy_work *work, const char *rel,
+		 const char *const * excludes);
+static bool add_file(t_copy_work *work, const char *rel);
+static void *copy_worker(void *arg);
+static bool copy_one_file(const char *src, const char *dst,
+			  const struct stat * st, bool *reflinked);
+static bool copy_data(int srcfd, int dstfd, off_t size);
+static bool copy_range(int srcfd, int dstfd, off_t offset, off_t len);
+
+/* set once copy_file_range() turned out not to work here */
+static bool no_copy_file_range = false;
+
+
+/*
+ * A source is local when the host given to clone designates this machine
+ * and its data directory can be read from here
+ */
+bool
+is_local_source(const char *host, const char *data_dir)
+{
+	char		hostname[MAXLEN];
+	char		control_file[MAXFILENAME];
+
+	if (host[0] != '\0' && host[0] != '/' &&
+		strcmp(host, "localhost") != 0 &&
+		strcmp(host, "127.0.0.1") != 0 &&
+		strcmp(host, "::1") != 0)
+	{
+		if (gethostname(hostname, sizeof(hostname)) != 0 ||
+			strcmp(host, hostname) != 0)
+			return false;
+	}
+
+	maxlen_snprintf(control_file, "%s/global/pg_control", data_dir);
+	return (access(control_file, R_OK) == 0);
+}
+
+
+/*
+ * Whether the two paths designate the same existing file or directory
+ */
+bool
+is_same_file(const char *path1, const char *path2)
+{
+	struct stat st1;
+	struct stat st2;
+
+	return (stat(path1, &st1) == 0 && stat(path2, &st2) == 0 &&
+			st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino);
+}
+
+
+/*
+ * Copies the content of directory src into dst, as rsync does with the
+ * archive option.  Entries whose name matches one of the excludes patterns
+ * are skipped at any level.  Returns false if anything could not be copied.
+ */
+bool
+local_copy_tree(const char *src, const char *dst,
+				const char *const * excludes, int jobs,
+				local_copy_callback callback, t_local_copy_stats *stats)
+{
+	t_copy_work work;
+	pthread_t  *threads;
+	int			started = 0;
+	int			i;
+	bool		ok;
+
+	memset(&work, 0, sizeof(work));
+	work.src = src;
+	work.dst = dst;
+	work.callback = callback;
+	work.stats = stats;
+	pthread_mutex_init(&work.lock, NULL);
+
+	ok = walk_dir(&work, "", excludes);
+
+	if (ok && work.nfiles > 0)
+	{
+		if (jobs < 1)
+			jobs = 1;
+		if (jobs > work.nfiles)
+			jobs = work.nfiles;
+
+		threads = malloc(jobs * sizeof(pthread_t));
+		if (threads == NULL)
+		{
+			log_err(_("local copy: out of memory\n"));
+			ok = false;
+		}
+		else
+		{
+			for (i = 0; i < jobs; i++)
+			{
+				if (pthread_create(&threads[i], NULL, copy_worker, &work) != 0)
+					break;
+				started++;
+			}
+
+			/* if no thread could be started, do the work ourselves */
+			if (started == 0)
+				copy_worker(&work);
+
+			for (i = 0; i < started; i++)
+				pthread_join(threads[i], NULL);
+			free(threads);
+		}
+	}
+
+	for (i = 0; i < work.nfiles; i++)
+		free(work.files[i]);
+	free(work.files);
+	pthread_mutex_destroy(&work.lock);
+
+	return ok && stats->failed == 0;
+}
+
+
+/*
+ * Copies a single file.  If dst is a directory the file keeps its name.
+ */
+bool
+local_copy_file(const char *src, const char *dst, t_local_copy_stats *stats)
+{
+	char		dst_path[MAXFILENAME];
+	struct stat st;
+	const char *base;
+	bool		reflinked = false;
+
+	if (stat(dst, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		base = strrchr(src, '/');
+		maxlen_snprintf(dst_path, "%s/%s", dst, base ? base + 1 : src);
+	}
+	else
+		maxlen_snprintf(dst_path, "%s", dst);
+
+	if (stat(src, &st) != 0)
+	{
+		log_err(_("local copy: can't stat \"%s\": %s\n"), src, strerror(errno));
+		stats->failed++;
+		return false;
+	}
+
+	if (!copy_one_file(src, dst_path, &st, &reflinked))
+	{
+		stats->failed++;
+		return false;
+	}
+
+	stats->files++;
+	stats->bytes += st.st_size;
+	if (reflinked)
+		stats->reflinked++;
+
+	return true;
+}
+
+
+/*
+ * Recreates the directories and symbolic links below rel, and queues the
+ * regular files for the workers
+ */
+static bool
+walk_dir(t_copy_work *work, const char *rel, const char *const * excludes)
+{
+	char		src_path[MAXFILENAME];
+	char		dst_path[MAXFILENAME];
+	char		entry_rel[MAXFILENAME];
+	char		link_target[MAXFILENAME];
+	DIR		   *dir;
+	struct dirent *de;
+	struct stat st;
+	ssize_t		len;
+	int			i;
+	bool		skip;
+	bool		ok = true;
+
+	maxlen_snprintf(src_path, "%s%s%s", work->src, rel[0] ? "/" : "", rel);
+	dir = opendir(src_path);
+	if (dir == NULL)
+	{
+		log_err(_("local copy: can't open directory \"%s\": %s\n"),
+				src_path, strerror(errno));
+		return false;
+	}
+
+	while (ok && (de = readdir(dir)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		skip = false;
+		for (i = 0; excludes != NULL && excludes[i] != NULL; i++)
+		{
+			if (fnmatch(excludes[i], de->d_name, 0) == 0)
+				skip = true;
+		}
+		if (skip)
+			continue;
+
+		maxlen_snprintf(entry_rel, "%s%s%s", rel, rel[0] ? "/" : "",
+						de->d_name);
+		maxlen_snprintf(src_path, "%s/%s", work->src, entry_rel);
+		maxlen_snprintf(dst_path, "%s/%s", work->dst, entry_rel);
+
+		if (lstat(src_path, &st) != 0)
+		{
+			/* files can vanish while the server runs, as with rsync */
+			if (errno == ENOENT)
+				continue;
+			log_err(_("local copy: can't stat \"%s\": %s\n"),
+					src_path, strerror(errno));
+			ok = false;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			if (mkdir(dst_path, st.st_mode & 07777) != 0 && errno != EEXIST)
+			{
+				log_err(_("local copy: can't create directory \"%s\": %s\n"),
+						dst_path, strerror(errno));
+				ok = false;
+			}
+			else
+				ok = walk_dir(work, entry_rel, excludes);
+		}
+		else if (S_ISLNK(st.st_mode))
+		{
+			len = readlink(src_path, link_target, sizeof(link_target) - 1);
+			if (len < 0)
+			{
+				log_err(_("local copy: can't read link \"%s\": %s\n"),
+						src_path, strerror(errno));
+				ok = false;
+				continue;
+			}
+			link_target[len] = '\0';
+			unlink(dst_path);
+			if (symlink(link_target, dst_path) != 0)
+			{
+				log_err(_("local copy: can't create link \"%s\": %s\n"),
+						dst_path, strerror(errno));
+				ok = false;
+			}
+		}
+		else if (S_ISREG(st.st_mode))
+			ok = add_file(work, entry_rel);
+	}
+
+	closedir(dir);
+	return ok;
+}
+
+
+static bool
+add_file(t_copy_work *work, const char *rel)
+{
+	char	  **files;
+
+	if (work->nfiles == work->maxfiles)
+	{
+		work->maxfiles = work->maxfiles ? work->maxfiles * 2 : 1024;
+		files = realloc(work->files, work->maxfiles * sizeof(char *));
+		if (files == NULL)
+		{
+			log_err(_("local copy: out of memory\n"));
+			return false;
+		}
+		work->files = files;
+	}
+
+	work->files[work->nfiles] = strdup(rel);
+	if (work->files[work->nfiles] == NULL)
+	{
+		log_err(_("local copy: out of memory\n"));
+		return false;
+	}
+	work->nfiles++;
+
+	return true;
+}
+
+
+static void *
+copy_worker(void *arg)
+{
+	t_copy_work *work = (t_copy_work *) arg;
+	char		src_path[MAXFILENAME];
+	char		dst_path[MAXFILENAME];
+	struct stat st;
+	const char *rel;
+	bool		reflinked;
+	bool		ok;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&work->lock);
+		rel = (work->next < work->nfiles) ? work->files[work->next++] : NULL;
+		pthread_mutex_unlock(&work->lock);
+
+		if (rel == NULL)
+			break;
+
+		maxlen_snprintf(src_path, "%s/%s", work->src, rel);
+		maxlen_snprintf(dst_path, "%s/%s", work->dst, rel);
+
+		reflinked = false;
+		if (stat(src_path, &st) != 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			log_err(_("local copy: can't stat \"%s\": %s\n"),
+					src_path, strerror(errno));
+			ok = false;
+		}
+		else
+			ok = copy_one_file(src_path, dst_path, &st, &reflinked);
+
+		pthread_mutex_lock(&work->lock);
+		if (ok)
+		{
+			work->stats->files++;
+			work->stats->bytes += st.st_size;
+			if (reflinked)
+				work->stats->reflinked++;
+			if (work->callback)
+				work->callback(st.st_size, rel);
+		}
+		else
+			work->stats->failed++;
+		pthread_mutex_unlock(&work->lock);
+	}
+
+	return NULL;
+}
+
+
+static bool
+copy_one_file(const char *src, const char *dst, const struct stat * st,
+			  bool *reflinked)
+{
+	struct timespec times[2];
+	struct stat src_st;
+	struct stat dst_st;
+	int			srcfd;
+	int			dstfd;
+	bool		ok = true;
+
+	srcfd = open(src, O_RDONLY);
+	if (srcfd < 0)
+	{
+		/* the server may have removed it meanwhile */
+		if (errno == ENOENT)
+			return true;
+		log_err(_("local copy: can't open \"%s\": %s\n"), src, strerror(errno));
+		return false;
+	}
+
+	/* truncated only once we know it isn't the source itself */
+	dstfd = open(dst, O_WRONLY | O_CREAT, st->st_mode & 07777);
+	if (dstfd < 0)
+	{
+		log_err(_("local copy: can't create \"%s\": %s\n"), dst, strerror(errno));
+		close(srcfd);
+		return false;
+	}
+
+	if (fstat(srcfd, &src_st) == 0 && fstat(dstfd, &dst_st) == 0 &&
+		src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino)
+	{
+		log_err(_("local copy: \"%s\" and \"%s\" are the same file\n"),
+				src, dst);
+		ok = false;
+	}
+	else if (ftruncate(dstfd, 0) != 0)
+	{
+		log_err(_("local copy: can't truncate \"%s\": %s\n"), dst,
+				strerror(errno));
+		ok = false;
+	}
+	if (!ok)
+	{
+		close(dstfd);
+		close(srcfd);
+		return false;
+	}
+
+#ifdef FICLONE
+	if (ioctl(dstfd, FICLONE, srcfd) == 0)
+		*reflinked = true;
+	else
+#endif
+	{
+		ok = copy_data(srcfd, dstfd, st->st_size);
+		if (ok && ftruncate(dstfd, st->st_size) != 0)
+			ok = false;
+		if (!ok)
+			log_err(_("local copy: can't copy \"%s\" to \"%s\": %s\n"),
+					src, dst, strerror(errno));
+	}
+
+	/* keep modification times, like rsync --archive */
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	futimens(dstfd, times);
+
+	if (close(dstfd) != 0)
+		ok = false;
+	close(srcfd);
+
+	return ok;
+}
+
+
+/*
+ * Copies the data extents of a file and leaves its holes unallocated
+ */
+static bool
+copy_data(int srcfd, int dstfd, off_t size)
+{
+	off_t		pos = 0;
+	off_t		data;
+	off_t		hole;
+
+	while (pos < size)
+	{
+		data = pos;
+		hole = size;
+#ifdef SEEK_DATA
+		data = lseek(srcfd, pos, SEEK_DATA);
+		if (data < 0)
+		{
+			/* nothing but a hole up to the end */
+			if (errno == ENXIO)
+				break;
+			/* the filesystem can't tell, copy everything */
+			data = pos;
+		}
+		else
+		{
+			hole = lseek(srcfd, data, SEEK_HOLE);
+			if (hole < 0 || hole > size)
+				hole = size;
+		}
+#endif
+		if (data >= size)
+			break;
+		if (!copy_range(srcfd, dstfd, data, hole - data))
+			return false;
+		pos = hole;
+	}
+
+	return true;
+}
+
+
+static bool
+copy_range(int srcfd, int dstfd, off_t offset, off_t len)
+{
+	char		buf[LOCAL_COPY_BUFSIZE];
+	off_t		in_off = offset;
+	off_t		out_off = offset;
+	ssize_t		nread;
+	ssize_t		nwritten;
+
+#ifdef SYS_copy_file_range
+	while (len > 0 && !no_copy_file_range)
+	{
+		nwritten = syscall(SYS_copy_file_range, srcfd, &in_off, dstfd,
+						   &out_off, (size_t) len, 0);
+		if (nwritten < 0)
+		{
+			if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+				errno != EOPNOTSUPP)
+				return false;
+			no_copy_file_range = true;
+			break;
+		}
+		/* the file was truncated meanwhile */
+		if (nwritten == 0)
+			return true;
+		len -= nwritten;
+	}
+#endif
+
+	while (len > 0)
+	{
+		nread = pread(srcfd, buf, Min(len, (off_t) sizeof(buf)), in_off);
+		if (nread < 0)
+			return false;
+		if (nread == 0)
+			return true;
+
+		nwritten = pwrite(dstfd, buf, nread, out_off);
+		if (nwritten != nread)
+			return false;
+
+		in_off += nread;
+		out_off += nread;
+		len -= nread;
+	}
+
+	return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * localcopy.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_LOCALCOPY_H_
+#define _REPMGR_LOCALCOPY_H_
+
+/*
+ * Called once per copied file, with its size and its path relative to the
+ * copied directory.  Calls are serialized, even with several jobs.
+ */
+typedef void (*local_copy_callback) (long long bytes, const char *name);
+
+typedef struct
+{
+	long		files;
+	long long	bytes;
+	long		reflinked;		/* files shared with the source (FICLONE) */
+	long		failed;
+}	t_local_copy_stats;
+
+bool		is_local_source(const char *host, const char *data_dir);
+bool		is_same_file(const char *path1, const char *path2);
+bool local_copy_tree(const char *src, const char *dst,
+				const char *const * excludes, int jobs,
+				local_copy_callback callback, t_local_copy_stats *stats);
+bool local_copy_file(const char *src, const char *dst,
+				t_local_copy_stats *stats);
+
+#endif
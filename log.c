@@ -2,7 +2,16 @@
  * log.c - Logging methods
  * Copyright (C) 2ndQuadrant, 2010-2014
  *
- * This module is a set of methods for logging (currently only syslog)
+ * This module is a set of methods for logging, to syslog or to stderr.
+ *
+ * Once repmgrd calls logger_start_async(), a line logged to stderr is
+ * only formatted, into a slot of a ring buffer; a writer thread takes
+ * the lines in order and writes them in batches, so a slow or full disk
+ * never holds up the caller.  Producers claim slots with compare-and-swap
+ * (a bounded queue after Dmitry Vyukov's), so any thread, or a signal
+ * handler, can log without taking a lock.  When the ring is full the line
+ * is dropped and counted, and the writer reports how many were.  The
+ * writer also rotates the log file and reopens it when it's moved away.
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -27,8 +36,15 @@
 #include <syslog.h>
 #endif
 
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 
@@ -39,36 +55,508 @@
 
 /* #define REPMGR_DEBUG */
 
+typedef struct
+{
+	unsigned long seq;			/* position it can be written (seq == pos)
+								 * or read (seq == pos + 1) at */
+	int			len;
+	char		text[LOG_LINE_MAX];
+}	t_log_slot;
+
+static t_log_slot ring[LOG_RING_SIZE];
+static unsigned long ring_head = 0;		/* next slot to claim */
+static unsigned long ring_tail = 0;		/* next slot to write out */
+static unsigned long ring_written = 0;	/* lines before it are on disk */
+static unsigned long ring_dropped = 0;	/* lines lost to a full ring */
+static sem_t ring_sem;
+
+static volatile bool writer_running = false;
+static pthread_t writer;
+static char log_file[MAXLEN] = "";
+static long log_rotation_bytes = 0;
+
+/* the format, and the fields of the JSON lines */
+static int	log_format = LOG_FORMAT_TEXT;
+static int	log_node = -1;
+static __thread int log_peer = -1;
+static __thread const char *log_phase = NULL;
+static __thread char log_lsn[32];
+static __thread long long log_duration = -1;
+
+static int	format_log_line(char *buf, int size, const char *level_name,
+							long long duration, const char *fmt, va_list ap);
+static int	format_writer_line(char *buf, int size, const char *fmt,...)
+__attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
+static int	json_escape(char *buf, int len, int max, const char *s);
+static void write_all(const char *buf, int len);
+static void *log_writer(void *arg);
+static void logger_flush(void);
+
+
 void
 stderr_log_with_level(const char *level_name, int level, const char *fmt, ...)
 {
-	time_t		t;
-	struct tm  *tm;
-	char		buff[100];
+	t_log_slot *slot;
+	unsigned long pos;
+	unsigned long seq;
+	char		line[LOG_LINE_MAX];
+	long long	duration = log_duration;
 	va_list		ap;
 
-	if (log_level >= level)
-	{
-		time(&t);
-		tm = localtime(&t);
-		strftime(buff, 100, "[%Y-%m-%d %H:%M:%S]", tm);
-		fprintf(stderr, "%s [%s] ", buff, level_name);
+	/* a duration is only about the line that follows it */
+	log_duration = -1;
 
+	if (log_level < level)
+		return;
+
+	if (!writer_running)
+	{
 		va_start(ap, fmt);
-		vfprintf(stderr, fmt, ap);
+		write_all(line, format_log_line(line, sizeof(line), level_name,
+										duration, fmt, ap));
 		va_end(ap);
+		return;
+	}
+
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		slot = &ring[pos % LOG_RING_SIZE];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos)
+		{
+			if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((long) (seq - pos) < 0)
+		{
+			/* the writer is a whole ring behind */
+			__atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	}
+
+	va_start(ap, fmt);
+	slot->len = format_log_line(slot->text, LOG_LINE_MAX, level_name,
+								duration, fmt, ap);
+	va_end(ap);
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&ring_sem);
+}
+
+
+/*
+ * The line of a message, in the log_format chosen, into buf, cut to fit;
+ * returns its length.  Nothing is allocated.  The time is only converted
+ * once a second per thread.
+ */
+static int
+format_log_line(char *buf, int size, const char *level_name,
+				long long duration, const char *fmt, va_list ap)
+{
+	static __thread time_t stamp_time = 0;
+	static __thread char stamp[32];
+	static __thread char json_stamp[32];
+	char		msg[LOG_LINE_MAX];
+	time_t		t;
+	struct tm	tm;
+	int			len;
+	int			n;
+
+	time(&t);
+	if (t != stamp_time)
+	{
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S]", &tm);
+		strftime(json_stamp, sizeof(json_stamp), "%Y-%m-%dT%H:%M:%S%z", &tm);
+		stamp_time = t;
+	}
+
+	if (log_format == LOG_FORMAT_TEXT)
+	{
+		len = snprintf(buf, size, "%s [%s] ", stamp, level_name);
+		n = vsnprintf(buf + len, size - len, fmt, ap);
+		if (n < 0)
+			n = 0;
+		if (len + n >= size)
+		{
+			/* truncated: keep it one line */
+			len = size - 1;
+			buf[len - 1] = '\n';
+		}
+		else
+			len += n;
+
+		return len;
+	}
+
+	len = snprintf(buf, size, "{\"time\":\"%s\",\"level\":\"%s\",\"node\":",
+				   json_stamp, level_name);
+	len += (log_node >= 0) ?
+		snprintf(buf + len, size - len, "%d", log_node) :
+		snprintf(buf + len, size - len, "null");
+	len += (log_peer >= 0) ?
+		snprintf(buf + len, size - len, ",\"peer\":%d", log_peer) :
+		snprintf(buf + len, size - len, ",\"peer\":null");
+	len += (log_phase != NULL) ?
+		snprintf(buf + len, size - len, ",\"phase\":\"%s\"", log_phase) :
+		snprintf(buf + len, size - len, ",\"phase\":null");
+	len += (log_lsn[0] != '\0') ?
+		snprintf(buf + len, size - len, ",\"lsn\":\"%s\"", log_lsn) :
+		snprintf(buf + len, size - len, ",\"lsn\":null");
+	len += (duration >= 0) ?
+		snprintf(buf + len, size - len, ",\"duration_us\":%lld", duration) :
+		snprintf(buf + len, size - len, ",\"duration_us\":null");
+	len += snprintf(buf + len, size - len, ",\"msg\":\"");
+
+	n = vsnprintf(msg, sizeof(msg), fmt, ap);
+	if (n < 0)
+		msg[0] = '\0';
+	n = strlen(msg);
+	while (n > 0 && msg[n - 1] == '\n')
+		msg[--n] = '\0';
+
+	/* room is kept for the end of the object */
+	len = json_escape(buf, len, size - 4, msg);
+	memcpy(buf + len, "\"}\n", 4);
+
+	return len + 3;
+}
+
+
+/*
+ * Appends 's' as the contents of a JSON string to buf, which holds 'len'
+ * bytes and can hold 'max', without splitting an escape sequence; returns
+ * the new length
+ */
+static int
+json_escape(char *buf, int len, int max, const char *s)
+{
+	char		esc[8];
+	int			n;
+
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			n = snprintf(esc, sizeof(esc), "\\%c", *s);
+		else if (*s == '\n')
+			n = snprintf(esc, sizeof(esc), "\\n");
+		else if (*s == '\t')
+			n = snprintf(esc, sizeof(esc), "\\t");
+		else if ((unsigned char) *s < 0x20)
+			n = snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *s);
+		else
+		{
+			esc[0] = *s;
+			n = 1;
+		}
+
+		if (len + n > max)
+			break;
+		memcpy(buf + len, esc, n);
+		len += n;
+	}
+	return len;
+}
+
+
+/*
+ * What the lines logged by this thread are about, for the JSON format:
+ * the node it talks to (-1 for none), the step it's in (a string that
+ * stays, NULL for none), a WAL location, and the duration of what the
+ * next line reports
+ */
+void
+log_set_peer(int node)
+{
+	log_peer = node;
+}
+
+
+void
+log_set_phase(const char *phase)
+{
+	log_phase = phase;
+}
+
+
+void
+log_set_lsn(const char *lsn)
+{
+	if (lsn == NULL)
+		log_lsn[0] = '\0';
+	else
+		snprintf(log_lsn, sizeof(log_lsn), "%s", lsn);
+}
+
+
+void
+log_set_duration(long long duration_us)
+{
+	log_duration = duration_us;
+}
+
+
+/* a warning of the writer thread itself */
+static int
+format_writer_line(char *buf, int size, const char *fmt,...)
+{
+	va_list		ap;
+	int			len;
+
+	va_start(ap, fmt);
+	len = format_log_line(buf, size, "WARNING", -1, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+
+/* to stderr, whatever it's been redirected to */
+static void
+write_all(const char *buf, int len)
+{
+	ssize_t		n;
+
+	while (len > 0)
+	{
+		n = write(STDERR_FILENO, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * Points stderr at a new log file, so the commands run by repmgrd write
+ * to it too
+ */
+static void
+open_log_file(void)
+{
+	int			fd;
 
-		fflush(stderr);
+	fd = open(log_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd == -1)
+		return;
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+}
+
+
+/* logfile becomes logfile.1, logfile.1 logfile.2, and so on */
+static void
+rotate_log_file(void)
+{
+	char		from[MAXLEN + 16];
+	char		to[MAXLEN + 16];
+	int			i;
+
+	for (i = LOG_ROTATION_FILES - 1; i > 0; i--)
+	{
+		snprintf(from, sizeof(from), "%s.%d", log_file, i);
+		snprintf(to, sizeof(to), "%s.%d", log_file, i + 1);
+		rename(from, to);
 	}
+	snprintf(to, sizeof(to), "%s.1", log_file);
+	rename(log_file, to);
+	open_log_file();
+}
+
+
+/*
+ * Rotates the log file when it's too big, and reopens it when it's been
+ * moved or removed, by logrotate for example
+ */
+static void
+check_log_file(void)
+{
+	struct stat fd_stat,
+				path_stat;
+
+	if (log_file[0] == '\0' || fstat(STDERR_FILENO, &fd_stat) != 0)
+		return;
+
+	if (stat(log_file, &path_stat) != 0 ||
+		path_stat.st_dev != fd_stat.st_dev ||
+		path_stat.st_ino != fd_stat.st_ino)
+		open_log_file();
+	else if (log_rotation_bytes > 0 && fd_stat.st_size >= log_rotation_bytes)
+		rotate_log_file();
+}
+
+
+/*
+ * The writer thread: gathers the lines logged since its last pass and
+ * writes them at once
+ */
+static void *
+log_writer(void *arg)
+{
+	static char batch[LOG_BATCH_SIZE];
+	t_log_slot *slot;
+	struct timespec deadline;
+	unsigned long reported = 0;
+	unsigned long dropped;
+	int			len;
+
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		if (sem_timedwait(&ring_sem, &deadline) != 0)
+			check_log_file();
+		while (sem_trywait(&ring_sem) == 0)
+			;
+
+		len = 0;
+		for (;;)
+		{
+			slot = &ring[ring_tail % LOG_RING_SIZE];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+				break;
+
+			if (len + slot->len > LOG_BATCH_SIZE)
+			{
+				write_all(batch, len);
+				__atomic_store_n(&ring_written, ring_tail, __ATOMIC_RELEASE);
+				len = 0;
+			}
+			memcpy(batch + len, slot->text, slot->len);
+			len += slot->len;
+
+			__atomic_store_n(&slot->seq, ring_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+			__atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+		}
+
+		dropped = __atomic_load_n(&ring_dropped, __ATOMIC_RELAXED);
+		if (dropped != reported && len + LOG_LINE_MAX <= LOG_BATCH_SIZE)
+		{
+			len += format_writer_line(batch + len, LOG_LINE_MAX,
+									  _("%lu log lines dropped, the log couldn't be written fast enough\n"),
+									  dropped - reported);
+			reported = dropped;
+		}
+
+		if (len > 0)
+		{
+			write_all(batch, len);
+			check_log_file();
+		}
+		__atomic_store_n(&ring_written, ring_tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+
+/* a forked child has no writer: it logs on its own */
+static void
+log_atfork_child(void)
+{
+	writer_running = false;
+}
+
+
+/*
+ * Starts the writer thread.  Only for stderr: syslog() doesn't wait for
+ * the disk.
+ */
+bool
+logger_start_async(void)
+{
+	sigset_t	blocked,
+				saved;
+	static bool started = false;
+	unsigned long i;
+
+	if (log_type != REPMGR_STDERR || started)
+		return false;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		ring[i].seq = i;
+	ring_head = ring_tail = ring_written = 0;
+	if (sem_init(&ring_sem, 0, 0) != 0)
+		return false;
+
+	/* signal handlers run in the main thread */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+	if (pthread_create(&writer, NULL, log_writer, NULL) == 0)
+		writer_running = true;
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (!writer_running)
+		return false;
+
+	started = true;
+	pthread_atfork(NULL, NULL, log_atfork_child);
+	atexit(logger_flush);
+	return true;
+}
+
+
+/*
+ * Waits, LOG_FLUSH_TIMEOUT_MS at most, for the lines logged so far to be
+ * written out, not only taken by the writer, then logs synchronously: for
+ * the last lines before an exit
+ */
+static void
+logger_flush(void)
+{
+	unsigned long head;
+	int			waited;
+
+	if (!writer_running)
+		return;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	for (waited = 0; waited < LOG_FLUSH_TIMEOUT_MS; waited++)
+	{
+		if ((long) (__atomic_load_n(&ring_written, __ATOMIC_ACQUIRE) - head) >= 0)
+			break;
+		sem_post(&ring_sem);
+		usleep(1000);
+	}
+	writer_running = false;
+}
+
+
+/*
+ * Reopens the log file, e.g. after the configuration was reloaded
+ */
+static void
+logger_reopen(t_configuration_options * opts)
+{
+	log_rotation_bytes = (long) opts->log_rotation_size * 1024;
+	if (*opts->logfile == '\0')
+		return;
+
+	snprintf(log_file, sizeof(log_file), "%s", opts->logfile);
+	open_log_file();
 }
 
 
 static int	detect_log_level(const char *level);
 static int	detect_log_facility(const char *facility);
+static void set_log_format(const char *format);
 
 int			log_type = REPMGR_STDERR;
 int			log_level = LOG_NOTICE;
 
+/* the level asked for on the command line, kept over reloads */
+static int	min_verbose = LOG_EMERG;
+
 bool
 logger_init(t_configuration_options * opts, const char *ident, const char *level, const char *facility)
 {
@@ -129,6 +617,9 @@ logger_init(t_configuration_options * opts, const char *ident, const char *level
 #endif
 	}
 
+	log_node = opts->node;
+	set_log_format(opts->log_format);
+
 #ifdef HAVE_SYSLOG
 
 	if (log_type == REPMGR_SYSLOG)
@@ -151,7 +642,9 @@ logger_init(t_configuration_options * opts, const char *ident, const char *level
 			fprintf(stderr, "error reopening stderr to '%s': %s",
 					opts->logfile, strerror(errno));
 		}
+		snprintf(log_file, sizeof(log_file), "%s", opts->logfile);
 	}
+	log_rotation_bytes = (long) opts->log_rotation_size * 1024;
 
 	return true;
 
@@ -160,6 +653,8 @@ logger_init(t_configuration_options * opts, const char *ident, const char *level
 bool
 logger_shutdown(void)
 {
+	logger_flush();
+
 #ifdef HAVE_SYSLOG
 	if (log_type == REPMGR_SYSLOG)
 		closelog();
@@ -176,10 +671,48 @@ logger_shutdown(void)
 void
 logger_min_verbose(int minimum)
 {
+	min_verbose = minimum;
 	if (log_level < minimum)
 		log_level = minimum;
 }
 
+/*
+ * Applies the logging settings of a reloaded configuration.  The facility
+ * stays: syslog or stderr is chosen once.
+ */
+void
+logger_reload(t_configuration_options * opts)
+{
+	int			l;
+
+	if (*opts->loglevel)
+	{
+		l = detect_log_level(opts->loglevel);
+		if (l > 0)
+			log_level = Max(l, min_verbose);
+		else
+			log_warning(_("Cannot detect log level %s (use any of DEBUG, INFO, NOTICE, WARNING, ERR, ALERT, CRIT or EMERG)\n"), opts->loglevel);
+	}
+#ifdef HAVE_SYSLOG
+	if (log_type == REPMGR_SYSLOG)
+		setlogmask(LOG_UPTO(log_level));
+#endif
+
+	set_log_format(opts->log_format);
+	logger_reopen(opts);
+}
+
+static void
+set_log_format(const char *format)
+{
+	if (*format == '\0' || strcasecmp(format, "TEXT") == 0)
+		log_format = LOG_FORMAT_TEXT;
+	else if (strcasecmp(format, "JSON") == 0)
+		log_format = LOG_FORMAT_JSON;
+	else
+		stderr_log_warning(_("Cannot detect log format %s (use TEXT or JSON)\n"), format);
+}
+
 int
 detect_log_level(const char *level)
 {
@@ -25,6 +25,19 @@
 #define REPMGR_SYSLOG 1
 #define REPMGR_STDERR 2
 
+#define LOG_FORMAT_TEXT 1
+#define LOG_FORMAT_JSON 2
+
+/* lines waiting for the writer thread, and their maximum length */
+#define LOG_RING_SIZE			1024
+#define LOG_LINE_MAX			1024
+/* what the writer thread writes at once, at most */
+#define LOG_BATCH_SIZE			(64 * 1024)
+/* how long an exit waits for the lines logged before it */
+#define LOG_FLUSH_TIMEOUT_MS	1000
+/* how many rotated log files are kept */
+#define LOG_ROTATION_FILES		5
+
 void
 stderr_log_with_level(const char *level_name, int level, const char *fmt,...)
 __attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
@@ -119,6 +132,12 @@ bool logger_init(t_configuration_options * opts, const char *ident,
 			const char *level, const char *facility);
 
 void		logger_min_verbose(int minimum);
+bool		logger_start_async(void);
+void		log_set_peer(int node);
+void		log_set_phase(const char *phase);
+void		log_set_lsn(const char *lsn);
+void		log_set_duration(long long duration_us);
+void		logger_reload(t_configuration_options * opts);
 
 extern int	log_type;
 extern int	log_level;
@@ -0,0 +1,335 @@
+/*
+ * registry.c - The nodes of the cluster, kept in memory by repmgrd
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * record_event() never waits for the network: in repmgrd the event is
+ * queued for a writer thread which inserts it on the master, and repmgr
+ * appends it to a local spool file, then leaves a child process to send
+ * it.  Events that can't be sent, because the master is down or being
+ * replaced, go to the spool too, and are sent in their order by whichever
+ * writer reaches the master next.
+ *
+ * The spool has one event per line.  Appends take an flock() on it; a
+ * writer claims it by renaming it under that lock to a name of its own
+ * ending in its PID, so the events are sent once, and a file left by a
+ * writer that died is claimed again by the next one.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/select.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "repmgr.h"
+#include "dbutils.h"
+#include "log.h"
+#include "registry.h"
+#include "strutil.h"
+
+static char registry_schema[MAXLEN];
+static char registry_cluster[MAXLEN];
+
+/*
+ * The list, shared with the event writer thread.  generation counts the
+ * changes notified, so a list read while one arrives stays stale.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_registry_node *registry = NULL;
+static int	registry_count = 0;
+static bool registry_stale = true;
+static unsigned long registry_generation = 0;
+
+/*
+ * The master connection LISTENing for changes, and its backend.  It is only
+ * compared with the connection passed to registry_wait(), never used on its
+ * own, as it may have been closed since.  NULL while changes aren't
+ * notified: the node list is then read again at each use.
+ */
+static PGconn *listen_conn = NULL;
+static int	listen_pid = 0;
+static bool listen_wanted = false;
+static bool trigger_warned = false;
+
+static bool registry_load(PGconn *conn);
+
+
+void
+registry_init(const char *schema, const char *cluster)
+{
+	xsnprintf(registry_schema, sizeof(registry_schema), "%s", schema);
+	xsnprintf(registry_cluster, sizeof(registry_cluster), "%s", cluster);
+}
+
+
+/*
+ * Reads the nodes of the cluster from conn, ordered by priority.  The
+ * previous list is kept if that fails.
+ */
+static bool
+registry_load(PGconn *conn)
+{
+	PGresult   *res;
+	t_stmt_params params;
+	t_registry_node *nodes;
+	unsigned long generation;
+	int			count;
+	int			i;
+
+	pthread_mutex_lock(&registry_lock);
+	generation = registry_generation;
+	pthread_mutex_unlock(&registry_lock);
+
+	stmt_params_init(&params);
+	stmt_param_text(&params, registry_cluster);
+	res = exec_statement(conn, STMT_NODE_LIST, &params);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_warning(_("Can't get the nodes of cluster '%s': %s"),
+					registry_cluster, PQerrorMessage(conn));
+		PQclear(res);
+		return false;
+	}
+
+	count = PQntuples(res);
+	nodes = malloc(Max(count, 1) * sizeof(t_registry_node));
+	if (nodes == NULL)
+	{
+		log_err(_("Can't allocate the nodes' info\n"));
+		PQclear(res);
+		return false;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		nodes[i].node_id = atoi(PQgetvalue(res, i, 0));
+		xsnprintf(nodes[i].name, sizeof(nodes[i].name), "%s",
+				  PQgetvalue(res, i, 1));
+		xsnprintf(nodes[i].conninfo, sizeof(nodes[i].conninfo), "%s",
+				  PQgetvalue(res, i, 2));
+		nodes[i].priority = atoi(PQgetvalue(res, i, 3));
+		nodes[i].is_witness = (strcmp(PQgetvalue(res, i, 4), "t") == 0);
+	}
+	PQclear(res);
+
+	pthread_mutex_lock(&registry_lock);
+	free(registry);
+	registry = nodes;
+	registry_count = count;
+	registry_stale = (generation != registry_generation);
+	pthread_mutex_unlock(&registry_lock);
+
+	log_debug(_("%d nodes registered in cluster '%s'\n"), count,
+			  registry_cluster);
+	return true;
+}
+
+
+/*
+ * From now on, keeps the node list in memory and reloads it only when the
+ * trigger on repl_nodes notifies a change on conn, which must be the
+ * master.  Without the trigger, in a schema created by an older repmgr,
+ * the list keeps being read at each use.
+ */
+bool
+registry_listen(PGconn *conn)
+{
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	bool		has_trigger;
+
+	pthread_mutex_lock(&registry_lock);
+	listen_conn = NULL;
+	pthread_mutex_unlock(&registry_lock);
+	registry_invalidate();
+
+	sqlquery_snprintf(sqlquery, "SELECT 1 FROM pg_catalog.pg_trigger "
+					  " WHERE tgrelid = '%s.repl_nodes'::regclass "
+					  "   AND tgname = 'repl_nodes_notify'",
+					  registry_schema);
+	res = PQexec(conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_warning(_("Can't check the triggers of %s.repl_nodes: %s"),
+					registry_schema, PQerrorMessage(conn));
+		PQclear(res);
+		return false;
+	}
+	has_trigger = (PQntuples(res) > 0);
+	PQclear(res);
+
+	if (!has_trigger)
+	{
+		if (!trigger_warned)
+		{
+			log_warning(_("%s.repl_nodes has no repl_nodes_notify trigger, the node list will be read at each use\n"),
+						registry_schema);
+			trigger_warned = true;
+		}
+		listen_wanted = false;
+		return false;
+	}
+	listen_wanted = true;
+
+	res = PQexec(conn, "LISTEN " REGISTRY_CHANNEL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		log_warning(_("Can't listen for changes of the node list: %s"),
+					PQerrorMessage(conn));
+		PQclear(res);
+		return false;
+	}
+	PQclear(res);
+
+	pthread_mutex_lock(&registry_lock);
+	listen_conn = conn;
+	listen_pid = PQbackendPID(conn);
+	pthread_mutex_unlock(&registry_lock);
+
+	/* read after LISTEN, so that no change in between is missed */
+	registry_load(conn);
+	return true;
+}
+
+
+/*
+ * Sleeps timeout_secs like sleep(), but reloads the node list from conn as
+ * soon as a change is notified on it.  A connection reset since the LISTEN
+ * may have missed changes, so it listens again and reloads.
+ */
+void
+registry_wait(PGconn *conn, int timeout_secs)
+{
+	struct timeval deadline,
+				now,
+				tmout;
+	long long	remaining;
+	fd_set		read_set;
+	PGnotify   *notify;
+	bool		stale;
+	int			sock;
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += timeout_secs;
+
+	if (listen_wanted && conn != NULL && PQstatus(conn) == CONNECTION_OK &&
+		(conn != listen_conn || PQbackendPID(conn) != listen_pid))
+		registry_listen(conn);
+
+	for (;;)
+	{
+		sock = -1;
+		if (conn != NULL && conn == listen_conn && PQconsumeInput(conn))
+		{
+			while ((notify = PQnotifies(conn)) != NULL)
+			{
+				log_debug(_("change of the node list notified by %s\n"),
+						  notify->extra);
+				registry_invalidate();
+				PQfreemem(notify);
+			}
+
+			pthread_mutex_lock(&registry_lock);
+			stale = registry_stale;
+			pthread_mutex_unlock(&registry_lock);
+
+			/* not while a query sent earlier still runs */
+			if (stale && !PQisBusy(conn))
+			{
+				log_info(_("reloading the node list\n"));
+				registry_load(conn);
+			}
+			sock = PQsocket(conn);
+		}
+
+		gettimeofday(&now, NULL);
+		remaining = (deadline.tv_sec - now.tv_sec) * 1000000LL +
+			(deadline.tv_usec - now.tv_usec);
+		if (remaining <= 0)
+			return;
+
+		tmout.tv_sec = remaining / 1000000;
+		tmout.tv_usec = remaining % 1000000;
+		FD_ZERO(&read_set);
+		if (sock >= 0)
+			FD_SET(sock, &read_set);
+
+		/* a signal, SIGHUP included, ends the wait like it ends sleep() */
+		if (select(sock + 1, &read_set, NULL, NULL, &tmout) < 0)
+		{
+			if (errno != EINTR)
+				log_warning(_("registry_wait: select() returned with error: %s\n"),
+							strerror(errno));
+			return;
+		}
+	}
+}
+
+
+/*
+ * Points *nodes to a copy of the nodes of the cluster, ordered by priority,
+ * which the caller frees.  The list in memory is used while no change was
+ * notified; otherwise it is read from conn.  Returns the number of nodes,
+ * or -1 if it can't be read and there is no earlier list to fall back to.
+ */
+int
+registry_nodes(PGconn *conn, t_registry_node **nodes)
+{
+	bool		reload;
+	bool		failed = false;
+	int			count;
+
+	pthread_mutex_lock(&registry_lock);
+	reload = (registry_stale || listen_conn == NULL);
+	pthread_mutex_unlock(&registry_lock);
+
+	if (reload)
+		failed = !registry_load(conn);
+
+	pthread_mutex_lock(&registry_lock);
+	if (registry == NULL)
+	{
+		pthread_mutex_unlock(&registry_lock);
+		return -1;
+	}
+	if (failed)
+		log_warning(_("using the last known list of nodes\n"));
+	count = registry_count;
+	*nodes = malloc(Max(count, 1) * sizeof(t_registry_node));
+	if (*nodes == NULL)
+	{
+		pthread_mutex_unlock(&registry_lock);
+		log_err(_("Can't allocate the nodes' info\n"));
+		return -1;
+	}
+	memcpy(*nodes, registry, count * sizeof(t_registry_node));
+	pthread_mutex_unlock(&registry_lock);
+
+	return count;
+}
+
+
+/* makes the next registry_nodes() read the list again */
+void
+registry_invalidate(void)
+{
+	pthread_mutex_lock(&registry_lock);
+	registry_stale = true;
+	registry_generation++;
+	pthread_mutex_unlock(&registry_lock);
+}
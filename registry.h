@@ -0,0 +1,43 @@
+/*
+ * registry.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_REGISTRY_H_
+#define _REPMGR_REGISTRY_H_
+
+#include "repmgr.h"
+
+/* the channel the trigger on repl_nodes notifies */
+#define REGISTRY_CHANNEL		"repmgr_nodes"
+
+typedef struct
+{
+	int			node_id;
+	char		name[MAXLEN];
+	char		conninfo[MAXCONNINFO];
+	int			priority;
+	bool		is_witness;
+} t_registry_node;
+
+void		registry_init(const char *schema, const char *cluster);
+bool		registry_listen(PGconn *conn);
+void		registry_wait(PGconn *conn, int timeout_secs);
+int			registry_nodes(PGconn *conn, t_registry_node **nodes);
+void		registry_invalidate(void);
+
+#endif
@@ -8,8 +8,10 @@
  * Commands implemented are.
  * MASTER REGISTER
  * STANDBY REGISTER, STANDBY CLONE, STANDBY FOLLOW, STANDBY PROMOTE
+ * STANDBY SWITCHOVER
  * CLUSTER SHOW, CLUSTER CLEANUP
  * WITNESS CREATE
+ * NODE REJOIN
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -28,21 +30,70 @@
 
 #include "repmgr.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "config.h"
+#include "arbiter.h"
 #include "check_dir.h"
+#include "datasync.h"
+#include "events.h"
+#include "localcopy.h"
+#include "registry.h"
 #include "strutil.h"
 #include "version.h"
 
 #define RECOVERY_FILE "recovery.conf"
 #define RECOVERY_DONE_FILE "recovery.done"
 
+/* seconds STANDBY PROMOTE waits for the server to leave recovery */
+#define PROMOTE_TIMEOUT		60
+
+/*
+ * STANDBY SWITCHOVER waits this many seconds at most for the standby to
+ * replay the master's WAL, checking every SWITCHOVER_POLL_MS.  Once the old
+ * master is stopped, its last WAL is considered received when the standby's
+ * position stayed the same for SWITCHOVER_SETTLE_MS.  Writes are paused
+ * once the master applied the read-only setting, within
+ * SWITCHOVER_PAUSE_TIMEOUT seconds.
+ */
+#define SWITCHOVER_TIMEOUT		60
+#define SWITCHOVER_POLL_MS		100
+#define SWITCHOVER_SETTLE_MS	500
+#define SWITCHOVER_PAUSE_TIMEOUT	5
+#define CLONE_MANIFEST_FILE "repmgr_clone.manifest"
+#define BUFFER_SNAPSHOT_FILE "repmgr_buffers.snapshot"
+
+/*
+ * The clone manifest is flushed to disk after this many file entries or
+ * this many seconds, whichever comes first
+ */
+#define CLONE_MANIFEST_SYNC_FILES	1000
+#define CLONE_MANIFEST_SYNC_SECS	5
+
+/*
+ * When choosing a standby to clone from, replication lag is compared in
+ * units of this many bytes (one WAL segment), so that the number of active
+ * sessions decides between standbys which are about as close to the master
+ */
+#define CLONE_SOURCE_LAG_UNIT		(16 * 1024 * 1024)
+
+/*
+ * How often the master's latency is sampled while an adaptive clone copies
+ * data, and how much weight each new sample gets in the moving average
+ */
+#define CLONE_THROTTLE_INTERVAL_MS	1000
+#define CLONE_THROTTLE_WEIGHT		0.3
+
 #define NO_ACTION		 0		/* Not a real action, just to initialize */
 #define MASTER_REGISTER  1
 #define STANDBY_REGISTER 2
@@ -52,24 +103,98 @@
 #define WITNESS_CREATE	 6
 #define CLUSTER_SHOW	 7
 #define CLUSTER_CLEANUP  8
+#define NODE_REJOIN		 9
+#define STANDBY_SWITCHOVER 10
+
+/* Long-only command line options */
+#define OPT_RESUME		 1
+#define OPT_FROM_STANDBY 2
+#define OPT_MAX_RATE	 3
+#define OPT_MAX_LATENCY  4
+#define OPT_VERIFY		 5
+#define OPT_REMOTE_CONFIG 6
+
+/*
+ * State of an in-progress STANDBY CLONE, as recorded in the manifest file
+ * kept in the target data directory
+ */
+typedef struct
+{
+	FILE	   *fp;
+	char		path[MAXFILENAME];
+	int			unsynced_entries;
+	time_t		last_sync;
+	long		files;
+	long long	bytes;
+}	t_clone_manifest;
+
+/*
+ * Throttling of the STANDBY CLONE copy.  The master connection is the one
+ * holding the backup open; it's only set while files are being copied.
+ */
+typedef struct
+{
+	PGconn	   *conn;
+	double		latency;		/* moving average, in milliseconds */
+	bool		paused;
+	long		pauses;
+	double		paused_secs;
+}	t_clone_throttle;
 
 static bool create_recovery_file(const char *data_dir);
 static int	test_ssh_connection(char *host, char *remote_user);
 static int copy_remote_files(char *host, char *remote_user, char *remote_path,
 				  char *local_path, bool is_directory);
+static int copy_local_files(char *src_path, char *dst_path, bool is_directory);
 static bool check_parameters_for_action(const int action);
 static bool create_schema(PGconn *conn);
 static bool copy_configuration(PGconn *masterconn, PGconn *witnessconn);
 static void write_primary_conninfo(char *line);
-
-static void do_master_register(void);
-static void do_standby_register(void);
-static void do_standby_clone(void);
-static void do_standby_promote(void);
-static void do_standby_follow(void);
-static void do_witness_create(void);
-static void do_cluster_show(void);
-static void do_cluster_cleanup(void);
+static void build_primary_conninfo(char *conn_buf);
+static bool set_primary_conninfo(PGconn *conn);
+static int	get_wal_receiver_pid(PGconn *conn);
+static bool wait_for_streaming(PGconn *conn, int old_receiver_pid);
+
+static bool clone_manifest_load(const char *data_dir, const char *source_host,
+					const char *source_dir);
+static bool clone_manifest_open(const char *data_dir, const char *source_host,
+					const char *source_dir, const char *backup_label);
+static void clone_manifest_add_file(long long bytes, const char *name);
+static void clone_manifest_sync(bool force);
+static void clone_manifest_close(bool remove_file);
+static double clone_throttle_probe(void);
+static bool clone_throttle_check(pid_t rsync_group);
+static int	run_rsync(const char *script);
+static void handle_rsync_line(char *line);
+static PGconn *choose_clone_source(PGconn *master_conn);
+static bool get_conn_host_port(PGconn *conn, const char *conninfo,
+				   char *host, char *port);
+static bool get_controldata_value(const char *data_dir, const char *name,
+					  char *value);
+static int	remote_command(const char *host, const char *command);
+static bool wait_for_replay(PGconn *conn, unsigned long long int target);
+static bool wait_for_last_wal(PGconn *conn);
+static bool set_master_read_only(PGconn *master_conn, bool read_only);
+static void restore_old_master(const char *master_host,
+				   const char *master_data_dir,
+				   const char *master_conninfo, bool can_pause);
+static long elapsed_ms(struct timeval * since);
+static void record_action_event(void);
+static void pg_basebackup_bin(char *path);
+static int	pg_basebackup_version(void);
+static int	run_basebackup(const char *host, const char *port,
+			   const char *data_dir);
+
+static int	do_master_register(void);
+static int	do_standby_register(void);
+static int	do_standby_clone(void);
+static int	do_standby_promote(void);
+static int	do_standby_follow(void);
+static int	do_witness_create(void);
+static int	do_cluster_show(void);
+static int	do_cluster_cleanup(void);
+static int	do_node_rejoin(void);
+static int	do_standby_switchover(void);
 
 static void usage(void);
 static void help(const char *progname);
@@ -91,6 +216,17 @@ t_configuration_options options = T_CONFIGURATION_OPTIONS_INITIALIZER;
 static char *server_mode = NULL;
 static char *server_cmd = NULL;
 
+static t_clone_manifest clone_manifest;
+static t_clone_throttle clone_throttle;
+
+/* set when STANDBY CLONE copies a master running on this host */
+static bool clone_local = false;
+
+/* the action, as recorded in repl_events when repmgr exits */
+static char action_event[MAXLEN];
+static struct timeval action_start;
+static int	action_status = -1;	/* exit status of the action, once done */
+
 int
 main(int argc, char **argv)
 {
@@ -111,6 +247,13 @@ main(int argc, char **argv)
 		{"ignore-rsync-warning", no_argument, NULL, 'I'},
 		{"min-recovery-apply-delay", required_argument, NULL, 'r'},
 		{"verbose", no_argument, NULL, 'v'},
+		{"resume", no_argument, NULL, OPT_RESUME},
+		{"from-standby", no_argument, NULL, OPT_FROM_STANDBY},
+		{"max-rate", required_argument, NULL, OPT_MAX_RATE},
+		{"max-latency", required_argument, NULL, OPT_MAX_LATENCY},
+		{"jobs", required_argument, NULL, 'j'},
+		{"verify", no_argument, NULL, OPT_VERIFY},
+		{"remote-config-file", required_argument, NULL, OPT_REMOTE_CONFIG},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -136,7 +279,7 @@ main(int argc, char **argv)
 	}
 
 
-	while ((c = getopt_long(argc, argv, "d:h:p:U:D:l:f:R:w:k:FWIvr:", long_options,
+	while ((c = getopt_long(argc, argv, "d:h:p:U:D:l:f:R:w:k:FWIvr:j:", long_options,
 							&optindex)) != -1)
 	{
 		switch (c)
@@ -208,6 +351,50 @@ main(int argc, char **argv)
 			case 'v':
 				runtime_options.verbose = true;
 				break;
+			case 'j':
+				if (atoi(optarg) > 0)
+					runtime_options.jobs = atoi(optarg);
+				else
+				{
+					log_err(_("--jobs must be a positive number\n"));
+					usage();
+					exit(ERR_BAD_CONFIG);
+				}
+				break;
+			case OPT_RESUME:
+				runtime_options.resume = true;
+				break;
+			case OPT_FROM_STANDBY:
+				runtime_options.from_standby = true;
+				break;
+			case OPT_VERIFY:
+				runtime_options.verify = true;
+				break;
+			case OPT_REMOTE_CONFIG:
+				snprintf(runtime_options.remote_config_file,
+						 sizeof(runtime_options.remote_config_file), "%s",
+						 optarg);
+				break;
+			case OPT_MAX_RATE:
+				if (atoi(optarg) > 0)
+					runtime_options.max_rate = atoi(optarg);
+				else
+				{
+					log_err(_("--max-rate must be a positive number of kilobytes per second\n"));
+					usage();
+					exit(ERR_BAD_CONFIG);
+				}
+				break;
+			case OPT_MAX_LATENCY:
+				if (atoi(optarg) > 0)
+					runtime_options.max_latency = atoi(optarg);
+				else
+				{
+					log_err(_("--max-latency must be a positive number of milliseconds\n"));
+					usage();
+					exit(ERR_BAD_CONFIG);
+				}
+				break;
 			default:
 				usage();
 				exit(ERR_BAD_CONFIG);
@@ -217,7 +404,8 @@ main(int argc, char **argv)
 	/*
 	 * Now we need to obtain the action, this comes in one of these forms:
 	 * MASTER REGISTER | STANDBY {REGISTER | CLONE [node] | PROMOTE | FOLLOW
-	 * [node]} | WITNESS CREATE CLUSTER {SHOW | CLEANUP}
+	 * [node] | SWITCHOVER} | WITNESS CREATE | CLUSTER {SHOW | CLEANUP} | NODE REJOIN
+	 * [node]
 	 *
 	 * the node part is optional, if we receive it then we shouldn't have
 	 * received a -h option
@@ -228,7 +416,8 @@ main(int argc, char **argv)
 		if (strcasecmp(server_mode, "STANDBY") != 0 &&
 			strcasecmp(server_mode, "MASTER") != 0 &&
 			strcasecmp(server_mode, "WITNESS") != 0 &&
-			strcasecmp(server_mode, "CLUSTER") != 0)
+			strcasecmp(server_mode, "CLUSTER") != 0 &&
+			strcasecmp(server_mode, "NODE") != 0)
 		{
 			usage();
 			exit(ERR_BAD_CONFIG);
@@ -254,6 +443,8 @@ main(int argc, char **argv)
 				action = STANDBY_PROMOTE;
 			else if (strcasecmp(server_cmd, "FOLLOW") == 0)
 				action = STANDBY_FOLLOW;
+			else if (strcasecmp(server_cmd, "SWITCHOVER") == 0)
+				action = STANDBY_SWITCHOVER;
 		}
 		else if (strcasecmp(server_mode, "CLUSTER") == 0)
 		{
@@ -263,8 +454,15 @@ main(int argc, char **argv)
 				action = CLUSTER_CLEANUP;
 		}
 		else if (strcasecmp(server_mode, "WITNESS") == 0)
+		{
 			if (strcasecmp(server_cmd, "CREATE") == 0)
 				action = WITNESS_CREATE;
+		}
+		else if (strcasecmp(server_mode, "NODE") == 0)
+		{
+			if (strcasecmp(server_cmd, "REJOIN") == 0)
+				action = NODE_REJOIN;
+		}
 	}
 
 	if (action == NO_ACTION)
@@ -274,7 +472,7 @@ main(int argc, char **argv)
 	}
 
 	/* For some actions we still can receive a last argument */
-	if (action == STANDBY_CLONE)
+	if (action == STANDBY_CLONE || action == NODE_REJOIN)
 	{
 		if (optind < argc)
 		{
@@ -360,32 +558,56 @@ main(int argc, char **argv)
 	/* Prepare the repmgr schema variable */
 	maxlen_snprintf(repmgr_schema, "%s%s", DEFAULT_REPMGR_SCHEMA_PREFIX,
 			 options.cluster_name);
+	statements_init(repmgr_schema);
+	registry_init(repmgr_schema, options.cluster_name);
+
+	/*
+	 * Every action but CLUSTER SHOW is recorded in repl_events, with its
+	 * outcome, also when it fails and exits
+	 */
+	if (action != CLUSTER_SHOW)
+	{
+		char	   *p;
+
+		maxlen_snprintf(action_event, "%s_%s", server_mode, server_cmd);
+		for (p = action_event; *p; p++)
+			*p = tolower((unsigned char) *p);
+		events_init(&options);
+		gettimeofday(&action_start, NULL);
+		atexit(record_action_event);
+	}
 
 	switch (action)
 	{
 		case MASTER_REGISTER:
-			do_master_register();
+			action_status = do_master_register();
 			break;
 		case STANDBY_REGISTER:
-			do_standby_register();
+			action_status = do_standby_register();
 			break;
 		case STANDBY_CLONE:
-			do_standby_clone();
+			action_status = do_standby_clone();
 			break;
 		case STANDBY_PROMOTE:
-			do_standby_promote();
+			action_status = do_standby_promote();
 			break;
 		case STANDBY_FOLLOW:
-			do_standby_follow();
+			action_status = do_standby_follow();
 			break;
 		case WITNESS_CREATE:
-			do_witness_create();
+			action_status = do_witness_create();
 			break;
 		case CLUSTER_SHOW:
-			do_cluster_show();
+			action_status = do_cluster_show();
 			break;
 		case CLUSTER_CLEANUP:
-			do_cluster_cleanup();
+			action_status = do_cluster_cleanup();
+			break;
+		case NODE_REJOIN:
+			action_status = do_node_rejoin();
+			break;
+		case STANDBY_SWITCHOVER:
+			action_status = do_standby_switchover();
 			break;
 		default:
 			usage();
@@ -393,43 +615,48 @@ main(int argc, char **argv)
 	}
 	logger_shutdown();
 
-	return 0;
+	return action_status;
 }
 
-static void
+static int
 do_cluster_show(void)
 {
 	PGconn	   *conn;
-	PGresult   *res;
-	char		sqlquery[QUERY_STR_LEN];
+	t_registry_node *nodes;
 	char		node_role[MAXLEN];
+	int			total_nodes;
 	int			i;
 
 	/* We need to connect to check configuration */
 	log_info(_("%s connecting to database\n"), progname);
 	conn = establish_db_connection(options.conninfo, true);
 
-	sqlquery_snprintf(sqlquery, "SELECT conninfo, witness FROM %s.repl_nodes;",
-					  repmgr_schema);
-	res = PQexec(conn, sqlquery);
-
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	total_nodes = registry_nodes(conn, &nodes);
+	if (total_nodes < 0)
 	{
 		log_err(_("Can't get nodes information, have you registered them?\n%s\n"),
 				PQerrorMessage(conn));
-		PQclear(res);
 		PQfinish(conn);
 		exit(ERR_BAD_CONFIG);
 	}
 	PQfinish(conn);
 
 	printf("Role      | Connection String \n");
-	for (i = 0; i < PQntuples(res); i++)
+	for (i = 0; i < total_nodes; i++)
 	{
-		conn = establish_db_connection(PQgetvalue(res, i, 0), false);
+		if (is_arbiter_conninfo(nodes[i].conninfo, NULL, NULL))
+		{
+			printf("%-10s", arbiter_request(nodes[i].conninfo, "PING",
+											node_role, sizeof(node_role)) ?
+				   "  arbiter" : "  FAILED");
+			printf("| %s\n", nodes[i].conninfo);
+			continue;
+		}
+
+		conn = establish_db_connection(nodes[i].conninfo, false);
 		if (PQstatus(conn) != CONNECTION_OK)
 			strcpy(node_role, "  FAILED");
-		else if (strcmp(PQgetvalue(res, i, 1), "t") == 0)
+		else if (nodes[i].is_witness)
 			strcpy(node_role, "  witness");
 		else if (is_standby(conn))
 			strcpy(node_role, "  standby");
@@ -437,15 +664,16 @@ do_cluster_show(void)
 			strcpy(node_role, "* master");
 
 		printf("%-10s", node_role);
-		printf("| %s\n", PQgetvalue(res, i, 0));
+		printf("| %s\n", nodes[i].conninfo);
 
 		PQfinish(conn);
 	}
 
-	PQclear(res);
+	free(nodes);
+	return SUCCESS;
 }
 
-static void
+static int
 do_cluster_cleanup(void)
 {
 	int			master_id;
@@ -460,8 +688,7 @@ do_cluster_cleanup(void)
 
 	/* check if there is a master in this cluster */
 	log_info(_("%s connecting to master database\n"), progname);
-	master_conn = get_master_connection(conn, repmgr_schema, options.cluster_name,
-										&master_id, NULL);
+	master_conn = get_master_connection(conn, &master_id, NULL);
 	if (!master_conn)
 	{
 		log_err(_("cluster cleanup: cannot connect to master\n"));
@@ -503,10 +730,11 @@ do_cluster_cleanup(void)
 
 	PQclear(res);
 	PQfinish(master_conn);
+	return SUCCESS;
 }
 
 
-static void
+static int
 do_master_register(void)
 {
 	PGconn	   *conn;
@@ -530,7 +758,7 @@ do_master_register(void)
 		if (ret_ver != NULL)
 			log_err(_("%s needs master to be PostgreSQL 9.0 or better\n"),
 					progname);
-		return;
+		return ERR_BAD_CONFIG;
 	}
 
 	/* Check we are a master */
@@ -593,7 +821,7 @@ do_master_register(void)
 
 		/* ok, create the schema */
 		if (!create_schema(conn))
-			return;
+			return ERR_DB_QUERY;
 	}
 	else
 	{
@@ -619,8 +847,7 @@ do_master_register(void)
 		}
 
 		/* Ensure there isn't any other master already registered */
-		master_conn = get_master_connection(conn, repmgr_schema,
-											options.cluster_name, &id, NULL);
+		master_conn = get_master_connection(conn, &id, NULL);
 		if (master_conn != NULL)
 		{
 			PQfinish(master_conn);
@@ -651,11 +878,11 @@ do_master_register(void)
 	PQfinish(conn);
 	log_notice(_("Master node correctly registered for cluster %s with id %d (conninfo: %s)\n"),
 			   options.cluster_name, options.node, options.conninfo);
-	return;
+	return SUCCESS;
 }
 
 
-static void
+static int
 do_standby_register(void)
 {
 	PGconn	   *conn;
@@ -738,8 +965,7 @@ do_standby_register(void)
 
 	/* check if there is a master in this cluster */
 	log_info(_("%s connecting to master database\n"), progname);
-	master_conn = get_master_connection(conn, repmgr_schema, options.cluster_name,
-										&master_id, NULL);
+	master_conn = get_master_connection(conn, &master_id, NULL);
 	if (!master_conn)
 	{
 		log_err(_("A master must be defined before configuring a slave\n"));
@@ -812,14 +1038,15 @@ do_standby_register(void)
 	PQfinish(conn);
 	log_notice(_("Standby node correctly registered for cluster %s with id %d (conninfo: %s)\n"),
 			   options.cluster_name, options.node, options.conninfo);
-	return;
+	return SUCCESS;
 }
 
 
-static void
+static int
 do_standby_clone(void)
 {
 	PGconn	   *conn;
+	PGconn	   *master_conn = NULL;
 	PGresult   *res;
 	char		sqlquery[QUERY_STR_LEN],
 			   *ret;
@@ -829,8 +1056,15 @@ do_standby_clone(void)
 				retval = SUCCESS;
 	int			i,
 				is_standby_retval;
+	int			master_id;
+	int			tablespace_count;
 	bool		flag_success = false;
 	bool		test_mode = false;
+	bool		from_standby = false;
+
+	char		upstream_host[MAXLEN];
+	char		upstream_port[MAXLEN];
+	char		upstream_conninfo[MAXCONNINFO];
 
 	char		tblspc_dir[MAXFILENAME];
 
@@ -854,6 +1088,11 @@ do_standby_clone(void)
 	const char *last_wal_segment = NULL;
 
 	char		master_version[MAXVERSIONSTR];
+	char		backup_label[MAXLEN];
+
+	uint64		backup_lsn = 0;
+	bool		verify = runtime_options.verify;
+	t_data_sync_stats sync_stats;
 
 	/*
 	 * if dest_dir has been provided, we copy everything in the same path if
@@ -890,57 +1129,182 @@ do_standby_clone(void)
 		exit(ERR_BAD_CONFIG);
 	}
 
-	/* Check we are cloning a primary node */
+	/*
+	 * The new standby will follow the node given on the command line, unless
+	 * that is a standby itself and the master can be found
+	 */
+	snprintf(upstream_host, sizeof(upstream_host), "%s", runtime_options.host);
+	snprintf(upstream_port, sizeof(upstream_port), "%s",
+			 runtime_options.masterport);
+
 	is_standby_retval = is_standby(conn);
-	if (is_standby_retval)
+	if (is_standby_retval == -1)
 	{
-		log_err(_(is_standby_retval == 1 ? "The command should clone a primary node\n" :
-				  "Connection to node lost!\n"));
-
+		log_err(_("Connection to node lost!\n"));
 		PQfinish(conn);
 		exit(ERR_BAD_CONFIG);
 	}
 
-	/* And check if it is well configured */
-	i = guc_set(conn, "wal_level", "=", "hot_standby");
-	if (i == 0 || i == -1)
+	/*
+	 * With --from-standby, the copy is read from the best registered standby
+	 * instead, so that the clone does not load the master
+	 */
+	if (is_standby_retval == 0 && runtime_options.from_standby)
 	{
-		PQfinish(conn);
-		if (i == 0)
-			log_err(_("%s needs parameter 'wal_level' to be set to 'hot_standby'\n"),
+		master_conn = conn;
+		conn = choose_clone_source(master_conn);
+		PQfinish(master_conn);
+		master_conn = NULL;
+
+		if (conn == NULL)
+		{
+			log_err(_("%s: no registered standby can be used as the clone source\n"),
 					progname);
-		exit(ERR_BAD_CONFIG);
-	}
+			exit(ERR_BAD_CONFIG);
+		}
 
-	i = guc_set_typed(conn, "wal_keep_segments", ">=",
-					  runtime_options.wal_keep_segments, "integer");
-	if (i == 0 || i == -1)
+		if (!get_conn_host_port(conn, NULL, runtime_options.host,
+								runtime_options.masterport))
+		{
+			log_err(_("%s: can't determine the host of the clone source\n"),
+					progname);
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+		is_standby_retval = 1;
+	}
+	else if (is_standby_retval == 1 && options.cluster_name[0])
 	{
-		PQfinish(conn);
-		if (i == 0)
-			log_err(_("%s needs parameter 'wal_keep_segments' to be set to %s or greater (see the '-w' option or edit the postgresql.conf of the PostgreSQL master.)\n"),
-					progname, runtime_options.wal_keep_segments);
-		exit(ERR_BAD_CONFIG);
+		master_conn = get_master_connection(conn, &master_id,
+											upstream_conninfo);
+		if (master_conn != NULL)
+		{
+			/* unknown: follow the node given on the command line */
+			if (!get_conn_host_port(master_conn, upstream_conninfo,
+									upstream_host, upstream_port))
+			{
+				snprintf(upstream_host, sizeof(upstream_host), "%s",
+						 runtime_options.host);
+				snprintf(upstream_port, sizeof(upstream_port), "%s",
+						 runtime_options.masterport);
+			}
+			PQfinish(master_conn);
+			master_conn = NULL;
+		}
 	}
 
-	i = guc_set(conn, "archive_mode", "=", "on");
-	if (i == 0 || i == -1)
+	if (is_standby_retval == 1)
 	{
-		PQfinish(conn);
-		if (i == 0)
-			log_err(_("%s needs parameter 'archive_mode' to be set to 'on'\n"),
+		/*
+		 * A standby can't run pg_start_backup(), its data directory is copied
+		 * with pg_basebackup, which needs 9.2 or better
+		 */
+		if (strcmp(master_version, "9.0") == 0 ||
+			strcmp(master_version, "9.1") == 0)
+		{
+			log_err(_("%s needs PostgreSQL 9.2 or better to clone a standby\n"),
 					progname);
-		exit(ERR_BAD_CONFIG);
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		if (runtime_options.resume)
+		{
+			log_err(_("%s: a clone from a standby can't be resumed\n"),
+					progname);
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		/* the copy is done by the local pg_basebackup */
+		if (runtime_options.max_rate > 0 && pg_basebackup_version() < 90400)
+		{
+			log_err(_("%s: --max-rate needs pg_basebackup 9.4 or better to clone a standby\n"),
+					progname);
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		from_standby = true;
+		if (strcmp(upstream_host, runtime_options.host) == 0 &&
+			strcmp(upstream_port, runtime_options.masterport) == 0)
+			log_notice(_("%s: master not found, the new standby will be cascaded from %s\n"),
+					   progname, runtime_options.host);
+		log_notice(_("%s: cloning standby %s:%s\n"), progname,
+				   runtime_options.host, runtime_options.masterport);
 	}
 
-	i = guc_set(conn, "hot_standby", "=", "on");
-	if (i == 0 || i == -1)
+	/*
+	 * Page checksums are verified against the start of a backup taken with
+	 * pg_start_backup(), and only exist since 9.3 when initdb enabled them
+	 */
+	if (verify && from_standby)
 	{
-		PQfinish(conn);
-		if (i == 0)
-			log_err(_("%s needs parameter 'hot_standby' to be set to 'on'\n"),
+		log_warning(_("%s: --verify is not supported when cloning from a standby\n"),
 					progname);
-		exit(ERR_BAD_CONFIG);
+		verify = false;
+	}
+	else if (verify && (strcmp(master_version, "9.0") == 0 ||
+						strcmp(master_version, "9.1") == 0 ||
+						strcmp(master_version, "9.2") == 0))
+	{
+		log_warning(_("%s: --verify needs PostgreSQL 9.3 or better, the clone won't be verified\n"),
+					progname);
+		verify = false;
+	}
+	else if (verify && guc_set(conn, "data_checksums", "=", "on") != 1)
+	{
+		log_warning(_("%s: the master doesn't use data checksums, the clone won't be verified\n"),
+					progname);
+		verify = false;
+	}
+
+	/*
+	 * And check if it is well configured.  This is about the master, the
+	 * settings of a standby are not relevant.
+	 */
+	if (!from_standby)
+	{
+		i = guc_set(conn, "wal_level", "=", "hot_standby");
+		if (i == 0 || i == -1)
+		{
+			PQfinish(conn);
+			if (i == 0)
+				log_err(_("%s needs parameter 'wal_level' to be set to 'hot_standby'\n"),
+						progname);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		i = guc_set_typed(conn, "wal_keep_segments", ">=",
+						  runtime_options.wal_keep_segments, "integer");
+		if (i == 0 || i == -1)
+		{
+			PQfinish(conn);
+			if (i == 0)
+				log_err(_("%s needs parameter 'wal_keep_segments' to be set to %s or greater (see the '-w' option or edit the postgresql.conf of the PostgreSQL master.)\n"),
+						progname, runtime_options.wal_keep_segments);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		i = guc_set(conn, "archive_mode", "=", "on");
+		if (i == 0 || i == -1)
+		{
+			PQfinish(conn);
+			if (i == 0)
+				log_err(_("%s needs parameter 'archive_mode' to be set to 'on'\n"),
+						progname);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		i = guc_set(conn, "hot_standby", "=", "on");
+		if (i == 0 || i == -1)
+		{
+			PQfinish(conn);
+			if (i == 0)
+				log_err(_("%s needs parameter 'hot_standby' to be set to 'on'\n"),
+						progname);
+			exit(ERR_BAD_CONFIG);
+		}
 	}
 
 	/*
@@ -968,6 +1332,7 @@ do_standby_clone(void)
 		PQfinish(conn);
 		exit(ERR_BAD_CONFIG);
 	}
+	tablespace_count = PQntuples(res);
 	for (i = 0; i < PQntuples(res); i++)
 	{
 		if (test_mode)
@@ -980,6 +1345,13 @@ do_standby_clone(void)
 
 		strncpy(tblspc_dir, PQgetvalue(res, i, 0), MAXFILENAME);
 
+		/*
+		 * When resuming, the tablespace directory is expected to hold the
+		 * files copied by the interrupted run
+		 */
+		if (runtime_options.resume && check_dir(tblspc_dir) == 2)
+			continue;
+
 		/*
 		 * Check this directory could be used for tablespace this will create
 		 * the directory a bit too early XXX build an array of tablespace to
@@ -1071,13 +1443,110 @@ do_standby_clone(void)
 		strncpy(local_xlog_directory, master_xlog_directory, MAXFILENAME);
 	}
 
-	r = test_ssh_connection(runtime_options.host, runtime_options.remote_user);
-	if (r != 0)
+	/*
+	 * An interrupted clone leaves a manifest in the target directory; check
+	 * it belongs to the same source before reusing what was copied
+	 */
+	if (runtime_options.resume &&
+		!clone_manifest_load(local_data_directory, runtime_options.host,
+							 master_data_directory))
 	{
-		log_err(_("%s: Aborting, remote host %s is not reachable.\n"),
-				progname, runtime_options.host);
 		PQfinish(conn);
-		exit(ERR_BAD_SSH);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/*
+	 * A master running on this same host is copied directly instead of going
+	 * through ssh and rsync.  Throttling is done by rsync, and so is removing
+	 * the files a resumed clone has that the master dropped since, so asking
+	 * for either keeps the rsync path.
+	 */
+	if (is_local_source(runtime_options.host, master_data_directory))
+	{
+		/*
+		 * Without -D, the files would be copied onto themselves: the data
+		 * directory keeps its path, and the tablespaces always do
+		 */
+		if (is_same_file(master_data_directory, local_data_directory) ||
+			tablespace_count > 0)
+		{
+			log_err(_("%s: the master runs on this host, its data directory or tablespaces would be overwritten; give another directory with -D, and no tablespace can be cloned on the same host\n"),
+					progname);
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+
+		clone_local = !from_standby && !runtime_options.resume &&
+			runtime_options.max_rate == 0 && runtime_options.max_latency == 0;
+	}
+
+	if (clone_local)
+	{
+		log_notice(_("standby clone: the master runs on this host, its files will be copied locally\n"));
+	}
+	else
+	{
+		r = test_ssh_connection(runtime_options.host, runtime_options.remote_user);
+		if (r != 0)
+		{
+			log_err(_("%s: Aborting, remote host %s is not reachable.\n"),
+					progname, runtime_options.host);
+			PQfinish(conn);
+			exit(ERR_BAD_SSH);
+		}
+	}
+
+	if (from_standby)
+	{
+		char	   *remote_files[3] = {master_config_file, master_hba_file,
+		master_ident_file};
+		char	   *local_files[3] = {local_config_file, local_hba_file,
+		local_ident_file};
+		size_t		dir_len = strlen(master_data_directory);
+
+		PQfinish(conn);
+
+		/* pg_basebackup refuses to write into a non empty directory */
+		if (check_dir(local_data_directory) == 2)
+		{
+			log_err(_("%s: directory %s is not empty, it can't be used to clone a standby\n"),
+					progname, local_data_directory);
+			exit(ERR_BAD_CONFIG);
+		}
+		if (!create_pg_dir(local_data_directory, false))
+			exit(ERR_BAD_CONFIG);
+
+		log_notice(_("Starting base backup of the standby...\n"));
+		r = run_basebackup(runtime_options.host, runtime_options.masterport,
+						   local_data_directory);
+		if (r != 0)
+			exit(ERR_BAD_BASEBACKUP);
+
+		/*
+		 * Configuration files living outside of the data directory are not
+		 * part of the base backup
+		 */
+		for (i = 0; i < 3; i++)
+		{
+			if (strncmp(remote_files[i], master_data_directory, dir_len) == 0 &&
+				remote_files[i][dir_len] == '/')
+				continue;
+
+			log_info(_("standby clone: standby configuration file '%s'\n"),
+					 remote_files[i]);
+			r = copy_remote_files(runtime_options.host,
+								  runtime_options.remote_user,
+								  remote_files[i], local_files[i], false);
+			if (r != 0)
+			{
+				log_err(_("standby clone: failed copying configuration file '%s'\n"),
+						remote_files[i]);
+				exit(ERR_BAD_RSYNC);
+			}
+		}
+
+		flag_success = true;
+		goto write_recovery;
 	}
 
 	log_notice(_("Starting backup...\n"));
@@ -1098,12 +1567,14 @@ do_standby_clone(void)
 
 	/*
 	 * inform the master we will start a backup and get the first XLog
-	 * filename so we can say to the user we need those files
+	 * filename so we can say to the user we need those files.  A resumed
+	 * clone always starts a new backup, under a fresh label.
 	 */
-	sqlquery_snprintf(
-					  sqlquery,
-	  "SELECT pg_xlogfile_name(pg_start_backup('repmgr_standby_clone_%ld'))",
-					  time(NULL));
+	maxlen_snprintf(backup_label, "repmgr_standby_clone_%ld", time(NULL));
+	sqlquery_snprintf(sqlquery,
+					  "SELECT %s(lsn), lsn "
+					  "  FROM pg_start_backup('%s') AS lsn",
+					  wal_function(conn, "pg_xlogfile_name"), backup_label);
 	log_debug(_("standby clone: %s\n"), sqlquery);
 	res = PQexec(conn, sqlquery);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
@@ -1113,6 +1584,7 @@ do_standby_clone(void)
 		PQfinish(conn);
 		exit(ERR_BAD_CONFIG);
 	}
+	backup_lsn = parse_lsn(PQgetvalue(res, 0, 1));
 
 	if (runtime_options.verbose)
 	{
@@ -1126,7 +1598,8 @@ do_standby_clone(void)
 	PQclear(res);
 
 	/* Check the directory could be used as a PGDATA dir */
-	if (!create_pg_dir(local_data_directory, runtime_options.force))
+	if (!runtime_options.resume &&
+		!create_pg_dir(local_data_directory, runtime_options.force))
 	{
 		log_err(_("%s: couldn't use directory %s ...\nUse --force option to force\n"),
 				progname, local_data_directory);
@@ -1135,6 +1608,22 @@ do_standby_clone(void)
 		goto stop_backup;
 	}
 
+	if (!clone_manifest_open(local_data_directory, runtime_options.host,
+							 master_data_directory, backup_label))
+	{
+		r = ERR_BAD_CONFIG;
+		retval = ERR_BAD_CONFIG;
+		goto stop_backup;
+	}
+
+	/* The copy is throttled against the master's latency from now on */
+	if (runtime_options.max_latency > 0)
+	{
+		memset(&clone_throttle, 0, sizeof(clone_throttle));
+		clone_throttle.conn = conn;
+		clone_throttle.latency = clone_throttle_probe();
+	}
+
 	/*
 	 * 1) first move global/pg_control
 	 *
@@ -1270,11 +1759,20 @@ do_standby_clone(void)
 
 stop_backup:
 
+	if (clone_throttle.conn != NULL)
+	{
+		if (clone_throttle.pauses > 0)
+			log_notice(_("standby clone: copy was paused %ld times for %.0f seconds because of master latency\n"),
+					   clone_throttle.pauses, clone_throttle.paused_secs);
+		clone_throttle.conn = NULL;
+	}
+
 	/*
 	 * Inform the master that we have finished the backup.
 	 */
 	log_notice(_("Finishing backup...\n"));
-	sqlquery_snprintf(sqlquery, "SELECT pg_xlogfile_name(pg_stop_backup())");
+	sqlquery_snprintf(sqlquery, "SELECT %s(pg_stop_backup())",
+					  wal_function(conn, "pg_xlogfile_name"));
 	log_debug(_("standby clone: %s\n"), sqlquery);
 
 	res = PQexec(conn, sqlquery);
@@ -1283,6 +1781,7 @@ stop_backup:
 		log_err(_("Can't stop backup: %s\n"), PQerrorMessage(conn));
 		PQclear(res);
 		PQfinish(conn);
+		clone_manifest_close(false);
 		exit(retval);
 	}
 	last_wal_segment = PQgetvalue(res, 0, 0);
@@ -1302,14 +1801,28 @@ stop_backup:
 	free(first_wal_segment);
 	first_wal_segment = NULL;
 
-	/* If the rsync failed then exit */
+	/*
+	 * If the rsync failed then exit, keeping the manifest so the clone can
+	 * be continued later
+	 */
 	if (r != 0)
 	{
-		log_err(_("Couldn't rsync the master...\nYou have to cleanup the destination directory (%s) manually!\n"),
-				local_data_directory);
+		clone_manifest_close(false);
+		log_err(_("Couldn't rsync the master...\n"));
+		if (retval == SUCCESS)
+			log_notice(_("HINT: run the same command again with --resume to continue the clone into %s, or clean up that directory manually\n"),
+					   local_data_directory);
 		exit(ERR_BAD_RSYNC);
 	}
 
+	/*
+	 * Everything was copied.  The manifest stays until the copy is on disk
+	 * and verified, so that a failure past this point can still be resumed.
+	 */
+	clone_manifest_close(false);
+
+write_recovery:
+
 	/*
 	 * We need to create the pg_xlog sub directory too.
 	 */
@@ -1321,20 +1834,87 @@ stop_backup:
 								 * error */
 	}
 
-	/* Finally, write the recovery.conf file */
-	create_recovery_file(local_data_directory);
-
 	/*
-	 * We don't start the service yet because we still may want to move the
-	 * directory
+	 * Pages with a bad checksum are read again from the node we copied from,
+	 * in case they were copied while being written there
 	 */
-	log_notice(_("%s standby clone complete\n"), progname);
-
-	/* HINT message : what to do next ? */
-	if (flag_success)
+	if (verify && backup_lsn != 0)
 	{
-		log_notice("HINT: You can now start your postgresql server\n");
-		if (test_mode)
+		conn = establish_db_connection_by_params(keywords, values, false);
+		if (PQstatus(conn) != CONNECTION_OK)
+		{
+			log_warning(_("standby clone: can't reconnect to %s, pages with a bad checksum won't be read again\n"),
+						runtime_options.host);
+			PQfinish(conn);
+			conn = NULL;
+		}
+	}
+	else
+		conn = NULL;
+
+	/*
+	 * Finally, write the recovery.conf file.  It points to the upstream node,
+	 * which is not the node we copied from when cloning from a standby.
+	 */
+	snprintf(runtime_options.host, sizeof(runtime_options.host), "%s",
+			 upstream_host);
+	snprintf(runtime_options.masterport,
+			 sizeof(runtime_options.masterport), "%s",
+			 upstream_port);
+	create_recovery_file(local_data_directory);
+
+	/*
+	 * Nothing copied is on disk yet: flush it all before telling the user
+	 * the standby can be started, checking the pages on the way if asked to
+	 */
+	log_notice(_("standby clone: syncing %sthe data directory\n"),
+			   verify ? "and verifying " : "");
+	memset(&sync_stats, 0, sizeof(sync_stats));
+	if (!sync_data_directory(local_data_directory, runtime_options.jobs,
+							 verify, backup_lsn, conn, &sync_stats))
+	{
+		if (sync_stats.bad_pages > 0)
+		{
+			log_err(_("%s: %ld pages of the clone have a bad checksum\n"),
+					progname, sync_stats.bad_pages);
+			r = ERR_BAD_CHECKSUM;
+		}
+		else
+		{
+			log_err(_("%s: couldn't sync the data directory %s\n"),
+					progname, local_data_directory);
+			r = ERR_SYS_FAILURE;
+		}
+		flag_success = false;
+		log_notice(_("HINT: run the same command again with --resume to copy the data directory %s again\n"),
+				   local_data_directory);
+	}
+	else
+		clone_manifest_close(true);
+
+	if (conn != NULL)
+		PQfinish(conn);
+
+	log_info(_("standby clone: synced %ld files, %.1f MB in %.1f s (%.1f MB/s)\n"),
+			 sync_stats.files, sync_stats.bytes / (1024.0 * 1024.0),
+			 sync_stats.seconds, sync_stats.seconds > 0 ?
+			 sync_stats.bytes / (1024.0 * 1024.0) / sync_stats.seconds : 0);
+	if (verify)
+		log_info(_("standby clone: %ld pages verified, %ld new or changed during the backup, %ld read again from the source\n"),
+				 sync_stats.pages_checked, sync_stats.pages_skipped,
+				 sync_stats.pages_reread);
+
+	/*
+	 * We don't start the service yet because we still may want to move the
+	 * directory
+	 */
+	log_notice(_("%s standby clone complete\n"), progname);
+
+	/* HINT message : what to do next ? */
+	if (flag_success)
+	{
+		log_notice("HINT: You can now start your postgresql server\n");
+		if (test_mode)
 		{
 			log_notice(_("for example : pg_ctl -D %s start\n"),
 					   local_data_directory);
@@ -1344,11 +1924,11 @@ stop_backup:
 			log_notice("for example : /etc/init.d/postgresql start\n");
 		}
 	}
-	exit(r);
+	return r;
 }
 
 
-static void
+static int
 do_standby_promote(void)
 {
 	PGconn	   *conn;
@@ -1367,6 +1947,8 @@ do_standby_promote(void)
 	char		recovery_done_path[MAXFILENAME];
 
 	char		standby_version[MAXVERSIONSTR];
+	struct timeval start,
+				end;
 
 	/* We need to connect to check configuration */
 	log_info(_("%s connecting to master database\n"), progname);
@@ -1396,8 +1978,7 @@ do_standby_promote(void)
 	}
 
 	/* we also need to check if there isn't any master already */
-	old_master_conn = get_master_connection(conn, repmgr_schema,
-								 options.cluster_name, &old_master_id, NULL);
+	old_master_conn = get_master_connection(conn, &old_master_id, NULL);
 	if (old_master_conn != NULL)
 	{
 		log_err(_("There is a master already in this cluster\n"));
@@ -1423,33 +2004,79 @@ do_standby_promote(void)
 	}
 	strcpy(data_dir, PQgetvalue(res, 0, 0));
 	PQclear(res);
-	PQfinish(conn);
-
-	log_info(_("%s: Marking recovery done\n"), progname);
-	maxlen_snprintf(recovery_file_path, "%s/%s", data_dir, RECOVERY_FILE);
-	maxlen_snprintf(recovery_done_path, "%s/%s", data_dir, RECOVERY_DONE_FILE);
-	rename(recovery_file_path, recovery_done_path);
 
 	/*
-	 * Restart and wait for the server to finish starting, so that the check
-	 * below will find an active server rather than one starting up.  This may
-	 * hang for up the default timeout (60 seconds).
+	 * 9.1 and later can leave recovery without a restart, so the sessions
+	 * already connected survive and the node is writable as soon as the
+	 * end of recovery checkpoint is requested.  9.0 has to be restarted.
 	 */
-	log_notice(_("%s: restarting server using %s/pg_ctl\n"), progname,
-			   options.pg_bindir);
-	maxlen_snprintf(script, "%s/pg_ctl %s -D %s -w -m fast restart",
-					options.pg_bindir, options.pgctl_options, data_dir);
-	r = system(script);
-	if (r != 0)
+	if (strcmp(standby_version, "9.0") == 0)
 	{
-		log_err(_("Can't restart PostgreSQL server\n"));
-		exit(ERR_NO_RESTART);
+		PQfinish(conn);
+
+		log_info(_("%s: Marking recovery done\n"), progname);
+		maxlen_snprintf(recovery_file_path, "%s/%s", data_dir, RECOVERY_FILE);
+		maxlen_snprintf(recovery_done_path, "%s/%s", data_dir, RECOVERY_DONE_FILE);
+		rename(recovery_file_path, recovery_done_path);
+
+		/*
+		 * Restart and wait for the server to finish starting, so that the
+		 * check below will find an active server rather than one starting
+		 * up.  This may hang for up the default timeout (60 seconds).
+		 */
+		log_notice(_("%s: restarting server using %s/pg_ctl\n"), progname,
+				   options.pg_bindir);
+		maxlen_snprintf(script, "%s/pg_ctl %s -D %s -w -m fast restart",
+						options.pg_bindir, options.pgctl_options, data_dir);
+		r = system(script);
+		if (r != 0)
+		{
+			log_err(_("Can't restart PostgreSQL server\n"));
+			exit(ERR_NO_RESTART);
+		}
+
+		/* reconnect to check we got promoted */
+		log_info(_("%s connecting to now restarted database\n"), progname);
+		conn = establish_db_connection(options.conninfo, true);
+		retval = is_standby(conn);
+	}
+	else
+	{
+		gettimeofday(&start, NULL);
+
+		log_notice(_("%s: promoting server using %s/pg_ctl\n"), progname,
+				   options.pg_bindir);
+		maxlen_snprintf(script, "%s/pg_ctl %s -D %s promote",
+						options.pg_bindir, options.pgctl_options, data_dir);
+		r = system(script);
+		if (r != 0)
+		{
+			log_err(_("Can't promote PostgreSQL server\n"));
+			PQfinish(conn);
+			exit(ERR_PROMOTION_FAIL);
+		}
+
+		/* the server switches over in the background, wait for it */
+		switch (wait_for_promotion(conn, PROMOTE_TIMEOUT))
+		{
+			case 1:
+				gettimeofday(&end, NULL);
+				log_info(_("%s: server promoted in %ld ms\n"), progname,
+						 (long) ((end.tv_sec - start.tv_sec) * 1000 +
+								 (end.tv_usec - start.tv_usec) / 1000));
+				retval = 0;
+				break;
+			case 0:
+				log_err(_("%s: server still in recovery after %d seconds\n"),
+						progname, PROMOTE_TIMEOUT);
+				retval = 1;
+				break;
+			default:
+				retval = -1;
+				break;
+		}
 	}
 
-	/* reconnect to check we got promoted */
-	log_info(_("%s connecting to now restarted database\n"), progname);
-	conn = establish_db_connection(options.conninfo, true);
-	retval = is_standby(conn);
 	if (retval)
 	{
 		log_err(_(retval == 1 ?
@@ -1458,15 +2085,29 @@ do_standby_promote(void)
 	}
 	else
 	{
-		log_err(_("%s: STANDBY PROMOTE successful.  You should REINDEX any hash indexes you have.\n"),
-				progname);
+		log_notice(_("%s: STANDBY PROMOTE successful.\n"), progname);
+	}
+
+	/*
+	 * Before 10 hash indexes are not WAL-logged, so they are unusable until
+	 * rebuilt
+	 */
+	if (retval == 0 && PQserverVersion(conn) < 100000)
+	{
+		r = reindex_hash_indexes(options.conninfo, runtime_options.jobs);
+		if (r != 0)
+			log_warning(_("%s: %s hash indexes could not be rebuilt, REINDEX them manually.\n"),
+						progname, r < 0 ? "the" : "some");
 	}
 	PQfinish(conn);
-	return;
+
+	if (retval)
+		return retval == 1 ? ERR_PROMOTION_FAIL : ERR_DB_CON;
+	return SUCCESS;
 }
 
 
-static void
+static int
 do_standby_follow(void)
 {
 	PGconn	   *conn;
@@ -1484,6 +2125,10 @@ do_standby_follow(void)
 
 	char		master_version[MAXVERSIONSTR];
 	char		standby_version[MAXVERSIONSTR];
+	char		snapshot_path[MAXFILENAME];
+	bool		prewarm;
+	int			server_version_num;
+	int			receiver_pid;
 
 	/* We need to connect to check configuration */
 	log_info(_("%s connecting to standby database\n"), progname);
@@ -1525,8 +2170,8 @@ do_standby_follow(void)
 			conn = establish_db_connection(options.conninfo, true);
 		}
 
-		master_conn = get_master_connection(conn, repmgr_schema,
-				options.cluster_name, &master_id, (char *) &master_conninfo);
+		master_conn = get_master_connection(conn, &master_id,
+											(char *) &master_conninfo);
 	}
 	while (master_conn == NULL && runtime_options.wait_for_master);
 
@@ -1577,9 +2222,11 @@ do_standby_follow(void)
 	 * closing the connection because we will need them to recreate the
 	 * recovery.conf file
 	 */
-	strncpy(runtime_options.host, PQhost(master_conn), MAXLEN);
-	strncpy(runtime_options.masterport, PQport(master_conn), MAXLEN);
-	strncpy(runtime_options.username, PQuser(master_conn), MAXLEN);
+	if (!get_conn_host_port(master_conn, master_conninfo,
+							runtime_options.host, runtime_options.masterport))
+		runtime_options.host[0] = '\0';	/* libpq's default, as connected */
+	snprintf(runtime_options.username, sizeof(runtime_options.username), "%s",
+			 PQuser(master_conn));
 	PQfinish(master_conn);
 
 	log_info(_("%s Changing standby's master\n"), progname);
@@ -1599,10 +2246,61 @@ do_standby_follow(void)
 	}
 	strcpy(data_dir, PQgetvalue(res, 0, 0));
 	PQclear(res);
+
+	/*
+	 * Since 13 primary_conninfo is reloadable: the WAL receiver reconnects
+	 * to the new master and read-only sessions are not disturbed
+	 */
+	server_version_num = PQserverVersion(conn);
+	if (server_version_num >= 130000)
+	{
+		if (!set_primary_conninfo(conn))
+		{
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+		receiver_pid = get_wal_receiver_pid(conn);
+		res = PQexec(conn, "SELECT pg_reload_conf()");
+		PQclear(res);
+
+		if (!wait_for_streaming(conn, receiver_pid))
+		{
+			log_warning(_("%s: the standby doesn't stream from the new master yet\n"),
+						progname);
+		}
+		else
+		{
+			log_notice(_("%s: standby follows the new master, no restart needed\n"),
+					   progname);
+		}
+		PQfinish(conn);
+		return SUCCESS;
+	}
+
+	/*
+	 * Otherwise a restart is needed.  Keep what is in shared buffers, so the
+	 * standby doesn't come back with a cold cache, and make the restart
+	 * quick with a restartpoint first.
+	 */
+	maxlen_snprintf(snapshot_path, "%s/%s", data_dir, BUFFER_SNAPSHOT_FILE);
+	prewarm = has_buffer_extensions(conn) &&
+		capture_buffer_cache(conn, snapshot_path) > 0;
+
+	res = PQexec(conn, "CHECKPOINT");
+	PQclear(res);
+
+	if (server_version_num >= 120000)
+	{
+		if (!set_primary_conninfo(conn))
+		{
+			PQfinish(conn);
+			exit(ERR_BAD_CONFIG);
+		}
+	}
 	PQfinish(conn);
 
 	/* write the recovery.conf file */
-	if (!create_recovery_file(data_dir))
+	if (server_version_num < 120000 && !create_recovery_file(data_dir))
 		exit(ERR_BAD_CONFIG);
 
 	/* Finally, restart the service */
@@ -1615,11 +2313,19 @@ do_standby_follow(void)
 		exit(ERR_NO_RESTART);
 	}
 
-	return;
+	if (prewarm)
+	{
+		log_info(_("%s: %ld blocks loaded back into shared buffers\n"),
+				 progname, prewarm_buffer_cache(options.conninfo, snapshot_path,
+												runtime_options.jobs));
+		unlink(snapshot_path);
+	}
+
+	return SUCCESS;
 }
 
 
-static void
+static int
 do_witness_create(void)
 {
 	PGconn	   *masterconn;
@@ -1679,6 +2385,33 @@ do_witness_create(void)
 
 	log_info(_("Successfully connected to primary.\n"));
 
+	/*
+	 * An arbiter witness is a repmgrd alone (see arbiter.c): it only has to
+	 * be registered
+	 */
+	if (is_arbiter_conninfo(options.conninfo, NULL, NULL))
+	{
+		sqlquery_snprintf(sqlquery, "INSERT INTO %s.repl_nodes(id, cluster, name, conninfo, priority, witness) "
+						  "VALUES (%d, '%s', '%s', '%s', %d, true)",
+						  repmgr_schema, options.node, options.cluster_name,
+						  options.node_name, options.conninfo, options.priority);
+
+		log_debug(_("witness create: %s"), sqlquery);
+		res = PQexec(masterconn, sqlquery);
+		if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			log_err(_("Cannot insert node details, %s\n"),
+					PQerrorMessage(masterconn));
+			PQfinish(masterconn);
+			exit(ERR_DB_QUERY);
+		}
+		PQclear(res);
+		PQfinish(masterconn);
+
+		log_notice(_("Arbiter registered, start repmgrd with this configuration to run it\n"));
+		return SUCCESS;
+	}
+
 	r = test_ssh_connection(runtime_options.host, runtime_options.remote_user);
 	if (r != 0)
 	{
@@ -1829,233 +2562,1878 @@ do_witness_create(void)
 	PQfinish(witnessconn);
 
 	log_notice(_("Configuration has been successfully copied to the witness\n"));
+	return SUCCESS;
 }
 
 
 
-static void
-usage(void)
-{
-	fprintf(stderr, _("\n\n%s: Replicator manager \n"), progname);
-	fprintf(stderr, _("Try \"%s --help\" for more information.\n"), progname);
-}
-
-
-
-static void
-help(const char *progname)
-{
-	printf(_("\n%s: Replicator manager \n"), progname);
-	printf(_("Usage:\n"));
-	printf(_(" %s [OPTIONS] master  {register}\n"), progname);
-	printf(_(" %s [OPTIONS] standby {register|clone|promote|follow}\n"),
-		   progname);
-	printf(_(" %s [OPTIONS] cluster {show|cleanup}\n"), progname);
-	printf(_("\nGeneral options:\n"));
-	printf(_("  --help                              show this help, then exit\n"));
-	printf(_("  --version                           output version information, then exit\n"));
-	printf(_("  --verbose                           output verbose activity information\n"));
-	printf(_("\nConnection options:\n"));
-	printf(_("  -d, --dbname=DBNAME                 database to connect to\n"));
-	printf(_("  -h, --host=HOSTNAME                 database server host or socket directory\n"));
-	printf(_("  -p, --port=PORT                     database server port\n"));
-	printf(_("  -U, --username=USERNAME             database user name to connect as\n"));
-	printf(_("\nConfiguration options:\n"));
-	printf(_("  -D, --data-dir=DIR                  local directory where the files will be\n" \
-			 "                                      copied to\n"));
-	printf(_("  -l, --local-port=PORT               standby or witness server local port\n"));
-	printf(_("  -f, --config-file=PATH              path to the configuration file\n"));
-	printf(_("  -R, --remote-user=USERNAME          database server username for rsync\n"));
-	printf(_("  -w, --wal-keep-segments=VALUE       minimum value for the GUC\n" \
-			 "                                      wal_keep_segments (default: 5000)\n"));
-	printf(_("  -I, --ignore-rsync-warning          ignore rsync partial transfer warning\n"));
-	printf(_("  -k, --keep-history=VALUE            keeps indicated number of days of\n" \
-			 "                                      history\n"));
-	printf(_("  -F, --force                         force potentially dangerous operations\n" \
-			 "                                      to happen\n"));
-	printf(_("  -W, --wait                          wait for a master to appear\n"));
-	printf(_("	-r, --min-recovery-apply-delay=VALUE  enable recovery time delay, value has to be a valid time atom (e.g. 5min)"));
-
-	printf(_("\n%s performs some tasks like clone a node, promote it or making follow\n"), progname);
-	printf(_("another node and then exits.\n\n"));
-	printf(_("COMMANDS:\n"));
-	printf(_(" master register         - registers the master in a cluster\n"));
-	printf(_(" standby register        - registers a standby in a cluster\n"));
-	printf(_(" standby clone [node]    - allows creation of a new standby\n"));
-	printf(_(" standby promote         - allows manual promotion of a specific standby into\n" \
-	"                           a new master in the event of a failover\n"));
-	printf(_(" standby follow          - allows the standby to re-point itself to a new\n" \
-			 "                           master\n"));
-	printf(_(" cluster show            - print node information\n"));
-	printf(_(" cluster cleanup         - cleans monitor's history\n"));
-}
-
-
 /*
- * Creates a recovery file for a standby.
+ * Planned switchover: this standby becomes the master, the current master
+ * rejoins as its standby and the other standbys follow it.  Writes are only
+ * unavailable between the moment new transactions are made read-only on the
+ * old master and the end of the promotion.
  */
-static bool
-create_recovery_file(const char *data_dir)
+static int
+do_standby_switchover(void)
 {
-	FILE	   *recovery_file;
-	char		recovery_file_path[MAXLEN];
-	char		line[MAXLEN];
+	PGconn	   *conn;
+	PGconn	   *master_conn;
+	PGresult   *res;
+	PGresult   *nodes_res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		script[MAXLEN];
+	char		command[MAXLEN];
+	char		master_conninfo[MAXLEN];
+	char		master_host[MAXLEN];
+	char		node_host[MAXLEN];
+	char		local_host[MAXLEN];
+	char		local_port[MAXLEN] = DEFAULT_MASTER_PORT;
+	char		data_dir[MAXFILENAME];
+	char		master_data_dir[MAXFILENAME];
+	char		remote_config[MAXFILENAME];
+	char		standby_version[MAXVERSIONSTR];
+	char		master_version[MAXVERSIONSTR];
+	char	   *ret;
+	unsigned long long int target;
+	struct timeval start;
+	struct timeval phase;
+	struct timeval writes_paused;
+	pid_t	   *children;
+	char	  **child_hosts;
+	int			nchildren = 0;
+	int			status;
+	int			master_id;
+	int			retval;
+	int			failures = 0;
+	bool		can_pause;
+	bool		can_rejoin;
+	pid_t		pid;
+	int			i,
+				j;
 
-	maxlen_snprintf(recovery_file_path, "%s/%s", data_dir, RECOVERY_FILE);
+	gettimeofday(&start, NULL);
 
-	recovery_file = fopen(recovery_file_path, "w");
-	if (recovery_file == NULL)
+	log_info(_("%s connecting to standby database\n"), progname);
+	conn = establish_db_connection(options.conninfo, true);
+
+	retval = is_standby(conn);
+	if (retval == 0 || retval == -1)
 	{
-		log_err(_("could not create recovery.conf file, it could be necessary to create it manually\n"));
-		return false;
+		log_err(_(retval == 0 ? "%s: The command should be executed on a standby node\n" :
+				  "%s: connection to node lost!\n"), progname);
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
 	}
 
-	maxlen_snprintf(line, "standby_mode = 'on'\n");
-	if (fputs(line, recovery_file) == EOF)
+	ret = pg_version(conn, standby_version);
+	if (ret == NULL || strcmp(standby_version, "") == 0 ||
+		strcmp(standby_version, "9.0") == 0)
 	{
-		log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
-		fclose(recovery_file);
-		return false;
+		if (ret != NULL)
+			log_err(_("%s needs PostgreSQL 9.1 or better for a switchover\n"),
+					progname);
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
 	}
 
-	write_primary_conninfo(line);
-
-	if (fputs(line, recovery_file) == EOF)
+	master_conn = get_master_connection(conn, &master_id, master_conninfo);
+	if (master_conn == NULL)
 	{
-		log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
-		fclose(recovery_file);
-		return false;
+		log_err(_("There isn't a master to switch over from in this cluster\n"));
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
 	}
 
-	if(*runtime_options.min_recovery_apply_delay)
+	ret = pg_version(master_conn, master_version);
+	if (ret == NULL || strcmp(master_version, standby_version) != 0)
 	{
-		maxlen_snprintf(line, "\nmin_recovery_apply_delay = %s\n",
-						runtime_options.min_recovery_apply_delay);
-
-		if (fputs(line, recovery_file) == EOF)
-		{
-			log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
-			fclose(recovery_file);
-			return false;
-		}
+		log_err(_("%s needs versions of both master (%s) and standby (%s) to match.\n"),
+				progname, master_version, standby_version);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
 	}
 
-	/* FreeFile(recovery_file); */
-	fclose(recovery_file);
+	/*
+	 * Writes are paused with ALTER SYSTEM (9.4), and the old master can only
+	 * rejoin without a new clone through pg_rewind (9.5)
+	 */
+	can_pause = (strcmp(master_version, "9.1") != 0 &&
+				 strcmp(master_version, "9.2") != 0 &&
+				 strcmp(master_version, "9.3") != 0);
+	can_rejoin = can_pause && strcmp(master_version, "9.4") != 0;
+
+	if (!get_conninfo_value(master_conninfo, "host", master_host))
+	{
+		log_err(_("%s: the conninfo of the master has no host, it can't be reached through ssh\n"),
+				progname);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	if (!get_conninfo_value(options.conninfo, "host", local_host) &&
+		gethostname(local_host, sizeof(local_host)) != 0)
+	{
+		log_err(_("%s: can't find out the address of this node\n"), progname);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	get_conninfo_value(options.conninfo, "port", local_port);
+
+	if (runtime_options.remote_config_file[0])
+		maxlen_snprintf(remote_config, "%s", runtime_options.remote_config_file);
+	else
+		maxlen_snprintf(remote_config, "%s", runtime_options.config_file);
+
+	if (test_ssh_connection(master_host, runtime_options.remote_user) != 0)
+	{
+		log_err(_("%s: Aborting, master host %s is not reachable.\n"),
+				progname, master_host);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_BAD_SSH);
+	}
+
+	/* Data directories of both nodes */
+	sqlquery_snprintf(sqlquery, "SELECT setting "
+					  " FROM pg_settings WHERE name = 'data_directory'");
+	res = PQexec(conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get info about data directory: %s\n"),
+				PQerrorMessage(conn));
+		PQclear(res);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_DB_QUERY);
+	}
+	snprintf(data_dir, sizeof(data_dir), "%s", PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get info about data directory: %s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(res);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_DB_QUERY);
+	}
+	snprintf(master_data_dir, sizeof(master_data_dir), "%s",
+			 PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	/* The other standbys, which will follow this node afterwards */
+	sqlquery_snprintf(sqlquery, "SELECT id, conninfo FROM %s.repl_nodes "
+					  " WHERE cluster = '%s' AND NOT witness "
+					  "   AND id <> %d AND id <> %d",
+					  repmgr_schema, options.cluster_name, master_id,
+					  options.node);
+	log_debug(_("standby switchover: %s\n"), sqlquery);
+	nodes_res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(nodes_res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get nodes information: %s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(nodes_res);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_DB_QUERY);
+	}
+
+	log_notice(_("%s: switching over from node %d to node %d\n"), progname,
+			   master_id, options.node);
+
+	/*
+	 * 1) Checkpoint while writes are still allowed, so that the shutdown
+	 * checkpoint of the old master has almost nothing left to flush
+	 */
+	gettimeofday(&phase, NULL);
+	res = PQexec(master_conn, "CHECKPOINT");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		log_warning(_("standby switchover: CHECKPOINT failed on the master: %s\n"),
+					PQerrorMessage(master_conn));
+	PQclear(res);
+	log_info(_("standby switchover: checkpoint done in %ld ms\n"),
+			 elapsed_ms(&phase));
+
+	/* 2) Make new transactions read-only on the master */
+	gettimeofday(&writes_paused, NULL);
+	if (can_pause)
+	{
+		if (set_master_read_only(master_conn, true))
+		{
+			log_info(_("standby switchover: writes paused on the master\n"));
+		}
+		else
+			log_warning(_("standby switchover: writes could not be paused on the master, they stop when it is stopped\n"));
+	}
+
+	/* 3) Let the standby catch up with what was written until now */
+	gettimeofday(&phase, NULL);
+	sqlquery_snprintf(sqlquery, "SELECT %s()",
+					  wal_function(master_conn, "pg_current_xlog_location"));
+	res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get the master's xlog location: %s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(res);
+		if (can_pause)
+			set_master_read_only(master_conn, false);
+		PQclear(nodes_res);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_DB_QUERY);
+	}
+	target = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	if (!wait_for_replay(conn, target))
+	{
+		log_err(_("%s: the standby didn't catch up with the master within %d seconds, switchover cancelled\n"),
+				progname, SWITCHOVER_TIMEOUT);
+		if (can_pause)
+			set_master_read_only(master_conn, false);
+		PQclear(nodes_res);
+		PQfinish(master_conn);
+		PQfinish(conn);
+		exit(ERR_FAILOVER_FAIL);
+	}
+	log_info(_("standby switchover: standby caught up in %ld ms\n"),
+			 elapsed_ms(&phase));
+	PQfinish(master_conn);
+
+	/*
+	 * 4) Stop the old master.  Its shutdown checkpoint is streamed to the
+	 * standby before the server exits.
+	 */
+	gettimeofday(&phase, NULL);
+	maxlen_snprintf(command, "%s/pg_ctl %s -D %s -m fast -w stop",
+					options.pg_bindir, options.pgctl_options, master_data_dir);
+	if (remote_command(master_host, command) != 0)
+	{
+		log_err(_("%s: can't stop the master on %s\n"), progname, master_host);
+		restore_old_master(master_host, master_data_dir, master_conninfo,
+						   can_pause);
+		PQclear(nodes_res);
+		PQfinish(conn);
+		exit(ERR_FAILOVER_FAIL);
+	}
+	if (!wait_for_last_wal(conn))
+	{
+		log_err(_("%s: the standby didn't finish replaying the master's WAL\n"),
+				progname);
+		restore_old_master(master_host, master_data_dir, master_conninfo,
+						   can_pause);
+		PQclear(nodes_res);
+		PQfinish(conn);
+		exit(ERR_FAILOVER_FAIL);
+	}
+	log_info(_("standby switchover: old master stopped in %ld ms\n"),
+			 elapsed_ms(&phase));
+
+	/* 5) Promote this node online */
+	gettimeofday(&phase, NULL);
+	maxlen_snprintf(script, "%s/pg_ctl %s -D %s promote",
+					options.pg_bindir, options.pgctl_options, data_dir);
+	if (system(script) != 0)
+	{
+		log_err(_("%s: promotion of this node failed\n"), progname);
+		restore_old_master(master_host, master_data_dir, master_conninfo,
+						   can_pause);
+		PQclear(nodes_res);
+		PQfinish(conn);
+		exit(ERR_PROMOTION_FAIL);
+	}
+	if (wait_for_promotion(conn, PROMOTE_TIMEOUT) != 1)
+	{
+		/* it may still be promoted: two masters are worse than none */
+		log_err(_("%s: this node was not promoted within %d seconds, the old master on %s is left stopped.\n"
+				  "Check whether this node left recovery:\n"
+				  "  psql -c \"SELECT pg_is_in_recovery()\"\n"
+				  "If it did, on %s run:\n"
+				  "  repmgr -f %s -D %s -p %s node rejoin %s\n"
+				  "If it didn't, stop it, and on %s run:\n"
+				  "  %s/pg_ctl %s -D %s -w start\n"),
+				progname, PROMOTE_TIMEOUT, master_host, master_host,
+				remote_config, master_data_dir, local_port, local_host,
+				master_host,
+				options.pg_bindir, options.pgctl_options, master_data_dir);
+		PQclear(nodes_res);
+		PQfinish(conn);
+		exit(ERR_PROMOTION_FAIL);
+	}
+	PQfinish(conn);
+	log_info(_("standby switchover: promoted in %ld ms\n"), elapsed_ms(&phase));
+	log_notice(_("%s: writes were unavailable for %ld ms\n"), progname,
+			   elapsed_ms(&writes_paused));
+
+	/*
+	 * 6) Repoint the old master and the other standbys, all at once.  Each
+	 * one runs its own repmgr through ssh.
+	 */
+	gettimeofday(&phase, NULL);
+	children = malloc((PQntuples(nodes_res) + 1) * sizeof(pid_t));
+	child_hosts = malloc((PQntuples(nodes_res) + 1) * sizeof(char *));
+	if (children == NULL || child_hosts == NULL)
+	{
+		log_err(_("%s: out of memory\n"), progname);
+		exit(ERR_SYS_FAILURE);
+	}
+
+	for (i = -1; i < PQntuples(nodes_res); i++)
+	{
+		if (i == -1)
+		{
+			if (!can_rejoin)
+			{
+				log_notice(_("%s: the old master needs 9.5 or better to rejoin, clone it again with STANDBY CLONE --force\n"),
+						   progname);
+				continue;
+			}
+			maxlen_snprintf(node_host, "%s", master_host);
+			maxlen_snprintf(command,
+							"%s/repmgr -f %s -D %s -p %s node rejoin %s",
+							options.pg_bindir, remote_config, master_data_dir,
+							local_port, local_host);
+		}
+		else
+		{
+			if (!get_conninfo_value(PQgetvalue(nodes_res, i, 1), "host",
+									node_host))
+			{
+				log_warning(_("%s: node %s has no host in its conninfo, it has to follow the new master manually\n"),
+							progname, PQgetvalue(nodes_res, i, 0));
+				failures++;
+				continue;
+			}
+			maxlen_snprintf(command, "%s/repmgr -f %s standby follow",
+							options.pg_bindir, remote_config);
+		}
+
+		fflush(NULL);
+		pid = fork();
+		if (pid < 0)
+		{
+			log_err(_("%s: can't fork: %s\n"), progname, strerror(errno));
+			failures++;
+			continue;
+		}
+		if (pid == 0)
+			_exit(remote_command(node_host, command) == 0 ? 0 : 1);
+
+		children[nchildren] = pid;
+		child_hosts[nchildren] = strdup(node_host);
+		nchildren++;
+	}
+
+	for (i = 0; i < nchildren; i++)
+	{
+		pid = wait(&status);
+		for (j = 0; j < nchildren && children[j] != pid; j++)
+			;
+		if (j == nchildren)
+			continue;
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		{
+			log_info(_("standby switchover: %s follows the new master after %ld ms\n"),
+					 child_hosts[j], elapsed_ms(&phase));
+		}
+		else
+		{
+			log_err(_("standby switchover: %s couldn't be repointed to the new master\n"),
+					child_hosts[j]);
+			failures++;
+		}
+	}
+
+	for (i = 0; i < nchildren; i++)
+		free(child_hosts[i]);
+	free(child_hosts);
+	free(children);
+	PQclear(nodes_res);
+
+	log_notice(_("%s: STANDBY SWITCHOVER done in %ld ms\n"), progname,
+			   elapsed_ms(&start));
+	if (failures > 0)
+	{
+		log_err(_("%s: %d nodes need to be repointed manually\n"), progname,
+				failures);
+		exit(ERR_FAILOVER_FAIL);
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Runs a command on host through ssh, as test_ssh_connection() does
+ */
+static int
+remote_command(const char *host, const char *command)
+{
+	char		script[MAXLEN];
+
+	if (!runtime_options.remote_user[0])
+		maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s \"%s\"",
+						options.ssh_options, host, command);
+	else
+		maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s -l %s \"%s\"",
+						options.ssh_options, host, runtime_options.remote_user,
+						command);
+
+	log_debug(_("command is: %s\n"), script);
+	return system(script);
+}
+
+
+/*
+ * Waits until the standby has replayed the WAL up to target
+ */
+static bool
+wait_for_replay(PGconn *conn, unsigned long long int target)
+{
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	unsigned long long int replayed;
+	int			waited;
+
+	sqlquery_snprintf(sqlquery, "SELECT %s()",
+					  wal_function(conn, "pg_last_xlog_replay_location"));
+	for (waited = 0; waited < SWITCHOVER_TIMEOUT * 1000;
+		 waited += SWITCHOVER_POLL_MS)
+	{
+		res = PQexec(conn, sqlquery);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			log_err(_("Can't get the standby's replay location: %s\n"),
+					PQerrorMessage(conn));
+			PQclear(res);
+			return false;
+		}
+		replayed = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+		PQclear(res);
+
+		if (replayed >= target)
+			return true;
+
+		usleep(SWITCHOVER_POLL_MS * 1000);
+	}
+
+	return false;
+}
+
+
+/*
+ * Once the master is stopped nothing new arrives: waits until everything
+ * received has been replayed and the received position is settled
+ */
+static bool
+wait_for_last_wal(PGconn *conn)
+{
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		received[MAXLEN] = "";
+	int			stable = 0;
+	int			waited;
+
+	sqlquery_snprintf(sqlquery, "SELECT %s(), %s()",
+					  wal_function(conn, "pg_last_xlog_receive_location"),
+					  wal_function(conn, "pg_last_xlog_replay_location"));
+	for (waited = 0; waited < SWITCHOVER_TIMEOUT * 1000;
+		 waited += SWITCHOVER_POLL_MS)
+	{
+		res = PQexec(conn, sqlquery);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			log_err(_("Can't get the standby's replay location: %s\n"),
+					PQerrorMessage(conn));
+			PQclear(res);
+			return false;
+		}
+
+		if (strcmp(PQgetvalue(res, 0, 0), received) == 0 &&
+			strcmp(PQgetvalue(res, 0, 0), PQgetvalue(res, 0, 1)) == 0)
+			stable += SWITCHOVER_POLL_MS;
+		else
+			stable = 0;
+		maxlen_snprintf(received, "%s", PQgetvalue(res, 0, 0));
+		PQclear(res);
+
+		if (stable >= SWITCHOVER_SETTLE_MS)
+			return true;
+
+		usleep(SWITCHOVER_POLL_MS * 1000);
+	}
+
+	return false;
+}
+
+
+/*
+ * Makes new transactions on the master read-only, or writable again.
+ *
+ * The setting is kept out of postgresql.auto.conf once the server applied
+ * it, so that it only lasts until the server is stopped or reloaded.  The
+ * other sessions are then terminated: their open transactions could still
+ * write, and a client could turn the setting off in its own session.  The
+ * walsenders are kept, the standby must receive the last WAL.
+ *
+ * Returns false if the master did not apply the setting in time; writes are
+ * then not fenced until the master is stopped.
+ */
+static bool
+set_master_read_only(PGconn *master_conn, bool read_only)
+{
+	PGresult   *res;
+	bool		applied = !read_only;
+	int			i;
+
+	if (read_only)
+	{
+		res = PQexec(master_conn,
+					 "ALTER SYSTEM SET default_transaction_read_only = on");
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			log_warning(_("standby switchover: can't set default_transaction_read_only on the master: %s\n"),
+						PQerrorMessage(master_conn));
+			PQclear(res);
+			return false;
+		}
+		PQclear(res);
+	}
+	else
+	{
+		res = PQexec(master_conn,
+					 "ALTER SYSTEM RESET default_transaction_read_only");
+		PQclear(res);
+	}
+
+	res = PQexec(master_conn, "SELECT pg_reload_conf()");
+	PQclear(res);
+
+	/* the reload is asynchronous: wait for this session to see it */
+	for (i = 0; read_only &&
+		 i < SWITCHOVER_PAUSE_TIMEOUT * 1000 / SWITCHOVER_POLL_MS; i++)
+	{
+		res = PQexec(master_conn,
+					 "SELECT current_setting('default_transaction_read_only')");
+		applied = (PQresultStatus(res) == PGRES_TUPLES_OK &&
+				   strcmp(PQgetvalue(res, 0, 0), "on") == 0);
+		PQclear(res);
+		if (applied)
+			break;
+		usleep(SWITCHOVER_POLL_MS * 1000);
+	}
+
+	if (!read_only)
+		return true;
+
+	/* not reloaded: the server doesn't read the file again until it is */
+	res = PQexec(master_conn,
+				 "ALTER SYSTEM RESET default_transaction_read_only");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		log_warning(_("standby switchover: can't reset default_transaction_read_only on the master: %s\n"),
+					PQerrorMessage(master_conn));
+	PQclear(res);
+
+	if (!applied)
+		return false;
+
+	res = PQexec(master_conn,
+				 "SELECT pg_terminate_backend(pid) FROM pg_stat_activity "
+				 " WHERE pid <> pg_backend_pid() AND datname IS NOT NULL "
+				 "   AND pid NOT IN (SELECT pid FROM pg_stat_replication)");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_warning(_("standby switchover: can't terminate the sessions on the master: %s\n"),
+					PQerrorMessage(master_conn));
+		applied = false;
+	}
+	PQclear(res);
+
+	return applied;
+}
+
+
+/*
+ * After the old master was being stopped, the switchover failed before
+ * this node was promoted: starts the old master again if it is down and
+ * makes it writable, so the cluster isn't left without a master.  If that
+ * can't be done, tells what to run by hand.
+ */
+static void
+restore_old_master(const char *master_host, const char *master_data_dir,
+				   const char *master_conninfo, bool can_pause)
+{
+	PGconn	   *master_conn;
+	char		command[MAXLEN];
+
+	master_conn = establish_db_connection(master_conninfo, false);
+	if (PQstatus(master_conn) != CONNECTION_OK)
+	{
+		PQfinish(master_conn);
+		log_notice(_("%s: starting the old master on %s again\n"), progname,
+				   master_host);
+
+		/* its output must not keep the ssh session open */
+		maxlen_snprintf(command,
+						"%s/pg_ctl %s -D %s -l %s/repmgr_restart.log -w start",
+						options.pg_bindir, options.pgctl_options,
+						master_data_dir, master_data_dir);
+		if (remote_command(master_host, command) == 0)
+			master_conn = establish_db_connection(master_conninfo, false);
+		else
+			master_conn = NULL;
+	}
+
+	if (master_conn != NULL && PQstatus(master_conn) == CONNECTION_OK &&
+		(!can_pause || set_master_read_only(master_conn, false)))
+	{
+		log_notice(_("%s: switchover cancelled, %s is still the master and accepts writes\n"),
+				   progname, master_host);
+		PQfinish(master_conn);
+		return;
+	}
+	if (master_conn != NULL)
+		PQfinish(master_conn);
+
+	log_err(_("%s: the old master on %s could not be brought back, the cluster has no master.\n"
+			  "On %s, start it:\n"
+			  "  %s/pg_ctl %s -D %s -w start\n"
+			  "then make it writable again:\n"
+			  "  psql -c \"ALTER SYSTEM RESET default_transaction_read_only\" -c \"SELECT pg_reload_conf()\"\n"),
+			progname, master_host, master_host, options.pg_bindir,
+			options.pgctl_options, master_data_dir);
+}
+
+
+static long
+elapsed_ms(struct timeval * since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_usec - since->tv_usec) / 1000;
+}
+
+
+/*
+ * atexit() handler: spools the event of the action, and leaves a child
+ * process to send it, so a promote_command or follow_command running
+ * repmgr doesn't wait for the master
+ */
+static void
+record_action_event(void)
+{
+	record_event(action_event, action_status == SUCCESS,
+				 elapsed_ms(&action_start), NULL);
+	events_flush_detached();
+}
+
+
+/*
+ * Brings a former master, stopped after a failover, back into the cluster
+ * as a standby of the new master.  If it went on writing on its old
+ * timeline, pg_rewind copies back only the blocks touched since the
+ * timelines diverged instead of the whole data directory.
+ */
+static int
+do_node_rejoin(void)
+{
+	PGconn	   *master_conn;
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		script[MAXLEN];
+	char		source_conninfo[MAXLEN];
+	char		cluster_state[MAXLEN];
+	char		user_buf[MAXLEN] = "";
+	char		local_tli_str[MAXLEN];
+	char		master_version[MAXVERSIONSTR];
+	char		master_tli_str[9];
+	char	   *ret;
+	char	   *data_dir = runtime_options.dest_dir;
+	unsigned long local_tli;
+	unsigned long master_tli;
+	int			r;
+
+	/* pg_rewind needs the server cleanly shut down */
+	maxlen_snprintf(script, "%s/pg_ctl %s -D %s status > /dev/null",
+					options.pg_bindir, options.pgctl_options, data_dir);
+	r = system(script);
+	if (r == 0)
+	{
+		log_err(_("%s: the server in %s is running, stop it before rejoining\n"),
+				progname, data_dir);
+		exit(ERR_BAD_CONFIG);
+	}
+	if (WEXITSTATUS(r) != 3)
+	{
+		log_err(_("%s: %s is not a valid data directory\n"),
+				progname, data_dir);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* Connection parameters for the new master */
+	keywords[0] = "host";
+	values[0] = runtime_options.host;
+	keywords[1] = "port";
+	values[1] = runtime_options.masterport;
+
+	log_info(_("%s connecting to the new master\n"), progname);
+	master_conn = establish_db_connection_by_params(keywords, values, true);
+
+	r = is_standby(master_conn);
+	if (r != 0)
+	{
+		log_err(_(r == 1 ? "%s: The node to rejoin should be a master\n" :
+				  "%s: connection to node lost!\n"), progname);
+		PQfinish(master_conn);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* pg_rewind comes with 9.5 */
+	ret = pg_version(master_conn, master_version);
+	if (ret == NULL || strcmp(master_version, "") == 0 ||
+		strcmp(master_version, "9.0") == 0 ||
+		strcmp(master_version, "9.1") == 0 ||
+		strcmp(master_version, "9.2") == 0 ||
+		strcmp(master_version, "9.3") == 0 ||
+		strcmp(master_version, "9.4") == 0)
+	{
+		if (ret != NULL)
+			log_err(_("%s needs PostgreSQL 9.5 or better to rejoin a node\n"),
+					progname);
+		PQfinish(master_conn);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* the node is made a standby with recovery.conf, gone in 12 */
+	if (PQserverVersion(master_conn) >= 120000)
+	{
+		log_err(_("%s can't rejoin a node of PostgreSQL 12 or later\n"),
+				progname);
+		PQfinish(master_conn);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* Compare the timelines of both nodes */
+	sqlquery_snprintf(sqlquery, "SELECT %s(%s())",
+					  wal_function(master_conn, "pg_xlogfile_name"),
+					  wal_function(master_conn, "pg_current_xlog_location"));
+	res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get the master's timeline: %s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(res);
+		PQfinish(master_conn);
+		exit(ERR_DB_QUERY);
+	}
+	snprintf(master_tli_str, sizeof(master_tli_str), "%s",
+			 PQgetvalue(res, 0, 0));
+	master_tli = strtoul(master_tli_str, NULL, 16);
+	PQclear(res);
+
+	if (!get_controldata_value(data_dir, "Latest checkpoint's TimeLineID",
+							   local_tli_str))
+	{
+		PQfinish(master_conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	local_tli = strtoul(local_tli_str, NULL, 10);
+
+	log_info(_("%s: local timeline is %lu, master timeline is %lu\n"),
+			 progname, local_tli, master_tli);
+
+	if (local_tli > master_tli)
+	{
+		log_err(_("%s: this node is on a later timeline than the master, it can't follow it\n"),
+				progname);
+		PQfinish(master_conn);
+		exit(ERR_BAD_CONFIG);
+	}
+
+	/* the new standby connects as the same user, like STANDBY FOLLOW does */
+	if (!runtime_options.username[0])
+		snprintf(runtime_options.username,
+				 sizeof(runtime_options.username), "%s",
+				 PQuser(master_conn));
+	PQfinish(master_conn);
+
+	if (local_tli < master_tli)
+	{
+		/*
+		 * The master was promoted after this node went down.  pg_rewind
+		 * finds where the histories forked and copies back what changed
+		 * since then; it does nothing if this node never went past it.
+		 *
+		 * It only takes a data directory shut down cleanly, and a master
+		 * that failed usually wasn't: crash recovery is run first, with
+		 * the server in single-user mode, which shuts it down cleanly.
+		 */
+		if (!get_controldata_value(data_dir, "Database cluster state",
+								   cluster_state))
+			exit(ERR_BAD_CONFIG);
+		if (strcmp(cluster_state, "shut down") != 0)
+		{
+			log_notice(_("%s: the server in %s was not shut down cleanly (%s), running crash recovery\n"),
+					   progname, data_dir, cluster_state);
+			maxlen_snprintf(script,
+							"%s/postgres --single -D %s template1 < /dev/null > /dev/null",
+							options.pg_bindir, data_dir);
+			log_info(_("crash recovery command line:  '%s'\n"), script);
+			if (system(script) != 0 ||
+				!get_controldata_value(data_dir, "Database cluster state",
+									   cluster_state) ||
+				strcmp(cluster_state, "shut down") != 0)
+			{
+				log_err(_("%s: crash recovery of %s failed; start the server and stop it cleanly, then run NODE REJOIN again\n"),
+						progname, data_dir);
+				exit(ERR_BAD_REWIND);
+			}
+		}
+
+		maxlen_snprintf(user_buf, " user=%s", runtime_options.username);
+		maxlen_snprintf(source_conninfo, "host=%s port=%s dbname=%s%s",
+						runtime_options.host,
+						runtime_options.masterport[0] ?
+						runtime_options.masterport : DEFAULT_MASTER_PORT,
+						runtime_options.dbname, user_buf);
+		maxlen_snprintf(script, "%s/pg_rewind -D %s --source-server='%s'%s",
+						options.pg_bindir, data_dir, source_conninfo,
+						runtime_options.verbose ? " --progress" : "");
+		log_notice(_("%s: rewinding the data directory\n"), progname);
+		log_info(_("pg_rewind command line:  '%s'\n"), script);
+		r = system(script);
+		if (r != 0)
+		{
+			log_err(_("%s: pg_rewind failed, the node has to be cloned again with STANDBY CLONE --force\n"),
+					progname);
+			exit(ERR_BAD_REWIND);
+		}
+	}
+	else
+		log_info(_("%s: both nodes are on the same timeline, nothing to rewind\n"),
+				 progname);
+
+	/* write the recovery.conf file */
+	if (!create_recovery_file(data_dir))
+		exit(ERR_BAD_CONFIG);
+
+	/* Finally, start the service */
+	maxlen_snprintf(script, "%s/pg_ctl %s -w -D %s start",
+					options.pg_bindir, options.pgctl_options, data_dir);
+	r = system(script);
+	if (r != 0)
+	{
+		log_err(_("Can't start service\n"));
+		exit(ERR_NO_RESTART);
+	}
+
+	log_notice(_("%s: NODE REJOIN successful, the node now follows %s\n"),
+			   progname, runtime_options.host);
+	return SUCCESS;
+}
+
+
+/*
+ * Reads one field of pg_controldata's output for data_dir
+ */
+static bool
+get_controldata_value(const char *data_dir, const char *name, char *value)
+{
+	FILE	   *output;
+	char		script[MAXLEN];
+	char		line[MAXLINELENGTH];
+	size_t		name_len = strlen(name);
+	char	   *p;
+	bool		found = false;
+
+	maxlen_snprintf(script, "LC_ALL=C %s/pg_controldata %s",
+					options.pg_bindir, data_dir);
+	output = popen(script, "r");
+	if (output == NULL)
+	{
+		log_err(_("Can't execute pg_controldata: %s\n"), strerror(errno));
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), output) != NULL)
+	{
+		if (!found && strncmp(line, name, name_len) == 0 &&
+			line[name_len] == ':')
+		{
+			for (p = line + name_len + 1; *p == ' '; p++)
+				;
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(value, MAXLEN, "%s", p);
+			found = true;
+		}
+	}
+
+	if (pclose(output) != 0 || !found)
+	{
+		log_err(_("Can't read \"%s\" from pg_controldata for %s\n"),
+				name, data_dir);
+		return false;
+	}
+
+	return true;
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, _("\n\n%s: Replicator manager \n"), progname);
+	fprintf(stderr, _("Try \"%s --help\" for more information.\n"), progname);
+}
+
+
+
+static void
+help(const char *progname)
+{
+	printf(_("\n%s: Replicator manager \n"), progname);
+	printf(_("Usage:\n"));
+	printf(_(" %s [OPTIONS] master  {register}\n"), progname);
+	printf(_(" %s [OPTIONS] standby {register|clone|promote|follow|switchover}\n"),
+		   progname);
+	printf(_(" %s [OPTIONS] cluster {show|cleanup}\n"), progname);
+	printf(_(" %s [OPTIONS] node    {rejoin}\n"), progname);
+	printf(_("\nGeneral options:\n"));
+	printf(_("  --help                              show this help, then exit\n"));
+	printf(_("  --version                           output version information, then exit\n"));
+	printf(_("  --verbose                           output verbose activity information\n"));
+	printf(_("\nConnection options:\n"));
+	printf(_("  -d, --dbname=DBNAME                 database to connect to\n"));
+	printf(_("  -h, --host=HOSTNAME                 database server host or socket directory\n"));
+	printf(_("  -p, --port=PORT                     database server port\n"));
+	printf(_("  -U, --username=USERNAME             database user name to connect as\n"));
+	printf(_("\nConfiguration options:\n"));
+	printf(_("  -D, --data-dir=DIR                  local directory where the files will be\n" \
+			 "                                      copied to\n"));
+	printf(_("  -l, --local-port=PORT               standby or witness server local port\n"));
+	printf(_("  -f, --config-file=PATH              path to the configuration file\n"));
+	printf(_("  -R, --remote-user=USERNAME          database server username for rsync\n"));
+	printf(_("  -w, --wal-keep-segments=VALUE       minimum value for the GUC\n" \
+			 "                                      wal_keep_segments (default: 5000)\n"));
+	printf(_("  -I, --ignore-rsync-warning          ignore rsync partial transfer warning\n"));
+	printf(_("  -k, --keep-history=VALUE            keeps indicated number of days of\n" \
+			 "                                      history\n"));
+	printf(_("  -F, --force                         force potentially dangerous operations\n" \
+			 "                                      to happen\n"));
+	printf(_("  -W, --wait                          wait for a master to appear\n"));
+	printf(_("	-r, --min-recovery-apply-delay=VALUE  enable recovery time delay, value has to be a valid time atom (e.g. 5min)\n"));
+	printf(_("  --resume                            continue an interrupted standby clone\n"));
+	printf(_("  --from-standby                      clone from the least loaded standby\n" \
+			 "                                      instead of the master\n"));
+	printf(_("  -j, --jobs=N                        number of files copied or synced at once\n"));
+	printf(_("  --verify                            verify the page checksums of the clone\n"));
+	printf(_("  --max-rate=KBPS                     limit the clone copy to KBPS kilobytes per second\n"));
+	printf(_("  --remote-config-file=PATH           path of repmgr.conf on the other nodes, for\n" \
+			 "                                      STANDBY SWITCHOVER (default: same as -f)\n"));
+	printf(_("  --max-latency=MS                    pause the clone copy while the master's latency\n" \
+			 "                                      is above MS milliseconds\n"));
+
+	printf(_("\n%s performs some tasks like clone a node, promote it or making follow\n"), progname);
+	printf(_("another node and then exits.\n\n"));
+	printf(_("COMMANDS:\n"));
+	printf(_(" master register         - registers the master in a cluster\n"));
+	printf(_(" standby register        - registers a standby in a cluster\n"));
+	printf(_(" standby clone [node]    - allows creation of a new standby\n"));
+	printf(_(" standby promote         - allows manual promotion of a specific standby into\n" \
+	"                           a new master in the event of a failover\n"));
+	printf(_(" standby follow          - allows the standby to re-point itself to a new\n" \
+			 "                           master\n"));
+	printf(_(" standby switchover      - promotes this standby and makes the current\n" \
+			 "                           master and the other standbys follow it\n"));
+	printf(_(" cluster show            - print node information\n"));
+	printf(_(" cluster cleanup         - cleans monitor's history\n"));
+	printf(_(" node rejoin [node]      - brings a failed master back as a standby of\n" \
+			 "                           the new master\n"));
+}
+
+
+/*
+ * Creates a recovery file for a standby.
+ */
+static bool
+create_recovery_file(const char *data_dir)
+{
+	FILE	   *recovery_file;
+	char		recovery_file_path[MAXLEN];
+	char		line[MAXLEN];
+
+	maxlen_snprintf(recovery_file_path, "%s/%s", data_dir, RECOVERY_FILE);
+
+	recovery_file = fopen(recovery_file_path, "w");
+	if (recovery_file == NULL)
+	{
+		log_err(_("could not create recovery.conf file, it could be necessary to create it manually\n"));
+		return false;
+	}
+
+	maxlen_snprintf(line, "standby_mode = 'on'\n");
+	if (fputs(line, recovery_file) == EOF)
+	{
+		log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
+		fclose(recovery_file);
+		return false;
+	}
+
+	write_primary_conninfo(line);
+
+	if (fputs(line, recovery_file) == EOF)
+	{
+		log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
+		fclose(recovery_file);
+		return false;
+	}
+
+	if(*runtime_options.min_recovery_apply_delay)
+	{
+		maxlen_snprintf(line, "\nmin_recovery_apply_delay = %s\n",
+						runtime_options.min_recovery_apply_delay);
+
+		if (fputs(line, recovery_file) == EOF)
+		{
+			log_err(_("recovery file could not be written, it could be necessary to create it manually\n"));
+			fclose(recovery_file);
+			return false;
+		}
+	}
+
+	/* FreeFile(recovery_file); */
+	fclose(recovery_file);
+
+	return true;
+}
+
+static int
+test_ssh_connection(char *host, char *remote_user)
+{
+	char		script[MAXLEN];
+	int			r = 1, i;
+
+	/* On some OS, true is located in a different place than in Linux
+	 * we have to try them all until all alternatives are gone or we
+	 * found `true' because the target OS may differ from the source
+	 * OS
+	 */
+	const char *truebin_pathes[] = {
+		"/bin/true",
+		"/usr/bin/true",
+		NULL
+	};
+
+	/* Check if we have ssh connectivity to host before trying to rsync */
+	for(i = 0; truebin_pathes[i] && r != 0; ++i)
+	{
+		if (!remote_user[0])
+			maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s %s",
+							options.ssh_options, host, truebin_pathes[i]);
+		else
+			maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s -l %s %s",
+							options.ssh_options, host, remote_user,
+							truebin_pathes[i]);
+
+		log_debug(_("command is: %s\n"), script);
+		r = system(script);
+	}
+
+	if (r != 0)
+		log_info(_("Can not connect to the remote host (%s)\n"), host);
+	return r;
+}
+
+static int
+copy_remote_files(char *host, char *remote_user, char *remote_path,
+				  char *local_path, bool is_directory)
+{
+	char		script[MAXLEN];
+	char		rsync_flags[MAXLEN];
+	char		host_string[MAXLEN];
+	int			r;
+
+	if (clone_local)
+		return copy_local_files(remote_path, local_path, is_directory);
+
+	if (*options.rsync_options == '\0')
+		maxlen_snprintf(
+						rsync_flags, "%s",
+					 "--archive --checksum --compress --progress --rsh=ssh");
+	else
+		maxlen_snprintf(rsync_flags, "%s", options.rsync_options);
+
+	/*
+	 * A resumed clone may hold files the master has dropped since the
+	 * previous run
+	 */
+	if (runtime_options.force || runtime_options.resume)
+		strcat(rsync_flags, " --delete");
+
+	/*
+	 * Keep partially transferred files around so an interrupted clone can
+	 * pick them up again, and report every completed file for the manifest
+	 */
+	if (clone_manifest.fp != NULL)
+		strcat(rsync_flags, " --partial --out-format=\"repmgr-file %l %n\"");
+
+	if (runtime_options.max_rate > 0)
+	{
+		char		bwlimit[MAXLEN];
+
+		maxlen_snprintf(bwlimit, " --bwlimit=%d", runtime_options.max_rate);
+		strcat(rsync_flags, bwlimit);
+	}
+
+	if (!remote_user[0])
+	{
+		maxlen_snprintf(host_string, "%s", host);
+	}
+	else
+	{
+		maxlen_snprintf(host_string, "%s@%s", remote_user, host);
+	}
+
+	if (is_directory)
+	{
+		strcat(rsync_flags,
+			   " --exclude=pg_xlog* --exclude=pg_log* --exclude=pg_control --exclude=*.pid"
+			   " --exclude=" CLONE_MANIFEST_FILE);
+		maxlen_snprintf(script, "rsync %s %s:%s/* %s",
+						rsync_flags, host_string, remote_path, local_path);
+	}
+	else
+	{
+		maxlen_snprintf(script, "rsync %s %s:%s %s",
+						rsync_flags, host_string, remote_path, local_path);
+	}
+
+	log_info(_("rsync command line:  '%s'\n"), script);
+
+	if (clone_manifest.fp == NULL && clone_throttle.conn == NULL)
+		r = system(script);
+	else
+	{
+		r = run_rsync(script);
+		if (clone_manifest.fp != NULL)
+			clone_manifest_sync(true);
+	}
+
+	/*
+	 * If we are transfering a directory (data directory, tablespace
+	 * directories) then we can ignore some rsync warnings.  If we get some of
+	 * those errors, we treat them as 0 only if passed the
+	 * --ignore-rsync-warning command-line option.
+	 *
+	 * List of ignorable rsync errors: 24	  Partial transfer due to vanished
+	 * source files
+	 */
+	if ((WEXITSTATUS(r) == 24) && is_directory)
+	{
+		if (runtime_options.ignore_rsync_warn)
+		{
+			r = 0;
+			log_info(_("rsync partial transfer warning ignored\n"));
+		}
+		else
+			log_warning(_("rsync completed with return code 24: "
+					   "\"Partial transfer due to vanished source files\".\n"
+						  "This can happen because of normal operation "
+						  "on the master server, but it may indicate an "
+					 "unexpected change during cloning.  If you are certain "
+						  "no changes were made to the master, try cloning "
+				  "again using \"repmgr --force --ignore-rsync-warning\"."));
+	}
+	if (r != 0)
+		log_err(_("Can't rsync from remote file or directory (%s:%s)\n"),
+				host_string, remote_path);
+
+	return r;
+}
+
+
+/*
+ * Reads the manifest left by an interrupted STANDBY CLONE in data_dir, and
+ * checks it was written for the same source.  What was transferred is not
+ * skipped blindly: data files may have changed since, so everything is
+ * handed to rsync again, which only moves the missing or changed parts.
+ */
+static bool
+clone_manifest_load(const char *data_dir, const char *source_host,
+					const char *source_dir)
+{
+	FILE	   *fp;
+	char		line[MAXLINELENGTH];
+	char		host[MAXLEN];
+	long long	bytes;
+	int			offset;
+	bool		source_ok = false;
+
+	memset(&clone_manifest, 0, sizeof(clone_manifest));
+	maxlen_snprintf(clone_manifest.path, "%s/%s", data_dir, CLONE_MANIFEST_FILE);
+
+	fp = fopen(clone_manifest.path, "r");
+	if (fp == NULL)
+	{
+		log_err(_("%s: no clone manifest found at \"%s\", nothing to resume\n"),
+				progname, clone_manifest.path);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "source %1023s %n", host, &offset) == 1)
+		{
+			source_ok = (strcmp(host, source_host) == 0 &&
+						 strcmp(line + offset, source_dir) == 0);
+		}
+		else if (sscanf(line, "file %lld %n", &bytes, &offset) == 1)
+		{
+			clone_manifest.files++;
+			clone_manifest.bytes += bytes;
+		}
+	}
+	fclose(fp);
+
+	if (!source_ok)
+	{
+		log_err(_("%s: clone manifest \"%s\" was written for a different source, can't resume\n"),
+				progname, clone_manifest.path);
+		return false;
+	}
+
+	log_notice(_("Resuming clone: %ld files (%lld bytes) were transferred by the previous run\n"),
+			   clone_manifest.files, clone_manifest.bytes);
+
+	return true;
+}
+
+
+/*
+ * Opens the clone manifest for writing.  A new clone starts a new manifest,
+ * a resumed one appends to the existing file.
+ */
+static bool
+clone_manifest_open(const char *data_dir, const char *source_host,
+					const char *source_dir, const char *backup_label)
+{
+	if (!runtime_options.resume)
+	{
+		memset(&clone_manifest, 0, sizeof(clone_manifest));
+		maxlen_snprintf(clone_manifest.path, "%s/%s", data_dir,
+						CLONE_MANIFEST_FILE);
+	}
+
+	clone_manifest.fp = fopen(clone_manifest.path,
+							  runtime_options.resume ? "a" : "w");
+	if (clone_manifest.fp == NULL)
+	{
+		log_err(_("%s: could not open clone manifest \"%s\": %s\n"),
+				progname, clone_manifest.path, strerror(errno));
+		return false;
+	}
+
+	if (!runtime_options.resume)
+	{
+		fprintf(clone_manifest.fp, "# repmgr standby clone manifest\n");
+		fprintf(clone_manifest.fp, "source %s %s\n", source_host, source_dir);
+	}
+	fprintf(clone_manifest.fp, "backup %s\n", backup_label);
+	clone_manifest_sync(true);
+
+	return true;
+}
+
+
+/*
+ * Records a file completely transferred by rsync, i.e. its byte range from
+ * zero to bytes is in place
+ */
+static void
+clone_manifest_add_file(long long bytes, const char *name)
+{
+	if (clone_manifest.fp == NULL)
+		return;
+
+	fprintf(clone_manifest.fp, "file %lld %s\n", bytes, name);
+	clone_manifest.files++;
+	clone_manifest.bytes += bytes;
+	clone_manifest.unsynced_entries++;
+
+	clone_manifest_sync(false);
+}
+
+
+/*
+ * Flush the manifest to disk, unless force is false and it was done
+ * recently enough
+ */
+static void
+clone_manifest_sync(bool force)
+{
+	time_t		now;
+
+	if (clone_manifest.fp == NULL)
+		return;
+
+	now = time(NULL);
+	if (!force &&
+		clone_manifest.unsynced_entries < CLONE_MANIFEST_SYNC_FILES &&
+		now - clone_manifest.last_sync < CLONE_MANIFEST_SYNC_SECS)
+		return;
+
+	if (fflush(clone_manifest.fp) != 0 ||
+		fsync(fileno(clone_manifest.fp)) != 0)
+		log_warning(_("could not sync clone manifest \"%s\": %s\n"),
+					clone_manifest.path, strerror(errno));
+
+	clone_manifest.unsynced_entries = 0;
+	clone_manifest.last_sync = now;
+}
+
+
+static void
+clone_manifest_close(bool remove_file)
+{
+	if (clone_manifest.fp != NULL)
+	{
+		clone_manifest_sync(true);
+		fclose(clone_manifest.fp);
+		clone_manifest.fp = NULL;
+	}
+
+	if (remove_file && clone_manifest.path[0] != '\0' && unlink(clone_manifest.path) != 0)
+		log_warning(_("could not remove clone manifest \"%s\": %s\n"),
+					clone_manifest.path, strerror(errno));
+}
+
+
+/*
+ * Local counterpart of copy_remote_files(), used when the master runs on
+ * this host.  Directories get the same exclusions as with rsync.  Returns 0
+ * on success, like rsync would.
+ */
+static int
+copy_local_files(char *src_path, char *dst_path, bool is_directory)
+{
+	static const char *const excludes[] = {
+		"pg_xlog*", "pg_log*", "pg_control", "*.pid", CLONE_MANIFEST_FILE, NULL
+	};
+	t_local_copy_stats stats;
+	const char *base;
+	bool		ok;
+
+	memset(&stats, 0, sizeof(stats));
+
+	log_info(_("local copy of '%s' into '%s'\n"), src_path, dst_path);
+
+	if (is_directory)
+		ok = local_copy_tree(src_path, dst_path, excludes, runtime_options.jobs,
+							 clone_manifest.fp ? clone_manifest_add_file : NULL,
+							 &stats);
+	else
+	{
+		ok = local_copy_file(src_path, dst_path, &stats);
+		if (ok && clone_manifest.fp != NULL)
+		{
+			base = strrchr(src_path, '/');
+			clone_manifest_add_file(stats.bytes, base ? base + 1 : src_path);
+		}
+	}
+
+	if (clone_manifest.fp != NULL)
+		clone_manifest_sync(true);
+
+	log_info(_("local copy: %ld files, %lld bytes, %ld shared with the source through reflinks\n"),
+			 stats.files, stats.bytes, stats.reflinked);
+
+	return ok ? 0 : 1;
+}
+
+
+/*
+ * Runs an rsync command line, feeding its output through
+ * handle_rsync_line().  When the copy is throttled, the master's latency is
+ * sampled while rsync runs and rsync is stopped until the master has
+ * recovered whenever the latency goes above --max-latency.  Returns the
+ * status as system() would.
+ */
+static int
+run_rsync(const char *script)
+{
+	int			pipefd[2];
+	pid_t		pid;
+	int			status;
+	char		line[MAXLINELENGTH];
+	size_t		line_len = 0;
+	char		buf[MAXLINELENGTH];
+	ssize_t		nread;
+	bool		eof = false;
+
+	fflush(stdout);
+	if (pipe(pipefd) != 0)
+	{
+		log_err(_("Can't execute rsync: %s\n"), strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0)
+	{
+		log_err(_("Can't execute rsync: %s\n"), strerror(errno));
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+
+	/*
+	 * When throttled, rsync and the receiver and ssh it forks get a process
+	 * group of their own, so that pausing stops all of them
+	 */
+	if (pid == 0)
+	{
+		if (clone_throttle.conn != NULL)
+			setpgid(0, 0);
+		close(pipefd[0]);
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[1]);
+		execl("/bin/sh", "sh", "-c", script, (char *) NULL);
+		_exit(127);
+	}
+
+	if (clone_throttle.conn != NULL)
+		setpgid(pid, pid);
+	close(pipefd[1]);
+
+	while (!eof)
+	{
+		fd_set		readfds;
+		struct timeval timeout;
+		int			n;
+		char	   *p;
+
+		FD_ZERO(&readfds);
+		FD_SET(pipefd[0], &readfds);
+		timeout.tv_sec = CLONE_THROTTLE_INTERVAL_MS / 1000;
+		timeout.tv_usec = (CLONE_THROTTLE_INTERVAL_MS % 1000) * 1000;
+
+		n = select(pipefd[0] + 1, &readfds, NULL, NULL,
+				   clone_throttle.conn != NULL ? &timeout : NULL);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		if (n > 0)
+		{
+			nread = read(pipefd[0], buf, sizeof(buf));
+			if (nread <= 0)
+				eof = true;
+
+			for (p = buf; nread > 0; p++, nread--)
+			{
+				line[line_len++] = *p;
+				if (*p == '\n' || line_len == sizeof(line) - 1)
+				{
+					line[line_len] = '\0';
+					handle_rsync_line(line);
+					line_len = 0;
+				}
+			}
+		}
+
+		if (clone_throttle.conn != NULL && !clone_throttle_check(-pid))
+		{
+			kill(-pid, SIGTERM);
+			break;
+		}
+	}
+
+	if (line_len > 0)
+	{
+		line[line_len] = '\0';
+		handle_rsync_line(line);
+	}
+	close(pipefd[0]);
+
+	/* never leave rsync stopped behind us */
+	if (clone_throttle.paused)
+	{
+		kill(-pid, SIGCONT);
+		clone_throttle.paused = false;
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return status;
+}
+
+
+/*
+ * Lines reported by rsync for completed files go to the clone manifest,
+ * anything else is shown to the user
+ */
+static void
+handle_rsync_line(char *line)
+{
+	long long	bytes;
+	int			offset;
+
+	if (clone_manifest.fp != NULL &&
+		sscanf(line, "repmgr-file %lld %n", &bytes, &offset) == 1)
+	{
+		line[strcspn(line, "\n")] = '\0';
+
+		/* directories are recreated by rsync, only track files */
+		if (line[strlen(line) - 1] != '/')
+			clone_manifest_add_file(bytes, line + offset);
+	}
+	else
+	{
+		fputs(line, stdout);
+		fflush(stdout);
+	}
+}
+
+
+/*
+ * Times a round trip to the master through the backup connection, in
+ * milliseconds.  Returns a negative value if the query failed.
+ */
+static double
+clone_throttle_probe(void)
+{
+	struct timeval start;
+	struct timeval end;
+	PGresult   *res;
+	bool		ok;
+
+	gettimeofday(&start, NULL);
+	res = PQexec(clone_throttle.conn, "SELECT 1");
+	gettimeofday(&end, NULL);
+
+	ok = (PQresultStatus(res) == PGRES_TUPLES_OK);
+	PQclear(res);
+	if (!ok)
+		return -1;
+
+	return (end.tv_sec - start.tv_sec) * 1000.0 +
+		(end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+
+/*
+ * Samples the master's latency and stops or resumes rsync accordingly.
+ * The copy resumes once the average latency drops back under half the
+ * limit, so it doesn't flip on every sample.  rsync_group is the negated
+ * process group of rsync, for kill().  Returns false if the master can't be
+ * reached anymore.
+ */
+static bool
+clone_throttle_check(pid_t rsync_group)
+{
+	static time_t last_check = 0;
+	static struct timeval paused_at;
+	struct timeval now;
+	double		sample;
+
+	gettimeofday(&now, NULL);
+	if (now.tv_sec == last_check)
+		return true;
+	last_check = now.tv_sec;
+
+	sample = clone_throttle_probe();
+	if (sample < 0)
+	{
+		log_err(_("standby clone: lost connection to the master: %s\n"),
+				PQerrorMessage(clone_throttle.conn));
+		return false;
+	}
+
+	clone_throttle.latency = CLONE_THROTTLE_WEIGHT * sample +
+		(1 - CLONE_THROTTLE_WEIGHT) * clone_throttle.latency;
+
+	if (!clone_throttle.paused &&
+		clone_throttle.latency > runtime_options.max_latency)
+	{
+		log_info(_("standby clone: master latency is %.1f ms, pausing the copy\n"),
+				 clone_throttle.latency);
+		if (kill(rsync_group, SIGSTOP) == 0)
+		{
+			clone_throttle.paused = true;
+			clone_throttle.pauses++;
+			paused_at = now;
+		}
+	}
+	else if (clone_throttle.paused &&
+			 clone_throttle.latency < runtime_options.max_latency / 2.0)
+	{
+		log_info(_("standby clone: master latency is %.1f ms, resuming the copy\n"),
+				 clone_throttle.latency);
+		kill(rsync_group, SIGCONT);
+		clone_throttle.paused = false;
+		clone_throttle.paused_secs += (now.tv_sec - paused_at.tv_sec) +
+			(now.tv_usec - paused_at.tv_usec) / 1000000.0;
+	}
+
+	return true;
+}
+
+
+/*
+ * Copies the host and port 'conn' is connected to.  libpq doesn't always
+ * know them, e.g. over its default socket: they are then read from
+ * 'conninfo' if given, and the port defaults to DEFAULT_MASTER_PORT.
+ * Returns false, leaving 'host' as is, if the host is still unknown.
+ */
+static bool
+get_conn_host_port(PGconn *conn, const char *conninfo, char *host, char *port)
+{
+	const char *value;
+
+	value = PQport(conn);
+	if (value != NULL && value[0] != '\0')
+		snprintf(port, MAXLEN, "%s", value);
+	else if (conninfo == NULL || !get_conninfo_value(conninfo, "port", port))
+		snprintf(port, MAXLEN, "%s", DEFAULT_MASTER_PORT);
+
+	value = PQhost(conn);
+	if (value != NULL && value[0] != '\0')
+		snprintf(host, MAXLEN, "%s", value);
+	else if (conninfo == NULL || !get_conninfo_value(conninfo, "host", host))
+		return false;
+
+	return true;
+}
+
+
+/*
+ * Picks the registered standby best suited to be the source of a clone: the
+ * one closest to the master, and among those the one with the fewest active
+ * sessions.  Returns a connection to it, or NULL if no standby can be used.
+ */
+static PGconn *
+choose_clone_source(PGconn *master_conn)
+{
+	PGconn	   *best_conn = NULL;
+	PGconn	   *node_conn;
+	PGresult   *res;
+	PGresult   *node_res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		node_version[MAXVERSIONSTR];
+	unsigned long long int master_location;
+	unsigned long long int replay_location;
+	unsigned long long int lag;
+	unsigned long long int best_lag = 0;
+	int			active;
+	int			best_active = 0;
+	int			best_id = -1;
+	int			i;
+
+	if (!options.cluster_name[0])
+	{
+		log_err(_("%s: the cluster name is needed to find a standby to clone, check the configuration file\n"),
+				progname);
+		return NULL;
+	}
+
+	sqlquery_snprintf(sqlquery, "SELECT %s()",
+					  wal_function(master_conn, "pg_current_xlog_location"));
+	res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get the master's xlog location: %s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(res);
+		return NULL;
+	}
+	master_location = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	sqlquery_snprintf(sqlquery, "SELECT id, conninfo FROM %s.repl_nodes "
+					  " WHERE cluster = '%s' AND NOT witness "
+					  " ORDER BY priority, id",
+					  repmgr_schema, options.cluster_name);
+	log_debug(_("standby clone: %s\n"), sqlquery);
+	res = PQexec(master_conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		log_err(_("Can't get nodes information, have you registered them?\n%s\n"),
+				PQerrorMessage(master_conn));
+		PQclear(res);
+		return NULL;
+	}
+
+	for (i = 0; i < PQntuples(res); i++)
+	{
+		node_conn = establish_db_connection(PQgetvalue(res, i, 1), false);
+		if (PQstatus(node_conn) != CONNECTION_OK)
+		{
+			PQfinish(node_conn);
+			continue;
+		}
+
+		/* pg_basebackup can only copy a 9.2 or better standby */
+		if (is_standby(node_conn) != 1 ||
+			pg_version(node_conn, node_version) == NULL ||
+			strcmp(node_version, "") == 0 ||
+			strcmp(node_version, "9.0") == 0 ||
+			strcmp(node_version, "9.1") == 0)
+		{
+			PQfinish(node_conn);
+			continue;
+		}
+
+		sqlquery_snprintf(sqlquery,
+						  "SELECT %s(), "
+						  "       (SELECT count(*) FROM pg_stat_activity "
+						  "         WHERE state <> 'idle' "
+						  "           AND pid <> pg_backend_pid())",
+						  wal_function(node_conn, "pg_last_xlog_replay_location"));
+		node_res = PQexec(node_conn, sqlquery);
+		if (PQresultStatus(node_res) != PGRES_TUPLES_OK)
+		{
+			log_warning(_("Can't get the state of standby %s: %s\n"),
+						PQgetvalue(res, i, 0), PQerrorMessage(node_conn));
+			PQclear(node_res);
+			PQfinish(node_conn);
+			continue;
+		}
+
+		replay_location = wal_location_to_bytes(PQgetvalue(node_res, 0, 0));
+		lag = (master_location > replay_location) ?
+			master_location - replay_location : 0;
+		active = atoi(PQgetvalue(node_res, 0, 1));
+		PQclear(node_res);
+
+		log_info(_("standby clone: node %s is %llu bytes behind the master, with %d active sessions\n"),
+				 PQgetvalue(res, i, 0), lag, active);
+
+		if (best_conn == NULL ||
+			lag / CLONE_SOURCE_LAG_UNIT < best_lag / CLONE_SOURCE_LAG_UNIT ||
+			(lag / CLONE_SOURCE_LAG_UNIT == best_lag / CLONE_SOURCE_LAG_UNIT &&
+			 active < best_active))
+		{
+			if (best_conn != NULL)
+				PQfinish(best_conn);
+			best_conn = node_conn;
+			best_lag = lag;
+			best_active = active;
+			best_id = atoi(PQgetvalue(res, i, 0));
+		}
+		else
+			PQfinish(node_conn);
+	}
+	PQclear(res);
 
-	return true;
+	if (best_conn != NULL)
+		log_notice(_("%s: node %d chosen as the clone source\n"), progname,
+				   best_id);
+
+	return best_conn;
+}
+
+
+/*
+ * Path of the local pg_basebackup, from pg_bindir when set
+ */
+static void
+pg_basebackup_bin(char *path)
+{
+	if (options.pg_bindir[0])
+		maxlen_snprintf(path, "%s/pg_basebackup", options.pg_bindir);
+	else
+		maxlen_snprintf(path, "pg_basebackup");
 }
 
+
+/*
+ * Version of the local pg_basebackup in PG_VERSION_NUM form (90400 for
+ * 9.4, 100000 for 10), from its --version output.  Returns -1 if it can't
+ * be run.
+ */
 static int
-test_ssh_connection(char *host, char *remote_user)
+pg_basebackup_version(void)
 {
+	FILE	   *output;
 	char		script[MAXLEN];
-	int			r = 1, i;
+	char		basebackup_bin[MAXLEN];
+	char		line[MAXLINELENGTH] = "";
+	char	   *p;
+	int			major;
+	int			minor = 0;
+	int			version = -1;
+
+	pg_basebackup_bin(basebackup_bin);
+	maxlen_snprintf(script, "%s --version", basebackup_bin);
+	output = popen(script, "r");
+	if (output == NULL)
+	{
+		log_err(_("Can't execute pg_basebackup: %s\n"), strerror(errno));
+		return -1;
+	}
 
-	/* On some OS, true is located in a different place than in Linux
-	 * we have to try them all until all alternatives are gone or we
-	 * found `true' because the target OS may differ from the source
-	 * OS
-	 */
-	const char *truebin_pathes[] = {
-		"/bin/true",
-		"/usr/bin/true",
-		NULL
-	};
+	/* "pg_basebackup (PostgreSQL) 9.3.5" */
+	if (fgets(line, sizeof(line), output) != NULL &&
+		(p = strrchr(line, ')')) != NULL &&
+		sscanf(p + 1, "%d.%d", &major, &minor) >= 1)
+		version = (major >= 10) ? major * 10000 : major * 10000 + minor * 100;
 
-	/* Check if we have ssh connectivity to host before trying to rsync */
-	for(i = 0; truebin_pathes[i] && r != 0; ++i)
+	if (pclose(output) != 0 || version < 0)
 	{
-		if (!remote_user[0])
-			maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s %s",
-							options.ssh_options, host, truebin_pathes[i]);
-		else
-			maxlen_snprintf(script, "ssh -o Batchmode=yes %s %s -l %s %s",
-							options.ssh_options, host, remote_user,
-							truebin_pathes[i]);
-
-		log_debug(_("command is: %s\n"), script);
-		r = system(script);
+		log_err(_("Can't get the version of %s\n"), basebackup_bin);
+		return -1;
 	}
 
-	if (r != 0)
-		log_info(_("Can not connect to the remote host (%s)\n"), host);
-	return r;
+	return version;
 }
 
+
+/*
+ * Copies the data directory of a standby with pg_basebackup: the backup
+ * starts from the standby's last restartpoint and the WAL needed to make it
+ * consistent is streamed along, so the master is not involved at all.
+ */
 static int
-copy_remote_files(char *host, char *remote_user, char *remote_path,
-				  char *local_path, bool is_directory)
+run_basebackup(const char *host, const char *port, const char *data_dir)
 {
 	char		script[MAXLEN];
-	char		rsync_flags[MAXLEN];
-	char		host_string[MAXLEN];
+	char		basebackup_bin[MAXLEN];
+	char		user_buf[MAXLEN] = "";
+	char		rate_buf[MAXLEN] = "";
 	int			r;
 
-	if (*options.rsync_options == '\0')
-		maxlen_snprintf(
-						rsync_flags, "%s",
-					 "--archive --checksum --compress --progress --rsh=ssh");
-	else
-		maxlen_snprintf(rsync_flags, "%s", options.rsync_options);
+	pg_basebackup_bin(basebackup_bin);
 
-	if (runtime_options.force)
-		strcat(rsync_flags, " --delete");
+	if (runtime_options.username[0])
+		maxlen_snprintf(user_buf, " -U %s", runtime_options.username);
 
-	if (!remote_user[0])
-	{
-		maxlen_snprintf(host_string, "%s", host);
-	}
-	else
-	{
-		maxlen_snprintf(host_string, "%s@%s", remote_user, host);
-	}
+	if (runtime_options.max_rate > 0)
+		maxlen_snprintf(rate_buf, " --max-rate=%dk", runtime_options.max_rate);
 
-	if (is_directory)
-	{
-		strcat(rsync_flags,
-			   " --exclude=pg_xlog* --exclude=pg_log* --exclude=pg_control --exclude=*.pid");
-		maxlen_snprintf(script, "rsync %s %s:%s/* %s",
-						rsync_flags, host_string, remote_path, local_path);
-	}
-	else
-	{
-		maxlen_snprintf(script, "rsync %s %s:%s %s",
-						rsync_flags, host_string, remote_path, local_path);
-	}
+	if (runtime_options.max_latency > 0)
+		log_warning(_("--max-latency is ignored when cloning from a standby\n"));
 
-	log_info(_("rsync command line:  '%s'\n"), script);
+	maxlen_snprintf(script, "%s -h %s -p %s%s -D %s -X stream%s%s",
+					basebackup_bin, host, port, user_buf, data_dir, rate_buf,
+					runtime_options.verbose ? " --progress --verbose" : "");
+	log_info(_("pg_basebackup command line:  '%s'\n"), script);
 
 	r = system(script);
-
-	/*
-	 * If we are transfering a directory (data directory, tablespace
-	 * directories) then we can ignore some rsync warnings.  If we get some of
-	 * those errors, we treat them as 0 only if passed the
-	 * --ignore-rsync-warning command-line option.
-	 *
-	 * List of ignorable rsync errors: 24	  Partial transfer due to vanished
-	 * source files
-	 */
-	if ((WEXITSTATUS(r) == 24) && is_directory)
-	{
-		if (runtime_options.ignore_rsync_warn)
-		{
-			r = 0;
-			log_info(_("rsync partial transfer warning ignored\n"));
-		}
-		else
-			log_warning(_("rsync completed with return code 24: "
-					   "\"Partial transfer due to vanished source files\".\n"
-						  "This can happen because of normal operation "
-						  "on the master server, but it may indicate an "
-					 "unexpected change during cloning.  If you are certain "
-						  "no changes were made to the master, try cloning "
-				  "again using \"repmgr --force --ignore-rsync-warning\"."));
-	}
 	if (r != 0)
-		log_err(_("Can't rsync from remote file or directory (%s:%s)\n"),
-				host_string, remote_path);
+		log_err(_("Can't take a base backup from %s:%s\n"), host, port);
 
 	return r;
 }
@@ -2157,6 +4535,26 @@ check_parameters_for_action(const int action)
 				ok = false;
 			}
 			break;
+		case STANDBY_SWITCHOVER:
+
+			/*
+			 * Like STANDBY PROMOTE, the current master is found through
+			 * repl_nodes
+			 */
+			if (runtime_options.host[0] || runtime_options.masterport[0] ||
+				runtime_options.username[0] || runtime_options.dbname[0])
+			{
+				log_err(_("You can't use connection parameters to the master when issuing a STANDBY SWITCHOVER command.\n"));
+				usage();
+				ok = false;
+			}
+			if (runtime_options.dest_dir[0])
+			{
+				log_err(_("You don't need a destination directory for STANDBY SWITCHOVER command\n"));
+				usage();
+				ok = false;
+			}
+			break;
 		case STANDBY_CLONE:
 
 			/*
@@ -2194,6 +4592,40 @@ check_parameters_for_action(const int action)
 		case CLUSTER_CLEANUP:
 			/* allow all parameters to be supplied */
 			break;
+		case NODE_REJOIN:
+
+			/*
+			 * The node is down, so the new master can't be found through it:
+			 * we need its address, and the local data directory
+			 */
+			if (!runtime_options.host[0])
+			{
+				log_err(_("You need to give the new master's address when issuing a NODE REJOIN command.\n"));
+				usage();
+				ok = false;
+			}
+			if (!runtime_options.dest_dir[0])
+			{
+				log_err(_("You need to give the data directory of the node when issuing a NODE REJOIN command.\n"));
+				usage();
+				ok = false;
+			}
+			break;
+	}
+
+	if (runtime_options.resume && action != STANDBY_CLONE)
+	{
+		log_err(_("The --resume option can only be used with STANDBY CLONE\n"));
+		usage();
+		ok = false;
+	}
+
+	if ((runtime_options.max_rate > 0 || runtime_options.max_latency > 0) &&
+		action != STANDBY_CLONE)
+	{
+		log_err(_("The --max-rate and --max-latency options can only be used with STANDBY CLONE\n"));
+		usage();
+		ok = false;
 	}
 
 	return ok;
@@ -2270,6 +4702,41 @@ create_schema(PGconn *conn)
 	}
 	PQclear(res);
 
+	/* repmgrd keeps the nodes in memory, until this tells it they changed */
+	sqlquery_snprintf(sqlquery,
+					  "CREATE FUNCTION %s.repl_nodes_notify() RETURNS trigger "
+					  "AS $$ BEGIN "
+					  "  PERFORM pg_notify('" REGISTRY_CHANNEL "', TG_TABLE_SCHEMA); "
+					  "  RETURN NULL; "
+					  "END $$ LANGUAGE plpgsql", repmgr_schema);
+	log_debug(_("master register: %s\n"), sqlquery);
+	res = PQexec(conn, sqlquery);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		log_err(_("Cannot create the function %s.repl_nodes_notify: %s\n"),
+				repmgr_schema, PQerrorMessage(conn));
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	PQclear(res);
+
+	sqlquery_snprintf(sqlquery,
+					  "CREATE TRIGGER repl_nodes_notify "
+					  "  AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE "
+					  "  ON %s.repl_nodes FOR EACH STATEMENT "
+					  "  EXECUTE PROCEDURE %s.repl_nodes_notify()",
+					  repmgr_schema, repmgr_schema);
+	log_debug(_("master register: %s\n"), sqlquery);
+	res = PQexec(conn, sqlquery);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		log_err(_("Cannot create the trigger on %s.repl_nodes: %s\n"),
+				repmgr_schema, PQerrorMessage(conn));
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	PQclear(res);
+
 	sqlquery_snprintf(sqlquery, "CREATE TABLE %s.repl_monitor ( "
 					  "  primary_node                   INTEGER NOT NULL, "
 					  "  standby_node                   INTEGER NOT NULL, "
@@ -2330,6 +4797,25 @@ create_schema(PGconn *conn)
 	}
 	PQclear(res);
 
+	/* what happened to the nodes, as reported by repmgr and repmgrd */
+	sqlquery_snprintf(sqlquery, "CREATE TABLE %s.repl_events ( "
+					  "  node_id          INTEGER NOT NULL, "
+					  "  event            TEXT NOT NULL, "
+					  "  successful       BOOLEAN NOT NULL DEFAULT TRUE, "
+		  "  event_timestamp  TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(), "
+					  "  duration_ms      BIGINT, "
+					  "  details          TEXT) ", repmgr_schema);
+	log_debug(_("master register: %s\n"), sqlquery);
+	res = PQexec(conn, sqlquery);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		log_err(_("Cannot create the table %s.repl_events: %s\n"),
+				repmgr_schema, PQerrorMessage(conn));
+		PQfinish(conn);
+		exit(ERR_BAD_CONFIG);
+	}
+	PQclear(res);
+
 	/*
 	 * XXX Here we MUST try to load the repmgr_function.sql not hardcode it
 	 * here
@@ -2360,6 +4846,33 @@ create_schema(PGconn *conn)
 	}
 	PQclear(res);
 
+	/* the election functions, see do_failover() in repmgrd */
+	sqlquery_snprintf(sqlquery,
+					  "CREATE OR REPLACE FUNCTION %s.repmgr_request_vote(bigint, integer, integer) RETURNS boolean "
+					  "AS '$libdir/repmgr_funcs', 'repmgr_request_vote' "
+					  "LANGUAGE C STRICT ", repmgr_schema);
+	res = PQexec(conn, sqlquery);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "Cannot create the function repmgr_request_vote: %s\n",
+				PQerrorMessage(conn));
+		return false;
+	}
+	PQclear(res);
+
+	sqlquery_snprintf(sqlquery,
+					  "CREATE OR REPLACE FUNCTION %s.repmgr_get_voted_epoch() RETURNS bigint "
+					  "AS '$libdir/repmgr_funcs', 'repmgr_get_voted_epoch' "
+					  "LANGUAGE C STRICT ", repmgr_schema);
+	res = PQexec(conn, sqlquery);
+	if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		fprintf(stderr, "Cannot create the function repmgr_get_voted_epoch: %s\n",
+				PQerrorMessage(conn));
+		return false;
+	}
+	PQclear(res);
+
 	return true;
 }
 
@@ -2419,8 +4932,20 @@ copy_configuration(PGconn *masterconn, PGconn *witnessconn)
 static void
 write_primary_conninfo(char *line)
 {
-	char		host_buf[MAXLEN] = "";
 	char		conn_buf[MAXLEN] = "";
+
+	build_primary_conninfo(conn_buf);
+	maxlen_snprintf(line, "primary_conninfo = '%s'", conn_buf);
+}
+
+
+/*
+ * Builds the connection string a standby uses to reach its upstream node
+ */
+static void
+build_primary_conninfo(char *conn_buf)
+{
+	char		host_buf[MAXLEN] = "";
 	char		user_buf[MAXLEN] = "";
 	char		appname_buf[MAXLEN] = "";
 	char		password_buf[MAXLEN] = "";
@@ -2458,7 +4983,103 @@ write_primary_conninfo(char *line)
 	   (runtime_options.masterport[0]) ? runtime_options.masterport : "5432",
 					host_buf, user_buf, password_buf,
 					appname_buf);
+}
 
-	maxlen_snprintf(line, "primary_conninfo = '%s'", conn_buf);
 
+/*
+ * Stores primary_conninfo with ALTER SYSTEM, on servers (12 and later)
+ * where it is a regular setting instead of a line of recovery.conf
+ */
+static bool
+set_primary_conninfo(PGconn *conn)
+{
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	char		conn_buf[MAXLEN] = "";
+	char	   *literal;
+
+	build_primary_conninfo(conn_buf);
+	literal = PQescapeLiteral(conn, conn_buf, strlen(conn_buf));
+	if (literal == NULL)
+	{
+		log_err(_("Can't quote primary_conninfo: %s\n"), PQerrorMessage(conn));
+		return false;
+	}
+	sqlquery_snprintf(sqlquery, "ALTER SYSTEM SET primary_conninfo = %s",
+					  literal);
+	PQfreemem(literal);
+
+	res = PQexec(conn, sqlquery);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		log_err(_("Can't set primary_conninfo: %s\n"), PQerrorMessage(conn));
+		PQclear(res);
+		return false;
+	}
+	PQclear(res);
+
+	return true;
+}
+
+
+/* the pid of the WAL receiver, 0 if there is none */
+static int
+get_wal_receiver_pid(PGconn *conn)
+{
+	PGresult   *res;
+	int			pid = 0;
+
+	res = PQexec(conn, "SELECT pid FROM pg_stat_wal_receiver");
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 &&
+		!PQgetisnull(res, 0, 0))
+		pid = atoi(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	return pid;
+}
+
+
+/*
+ * Waits until the WAL receiver streams from the new master, after
+ * primary_conninfo was changed with a reload.  Until the reload takes
+ * effect the old receiver still streams from the old upstream: the new one
+ * has another pid, or it already was connected to the new master's host
+ * and port.
+ */
+static bool
+wait_for_streaming(PGconn *conn, int old_receiver_pid)
+{
+	PGresult   *res;
+	const char *values[3];
+	char		pid_str[MAXLEN];
+	bool		streaming;
+	int			waited;
+
+	maxlen_snprintf(pid_str, "%d", old_receiver_pid);
+	values[0] = pid_str;
+	values[1] = runtime_options.host;
+	values[2] = runtime_options.masterport;
+
+	for (waited = 0; waited < PROMOTE_TIMEOUT * 1000;
+		 waited += SWITCHOVER_POLL_MS)
+	{
+		res = PQexecParams(conn,
+						   "SELECT status = 'streaming' "
+						   "   AND (pid <> $1::int "
+						   "        OR (sender_host = $2 "
+						   "            AND sender_port::text = $3)) "
+						   "  FROM pg_stat_wal_receiver",
+						   3, NULL, values, NULL, NULL, 0);
+		streaming = (PQresultStatus(res) == PGRES_TUPLES_OK &&
+					 PQntuples(res) == 1 &&
+					 strcmp(PQgetvalue(res, 0, 0), "t") == 0);
+		PQclear(res);
+
+		if (streaming)
+			return true;
+
+		usleep(SWITCHOVER_POLL_MS * 1000);
+	}
+
+	return false;
 }
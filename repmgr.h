@@ -42,6 +42,7 @@
 #define DEFAULT_MASTER_PORT		"5432"
 #define DEFAULT_DBNAME			"postgres"
 #define DEFAULT_REPMGR_SCHEMA_PREFIX	"repmgr_"
+#define DEFAULT_CLONE_JOBS		4
 
 #define MANUAL_FAILOVER		0
 #define AUTOMATIC_FAILOVER	1
@@ -69,8 +70,19 @@ typedef struct
 	int			keep_history;
 
 	char min_recovery_apply_delay[MAXLEN];
+
+	/* parameters used by STANDBY CLONE */
+	bool		resume;
+	bool		from_standby;
+	int			max_rate;
+	int			max_latency;
+	int			jobs;
+	bool		verify;
+
+	/* parameter used by STANDBY SWITCHOVER */
+	char		remote_config_file[MAXFILENAME];
 }	t_runtime_options;
 
-#define T_RUNTIME_OPTIONS_INITIALIZER { "", "", "", "", "", "", DEFAULT_WAL_KEEP_SEGMENTS, false, false, false, false, "", "", 0, "" }
+#define T_RUNTIME_OPTIONS_INITIALIZER { "", "", "", "", "", "", DEFAULT_WAL_KEEP_SEGMENTS, false, false, false, false, "", "", 0, "", false, false, 0, 0, DEFAULT_CLONE_JOBS, false, "" }
 
 #endif
@@ -22,6 +22,22 @@ CREATE TABLE repl_nodes (
 );
 ALTER TABLE repl_nodes OWNER TO repmgr;
 
+/*
+ * Tells the repmgrd daemons, which keep the nodes in memory, that they
+ * changed
+ */
+CREATE FUNCTION repl_nodes_notify() RETURNS trigger AS $$
+BEGIN
+  PERFORM pg_notify('repmgr_nodes', TG_TABLE_SCHEMA);
+  RETURN NULL;
+END
+$$ LANGUAGE plpgsql;
+ALTER FUNCTION repl_nodes_notify() OWNER TO repmgr;
+
+CREATE TRIGGER repl_nodes_notify
+  AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON repl_nodes
+  FOR EACH STATEMENT EXECUTE PROCEDURE repl_nodes_notify();
+
 /*
  * Keeps monitor info about every node and their relative "position"
  * to primary
@@ -59,3 +75,17 @@ WHERE (standby_node, last_monitor_time) IN (SELECT standby_node, MAX(last_monito
 ALTER VIEW repl_status OWNER TO repmgr;
 
 CREATE INDEX idx_repl_status_sort ON repl_monitor(last_monitor_time, standby_node);
+
+/*
+ * What happened to the nodes: failovers, with how long they took and
+ * the duration of each step in details
+ */
+CREATE TABLE repl_events (
+  node_id                        INTEGER NOT NULL,
+  event                          TEXT NOT NULL,
+  successful                     BOOLEAN NOT NULL DEFAULT TRUE,
+  event_timestamp                TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),
+  duration_ms                    BIGINT,
+  details                        TEXT
+);
+ALTER TABLE repl_events OWNER TO repmgr;
@@ -24,15 +24,24 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "repmgr.h"
+#include "arbiter.h"
 #include "config.h"
+#include "election.h"
+#include "events.h"
 #include "log.h"
+#include "registry.h"
 #include "strutil.h"
+#include "trace.h"
 #include "version.h"
 
 /* PostgreSQL's headers needed to export some functionality */
@@ -53,7 +62,7 @@ const XLogRecPtr InvalidXLogRecPtr = {0, 0};
 		a = b
 
 #define XLAssignValue(a, xlogid, xrecoff) \
-		a = xrecoff
+		a = ((XLogRecPtr) (xlogid) << 32) | (xrecoff)
 
 #define XLByteLT(a, b) \
 		(a < b)
@@ -69,18 +78,22 @@ const XLogRecPtr InvalidXLogRecPtr = {0, 0};
 
 
 /*
- * Struct to keep info about the nodes, used in the voting process in
- * do_failover()
+ * While monitoring, the apply rate is tracked as a moving average, used at
+ * failover when the replay sample doesn't show any progress (see
+ * election.h)
  */
-typedef struct s_node_info
-{
-	int			node_id;
-	char		conninfo_str[MAXLEN];
-	XLogRecPtr	xlog_location;
-	bool		is_ready;
-	bool		is_visible;
-	bool		is_witness;
-}	t_node_info;
+#define APPLY_RATE_WEIGHT		0.3
+
+/*
+ * Every repmgrd sends heartbeats to the arbiters at each monitoring step.
+ * Before a failover, a master whose heartbeats an arbiter received in the
+ * last ARBITER_HEARTBEAT_SECS (or three monitoring steps) is still alive:
+ * the standby is the one cut off.
+ */
+#define ARBITER_HEARTBEAT_SECS	10
+
+/* where standbys keep the list of blocks cached by the master */
+#define BUFFER_SNAPSHOT_FILE	"repmgr_master_buffers.snapshot"
 
 
 /* Local info */
@@ -102,6 +115,12 @@ char		repmgr_schema[MAXLEN];
 
 bool		failover_done = false;
 
+/* replay speed of this standby, in bytes per second, 0 while unknown */
+static double apply_rate = 0;
+
+/* path of the master's buffer cache snapshot, set on first capture */
+static char buffer_snapshot[MAXFILENAME] = "";
+
 char	   *pid_file = NULL;
 
 t_configuration_options config = T_CONFIGURATION_OPTIONS_INITIALIZER;
@@ -116,9 +135,16 @@ static void witness_monitor(void);
 static bool check_connection(PGconn *conn, const char *type);
 static void update_shared_memory(char *last_wal_standby_applied);
 static void update_registration(void);
+static void reload_local_config(bool register_node);
 static void do_failover(void);
-
-static unsigned long long int wal_location_to_bytes(char *wal_location);
+static void report_followers(t_node_info *nodes, int total_nodes);
+static bool win_election(t_node_info *nodes, int total_nodes,
+			 long long epoch);
+static void sample_apply_rate(void);
+static long estimate_replay_eta(char *received);
+static void capture_master_buffers(void);
+static void send_arbiter_heartbeats(void);
+static void prewarm_new_master(void);
 
 /*
  * Flag to mark SIGHUP. Whenever the main loop comes around it
@@ -126,10 +152,22 @@ static unsigned long long int wal_location_to_bytes(char *wal_location);
  */
 static volatile sig_atomic_t got_SIGHUP = false;
 
+/*
+ * Flag to mark SIGINT and SIGTERM.  repmgrd stops at the next point where
+ * it waits, out of the signal handler: stopping records an event and
+ * flushes the log, which take locks the interrupted code may hold.
+ */
+static volatile sig_atomic_t got_SIGTERM = false;
+
+/* when the master stopped answering, and how many times it was retried */
+static long long master_lost_at = 0;
+static int	master_lost_attempts = 0;
+
 static void handle_sighup(SIGNAL_ARGS);
 static void handle_sigint(SIGNAL_ARGS);
 
 static void terminate(int retval);
+static void check_terminate(void);
 
 #ifndef WIN32
 static void setup_event_handlers(void);
@@ -273,8 +311,24 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* from now on, logging doesn't wait for the log file */
+	logger_start_async();
+
 	xsnprintf(repmgr_schema, MAXLEN, "%s%s", DEFAULT_REPMGR_SCHEMA_PREFIX,
 			 local_options.cluster_name);
+	statements_init(repmgr_schema);
+	registry_init(repmgr_schema, local_options.cluster_name);
+
+	/* an arbiter witness has no database, it only answers other repmgrds */
+	if (is_arbiter_conninfo(local_options.conninfo, NULL, NULL))
+	{
+		run_arbiter(&local_options);
+		terminate(0);
+	}
+
+	events_init(&local_options);
+	events_start();
+	record_event("repmgrd_start", true, -1, NULL);
 
 	log_info(_("%s Connecting to database '%s'\n"), progname,
 			 local_options.conninfo);
@@ -335,15 +389,10 @@ main(int argc, char **argv)
 				primary_conn = my_local_conn;
 
 				check_cluster_configuration(my_local_conn);
+				registry_listen(primary_conn);
 				check_node_configuration();
 
-				if (reload_config(config_file, &local_options))
-				{
-					PQfinish(my_local_conn);
-					my_local_conn = establish_db_connection(local_options.conninfo, true);
-					primary_conn = my_local_conn;
-					update_registration();
-				}
+				reload_local_config(true);
 
 				log_info(_("%s Starting continuous primary connection check\n"),
 						 progname);
@@ -365,7 +414,10 @@ main(int argc, char **argv)
 						 * CheckActiveStandbiesConnections();
 						 * CheckInactiveStandbies();
 						 */
-						sleep(local_options.monitor_interval_secs);
+						send_arbiter_heartbeats();
+						registry_wait(primary_conn,
+									  local_options.monitor_interval_secs);
+						check_terminate();
 					}
 					else
 					{
@@ -377,31 +429,7 @@ main(int argc, char **argv)
 
 					if (got_SIGHUP)
 					{
-						/*
-						 * if we can reload, then could need to change
-						 * my_local_conn
-						 */
-						if (reload_config(config_file, &local_options))
-						{
-							PQfinish(my_local_conn);
-							my_local_conn = establish_db_connection(local_options.conninfo, true);
-							primary_conn = my_local_conn;
-
-							if (*local_options.logfile)
-							{
-								FILE	   *fd;
-
-								fd = freopen(local_options.logfile, "a", stderr);
-								if (fd == NULL)
-								{
-									fprintf(stderr, "error reopening stderr to '%s': %s",
-									 local_options.logfile, strerror(errno));
-								}
-
-							}
-
-							update_registration();
-						}
+						reload_local_config(false);
 						got_SIGHUP = false;
 					}
 				} while (!failover_done);
@@ -412,8 +440,7 @@ main(int argc, char **argv)
 				/* I need the id of the primary as well as a connection to it */
 				log_info(_("%s Connecting to primary for cluster '%s'\n"),
 						 progname, local_options.cluster_name);
-				primary_conn = get_master_connection(my_local_conn, repmgr_schema,
-												  local_options.cluster_name,
+				primary_conn = get_master_connection(my_local_conn,
 												&primary_options.node, NULL);
 				if (primary_conn == NULL)
 				{
@@ -421,14 +448,10 @@ main(int argc, char **argv)
 				}
 
 				check_cluster_configuration(my_local_conn);
+				registry_listen(primary_conn);
 				check_node_configuration();
 
-				if (reload_config(config_file, &local_options))
-				{
-					PQfinish(my_local_conn);
-					my_local_conn = establish_db_connection(local_options.conninfo, true);
-					update_registration();
-				}
+				reload_local_config(true);
 
 				/*
 				 * Every local_options.monitor_interval_secs seconds, do
@@ -451,20 +474,13 @@ main(int argc, char **argv)
 						witness_monitor();
 					else if (my_local_mode == STANDBY_MODE)
 						standby_monitor();
-					sleep(local_options.monitor_interval_secs);
+					registry_wait(primary_conn,
+								  local_options.monitor_interval_secs);
+					check_terminate();
 
 					if (got_SIGHUP)
 					{
-						/*
-						 * if we can reload, then could need to change
-						 * my_local_conn
-						 */
-						if (reload_config(config_file, &local_options))
-						{
-							PQfinish(my_local_conn);
-							my_local_conn = establish_db_connection(local_options.conninfo, true);
-							update_registration();
-						}
+						reload_local_config(false);
 						got_SIGHUP = false;
 					}
 				} while (!failover_done);
@@ -495,7 +511,7 @@ witness_monitor(void)
 {
 	char		monitor_witness_timestamp[MAXLEN];
 	PGresult   *res;
-	char		sqlquery[QUERY_STR_LEN];
+	t_stmt_params params;
 
 	/*
 	 * Check if the master is still available, if after 5 minutes of retries
@@ -531,9 +547,7 @@ witness_monitor(void)
 		return;
 
 	/* Get local xlog info */
-	sqlquery_snprintf(sqlquery, "SELECT CURRENT_TIMESTAMP ");
-
-	res = PQexec(my_local_conn, sqlquery);
+	res = exec_statement(my_local_conn, STMT_CURRENT_TIMESTAMP, NULL);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
 		log_err(_("PQexec failed: %s\n"), PQerrorMessage(my_local_conn));
@@ -546,22 +560,20 @@ witness_monitor(void)
 	PQclear(res);
 
 	/*
-	 * Build the SQL to execute on primary
+	 * Build the parameters of the INSERT to execute on primary
 	 */
-	sqlquery_snprintf(sqlquery,
-					  "INSERT INTO %s.repl_monitor "
-					  "VALUES(%d, %d, '%s'::timestamp with time zone, "
-					  " pg_current_xlog_location(), null,  "
-					  " 0, 0)",
-					  repmgr_schema, primary_options.node, local_options.node,
-					  monitor_witness_timestamp);
+	stmt_params_init(&params);
+	stmt_param_int4(&params, primary_options.node);
+	stmt_param_int4(&params, local_options.node);
+	stmt_param_text(&params, monitor_witness_timestamp);
 
 	/*
 	 * Execute the query asynchronously, but don't check for a result. We will
 	 * check the result next time we pause for a monitor step.
 	 */
-	log_debug("witness_monitor: %s\n", sqlquery);
-	if (PQsendQuery(primary_conn, sqlquery) == 0)
+	log_debug("witness_monitor: %s\n", monitor_witness_timestamp);
+	if (send_statement(primary_conn, STMT_INSERT_WITNESS_MONITOR, &params,
+					   local_options.master_response_timeout) == 0)
 		log_warning(_("Query could not be sent to primary. %s\n"),
 					PQerrorMessage(primary_conn));
 }
@@ -581,7 +593,8 @@ standby_monitor(void)
 	char		last_wal_standby_received[MAXLEN];
 	char		last_wal_standby_applied[MAXLEN];
 	char		last_wal_standby_applied_timestamp[MAXLEN];
-	char		sqlquery[QUERY_STR_LEN];
+	bool		applied_timestamp_null;
+	t_stmt_params params;
 
 	unsigned long long int lsn_primary;
 	unsigned long long int lsn_standby_received;
@@ -617,8 +630,8 @@ standby_monitor(void)
 			log_err(_("We couldn't reconnect to master. Now checking if another node has been promoted.\n"));
 			for (connection_retries = 0; connection_retries < 6; connection_retries++)
 			{
-				primary_conn = get_master_connection(my_local_conn, repmgr_schema,
-					local_options.cluster_name, &primary_options.node, NULL);
+				primary_conn = get_master_connection(my_local_conn,
+												&primary_options.node, NULL);
 				if (PQstatus(primary_conn) == CONNECTION_OK)
 				{
 					/*
@@ -640,6 +653,7 @@ standby_monitor(void)
 					 * trying
 					 */
 					sleep(local_options.retry_promote_interval_secs);
+					check_terminate();
 				}
 			}
 
@@ -690,9 +704,15 @@ standby_monitor(void)
 		log_info(_("standby connection got back up again!\n"));
 	}
 
+	sample_apply_rate();
+	send_arbiter_heartbeats();
+
 	/* Fast path for the case where no history is requested */
 	if (!monitoring_history)
+	{
+		capture_master_buffers();
 		return;
+	}
 
 	/*
 	 * Cancel any query that is still being executed, so i can insert the
@@ -703,13 +723,10 @@ standby_monitor(void)
 	if (wait_connection_availability(primary_conn, local_options.master_response_timeout) != 1)
 		return;
 
-	/* Get local xlog info */
-	sqlquery_snprintf(
-					  sqlquery,
-				"SELECT CURRENT_TIMESTAMP, pg_last_xlog_receive_location(), "
-		  "pg_last_xlog_replay_location(), pg_last_xact_replay_timestamp()");
+	capture_master_buffers();
 
-	res = PQexec(my_local_conn, sqlquery);
+	/* Get local xlog info */
+	res = exec_statement(my_local_conn, STMT_STANDBY_LOCATIONS, NULL);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
 		log_err(_("PQexec failed: %s\n"), PQerrorMessage(my_local_conn));
@@ -722,12 +739,14 @@ standby_monitor(void)
 	strncpy(last_wal_standby_received, PQgetvalue(res, 0, 1), MAXLEN);
 	strncpy(last_wal_standby_applied, PQgetvalue(res, 0, 2), MAXLEN);
 	strncpy(last_wal_standby_applied_timestamp, PQgetvalue(res, 0, 3), MAXLEN);
+	applied_timestamp_null = PQgetisnull(res, 0, 3);
 	PQclear(res);
 
-	/* Get primary xlog info */
-	sqlquery_snprintf(sqlquery, "SELECT pg_current_xlog_location() ");
+	log_set_peer(primary_options.node);
+	log_set_lsn(last_wal_standby_received);
 
-	res = PQexec(primary_conn, sqlquery);
+	/* Get primary xlog info */
+	res = exec_statement(primary_conn, STMT_MASTER_LOCATION, NULL);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
 		log_err(_("PQexec failed: %s\n"), PQerrorMessage(primary_conn));
@@ -744,26 +763,28 @@ standby_monitor(void)
 	lsn_standby_applied = wal_location_to_bytes(last_wal_standby_applied);
 
 	/*
-	 * Build the SQL to execute on primary
+	 * Build the parameters of the INSERT to execute on primary
 	 */
-	sqlquery_snprintf(sqlquery,
-					  "INSERT INTO %s.repl_monitor "
-					  "VALUES(%d, %d, '%s'::timestamp with time zone, "
-					  " '%s'::timestamp with time zone, '%s', '%s', "
-					  " %lld, %lld)", repmgr_schema,
-		 primary_options.node, local_options.node, monitor_standby_timestamp,
-					  last_wal_standby_applied_timestamp,
-					  last_wal_primary_location,
-					  last_wal_standby_received,
-					  (lsn_primary - lsn_standby_received),
-					  (lsn_standby_received - lsn_standby_applied));
+	stmt_params_init(&params);
+	stmt_param_int4(&params, primary_options.node);
+	stmt_param_int4(&params, local_options.node);
+	stmt_param_text(&params, monitor_standby_timestamp);
+	stmt_param_text(&params, applied_timestamp_null ? NULL :
+					last_wal_standby_applied_timestamp);
+	stmt_param_text(&params, last_wal_primary_location);
+	stmt_param_text(&params, last_wal_standby_received);
+	stmt_param_int8(&params, lsn_primary - lsn_standby_received);
+	stmt_param_int8(&params, lsn_standby_received - lsn_standby_applied);
 
 	/*
 	 * Execute the query asynchronously, but don't check for a result. We will
 	 * check the result next time we pause for a monitor step.
 	 */
-	log_debug("standby_monitor: %s\n", sqlquery);
-	if (PQsendQuery(primary_conn, sqlquery) == 0)
+	log_debug("standby_monitor: primary %s, received %s, applied %s\n",
+			  last_wal_primary_location, last_wal_standby_received,
+			  last_wal_standby_applied);
+	if (send_statement(primary_conn, STMT_INSERT_MONITOR, &params,
+					   local_options.master_response_timeout) == 0)
 		log_warning(_("Query could not be sent to primary. %s\n"),
 					PQerrorMessage(primary_conn));
 }
@@ -773,6 +794,7 @@ static void
 do_failover(void)
 {
 	PGresult   *res;
+	PGresult   *res_epoch;
 	char		sqlquery[QUERY_STR_LEN];
 
 	int			total_nodes = 0;
@@ -792,45 +814,70 @@ do_failover(void)
 
 	PGconn	   *node_conn = NULL;
 
-	/*
-	 * will get info about until 50 nodes, which seems to be large enough for
-	 * most scenarios
-	 */
-	t_node_info nodes[50];
+	/* info about every registered node */
+	t_node_info *nodes;
+	t_registry_node *registered;
 
 	/* initialize to keep compiler quiet */
-	t_node_info best_candidate = {-1, "", InvalidXLogRecPtr, false, false, false};
+	t_node_info best_candidate = {-1, "", "", InvalidXLogRecPtr, 0, 0, false, false, false};
+	long long	max_epoch = 0;
+	long long	epoch;
+	long		replay_eta;
+	long		heartbeat_age;
+	char		reply[MAXLEN];
+	char		location[MAXLEN];
+	char		detail[MAXLEN];
+	long long	duration;
 
-	/* get a list of standby nodes, including myself */
-	sprintf(sqlquery, "SELECT id, conninfo, witness "
-			"  FROM %s.repl_nodes "
-			" WHERE cluster = '%s' "
-			" ORDER BY priority, id ",
-			repmgr_schema, local_options.cluster_name);
+	/*
+	 * time every step, the failover starting when the master first failed to
+	 * answer
+	 */
+	if (master_lost_at == 0)
+		master_lost_at = trace_clock();
+	trace_set_file(local_options.trace_file, local_options.node);
+	trace_begin_at("failover", master_lost_at);
+	trace_begin_at("detection", master_lost_at);
+	maxlen_snprintf(detail, "attempts=%d", master_lost_attempts);
+	trace_end(true, detail);
+	trace_begin("visibility");
 
-	res = PQexec(my_local_conn, sqlquery);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	/*
+	 * get a list of standby nodes, including myself, from the node registry:
+	 * only read again if a change was notified
+	 */
+	total_nodes = registry_nodes(my_local_conn, &registered);
+	if (total_nodes < 0)
 	{
 		log_err(_("Can't get nodes' info: %s\n"), PQerrorMessage(my_local_conn));
-		PQclear(res);
 		terminate(ERR_DB_QUERY);
 	}
 
 	/*
 	 * total nodes that are registered
 	 */
-	total_nodes = PQntuples(res);
 	log_debug(_("%s: there are %d nodes registered\n"), progname, total_nodes);
 
+	nodes = malloc(Max(total_nodes, 1) * sizeof(t_node_info));
+	if (nodes == NULL)
+	{
+		log_err(_("Can't allocate the nodes' info\n"));
+		free(registered);
+		terminate(ERR_SYS_FAILURE);
+	}
+
 	/*
 	 * Build an array with the nodes and indicate which ones are visible and
 	 * ready
 	 */
 	for (i = 0; i < total_nodes; i++)
 	{
-		nodes[i].node_id = atoi(PQgetvalue(res, i, 0));
-		strncpy(nodes[i].conninfo_str, PQgetvalue(res, i, 1), MAXLEN);
-		nodes[i].is_witness = (strcmp(PQgetvalue(res, i, 2), "t") == 0) ? true : false;
+		nodes[i].node_id = registered[i].node_id;
+		snprintf(nodes[i].conninfo_str, sizeof(nodes[i].conninfo_str), "%s",
+				 registered[i].conninfo);
+		nodes[i].is_witness = registered[i].is_witness;
+		snprintf(nodes[i].name, sizeof(nodes[i].name), "%s",
+				 registered[i].name);
 
 		/*
 		 * Initialize on false so if we can't reach this node we know that
@@ -840,11 +887,27 @@ do_failover(void)
 		nodes[i].is_ready = false;
 
 		XLAssignValue(nodes[i].xlog_location, 0, 0);
+		nodes[i].received_bytes = 0;
+		nodes[i].replay_eta = REPLAY_ETA_UNKNOWN;
 
 		log_debug(_("%s: node=%d conninfo=\"%s\" witness=%s\n"),
 				  progname, nodes[i].node_id, nodes[i].conninfo_str,
 				  (nodes[i].is_witness) ? "true" : "false");
 
+		if (is_arbiter_conninfo(nodes[i].conninfo_str, NULL, NULL))
+		{
+			if (arbiter_request(nodes[i].conninfo_str, "EPOCH", reply,
+								sizeof(reply)) &&
+				sscanf(reply, "EPOCH %lld", &epoch) == 1)
+			{
+				visible_nodes++;
+				nodes[i].is_visible = true;
+				if (epoch > max_epoch)
+					max_epoch = epoch;
+			}
+			continue;
+		}
+
 		node_conn = establish_db_connection(nodes[i].conninfo_str, false);
 
 		/* if we can't see the node just skip it */
@@ -859,9 +922,19 @@ do_failover(void)
 		visible_nodes++;
 		nodes[i].is_visible = true;
 
+		/* the last election any node took part in */
+		sqlquery_snprintf(sqlquery, "SELECT %s.repmgr_get_voted_epoch()",
+						  repmgr_schema);
+		res_epoch = PQexec(node_conn, sqlquery);
+		if (PQresultStatus(res_epoch) == PGRES_TUPLES_OK &&
+			!PQgetisnull(res_epoch, 0, 0) &&
+			atoll(PQgetvalue(res_epoch, 0, 0)) > max_epoch)
+			max_epoch = atoll(PQgetvalue(res_epoch, 0, 0));
+		PQclear(res_epoch);
+
 		PQfinish(node_conn);
 	}
-	PQclear(res);
+	free(registered);
 
 	log_debug(_("Total nodes counted: registered=%d, visible=%d\n"),
 			  total_nodes, visible_nodes);
@@ -878,7 +951,32 @@ do_failover(void)
 		terminate(ERR_FAILOVER_FAIL);
 	}
 
+	/* an arbiter still hearing from the master means we are the ones isolated */
+	for (i = 0; i < total_nodes; i++)
+	{
+		if (!nodes[i].is_visible ||
+			!is_arbiter_conninfo(nodes[i].conninfo_str, NULL, NULL))
+			continue;
+
+		sqlquery_snprintf(sqlquery, "VISIBLE %d", primary_options.node);
+		if (arbiter_request(nodes[i].conninfo_str, sqlquery, reply,
+							sizeof(reply)) &&
+			sscanf(reply, "YES %ld", &heartbeat_age) == 1 &&
+			heartbeat_age < Max(ARBITER_HEARTBEAT_SECS,
+								3 * local_options.monitor_interval_secs) * 1000L)
+		{
+			log_err(_("Arbiter %d heard from master %d %ld ms ago, this node is cut off from it.\n"
+					  "Manual action will be needed to readd this node to the cluster.\n"),
+					nodes[i].node_id, primary_options.node, heartbeat_age);
+			terminate(ERR_FAILOVER_FAIL);
+		}
+	}
+
+	maxlen_snprintf(detail, "visible=%d/%d", visible_nodes, total_nodes);
+	trace_end(true, detail);
+
 	/* Query all the nodes to determine which ones are ready */
+	trace_begin("lsn_collection");
 	for (i = 0; i < total_nodes; i++)
 	{
 		/* if the node is not visible, skip it */
@@ -888,6 +986,8 @@ do_failover(void)
 		if (nodes[i].is_witness)
 			continue;
 
+		log_set_peer(nodes[i].node_id);
+
 		node_conn = establish_db_connection(nodes[i].conninfo_str, false);
 
 		/*
@@ -933,31 +1033,41 @@ do_failover(void)
 		}
 
 		XLAssignValue(nodes[i].xlog_location, uxlogid, uxrecoff);
+		nodes[i].received_bytes = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+		log_set_lsn(PQgetvalue(res, 0, 0));
 
 		PQclear(res);
 		PQfinish(node_conn);
 	}
+	trace_end(true, NULL);
 
-	/* last we get info about this node, and update shared memory */
-	sprintf(sqlquery, "SELECT pg_last_xlog_receive_location()");
-	res = PQexec(my_local_conn, sqlquery);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	/*
+	 * last we get info about this node, and update shared memory: the last
+	 * location received and the time needed to replay up to it, so every
+	 * node ranks the candidates with the same figures
+	 */
+	trace_begin("replay_sample");
+	replay_eta = estimate_replay_eta(location);
+	if (replay_eta < 0)
 	{
 		log_err(_("PQexec failed: %s.\nReport an invalid value to not be "
 				  " considered as new primary and exit.\n"),
 				PQerrorMessage(my_local_conn));
-		PQclear(res);
-		sprintf(last_wal_standby_applied, "'%X/%X'", 0, 0);
+		sprintf(last_wal_standby_applied, "%X/%X", 0, 0);
 		update_shared_memory(last_wal_standby_applied);
 		terminate(ERR_DB_QUERY);
 	}
 
 	/* write last location in shared memory */
-	update_shared_memory(PQgetvalue(res, 0, 0));
-	PQclear(res);
+	maxlen_snprintf(last_wal_standby_applied, "%s %ld", location, replay_eta);
+	update_shared_memory(last_wal_standby_applied);
+	trace_end(true, NULL);
 
+	trace_begin("readiness_wait");
 	for (i = 0; i < total_nodes; i++)
 	{
+		log_set_peer(nodes[i].node_id);
+		log_set_lsn(NULL);
 		while (!nodes[i].is_ready)
 		{
 			/*
@@ -1000,6 +1110,8 @@ do_failover(void)
 
 			uxlogid = 0;
 			uxrecoff = 0;
+			/* not published: ranked after the nodes with an estimate */
+			replay_eta = REPLAY_ETA_UNKNOWN;
 
 			sqlquery_snprintf(sqlquery, "SELECT %s.repmgr_get_last_standby_location()",
 							  repmgr_schema);
@@ -1014,7 +1126,9 @@ do_failover(void)
 				terminate(ERR_DB_QUERY);
 			}
 
-			if (sscanf(PQgetvalue(res, 0, 0), "%X/%X", &uxlogid, &uxrecoff) != 2)
+			/* a repmgrd without replay estimates publishes the location only */
+			if (sscanf(PQgetvalue(res, 0, 0), "%X/%X %ld",
+					   &uxlogid, &uxrecoff, &replay_eta) < 2)
 			{
 				log_info(_("could not parse transaction log location \"%s\"\n"),
 						 PQgetvalue(res, 0, 0));
@@ -1039,61 +1153,52 @@ do_failover(void)
 			if (XLByteLT(nodes[i].xlog_location, xlog_recptr))
 			{
 				XLAssignValue(nodes[i].xlog_location, uxlogid, uxrecoff);
+				nodes[i].received_bytes = wal_position_bytes(uxlogid, uxrecoff);
 			}
+			nodes[i].replay_eta = replay_eta;
 
-			log_debug("Last XLog position of node %d: log id=%u (%X), offset=%u (%X)\n",
+			log_debug("Last XLog position of node %d: log id=%u (%X), offset=%u (%X), replayed in %ld ms\n",
 					  nodes[i].node_id, uxlogid, uxlogid,
-					  uxrecoff, uxrecoff);
+					  uxrecoff, uxrecoff, replay_eta);
 
 			ready_nodes++;
 			nodes[i].is_ready = true;
 		}
 	}
+	log_set_peer(-1);
+	log_set_lsn(NULL);
+	maxlen_snprintf(detail, "ready=%d/%d", ready_nodes, total_nodes);
+	trace_end(true, detail);
 
 	/* Close the connection to this server */
 	PQfinish(my_local_conn);
 	my_local_conn = NULL;
 
-	/*
-	 * determine which one is the best candidate to promote to primary
-	 */
-	for (i = 0; i < total_nodes; i++)
+	/* determine which one is the best candidate to promote to primary */
+	i = choose_candidate(nodes, total_nodes,
+						 local_options.failover_lag_tolerance);
+	if (i >= 0)
 	{
-		/* witness is never a good candidate */
-		if (nodes[i].is_witness)
-			continue;
-
-		if (!nodes[i].is_ready || !nodes[i].is_visible)
-			continue;
-
-		if (!find_best)
-		{
-			/*
-			 * start with the first ready node, and then move on to the next
-			 * one
-			 */
-			best_candidate.node_id = nodes[i].node_id;
-			XLAssign(best_candidate.xlog_location, nodes[i].xlog_location);
-			best_candidate.is_ready = nodes[i].is_ready;
-			best_candidate.is_witness = nodes[i].is_witness;
-			find_best = true;
-		}
-
-		/* we use the macros provided by xlogdefs.h to compare XLogRecPtr */
+		best_candidate.node_id = nodes[i].node_id;
+		snprintf(best_candidate.conninfo_str,
+				 sizeof(best_candidate.conninfo_str), "%s",
+				 nodes[i].conninfo_str);
+		XLAssign(best_candidate.xlog_location, nodes[i].xlog_location);
+		best_candidate.received_bytes = nodes[i].received_bytes;
+		best_candidate.replay_eta = nodes[i].replay_eta;
+		best_candidate.is_ready = nodes[i].is_ready;
+		best_candidate.is_witness = nodes[i].is_witness;
+		find_best = true;
+	}
 
-		/*
-		 * Nodes are retrieved ordered by priority, so if the current best
-		 * candidate is lower than the next node's wal location then assign
-		 * next node as the new best candidate.
-		 */
-		if (XLByteLT(best_candidate.xlog_location, nodes[i].xlog_location))
-		{
-			best_candidate.node_id = nodes[i].node_id;
-			XLAssign(best_candidate.xlog_location, nodes[i].xlog_location);
-			best_candidate.is_ready = nodes[i].is_ready;
-			best_candidate.is_witness = nodes[i].is_witness;
-		}
+	if (find_best && best_candidate.replay_eta == REPLAY_ETA_UNKNOWN)
+	{
+		log_info(_("%s: node %d is the best candidate, its replay time is unknown\n"),
+				 progname, best_candidate.node_id);
 	}
+	else if (find_best)
+		log_info(_("%s: node %d is the best candidate, writable in about %ld ms\n"),
+				 progname, best_candidate.node_id, best_candidate.replay_eta);
 
 	/* once we know who is the best candidate, promote it */
 	if (find_best && (best_candidate.node_id == local_options.node))
@@ -1105,8 +1210,15 @@ do_failover(void)
 			terminate(ERR_FAILOVER_FAIL);
 		}
 
-		/* wait */
-		sleep(5);
+		trace_begin("election");
+		r = win_election(nodes, total_nodes, max_epoch);
+		trace_end(r, NULL);
+		if (!r)
+		{
+			log_err(_("%s: This node didn't get the votes of a majority of the nodes, not promoting it.\n"),
+					progname);
+			terminate(ERR_FAILOVER_FAIL);
+		}
 
 		if (verbose)
 			log_info(_("%s: This node is the best candidate to be the new primary, promoting...\n"),
@@ -1119,18 +1231,38 @@ do_failover(void)
 			fflush(stderr);
 		}
 
+		trace_begin("promote");
 		r = system(local_options.promote_command);
+		trace_end(r == 0, NULL);
 		if (r != 0)
 		{
 			log_err(_("%s: promote command failed. You could check and try it manually.\n"),
 					progname);
 			terminate(ERR_BAD_CONFIG);
 		}
+
+		prewarm_new_master();
+		trace_begin("followers");
+		report_followers(nodes, total_nodes);
+		trace_end(true, NULL);
 	}
 	else if (find_best)
 	{
-		/* wait */
-		sleep(10);
+		/*
+		 * Follow the new master as soon as it has left recovery, instead of
+		 * guessing how long its promotion takes
+		 */
+		trace_begin("promotion_wait");
+		node_conn = establish_db_connection(best_candidate.conninfo_str, false);
+		r = 0;
+		if (PQstatus(node_conn) == CONNECTION_OK)
+			r = wait_for_promotion(node_conn, FOLLOW_WAIT_TIMEOUT);
+		PQfinish(node_conn);
+		trace_end(r == 1, NULL);
+
+		if (r != 1)
+			log_warning(_("%s: node %d doesn't look promoted yet, following it anyway\n"),
+						progname, best_candidate.node_id);
 
 		if (verbose)
 			log_info(_("%s: Node %d is the best candidate to be the new primary, we should follow it...\n"),
@@ -1146,7 +1278,9 @@ do_failover(void)
 			fflush(stderr);
 		}
 
+		trace_begin("follow");
 		r = system(local_options.follow_command);
+		trace_end(r == 0, NULL);
 		if (r != 0)
 		{
 			log_err(_("%s: follow command failed. You could check and try it manually.\n"),
@@ -1161,6 +1295,19 @@ do_failover(void)
 		terminate(ERR_FAILOVER_FAIL);
 	}
 
+	duration = trace_end(true, NULL);
+	log_set_peer(best_candidate.node_id);
+	log_set_duration(duration);
+	log_notice(_("%s: failover done in %lld ms: %s\n"), progname,
+			   duration / 1000, trace_summary());
+	record_event(best_candidate.node_id == local_options.node ?
+				 "repmgrd_failover_promote" : "repmgrd_failover_follow",
+				 true, duration / 1000, trace_summary());
+	log_set_peer(-1);
+	master_lost_at = 0;
+
+	free(nodes);
+
 	/* to force it to re-calculate mode and master node */
 	failover_done = true;
 
@@ -1169,6 +1316,453 @@ do_failover(void)
 }
 
 
+/*
+ * Asks every visible node, the witness and this node included, for its
+ * vote in a new epoch, after the highest one seen.  Won with the votes of
+ * more than half of the registered nodes, and only while the lease given
+ * with them lasts.  A node refuses when it already voted in that epoch or
+ * for another node whose lease is running; then the election is retried,
+ * a few times, in the epoch after the highest one reported.
+ */
+static bool
+win_election(t_node_info *nodes, int total_nodes, long long epoch)
+{
+	PGconn	   *node_conn;
+	PGresult   *res;
+	char		sqlquery[QUERY_STR_LEN];
+	struct timeval start,
+				now;
+	char		reply[MAXLEN];
+	long long	seen;
+	long long	max_seen;
+	long		elapsed;
+	int			votes;
+	int			round;
+	int			i;
+
+	for (round = 0; round < ELECTION_ROUNDS; round++)
+	{
+		epoch++;
+		max_seen = epoch;
+		votes = 0;
+		gettimeofday(&start, NULL);
+
+		for (i = 0; i < total_nodes; i++)
+		{
+			if (!nodes[i].is_visible)
+				continue;
+
+			log_set_peer(nodes[i].node_id);
+			if (is_arbiter_conninfo(nodes[i].conninfo_str, NULL, NULL))
+			{
+				sqlquery_snprintf(sqlquery, "VOTE %lld %d %d", epoch,
+								  local_options.node, ELECTION_LEASE_SECS);
+				if (!arbiter_request(nodes[i].conninfo_str, sqlquery, reply,
+									 sizeof(reply)))
+				{
+					log_warning(_("Can't get the vote of arbiter %d\n"),
+								nodes[i].node_id);
+					continue;
+				}
+				if (strncmp(reply, "GRANTED ", 8) == 0)
+					votes++;
+				else
+					log_info(_("node %d refused its vote for epoch %lld\n"),
+							 nodes[i].node_id, epoch);
+				if (sscanf(reply, "%*s %lld", &seen) == 1 && seen > max_seen)
+					max_seen = seen;
+				continue;
+			}
+
+			node_conn = establish_db_connection(nodes[i].conninfo_str, false);
+			if (PQstatus(node_conn) != CONNECTION_OK)
+			{
+				PQfinish(node_conn);
+				continue;
+			}
+
+			sqlquery_snprintf(sqlquery,
+							  "SELECT %s.repmgr_request_vote(%lld, %d, %d), "
+							  "       %s.repmgr_get_voted_epoch()",
+							  repmgr_schema, epoch, local_options.node,
+							  ELECTION_LEASE_SECS, repmgr_schema);
+			res = PQexec(node_conn, sqlquery);
+			if (PQresultStatus(res) == PGRES_TUPLES_OK &&
+				!PQgetisnull(res, 0, 0) && !PQgetisnull(res, 0, 1))
+			{
+				if (strcmp(PQgetvalue(res, 0, 0), "t") == 0)
+					votes++;
+				else
+					log_info(_("node %d refused its vote for epoch %lld\n"),
+							 nodes[i].node_id, epoch);
+
+				seen = atoll(PQgetvalue(res, 0, 1));
+				if (seen > max_seen)
+					max_seen = seen;
+			}
+			else
+			{
+				log_warning(_("Can't get the vote of node %d: %s\n"),
+							nodes[i].node_id, PQerrorMessage(node_conn));
+			}
+			PQclear(res);
+			PQfinish(node_conn);
+		}
+		log_set_peer(-1);
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_usec - start.tv_usec) / 1000;
+
+		if (votes > total_nodes / 2 && elapsed < ELECTION_LEASE_SECS * 1000L)
+		{
+			log_notice(_("%s: elected in epoch %lld with %d votes of %d nodes\n"),
+					   progname, epoch, votes, total_nodes);
+			return true;
+		}
+
+		log_warning(_("%s: %d votes of %d nodes in epoch %lld, not elected\n"),
+					progname, votes, total_nodes, epoch);
+		epoch = max_seen;
+
+		/* let a competing candidate finish before trying again */
+		usleep((ELECTION_RETRY_MS + random() % ELECTION_RETRY_MS) * 1000);
+	}
+
+	return false;
+}
+
+
+/*
+ * Run by the new master: logs how long after its promotion each surviving
+ * standby is streaming from it, as seen in pg_stat_replication.  Standbys
+ * are recognized by the application_name repmgr puts in recovery.conf.
+ */
+static void
+report_followers(t_node_info *nodes, int total_nodes)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+	struct timeval start,
+				now;
+	bool	   *followed;
+	int			pending = 0;
+	long		elapsed = 0;
+	int			i,
+				j;
+
+	/* only a report: without memory, skip it */
+	followed = malloc(Max(total_nodes, 1) * sizeof(bool));
+	if (followed == NULL)
+	{
+		log_warning(_("Can't allocate memory to report the followers\n"));
+		return;
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < total_nodes; i++)
+	{
+		followed[i] = !nodes[i].is_visible || nodes[i].is_witness ||
+			nodes[i].node_id == local_options.node;
+		if (!followed[i])
+			pending++;
+	}
+
+	conn = establish_db_connection(local_options.conninfo, false);
+	if (PQstatus(conn) != CONNECTION_OK)
+	{
+		PQfinish(conn);
+		free(followed);
+		return;
+	}
+
+	while (pending > 0 && elapsed < FOLLOW_WAIT_TIMEOUT * 1000L)
+	{
+		res = PQexec(conn, "SELECT application_name FROM pg_stat_replication "
+					 " WHERE state = 'streaming'");
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			log_warning(_("Can't get replication status: %s\n"),
+						PQerrorMessage(conn));
+			PQclear(res);
+			break;
+		}
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_usec - start.tv_usec) / 1000;
+
+		for (j = 0; j < PQntuples(res); j++)
+		{
+			for (i = 0; i < total_nodes; i++)
+			{
+				if (!followed[i] &&
+					strcmp(nodes[i].name, PQgetvalue(res, j, 0)) == 0)
+				{
+					log_info(_("%s: node %d streams from the new master %ld ms after promotion\n"),
+							 progname, nodes[i].node_id, elapsed);
+					followed[i] = true;
+					pending--;
+				}
+			}
+		}
+		PQclear(res);
+
+		if (pending > 0)
+			usleep(FOLLOW_POLL_MS * 1000);
+	}
+	PQfinish(conn);
+
+	for (i = 0; i < total_nodes; i++)
+	{
+		if (!followed[i])
+			log_warning(_("%s: node %d doesn't stream from the new master after %d seconds\n"),
+						progname, nodes[i].node_id, FOLLOW_WAIT_TIMEOUT);
+	}
+	free(followed);
+}
+
+
+/*
+ * Called at every monitoring step: updates the moving average of the replay
+ * speed, from the intervals where this standby had WAL waiting to be
+ * replayed (otherwise it only measures how fast WAL arrives)
+ */
+static void
+sample_apply_rate(void)
+{
+	static long long prev_applied = 0;
+	static long long prev_backlog = 0;
+	static struct timeval prev_time;
+	PGresult   *res;
+	struct timeval now;
+	long long	received,
+				applied;
+	double		elapsed,
+				rate;
+
+	res = exec_statement(my_local_conn, STMT_REPLAY_PROGRESS, NULL);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		PQgetisnull(res, 0, 0) || PQgetisnull(res, 0, 1))
+	{
+		PQclear(res);
+		return;
+	}
+	received = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+	applied = wal_location_to_bytes(PQgetvalue(res, 0, 1));
+	PQclear(res);
+	gettimeofday(&now, NULL);
+
+	if (prev_backlog > 0 && applied > prev_applied)
+	{
+		elapsed = (now.tv_sec - prev_time.tv_sec) +
+			(now.tv_usec - prev_time.tv_usec) / 1000000.0;
+		if (elapsed > 0)
+		{
+			rate = (applied - prev_applied) / elapsed;
+			apply_rate = (apply_rate == 0) ? rate :
+				APPLY_RATE_WEIGHT * rate + (1 - APPLY_RATE_WEIGHT) * apply_rate;
+		}
+	}
+
+	prev_applied = applied;
+	prev_backlog = received - applied;
+	prev_time = now;
+}
+
+
+/*
+ * Estimates in how many milliseconds this standby will have replayed all the
+ * WAL it received, and copies the last received location into 'received'.
+ * With the master gone nothing else arrives, so the replay progress over
+ * APPLY_SAMPLE_MS is the actual apply rate.  Returns -1 if the standby
+ * can't be queried, REPLAY_ETA_UNKNOWN if replay doesn't progress.
+ */
+static long
+estimate_replay_eta(char *received)
+{
+	PGresult   *res;
+	long long	received_bytes,
+				applied_before,
+				applied_after,
+				backlog;
+	double		rate;
+
+	res = exec_statement(my_local_conn, STMT_REPLAY_PROGRESS, NULL);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		PQclear(res);
+		return -1;
+	}
+	snprintf(received, MAXLEN, "%s", PQgetvalue(res, 0, 0));
+	received_bytes = wal_location_to_bytes(PQgetvalue(res, 0, 0));
+	applied_before = wal_location_to_bytes(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	/* nothing left to replay: don't delay the failover with a sample */
+	if (received_bytes <= applied_before)
+		return 0;
+
+	usleep(APPLY_SAMPLE_MS * 1000);
+
+	res = exec_statement(my_local_conn, STMT_REPLAY_PROGRESS, NULL);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		PQclear(res);
+		return -1;
+	}
+	applied_after = wal_location_to_bytes(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	backlog = received_bytes - applied_after;
+	if (backlog <= 0)
+		return 0;
+
+	rate = (applied_after - applied_before) * 1000.0 / APPLY_SAMPLE_MS;
+	if (rate <= 0)
+		rate = apply_rate;
+	if (rate <= 0)
+		return REPLAY_ETA_UNKNOWN;
+
+	log_info(_("%s: %lld bytes to replay at %.0f bytes/s\n"),
+			 progname, backlog, rate);
+
+	return (long) (backlog * 1000.0 / rate);
+}
+
+
+/*
+ * Tells the arbiter witnesses, if any, that this node is alive
+ */
+static void
+send_arbiter_heartbeats(void)
+{
+	t_registry_node *nodes;
+	char		request[MAXLEN];
+	char		reply[MAXLEN];
+	int			total_nodes;
+	int			i;
+
+	total_nodes = registry_nodes(my_local_conn, &nodes);
+	if (total_nodes < 0)
+		return;
+
+	maxlen_snprintf(request, "HEARTBEAT %d", local_options.node);
+	for (i = 0; i < total_nodes; i++)
+	{
+		if (!nodes[i].is_witness ||
+			!is_arbiter_conninfo(nodes[i].conninfo, NULL, NULL))
+			continue;
+
+		if (!arbiter_request(nodes[i].conninfo, request, reply,
+							 sizeof(reply)))
+		{
+			log_debug(_("arbiter \"%s\" is not reachable\n"),
+					  nodes[i].conninfo);
+		}
+	}
+	free(nodes);
+}
+
+
+/*
+ * Every prewarm_interval_secs, saves into this standby's data directory
+ * which blocks the master has in shared buffers, for prewarm_new_master()
+ */
+static void
+capture_master_buffers(void)
+{
+	static time_t last_capture = 0;
+	PGresult   *res;
+	time_t		now;
+	long		blocks;
+
+	if (local_options.prewarm_interval_secs <= 0)
+		return;
+
+	now = time(NULL);
+	if (now - last_capture < local_options.prewarm_interval_secs)
+		return;
+	last_capture = now;
+
+	if (buffer_snapshot[0] == '\0')
+	{
+		res = PQexec(my_local_conn, "SHOW data_directory");
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		{
+			log_warning(_("Can't get the data directory: %s\n"),
+						PQerrorMessage(my_local_conn));
+			PQclear(res);
+			return;
+		}
+		maxlen_snprintf(buffer_snapshot, "%s/%s", PQgetvalue(res, 0, 0),
+						BUFFER_SNAPSHOT_FILE);
+		PQclear(res);
+	}
+
+	if (!has_buffer_extensions(primary_conn))
+	{
+		log_warning(_("pg_buffercache and pg_prewarm are needed on the master to save its buffer cache\n"));
+		return;
+	}
+
+	blocks = capture_buffer_cache(primary_conn, buffer_snapshot);
+	if (blocks >= 0)
+	{
+		log_debug(_("saved %ld blocks of the master's buffer cache\n"), blocks);
+	}
+}
+
+
+/*
+ * Run by the new master right after its promotion: loads back the blocks
+ * the former master had cached.  This happens in a detached process, so the
+ * followers are reported and monitoring resumes meanwhile.
+ */
+static void
+prewarm_new_master(void)
+{
+	pid_t		pid;
+	long		blocks;
+
+	if (local_options.prewarm_interval_secs <= 0 ||
+		buffer_snapshot[0] == '\0' || access(buffer_snapshot, R_OK) != 0)
+		return;
+
+	if (log_type == REPMGR_STDERR && *local_options.logfile)
+	{
+		fflush(stderr);
+	}
+
+	/* fork twice, so the prewarm process doesn't have to be waited for */
+	pid = fork();
+	if (pid == -1)
+	{
+		log_warning(_("Can't start the prewarm process: %s\n"), strerror(errno));
+		return;
+	}
+	if (pid > 0)
+	{
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	if (fork() != 0)
+		_exit(0);
+
+	blocks = prewarm_buffer_cache(local_options.conninfo, buffer_snapshot,
+								  local_options.prewarm_jobs);
+	if (blocks >= 0)
+	{
+		log_notice(_("%s: %ld blocks cached by the former master loaded into shared buffers\n"),
+				   progname, blocks);
+	}
+	unlink(buffer_snapshot);
+	_exit(0);
+}
+
+
 static bool
 check_connection(PGconn *conn, const char *type)
 {
@@ -1183,12 +1777,21 @@ check_connection(PGconn *conn, const char *type)
 	{
 		if (!is_pgup(conn, local_options.master_response_timeout))
 		{
+			/* the start of the detection step of the failover trace */
+			if (strcmp(type, "master") == 0)
+			{
+				if (connection_retries == 0)
+					master_lost_at = trace_clock();
+				master_lost_attempts = connection_retries + 1;
+			}
+
 			log_warning(_("%s: Connection to %s has been lost, trying to recover... %i seconds before failover decision\n"),
 						progname,
 						type,
 						(local_options.reconnect_intvl * (local_options.reconnect_attempts - connection_retries)));
 			/* wait local_options.reconnect_intvl seconds between retries */
 			sleep(local_options.reconnect_intvl);
+			check_terminate();
 		}
 		else
 		{
@@ -1250,36 +1853,38 @@ check_cluster_configuration(PGconn *conn)
 static void
 check_node_configuration(void)
 {
-	PGresult   *res;
+	t_registry_node *nodes;
 	char		sqlquery[QUERY_STR_LEN];
+	int			total_nodes;
+	bool		registered = false;
+	int			i;
 
 	/*
 	 * Check if we have my node information in repl_nodes
 	 */
 	log_info(_("%s Checking node %d in cluster '%s'\n"),
 			 progname, local_options.node, local_options.cluster_name);
-	sqlquery_snprintf(sqlquery, "SELECT * FROM %s.repl_nodes "
-					  " WHERE id = %d AND cluster = '%s' ",
-					  repmgr_schema, local_options.node,
-					  local_options.cluster_name);
-
-	res = PQexec(my_local_conn, sqlquery);
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	total_nodes = registry_nodes(my_local_conn, &nodes);
+	if (total_nodes < 0)
 	{
 		log_err(_("PQexec failed: %s\n"), PQerrorMessage(my_local_conn));
-		PQclear(res);
 		terminate(ERR_BAD_CONFIG);
 	}
 
+	for (i = 0; i < total_nodes; i++)
+	{
+		if (nodes[i].node_id == local_options.node)
+			registered = true;
+	}
+	free(nodes);
+
 	/*
 	 * If there isn't any results then we have not configured this node yet in
 	 * repmgr, if that is the case we will insert the node to the cluster,
 	 * except if it is a witness
 	 */
-	if (PQntuples(res) == 0)
+	if (!registered)
 	{
-		PQclear(res);
-
 		if (my_local_mode == WITNESS_MODE)
 		{
 			log_err(_("The witness is not configured\n"));
@@ -1302,29 +1907,11 @@ check_node_configuration(void)
 					PQerrorMessage(primary_conn));
 			terminate(ERR_BAD_CONFIG);
 		}
-	}
-	else
-	{
-		PQclear(res);
+		registry_invalidate();
 	}
 }
 
 
-static unsigned long long int
-wal_location_to_bytes(char *wal_location)
-{
-	unsigned int xlogid;
-	unsigned int xrecoff;
-
-	if (sscanf(wal_location, "%X/%X", &xlogid, &xrecoff) != 2)
-	{
-		log_err(_("wrong log location format: %s\n"), wal_location);
-		return 0;
-	}
-	return (((long long) xlogid * 16 * 1024 * 1024 * 255) + xrecoff);
-}
-
-
 void
 usage(void)
 {
@@ -1354,7 +1941,7 @@ help(const char *progname)
 static void
 handle_sigint(SIGNAL_ARGS)
 {
-	terminate(0);
+	got_SIGTERM = true;
 }
 
 /* SIGHUP: set flag to re-read config file at next convenient time */
@@ -1364,6 +1951,20 @@ handle_sighup(SIGNAL_ARGS)
 	got_SIGHUP = true;
 }
 
+#endif
+
+/* stops repmgrd if SIGINT or SIGTERM came */
+static void
+check_terminate(void)
+{
+	if (got_SIGTERM)
+	{
+		log_info(_("%s: stop requested\n"), progname);
+		terminate(0);
+	}
+}
+
+#ifndef WIN32
 static void
 setup_event_handlers(void)
 {
@@ -1376,6 +1977,16 @@ setup_event_handlers(void)
 static void
 terminate(int retval)
 {
+	long long	failover_us;
+
+	/* a failover given up on still leaves its trace, and its event */
+	failover_us = trace_abort();
+	if (failover_us > 0)
+		record_event("repmgrd_failover", false, failover_us / 1000,
+					 trace_summary());
+	record_event("repmgrd_stop", retval == 0, -1, NULL);
+	events_shutdown(EVENT_SHUTDOWN_SECS);
+
 	close_connections();
 	logger_shutdown();
 
@@ -1394,13 +2005,13 @@ static void
 update_shared_memory(char *last_wal_standby_applied)
 {
 	PGresult   *res;
-	char		sqlquery[QUERY_STR_LEN];
+	t_stmt_params params;
 
-	sprintf(sqlquery, "SELECT %s.repmgr_update_standby_location('%s')",
-			repmgr_schema, last_wal_standby_applied);
+	stmt_params_init(&params);
+	stmt_param_text(&params, last_wal_standby_applied);
 
 	/* If an error happens, just inform about that and continue */
-	res = PQexec(my_local_conn, sqlquery);
+	res = exec_statement(my_local_conn, STMT_UPDATE_STANDBY_LOCATION, &params);
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
 	{
 		log_warning(_("Cannot update this standby's shared memory: %s\n"),
@@ -1417,6 +2028,46 @@ update_shared_memory(char *last_wal_standby_applied)
 	PQclear(res);
 }
 
+/*
+ * Re-reads the configuration file, kept as it is if it's not valid.  The
+ * connection to the local node is only replaced when conninfo changed, and
+ * repl_nodes only updated when conninfo or priority did, or when
+ * register_node asks for it; the other settings are read where they're
+ * used.
+ */
+static void
+reload_local_config(bool register_node)
+{
+	int			changes = 0;
+	bool		local_is_primary;
+
+	if (!reload_config(config_file, &local_options, &changes))
+		return;
+
+	if (changes & CONFIG_CHANGED_LOGGING)
+		logger_reload(&local_options);
+
+	if (changes & CONFIG_CHANGED_CONNINFO)
+	{
+		local_is_primary = (primary_conn == my_local_conn);
+
+		PQfinish(my_local_conn);
+		my_local_conn = establish_db_connection(local_options.conninfo, true);
+		if (local_is_primary)
+		{
+			primary_conn = my_local_conn;
+			snprintf(primary_options.conninfo,
+					 sizeof(primary_options.conninfo), "%s",
+					 local_options.conninfo);
+		}
+	}
+
+	if (register_node ||
+		(changes & (CONFIG_CHANGED_CONNINFO | CONFIG_CHANGED_PRIORITY)))
+		update_registration();
+}
+
+
 static void
 update_registration(void)
 {
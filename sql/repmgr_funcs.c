@@ -9,6 +9,7 @@
 #include "fmgr.h"
 #include "access/xlog.h"
 #include "miscadmin.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/lwlock.h"
 #include "storage/procarray.h"
@@ -20,6 +21,12 @@
 /* same definition as the one in xlog_internal.h */
 #define MAXFNAMELEN		64
 
+/*
+ * The last vote is kept in the data directory too, so a restarted server
+ * can't vote twice in the same epoch
+ */
+#define VOTE_STATE_FILE		"repmgr_vote.state"
+
 PG_MODULE_MAGIC;
 
 /*
@@ -30,6 +37,9 @@ typedef struct repmgrSharedState
 	LWLockId	lock;			/* protects search/modification */
 	char		location[MAXFNAMELEN];	/* last known xlog location */
 	TimestampTz last_updated;
+	int64		voted_epoch;	/* last election this node voted in */
+	int32		voted_for;		/* node id it voted for, -1 if none */
+	TimestampTz lease_expiry;	/* no vote for another node until then */
 }	repmgrSharedState;
 
 /* Links to shared memory state */
@@ -44,6 +54,8 @@ static void repmgr_shmem_startup(void);
 static Size repmgr_memsize(void);
 
 static bool repmgr_set_standby_location(char *locationstr);
+static void repmgr_load_vote(void);
+static bool repmgr_save_vote(int64 epoch, int32 candidate, TimestampTz lease_expiry);
 
 Datum		repmgr_update_standby_location(PG_FUNCTION_ARGS);
 Datum		repmgr_get_last_standby_location(PG_FUNCTION_ARGS);
@@ -57,6 +69,12 @@ Datum		repmgr_get_last_updated(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(repmgr_update_last_updated);
 PG_FUNCTION_INFO_V1(repmgr_get_last_updated);
 
+Datum		repmgr_request_vote(PG_FUNCTION_ARGS);
+Datum		repmgr_get_voted_epoch(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(repmgr_request_vote);
+PG_FUNCTION_INFO_V1(repmgr_get_voted_epoch);
+
 
 /*
  * Module load callback
@@ -129,6 +147,10 @@ repmgr_shmem_startup(void)
 		shared_state->lock = LWLockAssign();
 		snprintf(shared_state->location,
 				 sizeof(shared_state->location), "%X/%X", 0, 0);
+		shared_state->voted_epoch = 0;
+		shared_state->voted_for = -1;
+		shared_state->lease_expiry = 0;
+		repmgr_load_vote();
 	}
 
 	LWLockRelease(AddinShmemInitLock);
@@ -230,3 +252,130 @@ repmgr_get_last_updated(PG_FUNCTION_ARGS)
 
 	PG_RETURN_TIMESTAMPTZ(last_updated);
 }
+
+
+/*
+ * Reads the last vote back from VOTE_STATE_FILE, at server start
+ */
+static void
+repmgr_load_vote(void)
+{
+	FILE	   *fp;
+	int64		epoch;
+	int			candidate;
+	int64		lease_expiry;
+
+	fp = AllocateFile(VOTE_STATE_FILE, "r");
+	if (fp == NULL)
+		return;
+
+	if (fscanf(fp, INT64_FORMAT " %d " INT64_FORMAT,
+			   &epoch, &candidate, &lease_expiry) == 3)
+	{
+		shared_state->voted_epoch = epoch;
+		shared_state->voted_for = candidate;
+		shared_state->lease_expiry = (TimestampTz) lease_expiry;
+	}
+	FreeFile(fp);
+}
+
+
+/*
+ * Writes a vote durably, before it is granted.  Called with the lock held.
+ */
+static bool
+repmgr_save_vote(int64 epoch, int32 candidate, TimestampTz lease_expiry)
+{
+	FILE	   *fp;
+	bool		ok;
+
+	fp = AllocateFile(VOTE_STATE_FILE ".tmp", "w");
+	if (fp == NULL)
+		return false;
+
+	ok = fprintf(fp, INT64_FORMAT " %d " INT64_FORMAT "\n",
+				 epoch, candidate, (int64) lease_expiry) > 0 &&
+		fflush(fp) == 0 && pg_fsync(fileno(fp)) == 0;
+	if (FreeFile(fp) != 0)
+		ok = false;
+
+	if (ok && rename(VOTE_STATE_FILE ".tmp", VOTE_STATE_FILE) != 0)
+		ok = false;
+
+	if (!ok)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write \"%s\": %m", VOTE_STATE_FILE)));
+
+	return ok;
+}
+
+
+/*
+ * Asks this node for its vote in an election: (epoch, candidate node id,
+ * lease in seconds).  A node votes at most once per epoch, only for an epoch
+ * newer than any it voted in, and not for another candidate while the lease
+ * given with its last vote lasts.  Asking again for the vote already given
+ * returns true.
+ */
+Datum
+repmgr_request_vote(PG_FUNCTION_ARGS)
+{
+	int64		epoch = PG_GETARG_INT64(0);
+	int32		candidate = PG_GETARG_INT32(1);
+	int32		lease_secs = PG_GETARG_INT32(2);
+	TimestampTz now = GetCurrentTimestamp();
+	TimestampTz lease_expiry;
+	bool		granted = false;
+
+	/* Safety check... */
+	if (!shared_state)
+		PG_RETURN_BOOL(false);
+
+#ifdef HAVE_INT64_TIMESTAMP
+	lease_expiry = now + (TimestampTz) lease_secs * USECS_PER_SEC;
+#else
+	lease_expiry = now + lease_secs;
+#endif
+
+	LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+	if (epoch == shared_state->voted_epoch &&
+		candidate == shared_state->voted_for)
+	{
+		granted = true;
+	}
+	else if (epoch > shared_state->voted_epoch &&
+			 (candidate == shared_state->voted_for ||
+			  shared_state->voted_for == -1 ||
+			  now >= shared_state->lease_expiry))
+	{
+		if (repmgr_save_vote(epoch, candidate, lease_expiry))
+		{
+			shared_state->voted_epoch = epoch;
+			shared_state->voted_for = candidate;
+			shared_state->lease_expiry = lease_expiry;
+			granted = true;
+		}
+	}
+	LWLockRelease(shared_state->lock);
+
+	PG_RETURN_BOOL(granted);
+}
+
+
+/* get the last epoch this node voted in */
+Datum
+repmgr_get_voted_epoch(PG_FUNCTION_ARGS)
+{
+	int64		epoch;
+
+	/* Safety check... */
+	if (!shared_state)
+		PG_RETURN_NULL();
+
+	LWLockAcquire(shared_state->lock, LW_SHARED);
+	epoch = shared_state->voted_epoch;
+	LWLockRelease(shared_state->lock);
+
+	PG_RETURN_INT64(epoch);
+}
@@ -9,3 +9,6 @@ DROP FUNCTION repmgr_get_last_standby_location();
 
 DROP FUNCTION repmgr_update_last_updated();
 DROP FUNCTION repmgr_get_last_updated();
+
+DROP FUNCTION repmgr_request_vote(bigint, integer, integer);
+DROP FUNCTION repmgr_get_voted_epoch();
@@ -0,0 +1,201 @@
+/*
+ * trace.c - Timing spans of the failover steps
+ * Copyright (C) 2ndQuadrant, 2010-2014
+ *
+ * A span times one step of a procedure, from trace_begin() to trace_end(),
+ * on the monotonic clock; spans begun inside another are its children.
+ * When a span ends it is appended to the trace file as one JSON object per
+ * line, with its parent, its start relative to the outermost span, and its
+ * duration, both in microseconds.  The outermost span opens and closes the
+ * file, so it can be rotated or removed between two of them.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "repmgr.h"
+#include "log.h"
+#include "strutil.h"
+#include "trace.h"
+
+typedef struct
+{
+	const char *name;
+	long long	start_us;
+}	t_span;
+
+static t_span spans[TRACE_MAX_DEPTH];
+static int	depth = 0;
+static char trace_path[MAXLEN] = "";
+static int	trace_node = -1;
+static FILE *trace_fp = NULL;
+static char trace_id[MAXLEN];
+static char summary[MAXLEN];
+
+
+/*
+ * Where the spans go; an empty path only keeps the summary
+ */
+void
+trace_set_file(const char *path, int node_id)
+{
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+	trace_node = node_id;
+}
+
+
+/* monotonic time, in microseconds */
+long long
+trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void
+trace_begin(const char *name)
+{
+	trace_begin_at(name, trace_clock());
+}
+
+
+/*
+ * Begins a span that started at start_us (from trace_clock()), e.g. when
+ * what it times was only known to be worth tracing afterwards
+ */
+void
+trace_begin_at(const char *name, long long start_us)
+{
+	if (depth == 0)
+	{
+		time_t		now = time(NULL);
+		char		stamp[64];
+
+		strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", localtime(&now));
+		maxlen_snprintf(trace_id, "%d-%s", trace_node, stamp);
+		summary[0] = '\0';
+
+		if (*trace_path)
+		{
+			trace_fp = fopen(trace_path, "a");
+			if (trace_fp == NULL)
+			{
+				log_warning(_("Can't open trace file \"%s\": %s\n"), trace_path,
+							strerror(errno));
+			}
+		}
+	}
+
+	/* too deep: the span is counted, not recorded */
+	if (depth < TRACE_MAX_DEPTH)
+	{
+		spans[depth].name = name;
+		spans[depth].start_us = start_us;
+		log_set_phase(name);
+	}
+	depth++;
+}
+
+
+/*
+ * Ends the innermost span, and returns its duration in microseconds.
+ * 'detail', when not NULL, is recorded with it.
+ */
+long long
+trace_end(bool ok, const char *detail)
+{
+	t_span	   *span;
+	long long	duration;
+	size_t		len;
+
+	if (depth == 0)
+		return 0;
+
+	depth--;
+	if (depth >= TRACE_MAX_DEPTH)
+		return 0;
+
+	span = &spans[depth];
+	duration = trace_clock() - span->start_us;
+
+	if (trace_fp != NULL)
+	{
+		fprintf(trace_fp,
+				"{\"trace\":\"%s\",\"node\":%d,\"span\":\"%s\",\"parent\":\"%s\","
+				"\"depth\":%d,\"start_us\":%lld,\"duration_us\":%lld,\"ok\":%s",
+				trace_id, trace_node, span->name,
+				depth > 0 ? spans[depth - 1].name : "", depth,
+				span->start_us - spans[0].start_us, duration,
+				ok ? "true" : "false");
+		if (detail != NULL)
+			fprintf(trace_fp, ",\"detail\":\"%s\"", detail);
+		fprintf(trace_fp, "}\n");
+		fflush(trace_fp);
+	}
+
+	/* the steps of the outermost span, for the log and repl_events */
+	if (depth == 1)
+	{
+		len = strlen(summary);
+		snprintf(summary + len, sizeof(summary) - len, "%s%s=%lldms%s",
+				 len ? " " : "", span->name, duration / 1000,
+				 ok ? "" : "(failed)");
+	}
+
+	log_set_duration(duration);
+	log_debug(_("%s %s after %lld ms\n"), span->name,
+			  ok ? "done" : "failed", duration / 1000);
+	log_set_phase(depth > 0 ? spans[depth - 1].name : NULL);
+
+	if (depth == 0 && trace_fp != NULL)
+	{
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+
+	return duration;
+}
+
+
+/*
+ * Ends every open span as failed, when giving up, and returns the duration
+ * of the outermost one, 0 if none was open
+ */
+long long
+trace_abort(void)
+{
+	long long	duration = 0;
+
+	while (depth > 0)
+		duration = trace_end(false, NULL);
+	return duration;
+}
+
+
+/*
+ * "step=Nms ..." for the children of the last outermost span
+ */
+const char *
+trace_summary(void)
+{
+	return summary;
+}
@@ -0,0 +1,36 @@
+/*
+ * trace.h
+ * Copyright (c) 2ndQuadrant, 2010-2014
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REPMGR_TRACE_H_
+#define _REPMGR_TRACE_H_
+
+#include "repmgr.h"
+
+/* spans can nest this deep */
+#define TRACE_MAX_DEPTH			8
+
+void		trace_set_file(const char *path, int node_id);
+long long	trace_clock(void);
+void		trace_begin(const char *name);
+void		trace_begin_at(const char *name, long long start_us);
+long long	trace_end(bool ok, const char *detail);
+long long	trace_abort(void);
+const char *trace_summary(void);
+
+#endif
@@ -6,7 +6,9 @@
  */
 
 DROP TABLE IF EXISTS repl_nodes;
+DROP FUNCTION IF EXISTS repl_nodes_notify();
 DROP TABLE IF EXISTS repl_monitor;
+DROP TABLE IF EXISTS repl_events;
 DROP VIEW IF EXISTS repl_status;
 
 DROP SCHEMA repmgr;